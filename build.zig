@@ -62,6 +62,28 @@ pub fn build(b: *std.Build) void {
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
 
+    const bench_exe = b.addExecutable(.{
+        .name = "fpindex-bench",
+        .root_source_file = b.path("src/bench.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+
+    bench_exe.root_module.addImport("httpz", httpz.module("httpz"));
+    bench_exe.root_module.addImport("metrics", metrics.module("metrics"));
+    bench_exe.root_module.addImport("zul", zul.module("zul"));
+    bench_exe.root_module.addImport("msgpack", msgpack.module("msgpack"));
+
+    const run_bench = b.addRunArtifact(bench_exe);
+    run_bench.has_side_effects = true;
+
+    if (b.args) |args| {
+        run_bench.addArgs(args);
+    }
+
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&run_bench.step);
+
     const main_tests = b.addTest(.{
         .name = "aindex-tests",
         .root_source_file = b.path("src/main.zig"),
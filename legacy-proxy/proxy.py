@@ -2,6 +2,7 @@ import asyncio
 import aiohttp
 import msgpack
 import argparse
+import struct
 import traceback
 
 
@@ -15,23 +16,94 @@ def parse_hashes(src):
     return [int(v)&0xffffffff for v in src.split(",")]
 
 
+SEARCH_CONTENT_TYPE = "application/vnd.fpindex.search"
+
+# set in the flags of a query that didn't finish in time, its results may be incomplete
+FLAG_TIMED_OUT = 1
+
+
+def encode_search_request(queries):
+    parts = [struct.pack("<I", len(queries))]
+    for query in queries:
+        # zero limit and timeout mean the server defaults
+        parts.append(struct.pack(f"<III{len(query)}I", 0, 0, len(query), *query))
+    return b"".join(parts)
+
+
+def decode_search_response(data, num_queries):
+    (n,) = struct.unpack_from("<I", data, 0)
+    if n != num_queries:
+        raise ValueError(f"expected {num_queries} responses, got {n}")
+    pos = 4
+    responses = []
+    for _ in range(n):
+        flags, num_results = struct.unpack_from("<II", data, pos)
+        pos += 8
+        values = struct.unpack_from(f"<{2 * num_results}I", data, pos)
+        pos += 8 * num_results
+        responses.append((flags, list(zip(values[0::2], values[1::2]))))
+    return responses
+
+
+class SearchBatcher:
+    """Sends searches from all connections to the server in batches, as one binary
+    multi-search request, instead of one HTTP request per search."""
+
+    def __init__(self, session, url, max_batch_size=100, max_wait=0.001):
+        self.session = session
+        self.url = url
+        self.max_batch_size = max_batch_size
+        self.max_wait = max_wait
+        self.pending = []
+        self.flush_handle = None
+
+    def search(self, query):
+        future = asyncio.get_running_loop().create_future()
+        self.pending.append((query, future))
+        if len(self.pending) >= self.max_batch_size:
+            self.flush()
+        elif self.flush_handle is None:
+            self.flush_handle = asyncio.get_running_loop().call_later(self.max_wait, self.flush)
+        return future
+
+    def flush(self):
+        if self.flush_handle is not None:
+            self.flush_handle.cancel()
+            self.flush_handle = None
+        batch, self.pending = self.pending, []
+        if batch:
+            asyncio.ensure_future(self.send(batch))
+
+    async def send(self, batch):
+        try:
+            data = encode_search_request([query for (query, _) in batch])
+            headers = {"Content-Type": SEARCH_CONTENT_TYPE}
+            async with self.session.post(self.url, data=data, headers=headers) as resp:
+                resp.raise_for_status()
+                responses = decode_search_response(await resp.read(), len(batch))
+        except Exception as ex:
+            for (_, future) in batch:
+                if not future.done():
+                    future.set_exception(ex)
+            return
+        for (_, future), (flags, results) in zip(batch, responses):
+            if future.done():
+                continue
+            if flags & FLAG_TIMED_OUT:
+                future.set_exception(ProtocolError("search timed out"))
+            else:
+                future.set_result(results)
+
+
 class Protocol:
 
-    def __init__(self, session):
+    def __init__(self, session, batcher):
         self.session = session
+        self.batcher = batcher
         self.changes = []
 
     async def search(self, query):
-        url = self.index_url + f"/{self.index_name}/_search"
-        data = msgpack.dumps({"q": query})
-        headers = {
-            "Content-Type": "application/vnd.msgpack",
-            "Accept": "application/vnd.msgpack",
-        }
-        async with self.session.post(url, data=data, headers=headers) as resp:
-            resp.raise_for_status()
-            body = msgpack.loads(await resp.content.read())
-            return [(r["i"], r["s"]) for r in body["r"]]
+        return await self.batcher.search(query)
 
     async def update(self, changes):
         print(f'sending update with {len(changes)} changes')
@@ -135,6 +207,9 @@ class Server:
     async def serve(self, listen_host, listen_port):
         async with aiohttp.ClientSession() as session:
             self.session = session
+            self.batcher = SearchBatcher(
+                session, self.index_url + f"/{self.index_name}/_bsearch"
+            )
             server = await asyncio.start_server(
                 self.handle_connection, listen_host, listen_port
             )
@@ -143,7 +218,7 @@ class Server:
 
     async def handle_connection(self, reader, writer):
         try:
-            proto = Protocol(self.session)
+            proto = Protocol(self.session, self.batcher)
             proto.index_name = self.index_name
             proto.index_url = self.index_url
 
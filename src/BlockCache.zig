@@ -0,0 +1,206 @@
+//! Decoded blocks of file segments, shared by all file segments of an index, so that
+//! popular hash ranges don't have to be decoded again for every search. Entries are
+//! evicted with the CLOCK policy, when the memory budget is exceeded. New entries
+//! start unreferenced, so blocks touched only once are evicted first.
+
+const std = @import("std");
+
+const Item = @import("segment.zig").Item;
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Each shard has its own lock, clock and part of the budget.
+const num_shards = 16;
+
+// rough per-entry cost of the hash map and the slot, on top of the items
+const entry_overhead = 64;
+
+// Shards of an index share the cache and their segments can have the same info,
+// so the shard number is part of the key.
+pub const Key = struct {
+    shard_no: u64,
+    version: u64,
+    merges: u64,
+    block_no: u64,
+
+    pub fn init(shard_no: usize, info: SegmentInfo, block_no: usize) Key {
+        return .{ .shard_no = shard_no, .version = info.version, .merges = info.merges, .block_no = block_no };
+    }
+};
+
+const Slot = struct {
+    key: Key,
+    items: []Item,
+    referenced: bool = false,
+};
+
+const Shard = struct {
+    lock: std.Thread.Mutex = .{},
+    slots: std.ArrayListUnmanaged(Slot) = .{},
+    positions: std.AutoHashMapUnmanaged(Key, usize) = .{},
+    hand: usize = 0,
+    size: usize = 0,
+};
+
+allocator: std.mem.Allocator,
+shards: [num_shards]Shard = [_]Shard{.{}} ** num_shards,
+max_size_per_shard: usize,
+
+pub fn init(allocator: std.mem.Allocator, max_size: usize) Self {
+    return .{
+        .allocator = allocator,
+        .max_size_per_shard = max_size / num_shards,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    for (&self.shards) |*shard| {
+        for (shard.slots.items) |slot| {
+            self.allocator.free(slot.items);
+        }
+        shard.slots.deinit(self.allocator);
+        shard.positions.deinit(self.allocator);
+    }
+}
+
+fn getShard(self: *Self, key: Key) *Shard {
+    var hasher = std.hash.Wyhash.init(0);
+    std.hash.autoHash(&hasher, key);
+    return &self.shards[hasher.final() % num_shards];
+}
+
+fn getEntrySize(items: []const Item) usize {
+    return items.len * @sizeOf(Item) + entry_overhead;
+}
+
+/// Appends the cached items of the block to `items` and returns true, or returns false if the block is not cached.
+pub fn get(self: *Self, key: Key, items: *std.ArrayList(Item)) !bool {
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    const pos = shard.positions.get(key) orelse {
+        metrics.blockCacheMiss();
+        return false;
+    };
+
+    const slot = &shard.slots.items[pos];
+    slot.referenced = true;
+    try items.appendSlice(slot.items);
+
+    metrics.blockCacheHit();
+    return true;
+}
+
+fn evict(self: *Self, shard: *Shard) void {
+    while (true) {
+        if (shard.hand >= shard.slots.items.len) {
+            shard.hand = 0;
+        }
+        const slot = &shard.slots.items[shard.hand];
+        if (slot.referenced) {
+            slot.referenced = false;
+            shard.hand += 1;
+            continue;
+        }
+
+        shard.size -= getEntrySize(slot.items);
+        _ = shard.positions.remove(slot.key);
+        self.allocator.free(slot.items);
+
+        // the last slot takes the place of the evicted one, the hand stays to check it next
+        _ = shard.slots.swapRemove(shard.hand);
+        if (shard.hand < shard.slots.items.len) {
+            shard.positions.putAssumeCapacity(shard.slots.items[shard.hand].key, shard.hand);
+        }
+
+        metrics.blockCacheEviction();
+        return;
+    }
+}
+
+/// Adds a copy of the decoded block to the cache.
+pub fn put(self: *Self, key: Key, items: []const Item) !void {
+    const size = getEntrySize(items);
+    if (size > self.max_size_per_shard) {
+        return;
+    }
+
+    const shard = self.getShard(key);
+
+    // copy outside of the lock
+    const items_copy = try self.allocator.dupe(Item, items);
+    errdefer self.allocator.free(items_copy);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    if (shard.positions.contains(key)) {
+        self.allocator.free(items_copy);
+        return;
+    }
+
+    try shard.slots.ensureUnusedCapacity(self.allocator, 1);
+    try shard.positions.ensureUnusedCapacity(self.allocator, 1);
+
+    while (shard.size + size > self.max_size_per_shard and shard.slots.items.len > 0) {
+        self.evict(shard);
+    }
+
+    shard.positions.putAssumeCapacityNoClobber(key, shard.slots.items.len);
+    shard.slots.appendAssumeCapacity(.{ .key = key, .items = items_copy });
+    shard.size += size;
+}
+
+pub fn getSize(self: *Self) usize {
+    var result: usize = 0;
+    for (&self.shards) |*shard| {
+        shard.lock.lock();
+        defer shard.lock.unlock();
+        result += shard.size;
+    }
+    return result;
+}
+
+test "BlockCache" {
+    const allocator = std.testing.allocator;
+
+    const block_items = [_]Item{ .{ .hash = 1, .id = 1 }, .{ .hash = 2, .id = 1 } };
+    const entry_size = getEntrySize(&block_items);
+
+    // room for three blocks per shard
+    var cache = Self.init(allocator, 3 * entry_size * num_shards);
+    defer cache.deinit();
+
+    var items = std.ArrayList(Item).init(allocator);
+    defer items.deinit();
+
+    const info = SegmentInfo{ .version = 1 };
+
+    try std.testing.expect(!try cache.get(Key.init(0, info, 0), &items));
+
+    try cache.put(Key.init(0, info, 0), &block_items);
+    try std.testing.expect(try cache.get(Key.init(0, info, 0), &items));
+    try std.testing.expectEqualSlices(Item, &block_items, items.items);
+
+    // different segment, same block number
+    try std.testing.expect(!try cache.get(Key.init(0, .{ .version = 1, .merges = 1 }, 0), &items));
+
+    // same segment info in a different shard
+    try std.testing.expect(!try cache.get(Key.init(1, info, 0), &items));
+
+    // fill the cache, the block that keeps being used stays, blocks that were never used are evicted
+    for (1..1000) |i| {
+        try cache.put(Key.init(0, info, i), &block_items);
+        items.clearRetainingCapacity();
+        try std.testing.expect(try cache.get(Key.init(0, info, 0), &items));
+    }
+    try std.testing.expect(cache.getSize() <= 3 * entry_size * num_shards);
+
+    items.clearRetainingCapacity();
+    try std.testing.expect(try cache.get(Key.init(0, info, 0), &items));
+    try std.testing.expectEqualSlices(Item, &block_items, items.items);
+}
@@ -0,0 +1,216 @@
+//! Docs of a file segment, stored as a sorted array of doc ids and a bitset of deleted docs.
+//! The encoded table is used directly from the memory-mapped segment file.
+
+const std = @import("std");
+
+const Self = @This();
+
+pub const alignment = @alignOf(u32);
+
+pub const Doc = struct {
+    id: u32,
+    active: bool,
+};
+
+// sorted, little endian
+ids: []const u32 = &.{},
+// bit i is set if the doc ids[i] is deleted
+deleted: []const u8 = &.{},
+// set if the table was built in memory, instead of pointing to the segment file
+buffer: []align(alignment) u8 = &.{},
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    allocator.free(self.buffer);
+    self.* = .{};
+}
+
+pub fn count(self: Self) u32 {
+    return @intCast(self.ids.len);
+}
+
+fn getId(self: Self, index: usize) u32 {
+    return std.mem.littleToNative(u32, self.ids[index]);
+}
+
+fn isDeleted(self: Self, index: usize) bool {
+    return (self.deleted[index / 8] >> @intCast(index % 8)) & 1 != 0;
+}
+
+fn find(self: Self, doc_id: u32) ?usize {
+    var left: usize = 0;
+    var right: usize = self.ids.len;
+    while (left < right) {
+        const mid = left + (right - left) / 2;
+        const id = self.getId(mid);
+        if (id < doc_id) {
+            left = mid + 1;
+        } else if (id > doc_id) {
+            right = mid;
+        } else {
+            return mid;
+        }
+    }
+    return null;
+}
+
+/// Returns whether the doc is active, or null if it's not in the table.
+pub fn get(self: Self, doc_id: u32) ?bool {
+    const index = self.find(doc_id) orelse return null;
+    return !self.isDeleted(index);
+}
+
+pub fn contains(self: Self, doc_id: u32) bool {
+    return self.find(doc_id) != null;
+}
+
+pub fn getMinDocId(self: Self) u32 {
+    return if (self.ids.len > 0) self.getId(0) else 0;
+}
+
+pub fn getMaxDocId(self: Self) u32 {
+    return if (self.ids.len > 0) self.getId(self.ids.len - 1) else 0;
+}
+
+pub const Iterator = struct {
+    table: *const Self,
+    index: usize = 0,
+
+    pub fn next(self: *Iterator) ?Doc {
+        if (self.index >= self.table.ids.len) {
+            return null;
+        }
+        const index = self.index;
+        self.index += 1;
+        return .{
+            .id = self.table.getId(index),
+            .active = !self.table.isDeleted(index),
+        };
+    }
+};
+
+pub fn iterator(self: *const Self) Iterator {
+    return .{ .table = self };
+}
+
+pub fn encodedSize(num_docs: usize) usize {
+    return @sizeOf(u32) + num_docs * @sizeOf(u32) + std.math.divCeil(usize, num_docs, 8) catch unreachable;
+}
+
+/// Writes the table for a docs map, the writer must be at a position aligned to `alignment`.
+pub fn write(allocator: std.mem.Allocator, writer: anytype, docs: std.AutoHashMapUnmanaged(u32, bool)) !void {
+    const ids = try allocator.alloc(u32, docs.count());
+    defer allocator.free(ids);
+
+    var iter = docs.keyIterator();
+    var i: usize = 0;
+    while (iter.next()) |key_ptr| : (i += 1) {
+        ids[i] = key_ptr.*;
+    }
+    std.sort.pdq(u32, ids, {}, std.sort.asc(u32));
+
+    try writer.writeInt(u32, @intCast(ids.len), .little);
+    for (ids) |id| {
+        try writer.writeInt(u32, id, .little);
+    }
+
+    var byte: u8 = 0;
+    for (ids, 0..) |id, j| {
+        if (!docs.get(id).?) {
+            byte |= @as(u8, 1) << @intCast(j % 8);
+        }
+        if (j % 8 == 7) {
+            try writer.writeByte(byte);
+            byte = 0;
+        }
+    }
+    if (ids.len % 8 != 0) {
+        try writer.writeByte(byte);
+    }
+}
+
+/// Returns a table pointing into the encoded data, and the size of the encoded table.
+pub fn decode(data: []const u8) !struct { table: Self, size: usize } {
+    if (data.len < @sizeOf(u32) or !std.mem.isAligned(@intFromPtr(data.ptr), alignment)) {
+        return error.InvalidDocTable;
+    }
+
+    const num_docs = std.mem.readInt(u32, data[0..4], .little);
+    const size = encodedSize(num_docs);
+    if (data.len < size) {
+        return error.InvalidDocTable;
+    }
+
+    const ids_start = @sizeOf(u32);
+    const ids_end = ids_start + num_docs * @sizeOf(u32);
+    const ids_ptr: [*]const u32 = @ptrCast(@alignCast(data.ptr + ids_start));
+
+    return .{
+        .table = .{
+            .ids = ids_ptr[0..num_docs],
+            .deleted = data[ids_end..size],
+        },
+        .size = size,
+    };
+}
+
+/// Builds a table owning its memory, e.g. for segment files that store docs as a msgpack map.
+pub fn fromMap(allocator: std.mem.Allocator, docs: std.AutoHashMapUnmanaged(u32, bool)) !Self {
+    const buffer = try allocator.alignedAlloc(u8, alignment, encodedSize(docs.count()));
+    errdefer allocator.free(buffer);
+
+    var stream = std.io.fixedBufferStream(buffer);
+    try write(allocator, stream.writer(), docs);
+
+    var result = (try decode(buffer)).table;
+    result.buffer = buffer;
+    return result;
+}
+
+test "DocTable" {
+    const allocator = std.testing.allocator;
+
+    var docs: std.AutoHashMapUnmanaged(u32, bool) = .{};
+    defer docs.deinit(allocator);
+
+    for (0..100) |i| {
+        try docs.put(allocator, @intCast(1000 - i * 7), i % 3 != 0);
+    }
+
+    var table = try fromMap(allocator, docs);
+    defer table.deinit(allocator);
+
+    try std.testing.expectEqual(100, table.count());
+    try std.testing.expectEqual(1000 - 99 * 7, table.getMinDocId());
+    try std.testing.expectEqual(1000, table.getMaxDocId());
+
+    for (0..100) |i| {
+        const doc_id: u32 = @intCast(1000 - i * 7);
+        try std.testing.expectEqual(i % 3 != 0, table.get(doc_id).?);
+        try std.testing.expect(table.contains(doc_id));
+        try std.testing.expect(!table.contains(doc_id + 1));
+    }
+    try std.testing.expectEqual(null, table.get(0));
+    try std.testing.expectEqual(null, table.get(2000));
+
+    var num_docs: usize = 0;
+    var prev_id: u32 = 0;
+    var iter = table.iterator();
+    while (iter.next()) |doc| {
+        try std.testing.expect(doc.id > prev_id);
+        try std.testing.expectEqual(docs.get(doc.id).?, doc.active);
+        prev_id = doc.id;
+        num_docs += 1;
+    }
+    try std.testing.expectEqual(100, num_docs);
+}
+
+test "DocTable: empty" {
+    const docs: std.AutoHashMapUnmanaged(u32, bool) = .{};
+
+    var table = try fromMap(std.testing.allocator, docs);
+    defer table.deinit(std.testing.allocator);
+
+    try std.testing.expectEqual(0, table.count());
+    try std.testing.expectEqual(null, table.get(1));
+    try std.testing.expectEqual(0, table.getMinDocId());
+}
@@ -6,6 +6,7 @@ const common = @import("common.zig");
 const SearchResults = common.SearchResults;
 const KeepOrDelete = common.KeepOrDelete;
 const Deadline = @import("utils/Deadline.zig");
+const Scheduler = @import("utils/Scheduler.zig");
 
 const Item = @import("segment.zig").Item;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
@@ -13,26 +14,64 @@ const SegmentStatus = @import("segment.zig").SegmentStatus;
 const metrics = @import("metrics.zig");
 
 const filefmt = @import("filefmt.zig");
+const DocTable = @import("DocTable.zig");
+const BloomFilter = @import("utils/BloomFilter.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
+const BlockCache = @import("BlockCache.zig");
 
 const Self = @This();
 
+pub const tier_name = "file";
+
 pub const Options = struct {
     dir: std.fs.Dir,
+    // if set, large merges are split into hash ranges that are merged on the scheduler threads
+    scheduler: ?*Scheduler = null,
+    merge_threads: usize = 1,
+    parallel_merge_min_size: usize = 10_000_000,
+    // load segments from the block index stored in the file, without reading all blocks
+    fast_open: bool = false,
+    // throttles writes of merged and checkpointed segment files
+    rate_limiter: ?*RateLimiter = null,
+    // if set, searches keep decoded blocks here, shared by all segments of the index
+    block_cache: ?*BlockCache = null,
+    // shard of the index the segments belong to, it separates their blocks in the shared cache
+    shard_no: usize = 0,
+    // block size and format of new segment files
+    layout: filefmt.BlockLayout = .{},
+    // if set, segments with at least `large_segment_min_size` items are written with this layout,
+    // larger blocks mean a smaller block index and less index lookups per hash in big segments
+    large_segment_layout: ?filefmt.BlockLayout = null,
+    large_segment_min_size: usize = 100_000_000,
 };
 
 allocator: std.mem.Allocator,
 dir: std.fs.Dir,
+scheduler: ?*Scheduler = null,
+merge_threads: usize = 1,
+parallel_merge_min_size: usize = 0,
+fast_open: bool = false,
+rate_limiter: ?*RateLimiter = null,
+block_cache: ?*BlockCache = null,
+shard_no: usize = 0,
+layout: filefmt.BlockLayout = .{},
+large_segment_layout: ?filefmt.BlockLayout = null,
+large_segment_min_size: usize = 0,
 info: SegmentInfo = .{},
 status: SegmentStatus = .{},
 attributes: std.StringHashMapUnmanaged(u64) = .{},
-docs: std.AutoHashMapUnmanaged(u32, bool) = .{},
+docs: DocTable = .{},
+doc_filter: BloomFilter = .{},
 min_doc_id: u32 = 0,
 max_doc_id: u32 = 0,
 index: std.ArrayListUnmanaged(u32) = .{},
 block_size: usize = 0,
+block_format: filefmt.BlockFormat = .varint,
 blocks: []const u8,
 merged: u32 = 0,
 num_items: usize = 0,
+checksum: u64 = 0,
+checksum_verified: bool = false,
 delete_in_deinit: bool = false,
 
 mmaped_file: ?std.fs.File = null,
@@ -42,6 +81,16 @@ pub fn init(allocator: std.mem.Allocator, options: Options) Self {
     return Self{
         .allocator = allocator,
         .dir = options.dir,
+        .scheduler = options.scheduler,
+        .merge_threads = options.merge_threads,
+        .parallel_merge_min_size = options.parallel_merge_min_size,
+        .fast_open = options.fast_open,
+        .rate_limiter = options.rate_limiter,
+        .block_cache = options.block_cache,
+        .shard_no = options.shard_no,
+        .layout = options.layout,
+        .large_segment_layout = options.large_segment_layout,
+        .large_segment_min_size = options.large_segment_min_size,
         .blocks = undefined,
     };
 }
@@ -53,6 +102,7 @@ pub fn deinit(self: *Self, delete_file: KeepOrDelete) void {
     }
     self.attributes.deinit(self.allocator);
     self.docs.deinit(self.allocator);
+    self.doc_filter.deinit(self.allocator);
     self.index.deinit(self.allocator);
 
     if (self.mmaped_data) |data| {
@@ -72,13 +122,18 @@ pub fn getBlockData(self: Self, block: usize) []const u8 {
     return self.blocks[block * self.block_size .. (block + 1) * self.block_size];
 }
 
-pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+pub fn search(self: Self, sorted_hashes: []const u32, results: anytype, deadline: Deadline) !void {
     var prev_block_no: usize = std.math.maxInt(usize);
     var prev_block_range_start: usize = 0;
 
     var block_items = std.ArrayList(Item).init(results.allocator);
     defer block_items.deinit();
 
+    // hits are reported only after all docs of the hash are known, so hashes
+    // with too many docs can be skipped
+    var hash_items = std.ArrayList(Item).init(results.allocator);
+    defer hash_items.deinit();
+
     // Let's say we have blocks like this:
     //
     // |4.......|6.......|9.......|
@@ -89,33 +144,64 @@ pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, d
     // We want to find hash=10, lowerBound returns block=3 (EOF), but block=2 could still contain hash=6, so we go one back.
 
     for (sorted_hashes, 1..) |hash, i| {
+        results.startHash(i - 1);
         var block_no = std.sort.lowerBound(u32, hash, self.index.items[prev_block_range_start..], {}, std.sort.asc(u32)) + prev_block_range_start;
         if (block_no > 0) {
             block_no -= 1;
         }
         prev_block_range_start = block_no;
 
-        var num_docs: usize = 0;
+        const max_docs = results.getMaxDocsPerHash();
+        hash_items.clearRetainingCapacity();
+
+        var skipped = false;
         var num_blocks: u64 = 0;
         while (block_no < self.index.items.len and self.index.items[block_no] <= hash) : (block_no += 1) {
-            if (block_no != prev_block_no) {
-                prev_block_no = block_no;
-                const block_data = self.getBlockData(block_no);
-                try filefmt.readBlock(block_data, &block_items, self.min_doc_id);
-            }
-            const matches = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, block_items.items, {}, Item.cmpByHash);
-            for (matches[0]..matches[1]) |j| {
-                try results.incr(block_items.items[j].id, self.info.version);
-            }
-            num_docs += matches[1] - matches[0];
-            if (num_docs > 1000) {
-                break; // XXX explain why
-            }
+            const block_data = self.getBlockData(block_no);
+            const matches = if (self.block_cache) |cache| blk: {
+                if (block_no != prev_block_no) {
+                    prev_block_no = block_no;
+                    block_items.clearRetainingCapacity();
+                    try self.readCachedBlock(cache, block_no, &block_items);
+                }
+                const range = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, block_items.items, {}, Item.cmpByHash);
+                break :blk block_items.items[range[0]..range[1]];
+            } else switch (self.block_format) {
+                .varint => blk: {
+                    // varint blocks can't be searched without decoding, so keep the whole block around for the next hash
+                    if (block_no != prev_block_no) {
+                        prev_block_no = block_no;
+                        block_items.clearRetainingCapacity();
+                        try filefmt.readVarintBlock(block_data, &block_items, self.min_doc_id);
+                    }
+                    const range = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, block_items.items, {}, Item.cmpByHash);
+                    break :blk block_items.items[range[0]..range[1]];
+                },
+                .bitpacked => blk: {
+                    block_items.clearRetainingCapacity();
+                    try filefmt.searchBitpackedBlock(block_data, hash, &block_items, self.min_doc_id);
+                    break :blk block_items.items;
+                },
+            };
+            try hash_items.appendSlice(matches);
             num_blocks += 1;
+            if (max_docs > 0 and hash_items.items.len > max_docs) {
+                skipped = true;
+                break;
+            }
         }
 
-        metrics.scannedDocsPerHash(num_docs);
+        metrics.scannedDocsPerHash(hash_items.items.len);
         metrics.scannedBlocksPerHash(num_blocks);
+        results.countScanned(num_blocks, hash_items.items.len);
+
+        if (skipped) {
+            metrics.skippedHash();
+        } else {
+            for (hash_items.items) |item| {
+                try results.incr(item.id, self.info.version);
+            }
+        }
 
         if (i % 10 == 0) {
             try deadline.check();
@@ -123,8 +209,28 @@ pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, d
     }
 }
 
+fn readCachedBlock(self: Self, cache: *BlockCache, block_no: usize, items: *std.ArrayList(Item)) !void {
+    const key = BlockCache.Key.init(self.shard_no, self.info, block_no);
+    if (try cache.get(key, items)) {
+        return;
+    }
+    try filefmt.readBlock(self.block_format, self.getBlockData(block_no), items, self.min_doc_id);
+    cache.put(key, items.items) catch |err| {
+        log.warn("failed to cache block: {}", .{err});
+    };
+}
+
 pub fn load(self: *Self, info: SegmentInfo) !void {
-    try filefmt.readSegmentFile(self.dir, info, self);
+    try filefmt.openSegmentFile(self.dir, info, self, .{ .fast = self.fast_open });
+}
+
+/// Verifies the checksum of a segment that was loaded with `fast_open`.
+pub fn verify(self: *Self) !void {
+    if (self.checksum_verified) {
+        return;
+    }
+    try filefmt.verifySegmentBlocks(self);
+    self.checksum_verified = true;
 }
 
 pub fn delete(self: *Self) void {
@@ -145,14 +251,190 @@ pub fn cleanup(self: *Self) void {
 }
 
 pub fn merge(self: *Self, source: anytype) !void {
+    if (self.scheduler) |scheduler| {
+        if (self.merge_threads > 1 and source.estimated_size >= self.parallel_merge_min_size) {
+            return self.mergeParallel(scheduler, source);
+        }
+    }
     try self.build(source);
 }
 
+// Picks hashes that split the merged items into roughly equal ranges,
+// block indexes of the sources are used as a sample of the hash distribution.
+fn findSplitHashes(allocator: std.mem.Allocator, source: anytype, num_parts: usize) ![]u32 {
+    var hashes = std.ArrayList(u32).init(allocator);
+    defer hashes.deinit();
+
+    for (source.sources.items) |merge_source| {
+        try hashes.appendSlice(merge_source.reader.segment.index.items);
+    }
+    std.sort.pdq(u32, hashes.items, {}, std.sort.asc(u32));
+
+    var result = std.ArrayList(u32).init(allocator);
+    errdefer result.deinit();
+
+    if (hashes.items.len == 0) {
+        return result.toOwnedSlice();
+    }
+
+    for (1..num_parts) |i| {
+        const hash = hashes.items[i * hashes.items.len / num_parts];
+        if (hash == 0) {
+            continue;
+        }
+        if (result.items.len > 0 and result.items[result.items.len - 1] >= hash) {
+            continue;
+        }
+        try result.append(hash);
+    }
+
+    return result.toOwnedSlice();
+}
+
+fn MergePart(comptime Merger: type) type {
+    return struct {
+        merger: Merger,
+        file: std.fs.File,
+        file_name_buf: [filefmt.max_file_name_size + 16]u8 = undefined,
+        file_name_len: usize = 0,
+        block_index: filefmt.BlockIndex = .{},
+        result: anyerror!void = {},
+
+        fn open(self: *@This(), dir: std.fs.Dir, file_name: []const u8, part_no: usize) !void {
+            const part_file_name = try std.fmt.bufPrint(&self.file_name_buf, "{s}.part{}", .{ file_name, part_no });
+            self.file_name_len = part_file_name.len;
+            self.file = try dir.createFile(part_file_name, .{ .read = true, .truncate = true });
+        }
+
+        fn close(self: *@This(), allocator: std.mem.Allocator, dir: std.fs.Dir) void {
+            self.file.close();
+            dir.deleteFile(self.file_name_buf[0..self.file_name_len]) catch |err| {
+                log.err("failed to clean up part file {s}: {}", .{ self.file_name_buf[0..self.file_name_len], err });
+            };
+            self.block_index.deinit(allocator);
+            self.merger.deinit();
+        }
+
+        fn run(self: *@This(), allocator: std.mem.Allocator, min_doc_id: u32, options: filefmt.WriteOptions) void {
+            self.result = filefmt.writeSegmentFileBlocks(allocator, self.file, &self.merger, min_doc_id, &self.block_index, options);
+        }
+    };
+}
+
+// Each hash range is merged into a separate part file on the scheduler threads,
+// then the parts are concatenated into the segment file.
+fn mergeParallel(self: *Self, scheduler: *Scheduler, source: anytype) !void {
+    const Part = MergePart(@TypeOf(source.*));
+
+    const split_hashes = try findSplitHashes(self.allocator, source, self.merge_threads);
+    defer self.allocator.free(split_hashes);
+
+    if (split_hashes.len == 0) {
+        return self.build(source);
+    }
+
+    var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+    const file_name = filefmt.buildSegmentFileName(&file_name_buf, source.segment.info);
+
+    const parts = try self.allocator.alloc(Part, split_hashes.len + 1);
+    defer self.allocator.free(parts);
+
+    var num_parts: usize = 0;
+    defer for (parts[0..num_parts]) |*part| part.close(self.allocator, self.dir);
+
+    for (parts, 0..) |*part, i| {
+        const start_hash = if (i == 0) 0 else split_hashes[i - 1];
+        const end_hash = if (i < split_hashes.len) split_hashes[i] else null;
+        part.* = .{ .merger = try source.initRange(start_hash, end_hash), .file = undefined };
+        part.open(self.dir, file_name, i) catch |err| {
+            part.merger.deinit();
+            return err;
+        };
+        num_parts += 1;
+    }
+
+    const tasks = try self.allocator.alloc(Scheduler.Task, parts.len);
+    defer self.allocator.free(tasks);
+
+    var num_tasks: usize = 0;
+    defer for (tasks[0..num_tasks]) |task| scheduler.destroyTask(task);
+
+    // all parts must use the same layout as the final file, their blocks are copied as they are
+    const write_options = self.getWriteOptions(source);
+
+    // part files are read back right away, so their pages are kept in the page cache
+    var part_write_options = write_options;
+    part_write_options.drop_cache = false;
+
+    for (parts, tasks) |*part, *task| {
+        task.* = try scheduler.createTask(.low, Part.run, .{ part, self.allocator, source.segment.min_doc_id, part_write_options });
+        num_tasks += 1;
+        scheduler.scheduleTask(task.*);
+    }
+
+    for (tasks) |task| {
+        scheduler.waitTask(task);
+    }
+
+    const part_files = try self.allocator.alloc(std.fs.File, parts.len);
+    defer self.allocator.free(part_files);
+
+    const part_indexes = try self.allocator.alloc(filefmt.BlockIndex, parts.len);
+    defer self.allocator.free(part_indexes);
+
+    for (parts, part_files, part_indexes) |*part, *part_file, *part_index| {
+        try part.result;
+        part_file.* = part.file;
+        part_index.* = part.block_index;
+    }
+
+    var block_index: filefmt.BlockIndex = .{};
+    defer block_index.deinit(self.allocator);
+
+    try filefmt.writeSegmentFileFromParts(self.allocator, self.dir, source.segment, part_files, part_indexes, &block_index, write_options);
+
+    errdefer self.dir.deleteFile(file_name) catch |err| {
+        if (err != error.FileNotFound) {
+            log.err("failed to clean up segment file {s}: {}", .{ file_name, err });
+        }
+    };
+
+    try filefmt.openSegmentFile(self.dir, source.segment.info, self, .{ .block_index = &block_index });
+}
+
+fn getSourceSize(source: anytype) usize {
+    if (@hasField(@TypeOf(source.*), "estimated_size")) {
+        return source.estimated_size;
+    }
+    return source.segment.getSize();
+}
+
+fn getLayout(self: Self, num_items: usize) filefmt.BlockLayout {
+    if (self.large_segment_layout) |layout| {
+        if (num_items >= self.large_segment_min_size) {
+            return layout;
+        }
+    }
+    return self.layout;
+}
+
+fn getWriteOptions(self: Self, source: anytype) filefmt.WriteOptions {
+    return .{
+        .layout = self.getLayout(getSourceSize(source)),
+        .rate_limiter = self.rate_limiter,
+        .drop_cache = true,
+    };
+}
+
 pub fn build(self: *Self, source: anytype) !void {
     var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
     const file_name = filefmt.buildSegmentFileName(&file_name_buf, source.segment.info);
 
-    try filefmt.writeSegmentFile(self.dir, source);
+    // the block index is collected while writing, so the file doesn't have to be scanned again
+    var block_index: filefmt.BlockIndex = .{};
+    defer block_index.deinit(self.allocator);
+
+    try filefmt.writeSegmentFile(self.allocator, self.dir, source, &block_index, self.getWriteOptions(source));
 
     errdefer self.dir.deleteFile(file_name) catch |err| {
         if (err != error.FileNotFound) {
@@ -160,7 +442,7 @@ pub fn build(self: *Self, source: anytype) !void {
         }
     };
 
-    try filefmt.readSegmentFile(self.dir, source.segment.info, self);
+    try filefmt.openSegmentFile(self.dir, source.segment.info, self, .{ .block_index = &block_index });
 }
 
 test "build" {
@@ -194,10 +476,259 @@ test "build" {
     try std.testing.expectEqual(1, segment.index.items.len);
 }
 
+test "search skips hashes with too many docs" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var changes = std.ArrayList(Change).init(std.testing.allocator);
+    defer changes.deinit();
+
+    for (1..2001) |i| {
+        const hashes: []const u32 = if (i <= 10) &.{ 1, 2 } else &.{1};
+        try changes.append(.{ .insert = .{ .id = @intCast(i), .hashes = hashes } });
+    }
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    source.info = .{ .version = 1 };
+    try source.build(changes.items);
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var segment = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+
+    {
+        var results = SearchResults.init(std.testing.allocator, .{ .max_docs_per_hash = 1000 });
+        defer results.deinit();
+
+        try segment.search(&.{ 1, 2 }, &results, .{});
+
+        try std.testing.expectEqual(10, results.count());
+        try std.testing.expectEqual(1, results.get(1).?.score);
+    }
+
+    {
+        var results = SearchResults.init(std.testing.allocator, .{ .max_docs_per_hash = 0 });
+        defer results.deinit();
+
+        try segment.search(&.{ 1, 2 }, &results, .{});
+
+        try std.testing.expectEqual(2000, results.count());
+        try std.testing.expectEqual(2, results.get(1).?.score);
+    }
+}
+
+test "search with block cache" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var changes = std.ArrayList(Change).init(std.testing.allocator);
+    defer changes.deinit();
+
+    var hashes: [1000]u32 = undefined;
+    for (&hashes, 0..) |*hash, i| {
+        hash.* = @intCast(i * 7);
+    }
+    for (1..11) |i| {
+        try changes.append(.{ .insert = .{ .id = @intCast(i), .hashes = &hashes } });
+    }
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    source.info = .{ .version = 1 };
+    try source.build(changes.items);
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var cache = BlockCache.init(std.testing.allocator, 1024 * 1024);
+    defer cache.deinit();
+
+    var segment = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir, .block_cache = &cache });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+
+    for (0..2) |_| {
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try segment.search(&.{ 0, 7, 14, 6993, 6994 }, &results, .{});
+
+        try std.testing.expectEqual(10, results.count());
+        for (1..11) |i| {
+            try std.testing.expectEqual(4, results.get(@intCast(i)).?.score);
+        }
+        try std.testing.expect(cache.getSize() > 0);
+    }
+}
+
+test "build with large segment layout" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var changes = std.ArrayList(Change).init(std.testing.allocator);
+    defer changes.deinit();
+
+    var hashes: [1000]u32 = undefined;
+    for (&hashes, 0..) |*hash, i| {
+        hash.* = @intCast(i * 7);
+    }
+    for (1..11) |i| {
+        try changes.append(.{ .insert = .{ .id = @intCast(i), .hashes = &hashes } });
+    }
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    source.info = .{ .version = 1 };
+    try source.build(changes.items);
+
+    const options = Options{
+        .dir = tmp_dir.dir,
+        .layout = .{ .block_size = 256, .block_format = .varint },
+        .large_segment_layout = .{ .block_size = 4096, .block_format = .bitpacked },
+    };
+
+    for ([_]usize{ 10_000, 10_001 }) |min_size| {
+        var source_reader = source.reader();
+        defer source_reader.close();
+
+        var segment_options = options;
+        segment_options.large_segment_min_size = min_size;
+
+        var segment = Self.init(std.testing.allocator, segment_options);
+        defer segment.deinit(.delete);
+
+        try segment.build(&source_reader);
+
+        const expected = if (min_size <= source.getSize()) options.large_segment_layout.? else options.layout;
+        try std.testing.expectEqual(expected.block_size, segment.block_size);
+        try std.testing.expectEqual(expected.block_format, segment.block_format);
+
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try segment.search(&.{ 0, 7, 14, 6993, 6994 }, &results, .{});
+
+        try std.testing.expectEqual(10, results.count());
+        try std.testing.expectEqual(4, results.get(1).?.score);
+    }
+}
+
+test "parallel merge" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const SegmentList = @import("segment_list.zig").SegmentList;
+    const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
+    const List = SegmentList(Self);
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var collection = try List.init(std.testing.allocator, 3);
+    defer collection.deinit(std.testing.allocator, .delete);
+
+    var expected = std.ArrayList(Item).init(std.testing.allocator);
+    defer expected.deinit();
+
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    for (0..3) |i| {
+        var source = MemorySegment.init(std.testing.allocator, .{});
+        defer source.deinit(.delete);
+
+        source.info = .{ .version = i + 1 };
+        source.status.frozen = true;
+        for (0..10) |j| {
+            const doc_id: u32 = @intCast(i * 10 + j + 1);
+            try source.docs.put(source.allocator, doc_id, true);
+            for (0..100) |_| {
+                try source.items.append(source.allocator, .{ .id = doc_id, .hash = rand.int(u32) });
+            }
+        }
+        std.sort.pdq(Item, source.items.items, {}, Item.cmp);
+        try expected.appendSlice(source.items.items);
+
+        var source_reader = source.reader();
+        defer source_reader.close();
+
+        const node = try List.createSegment(std.testing.allocator, .{ .dir = tmp_dir.dir });
+        collection.nodes.appendAssumeCapacity(node);
+        try node.value.build(&source_reader);
+    }
+    std.sort.pdq(Item, expected.items, {}, Item.cmp);
+
+    var merger = try SegmentMerger(Self).init(std.testing.allocator, &collection, 3);
+    defer merger.deinit();
+
+    for (collection.nodes.items) |node| {
+        merger.addSource(node.value);
+    }
+    try merger.prepare();
+
+    var segment = Self.init(std.testing.allocator, .{
+        .dir = tmp_dir.dir,
+        .scheduler = &scheduler,
+        .merge_threads = 4,
+        .parallel_merge_min_size = 0,
+    });
+    defer segment.deinit(.delete);
+
+    try segment.merge(&merger);
+
+    try std.testing.expectEqualDeep(SegmentInfo{ .version = 1, .merges = 2 }, segment.info);
+    try std.testing.expectEqual(30, segment.docs.count());
+    try std.testing.expectEqual(expected.items.len, segment.getSize());
+
+    var items = std.ArrayList(Item).init(std.testing.allocator);
+    defer items.deinit();
+
+    var segment_reader = segment.reader();
+    defer segment_reader.close();
+
+    while (try segment_reader.read()) |item| {
+        try items.append(item);
+        segment_reader.advance();
+    }
+    try std.testing.expectEqualSlices(Item, expected.items, items.items);
+}
+
 pub fn getSize(self: Self) usize {
     return self.num_items;
 }
 
+/// Approximate number of bytes allocated by the segment, without the memory-mapped file.
+pub fn getMemoryUsage(self: Self) usize {
+    return self.docs.buffer.len + self.index.capacity * @sizeOf(u32) + self.doc_filter.buffer.len * @sizeOf(u32);
+}
+
+/// Size of the memory-mapped file, which is only resident as far as the page cache keeps it.
+pub fn getMappedSize(self: Self) usize {
+    if (self.mmaped_data) |data| {
+        return data.len;
+    }
+    return 0;
+}
+
 pub fn reader(self: *const Self) Reader {
     return .{
         .segment = self,
@@ -205,14 +736,46 @@ pub fn reader(self: *const Self) Reader {
     };
 }
 
+// Readers are used for merging, they read blocks with pread in large sequential chunks,
+// instead of through the mmaped data that searches access randomly.
+const reader_buffer_size = 256 * 1024;
+
 pub const Reader = struct {
     segment: *const Self,
     items: std.ArrayList(Item),
     index: usize = 0,
     block_no: usize = 0,
+    buffer: []u8 = &.{},
+    buffer_start_block: usize = 0,
+    buffer_num_blocks: usize = 0,
 
     pub fn close(self: *Reader) void {
         self.items.deinit();
+        self.segment.allocator.free(self.buffer);
+    }
+
+    fn getBlockData(self: *Reader, block_no: usize) ![]const u8 {
+        const segment = self.segment;
+        const file = segment.mmaped_file orelse return segment.getBlockData(block_no);
+        const data = segment.mmaped_data orelse return segment.getBlockData(block_no);
+
+        if (block_no < self.buffer_start_block or block_no >= self.buffer_start_block + self.buffer_num_blocks) {
+            if (self.buffer.len == 0) {
+                self.buffer = try segment.allocator.alloc(u8, @max(1, reader_buffer_size / segment.block_size) * segment.block_size);
+                filefmt.adviseSequentialReads(file);
+            }
+            const num_blocks = @min(self.buffer.len / segment.block_size, segment.index.items.len - block_no);
+            const blocks_offset = @intFromPtr(segment.blocks.ptr) - @intFromPtr(data.ptr);
+            const chunk = self.buffer[0 .. num_blocks * segment.block_size];
+            const n = try file.preadAll(chunk, blocks_offset + block_no * segment.block_size);
+            if (n != chunk.len) {
+                return error.UnexpectedEndOfFile;
+            }
+            self.buffer_start_block = block_no;
+            self.buffer_num_blocks = num_blocks;
+        }
+
+        return self.buffer[(block_no - self.buffer_start_block) * segment.block_size ..][0..segment.block_size];
     }
 
     pub fn read(self: *Reader) !?Item {
@@ -222,9 +785,9 @@ pub const Reader = struct {
             }
             self.items.clearRetainingCapacity();
             self.index = 0;
-            const block_data = self.segment.getBlockData(self.block_no);
+            const block_data = try self.getBlockData(self.block_no);
             self.block_no += 1;
-            try filefmt.readBlock(block_data, &self.items, self.segment.min_doc_id);
+            try filefmt.readBlock(self.segment.block_format, block_data, &self.items, self.segment.min_doc_id);
         }
         return self.items.items[self.index];
     }
@@ -234,4 +797,23 @@ pub const Reader = struct {
             self.index += 1;
         }
     }
+
+    /// Positions the reader at the first item with hash >= `hash`.
+    pub fn seek(self: *Reader, hash: u32) !void {
+        // the block index has the first hash of each block, so items with the hash
+        // can start at the end of the previous block
+        var block_no = std.sort.lowerBound(u32, hash, self.segment.index.items, {}, std.sort.asc(u32));
+        if (block_no > 0) {
+            block_no -= 1;
+        }
+        self.block_no = block_no;
+        self.items.clearRetainingCapacity();
+        self.index = 0;
+        while (try self.read()) |item| {
+            if (item.hash >= hash) {
+                break;
+            }
+            self.advance();
+        }
+    }
 };
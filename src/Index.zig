@@ -1,15 +1,22 @@
 const std = @import("std");
 const Allocator = std.mem.Allocator;
+const assert = std.debug.assert;
 const log = std.log.scoped(.index);
 
 const zul = @import("zul");
+const msgpack = @import("msgpack");
 
 const Deadline = @import("utils/Deadline.zig");
 const Scheduler = @import("utils/Scheduler.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
 const Change = @import("change.zig").Change;
+const Transaction = @import("change.zig").Transaction;
 const SearchResult = @import("common.zig").SearchResult;
 const SearchResults = @import("common.zig").SearchResults;
+const SearchTimings = @import("common.zig").SearchTimings;
+const MultiSearchResults = @import("common.zig").MultiSearchResults;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
+const HashRange = @import("segment.zig").HashRange;
 const DocInfo = @import("common.zig").DocInfo;
 
 const Oplog = @import("Oplog.zig");
@@ -20,48 +27,265 @@ const SegmentListManager = @import("segment_list.zig").SegmentListManager;
 const MemorySegment = @import("MemorySegment.zig");
 const MemorySegmentList = SegmentList(MemorySegment);
 const MemorySegmentNode = MemorySegmentList.Node;
+const MemorySegmentListManager = SegmentListManager(MemorySegment);
 
 const FileSegment = @import("FileSegment.zig");
 const FileSegmentList = SegmentList(FileSegment);
 const FileSegmentNode = FileSegmentList.Node;
+const FileSegmentListManager = SegmentListManager(FileSegment);
 
 const IndexReader = @import("IndexReader.zig");
+const SearchCache = @import("SearchCache.zig");
+const BlockCache = @import("BlockCache.zig");
+const Replicator = @import("Replicator.zig");
 const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
+const AtomicSharedPtr = @import("utils/atomic_shared_ptr.zig").AtomicSharedPtr;
 
 const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
 
 const TieredMergePolicy = @import("segment_merge_policy.zig").TieredMergePolicy;
+const MergeLoad = @import("segment_merge_policy.zig").MergeLoad;
 
 const filefmt = @import("filefmt.zig");
 
 const metrics = @import("metrics.zig");
 const Self = @This();
 
-const Options = struct {
+pub const Options = struct {
     min_segment_size: usize = 500_000,
     max_segment_size: usize = 750_000_000,
+    search_pool: ?*std.Thread.Pool = null,
+    // maximum number of cached search results, zero disables the cache
+    search_cache_size: usize = 0,
+    // how long to wait for concurrent updates to share one oplog fsync
+    oplog_max_batch_wait_us: u64 = 0,
+    oplog_max_batch_size: usize = 1024 * 1024,
+    // format of new oplog writes, older files are read in either format
+    oplog_format: Oplog.Format = .compact,
+    // large file segment merges are split into this many hash ranges merged in parallel
+    merge_threads: usize = 1,
+    // open file segments without reading all blocks and verify their checksums in the background
+    fast_open: bool = false,
+    // throttles segment file writes while searches are running, shared by all indexes
+    rate_limiter: ?*RateLimiter = null,
+    // memory budget in bytes for decoded file segment blocks, zero disables the cache
+    block_cache_size: usize = 0,
+    // block size and format of new file segments
+    block_layout: filefmt.BlockLayout = .{},
+    // file segments with at least `large_segment_min_size` items use this layout instead
+    large_segment_layout: ?filefmt.BlockLayout = null,
+    large_segment_min_size: usize = 100_000_000,
+    // read-only copy of an index on another node, updated only by replication,
+    // it doesn't run checkpoints or file segment merges, the segments come from the leader
+    replica: bool = false,
+    // base URL of the leader a replica follows, e.g. "http://leader:6081"
+    leader_url: ?[]const u8 = null,
+    replication: Replicator.Options = .{},
+    // number of hash ranges the index is split into, each with its own segments, merges and checkpoints,
+    // it must stay the same for the life of the index
+    num_shards: usize = 1,
+    // file segments with at least this share of items from superseded docs are rewritten,
+    // even if there are few segments, zero disables it
+    min_reclaim_ratio: f64 = 0.33,
+    // while the node runs at least this many searches per second, file segment merges
+    // bigger than `busy_max_merge_size` items are deferred, zero disables it
+    busy_search_rate: f64 = 0,
+    busy_max_merge_size: usize = 50_000_000,
 };
 
+pub const max_shards = 64;
+
+// Part of the index for one hash range. Every shard gets all updates, with only the hashes
+// in its range, so it can resolve doc versions on its own. The segment size limits are split
+// between the shards, so merges stay proportionally smaller.
+const Shard = struct {
+    hash_range: HashRange,
+    // the index directory for unsharded indexes, a subdirectory otherwise
+    dir: std.fs.Dir,
+    owns_dir: bool,
+    // the first memory segment is checkpointed when it reaches this size
+    min_segment_size: usize,
+    memory_segments: SegmentListManager(MemorySegment),
+    file_segments: SegmentListManager(FileSegment),
+
+    checkpoint_task: ?Scheduler.Task = null,
+    file_segment_merge_task: ?Scheduler.Task = null,
+    memory_segment_merge_task: ?Scheduler.Task = null,
+
+    fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, index_dir: std.fs.Dir, shard_no: usize, options: Options, memory_segment_items_pool: *MemorySegment.ItemPool, block_cache: ?*BlockCache) !Shard {
+        const num_shards = options.num_shards;
+
+        var dir = index_dir;
+        if (num_shards > 1) {
+            var dir_name_buf: [32]u8 = undefined;
+            dir = try index_dir.makeOpenPath(getShardDirName(&dir_name_buf, shard_no), .{ .iterate = true });
+        }
+        errdefer if (num_shards > 1) dir.close();
+
+        const min_segment_size = @max(options.min_segment_size / num_shards, 1);
+        const max_segment_size = @max(options.max_segment_size / num_shards, 1);
+
+        var memory_segments = try SegmentListManager(MemorySegment).init(
+            allocator,
+            .{
+                .items_pool = memory_segment_items_pool,
+            },
+            .{
+                .min_segment_size = 100,
+                .max_segment_size = min_segment_size,
+                .segments_per_level = 5,
+                .segments_per_merge = 10,
+                .max_segments = 16,
+            },
+        );
+        errdefer memory_segments.deinit(allocator, .keep);
+
+        var file_segments = try SegmentListManager(FileSegment).init(
+            allocator,
+            .{
+                .dir = dir,
+                .scheduler = scheduler,
+                .merge_threads = options.merge_threads,
+                .fast_open = options.fast_open,
+                .rate_limiter = options.rate_limiter,
+                .block_cache = block_cache,
+                .shard_no = shard_no,
+                .layout = options.block_layout,
+                .large_segment_layout = options.large_segment_layout,
+                .large_segment_min_size = options.large_segment_min_size,
+            },
+            .{
+                .min_segment_size = min_segment_size,
+                .max_segment_size = max_segment_size,
+                .segments_per_level = 10,
+                .segments_per_merge = 10,
+                .min_reclaim_ratio = options.min_reclaim_ratio,
+                .busy_search_rate = options.busy_search_rate,
+                .busy_max_merge_size = @max(options.busy_max_merge_size / num_shards, 1),
+            },
+        );
+        errdefer file_segments.deinit(allocator, .keep);
+
+        return .{
+            .hash_range = HashRange.split(num_shards, shard_no),
+            .dir = dir,
+            .owns_dir = num_shards > 1,
+            .min_segment_size = min_segment_size,
+            .memory_segments = memory_segments,
+            .file_segments = file_segments,
+        };
+    }
+
+    fn deinit(self: *Shard, allocator: std.mem.Allocator, scheduler: *Scheduler) void {
+        if (self.checkpoint_task) |task| {
+            scheduler.destroyTask(task);
+        }
+
+        if (self.memory_segment_merge_task) |task| {
+            scheduler.destroyTask(task);
+        }
+
+        if (self.file_segment_merge_task) |task| {
+            scheduler.destroyTask(task);
+        }
+
+        self.memory_segments.deinit(allocator, .keep);
+        self.file_segments.deinit(allocator, .keep);
+
+        if (self.owns_dir) {
+            self.dir.close();
+        }
+    }
+
+    // Last commit included in the file segments, must be called with `segments_lock` held,
+    // or when nothing else can change the file segments.
+    fn getCheckpointedCommitId(self: *const Shard) u64 {
+        if (self.file_segments.segments.value.getLast()) |node| {
+            return node.value.info.getLastCommitId();
+        }
+        return 0;
+    }
+};
+
+fn getShardDirName(buf: []u8, shard_no: usize) []const u8 {
+    return std.fmt.bufPrint(buf, "shard-{}", .{shard_no}) catch unreachable;
+}
+
+fn shardManifestExists(dir: std.fs.Dir, shard_no: usize) bool {
+    var dir_name_buf: [32]u8 = undefined;
+    var path_buf: [64]u8 = undefined;
+    const path = std.fmt.bufPrint(&path_buf, "{s}/{s}", .{ getShardDirName(&dir_name_buf, shard_no), filefmt.manifest_file_name }) catch unreachable;
+    return exists(dir, path);
+}
+
+// The number of shards can't be changed, the segments would be in the wrong hash ranges.
+// This runs before the shard directories are created, so a wrong shard count leaves
+// nothing behind.
+fn checkShardLayout(dir: std.fs.Dir, num_shards: usize) !void {
+    var dir_name_buf: [32]u8 = undefined;
+    if (num_shards == 1) {
+        if (exists(dir, getShardDirName(&dir_name_buf, 0))) {
+            return error.ShardCountMismatch;
+        }
+    } else {
+        if (exists(dir, filefmt.manifest_file_name)) {
+            return error.ShardCountMismatch;
+        }
+        // the first shard's manifest is written last, once it exists, all shards have one
+        if (shardManifestExists(dir, 0)) {
+            if (!shardManifestExists(dir, num_shards - 1) or shardManifestExists(dir, num_shards)) {
+                return error.ShardCountMismatch;
+            }
+        }
+    }
+}
+
+fn exists(dir: std.fs.Dir, name: []const u8) bool {
+    dir.access(name, .{}) catch return false;
+    return true;
+}
+
 options: Options,
 allocator: std.mem.Allocator,
 scheduler: *Scheduler,
 name: []const u8,
 
+// retired item buffers of memory segments, reused by new segments and merges
+memory_segment_items_pool: *MemorySegment.ItemPool,
+
+// decoded blocks of file segments, shared by all of them
+block_cache: ?*BlockCache = null,
+
 dir: std.fs.Dir,
 
 oplog: Oplog,
 
+// serializes reserving memory for updates and getting their commit ids, see `updateInternal`
+reserve_lock: std.Thread.Mutex = .{},
+
+// updates are written to the oplog concurrently, but memory segments are added in commit order
+commit_order_lock: std.Thread.Mutex = .{},
+commit_order_cond: std.Thread.Condition = .{},
+next_commit_id_to_apply: u64 = 0,
+
 open_lock: std.Thread.Mutex = .{},
 is_ready: std.Thread.ResetEvent = .{},
 load_task: ?Scheduler.Task = null,
 
-segments_lock: std.Thread.RwLock = .{},
-memory_segments: SegmentListManager(MemorySegment),
-file_segments: SegmentListManager(FileSegment),
+// serializes changes of the segment lists, searches don't take it
+segments_lock: std.Thread.Mutex = .{},
+shards: []Shard,
+
+// the current segment lists, republished after every change
+snapshot: AtomicSharedPtr(IndexReader.Snapshot),
+
+search_cache: ?SearchCache = null,
+
+verify_segments_task: ?Scheduler.Task = null,
+// set if a segment opened with `fast_open` failed the checksum verification
+corrupted: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
 
-checkpoint_task: ?Scheduler.Task = null,
-file_segment_merge_task: ?Scheduler.Task = null,
-memory_segment_merge_task: ?Scheduler.Task = null,
+replicator: ?*Replicator = null,
 
 fn getFileSegmentSize(segment: SharedPtr(FileSegment)) usize {
     return segment.value.getSize();
@@ -72,83 +296,127 @@ fn getMemorySegmentSize(segment: SharedPtr(MemorySegment)) usize {
 }
 
 pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, parent_dir: std.fs.Dir, path: []const u8, options: Options) !Self {
+    try options.block_layout.validate();
+    if (options.large_segment_layout) |layout| {
+        try layout.validate();
+    }
+    if (options.num_shards == 0 or options.num_shards > max_shards) {
+        return error.InvalidShardCount;
+    }
+
     var dir = try parent_dir.makeOpenPath(path, .{ .iterate = true });
     errdefer dir.close();
 
-    var oplog = try Oplog.init(allocator, dir);
+    try checkShardLayout(dir, options.num_shards);
+
+    var oplog = try Oplog.init(allocator, dir, .{
+        .max_batch_wait_ns = options.oplog_max_batch_wait_us * std.time.ns_per_us,
+        .max_batch_size = options.oplog_max_batch_size,
+        .format = options.oplog_format,
+        // replayed transactions are added as memory segments up to the checkpoint size
+        .max_replay_batch_size = options.min_segment_size,
+    });
     errdefer oplog.deinit();
 
-    const memory_segments = try SegmentListManager(MemorySegment).init(
-        allocator,
-        .{},
-        .{
-            .min_segment_size = 100,
-            .max_segment_size = options.min_segment_size,
-            .segments_per_level = 5,
-            .segments_per_merge = 10,
-            .max_segments = 16,
-        },
-    );
-
-    const file_segments = try SegmentListManager(FileSegment).init(
-        allocator,
-        .{
-            .dir = dir,
-        },
-        .{
-            .min_segment_size = options.min_segment_size,
-            .max_segment_size = options.max_segment_size,
-            .segments_per_level = 10,
-            .segments_per_merge = 10,
-        },
-    );
+    const memory_segment_items_pool = try allocator.create(MemorySegment.ItemPool);
+    errdefer allocator.destroy(memory_segment_items_pool);
+
+    memory_segment_items_pool.* = MemorySegment.ItemPool.init(allocator, .{});
+    errdefer memory_segment_items_pool.deinit();
+
+    var block_cache: ?*BlockCache = null;
+    if (options.block_cache_size > 0) {
+        block_cache = try allocator.create(BlockCache);
+        block_cache.?.* = BlockCache.init(allocator, options.block_cache_size);
+    }
+    errdefer if (block_cache) |cache| {
+        cache.deinit();
+        allocator.destroy(cache);
+    };
+
+    const shards = try allocator.alloc(Shard, options.num_shards);
+    errdefer allocator.free(shards);
+
+    var num_shards: usize = 0;
+    errdefer for (shards[0..num_shards]) |*shard| shard.deinit(allocator, scheduler);
+
+    for (shards, 0..) |*shard, i| {
+        shard.* = try Shard.init(allocator, scheduler, dir, i, options, memory_segment_items_pool, block_cache);
+        num_shards += 1;
+    }
+
+    const snapshot = try allocSnapshotFor(allocator, shards.len);
+    for (snapshot.value.shards, shards) |*snapshot_shard, *shard| {
+        snapshot_shard.* = .{
+            .hash_range = shard.hash_range,
+            .file_segments = shard.file_segments.segments.acquire(),
+            .memory_segments = shard.memory_segments.segments.acquire(),
+        };
+    }
 
     return .{
         .options = options,
         .allocator = allocator,
         .scheduler = scheduler,
+        .memory_segment_items_pool = memory_segment_items_pool,
+        .block_cache = block_cache,
         .dir = dir,
         .name = path,
         .oplog = oplog,
         .segments_lock = .{},
-        .memory_segments = memory_segments,
-        .file_segments = file_segments,
+        .shards = shards,
+        .snapshot = AtomicSharedPtr(IndexReader.Snapshot).init(snapshot),
+        .search_cache = if (options.search_cache_size > 0) SearchCache.init(allocator, options.search_cache_size) else null,
     };
 }
 
 pub fn deinit(self: *Self) void {
     log.info("closing index {}", .{@intFromPtr(self)});
 
+    // stop applying changes before anything else is torn down
+    if (self.replicator) |replicator| {
+        replicator.deinit();
+        self.allocator.destroy(replicator);
+    }
+
     if (self.load_task) |task| {
         self.scheduler.destroyTask(task);
     }
 
-    if (self.checkpoint_task) |task| {
+    if (self.verify_segments_task) |task| {
         self.scheduler.destroyTask(task);
     }
 
-    if (self.memory_segment_merge_task) |task| {
-        self.scheduler.destroyTask(task);
+    self.snapshot.deinit(self.allocator, IndexReader.Snapshot.destroy, .{self.allocator});
+
+    for (self.shards) |*shard| {
+        shard.deinit(self.allocator, self.scheduler);
     }
+    self.allocator.free(self.shards);
 
-    if (self.file_segment_merge_task) |task| {
-        self.scheduler.destroyTask(task);
+    self.memory_segment_items_pool.deinit();
+    self.allocator.destroy(self.memory_segment_items_pool);
+
+    if (self.block_cache) |cache| {
+        cache.deinit();
+        self.allocator.destroy(cache);
     }
 
-    self.memory_segments.deinit(self.allocator, .keep);
-    self.file_segments.deinit(self.allocator, .keep);
+    if (self.search_cache) |*cache| {
+        cache.deinit();
+    }
 
     self.oplog.deinit();
     self.dir.close();
 }
 
-fn checkpoint(self: *Self) !bool {
-    var source = self.memory_segments.prepareCheckpoint(self.allocator) orelse return false;
+fn checkpoint(self: *Self, shard: *Shard) !bool {
+    var source = shard.memory_segments.prepareCheckpoint(self.allocator) orelse return false;
     defer MemorySegmentList.destroySegment(self.allocator, &source);
 
     // build new file segment
 
-    var target = try FileSegmentList.createSegment(self.allocator, .{ .dir = self.dir });
+    var target = try FileSegmentList.createSegment(self.allocator, shard.file_segments.options);
     defer FileSegmentList.destroySegment(self.allocator, &target);
 
     var reader = source.value.reader();
@@ -159,23 +427,24 @@ fn checkpoint(self: *Self) !bool {
 
     // update memory segments list
 
-    var memory_segments_update = try self.memory_segments.beginUpdate(self.allocator);
-    defer self.memory_segments.cleanupAfterUpdate(self.allocator, &memory_segments_update);
+    var memory_segments_update = try shard.memory_segments.beginUpdate(self.allocator);
+    defer shard.memory_segments.cleanupAfterUpdate(self.allocator, &memory_segments_update);
 
     memory_segments_update.removeSegment(source);
 
     // update file segments list
 
-    var file_segments_update = try self.file_segments.beginUpdate(self.allocator);
-    defer self.file_segments.cleanupAfterUpdate(self.allocator, &file_segments_update);
+    var file_segments_update = try shard.file_segments.beginUpdate(self.allocator);
+    defer shard.file_segments.cleanupAfterUpdate(self.allocator, &file_segments_update);
+
+    var snapshot = try self.allocSnapshot();
+    defer self.freeSnapshot(&snapshot);
 
     file_segments_update.appendSegment(target);
 
-    try self.updateManifestFile(file_segments_update.segments.value);
+    try updateManifestFile(self.allocator, shard, file_segments_update.segments.value);
 
-    defer self.oplog.truncate(target.value.info.getLastCommitId()) catch |err| {
-        log.warn("failed to truncate oplog: {}", .{err});
-    };
+    defer self.truncateOplog();
 
     defer self.updateDocsMetrics();
 
@@ -184,66 +453,439 @@ fn checkpoint(self: *Self) !bool {
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
 
-    self.memory_segments.commitUpdate(&memory_segments_update);
-    self.file_segments.commitUpdate(&file_segments_update);
+    shard.memory_segments.commitUpdate(&memory_segments_update);
+    shard.file_segments.commitUpdate(&file_segments_update);
+    self.publishSnapshot(&snapshot);
 
     metrics.checkpoint();
+    metrics.fileSegmentIngest(target.value.getSize());
 
-    self.maybeScheduleFileSegmentMerge();
+    self.maybeScheduleFileSegmentMerge(shard);
 
     return true;
 }
 
+// Removes oplog files with changes that are in the file segments of all shards.
+fn truncateOplog(self: *Self) void {
+    const commit_id = blk: {
+        self.segments_lock.lock();
+        defer self.segments_lock.unlock();
+
+        break :blk self.getCheckpointedCommitId();
+    };
+
+    self.oplog.truncate(commit_id) catch |err| {
+        log.warn("failed to truncate oplog: {}", .{err});
+    };
+}
+
+// Shards are checkpointed separately, this is the last commit that all of them have in file segments.
+fn getCheckpointedCommitId(self: *Self) u64 {
+    var result: u64 = std.math.maxInt(u64);
+    for (self.shards) |*shard| {
+        result = @min(result, shard.getCheckpointedCommitId());
+    }
+    return result;
+}
+
+pub const ImportOptions = struct {
+    // number of items sorted in memory at once, each run is written to a temporary segment file
+    max_items_per_run: usize = 16 * 1024 * 1024,
+};
+
+/// Bulk-loads a stream of msgpack-encoded changes, bypassing the oplog and memory segments.
+/// The changes are sorted in memory in bounded runs, each run is written to a temporary
+/// file segment, and the runs are merged into one file segment, which is added to the
+/// manifest at once. Later changes in the stream override earlier ones.
+/// This is meant for offline loading, nothing else can update the index during the import.
+/// Sharded indexes get one file segment per shard, the manifests of all shards are replaced together.
+pub fn import(self: *Self, reader: anytype, options: ImportOptions) !void {
+    try self.checkReady();
+    try self.checkWritable();
+
+    // the imported segment must be newer than everything that's already in the index
+    for (self.shards) |*shard| {
+        while (shard.memory_segments.count() > 0) {
+            _ = shard.memory_segments.freezeFirstSegment(self.allocator);
+            if (!try self.checkpoint(shard)) {
+                return error.CheckpointFailed;
+            }
+        }
+    }
+
+    // every shard gets its own runs, with the same commit ids
+    var runs: [max_shards]FileSegmentList = undefined;
+    const shard_runs = runs[0..self.shards.len];
+    for (shard_runs) |*r| {
+        r.* = FileSegmentList.initEmpty();
+    }
+    defer for (shard_runs) |*r| {
+        r.deinit(self.allocator, .delete);
+    };
+
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    var changes = std.ArrayList(Change).init(self.allocator);
+    defer changes.deinit();
+
+    var num_changes: usize = 0;
+    var eof = false;
+    while (!eof) {
+        _ = arena.reset(.retain_capacity);
+        changes.clearRetainingCapacity();
+
+        var num_items: usize = 0;
+        while (num_items < options.max_items_per_run) {
+            const change = msgpack.decodeLeaky(Change, arena.allocator(), reader) catch |err| {
+                if (err == error.EndOfStream) {
+                    eof = true;
+                    break;
+                }
+                return err;
+            };
+            try changes.append(change);
+            if (change == .insert) {
+                num_items += change.insert.hashes.len;
+            }
+        }
+
+        if (changes.items.len > 0) {
+            try self.importRun(shard_runs, changes.items);
+            num_changes += changes.items.len;
+        }
+    }
+
+    if (shard_runs[0].nodes.items.len == 0) {
+        return;
+    }
+
+    var targets: [max_shards]FileSegmentNode = undefined;
+    var num_targets: usize = 0;
+    defer for (targets[0..num_targets]) |*target| {
+        FileSegmentList.destroySegment(self.allocator, target);
+    };
+
+    for (self.shards, shard_runs) |*shard, *r| {
+        targets[num_targets] = try self.mergeImportRuns(shard, r);
+        num_targets += 1;
+    }
+
+    // shards are updated in order, the same as everywhere else where multiple shards are updated at once
+    var updates: [max_shards]FileSegmentListManager.Update = undefined;
+    var num_updates: usize = 0;
+    defer for (self.shards[0..num_updates], updates[0..num_updates]) |*shard, *upd| {
+        shard.file_segments.cleanupAfterUpdate(self.allocator, upd);
+    };
+
+    for (self.shards) |*shard| {
+        updates[num_updates] = try shard.file_segments.beginUpdate(self.allocator);
+        num_updates += 1;
+    }
+
+    var snapshot = try self.allocSnapshot();
+    defer self.freeSnapshot(&snapshot);
+
+    for (updates[0..num_updates], targets[0..num_targets]) |*upd, target| {
+        upd.appendSegment(target);
+    }
+    try self.updateAllManifestFiles(updates[0..num_updates]);
+
+    defer self.truncateOplog();
+
+    defer self.updateDocsMetrics();
+
+    {
+        self.commit_order_lock.lock();
+        defer self.commit_order_lock.unlock();
+
+        self.next_commit_id_to_apply = self.oplog.getNextCommitId();
+    }
+
+    self.segments_lock.lock();
+    defer self.segments_lock.unlock();
+
+    for (self.shards, updates[0..num_updates]) |*shard, *upd| {
+        shard.file_segments.commitUpdate(upd);
+    }
+    self.publishSnapshot(&snapshot);
+
+    for (targets[0..num_targets]) |target| {
+        metrics.fileSegmentIngest(target.value.getSize());
+    }
+
+    log.info("imported {} changes in {} runs into segment {}", .{ num_changes, shard_runs[0].nodes.items.len, targets[0].value.info.version });
+
+    for (self.shards) |*shard| {
+        self.maybeScheduleFileSegmentMerge(shard);
+    }
+}
+
+fn importRun(self: *Self, runs: []FileSegmentList, changes: []const Change) !void {
+    const version = self.oplog.reserveCommitId();
+
+    for (self.shards, runs) |*shard, *shard_runs| {
+        var source = try MemorySegmentList.createSegment(self.allocator, shard.memory_segments.options);
+        defer MemorySegmentList.destroySegment(self.allocator, &source);
+
+        try source.value.buildRange(changes, shard.hash_range);
+        source.value.info = .{ .version = version };
+
+        var run = try FileSegmentList.createSegment(self.allocator, shard.file_segments.options);
+        defer FileSegmentList.destroySegment(self.allocator, &run);
+
+        var reader = source.value.reader();
+        defer reader.close();
+
+        try run.value.build(&reader);
+
+        try shard_runs.nodes.append(self.allocator, run.acquire());
+    }
+}
+
+fn mergeImportRuns(self: *Self, shard: *Shard, runs: *FileSegmentList) !FileSegmentNode {
+    if (runs.nodes.items.len == 1) {
+        return runs.nodes.items[0].acquire();
+    }
+
+    var merger = try SegmentMerger(FileSegment).init(self.allocator, runs, runs.nodes.items.len);
+    defer merger.deinit();
+
+    for (runs.nodes.items) |run| {
+        merger.addSource(run.value);
+    }
+    try merger.prepare();
+
+    var target = try FileSegmentList.createSegment(self.allocator, shard.file_segments.options);
+    errdefer FileSegmentList.destroySegment(self.allocator, &target);
+
+    try target.value.merge(&merger);
+
+    return target;
+}
+
 fn updateDocsMetrics(self: *Self) void {
     var snapshot = self.acquireReader() catch return;
     defer self.releaseReader(&snapshot);
 
     metrics.docs(self.name, snapshot.getNumDocs());
+
+    var memory_segment_bytes: usize = 0;
+    for (snapshot.shards) |shard| {
+        for (shard.memory_segments.value.nodes.items) |node| {
+            memory_segment_bytes += node.value.getMemoryUsage();
+        }
+    }
+    metrics.memorySegmentBytes(self.name, memory_segment_bytes);
+    metrics.memorySegmentPoolBytes(self.name, self.memory_segment_items_pool.getPooledBytes());
 }
 
-fn checkpointTask(self: *Self) void {
-    _ = self.checkpoint() catch |err| {
+pub const MemoryUsage = struct {
+    // segment items, doc maps and pooled item buffers
+    memory_segments: usize = 0,
+    // doc tables built in memory, block indexes and doc filters
+    file_segments: usize = 0,
+    block_cache: usize = 0,
+    // memory-mapped segment files, not included in the total, the kernel can evict them
+    mapped: usize = 0,
+
+    pub fn getTotal(self: MemoryUsage) usize {
+        return self.memory_segments + self.file_segments + self.block_cache;
+    }
+};
+
+/// Returns the approximate memory held by the index, for the node's memory budget.
+pub fn getMemoryUsage(self: *Self) MemoryUsage {
+    var result = MemoryUsage{};
+
+    var reader = self.acquireReader() catch return result;
+    defer self.releaseReader(&reader);
+
+    for (reader.shards) |shard| {
+        for (shard.memory_segments.value.nodes.items) |node| {
+            result.memory_segments += node.value.getMemoryUsage();
+        }
+        for (shard.file_segments.value.nodes.items) |node| {
+            result.file_segments += node.value.getMemoryUsage();
+            result.mapped += node.value.getMappedSize();
+        }
+    }
+    result.memory_segments += self.memory_segment_items_pool.getPooledBytes();
+
+    if (self.block_cache) |block_cache| {
+        result.block_cache = block_cache.getSize();
+    }
+    return result;
+}
+
+/// Checkpoints the oldest memory segment of each shard, no matter how small it is,
+/// to release memory. Replicas don't checkpoint, their file segments come from the leader.
+/// Shards whose first segment is already frozen have a checkpoint pending and are skipped.
+/// Returns true if a checkpoint was scheduled.
+pub fn forceCheckpoint(self: *Self) bool {
+    if (!self.is_ready.isSet()) {
+        return false;
+    }
+    var scheduled = false;
+    for (self.shards) |*shard| {
+        if (shard.checkpoint_task) |task| {
+            if (shard.memory_segments.freezeFirstSegment(self.allocator)) {
+                self.scheduler.scheduleTask(task);
+                metrics.forcedCheckpoint();
+                scheduled = true;
+            }
+        }
+    }
+    return scheduled;
+}
+
+fn checkpointTask(self: *Self, shard: *Shard) void {
+    _ = self.checkpoint(shard) catch |err| {
         log.err("checkpoint failed: {}", .{err});
     };
 }
 
-fn memorySegmentMergeTask(self: *Self) void {
-    _ = self.maybeMergeMemorySegments() catch |err| {
+fn memorySegmentMergeTask(self: *Self, shard: *Shard) void {
+    _ = self.maybeMergeMemorySegments(shard) catch |err| {
         log.err("memory segment merge failed: {}", .{err});
     };
 }
 
-fn fileSegmentMergeTask(self: *Self) void {
-    _ = self.maybeMergeFileSegments() catch |err| {
+fn fileSegmentMergeTask(self: *Self, shard: *Shard) void {
+    _ = self.maybeMergeFileSegments(shard) catch |err| {
         log.err("file segment merge failed: {}", .{err});
     };
 }
 
-fn updateManifestFile(self: *Self, segments: *FileSegmentList) !void {
-    const infos = try self.allocator.alloc(SegmentInfo, segments.nodes.items.len);
-    defer self.allocator.free(infos);
+fn verifySegmentsTask(self: *Self) void {
+    var reader = self.acquireReader() catch |err| {
+        log.err("segment verification failed: {}", .{err});
+        return;
+    };
+    defer self.releaseReader(&reader);
+
+    for (reader.shards) |shard| {
+        for (shard.file_segments.value.nodes.items) |node| {
+            node.value.verify() catch |err| {
+                log.err("segment {} failed verification: {}", .{ node.value.info.getLastCommitId(), err });
+                self.corrupted.store(true, .monotonic);
+            };
+        }
+    }
+}
+
+fn writeManifestFile(allocator: std.mem.Allocator, dir: std.fs.Dir, file_name: []const u8, segments: *FileSegmentList) !void {
+    const infos = try allocator.alloc(SegmentInfo, segments.nodes.items.len);
+    defer allocator.free(infos);
 
     for (segments.nodes.items, 0..) |node, i| {
         infos[i] = node.value.info;
     }
 
-    try filefmt.writeManifestFile(self.dir, infos);
+    try filefmt.writeManifestFileAs(dir, file_name, infos);
 }
 
-fn maybeMergeFileSegments(self: *Self) !bool {
-    var upd = try self.file_segments.prepareMerge(self.allocator) orelse return false;
-    defer self.file_segments.cleanupAfterUpdate(self.allocator, &upd);
+fn updateManifestFile(allocator: std.mem.Allocator, shard: *Shard, segments: *FileSegmentList) !void {
+    try writeManifestFile(allocator, shard.dir, filefmt.manifest_file_name, segments);
 
-    try self.updateManifestFile(upd.segments.value);
+    // left over if renaming failed after a commit, this manifest already includes it
+    if (shard.owns_dir) {
+        shard.dir.deleteFile(filefmt.pending_manifest_file_name) catch {};
+    }
+}
+
+// Replaces the manifests of all shards together, so that a change that fails or crashes
+// half-way is not visible in only some of the hash ranges. The new manifests are written
+// next to the current ones, the commit file makes them valid, then they are renamed in
+// place. Opening the index finishes or discards an interrupted change.
+fn updateAllManifestFiles(self: *Self, updates: []FileSegmentListManager.Update) !void {
+    if (self.shards.len == 1) {
+        return updateManifestFile(self.allocator, &self.shards[0], updates[0].segments.value);
+    }
+
+    // a commit file from before would make the pending manifests valid too early
+    self.dir.deleteFile(filefmt.manifest_commit_file_name) catch |err| {
+        if (err != error.FileNotFound) return err;
+    };
+
+    {
+        errdefer for (self.shards) |*shard| {
+            shard.dir.deleteFile(filefmt.pending_manifest_file_name) catch {};
+        };
+
+        for (self.shards, updates) |*shard, *upd| {
+            try writeManifestFile(self.allocator, shard.dir, filefmt.pending_manifest_file_name, upd.segments.value);
+        }
+        try filefmt.writeManifestCommitFile(self.dir);
+    }
+
+    // the change is committed now, if renaming fails, the next open finishes it
+    var renamed = true;
+    for (self.shards) |*shard| {
+        shard.dir.rename(filefmt.pending_manifest_file_name, filefmt.manifest_file_name) catch |err| {
+            log.err("failed to rename manifest file in {s}: {}", .{ self.name, err });
+            renamed = false;
+        };
+    }
+    if (renamed) {
+        self.dir.deleteFile(filefmt.manifest_commit_file_name) catch |err| {
+            log.warn("failed to delete manifest commit file in {s}: {}", .{ self.name, err });
+        };
+    }
+}
+
+// Finishes or discards a change of all manifests that was interrupted.
+fn recoverManifestFiles(self: *Self) !void {
+    if (self.shards.len == 1) {
+        return;
+    }
+
+    const committed = exists(self.dir, filefmt.manifest_commit_file_name);
+    for (self.shards, 0..) |*shard, shard_no| {
+        if (!exists(shard.dir, filefmt.pending_manifest_file_name)) {
+            continue;
+        }
+        if (committed) {
+            log.info("finishing interrupted manifest update of index {s} (shard {})", .{ self.name, shard_no });
+            try shard.dir.rename(filefmt.pending_manifest_file_name, filefmt.manifest_file_name);
+        } else {
+            log.info("discarding interrupted manifest update of index {s} (shard {})", .{ self.name, shard_no });
+            try shard.dir.deleteFile(filefmt.pending_manifest_file_name);
+        }
+    }
+    if (committed) {
+        try self.dir.deleteFile(filefmt.manifest_commit_file_name);
+    }
+}
+
+/// Returns the searches per second of the whole node, if it's tracked.
+pub fn getSearchRate(self: *Self) f64 {
+    const rate_limiter = self.options.rate_limiter orelse return 0;
+    return rate_limiter.getSearchRate();
+}
+
+fn getMergeLoad(self: *Self) MergeLoad {
+    return .{ .search_rate = self.getSearchRate() };
+}
+
+fn maybeMergeFileSegments(self: *Self, shard: *Shard) !bool {
+    var upd = try shard.file_segments.prepareMerge(self.allocator, self.getMergeLoad()) orelse return false;
+    defer shard.file_segments.cleanupAfterUpdate(self.allocator, &upd);
+
+    var snapshot = try self.allocSnapshot();
+    defer self.freeSnapshot(&snapshot);
+
+    try updateManifestFile(self.allocator, shard, upd.segments.value);
 
     defer self.updateDocsMetrics();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
 
-    self.file_segments.commitUpdate(&upd);
+    shard.file_segments.commitUpdate(&upd);
+    self.publishSnapshot(&snapshot);
 
-    metrics.fileSegmentMerge();
+    metrics.fileSegmentMerge(upd.merge.?.size, upd.merged_size);
 
     return true;
 }
@@ -262,20 +904,24 @@ fn fileSegmentMergeThreadFn(self: *Self) void {
     }
 }
 
-fn maybeMergeMemorySegments(self: *Self) !bool {
-    var upd = try self.memory_segments.prepareMerge(self.allocator) orelse return false;
-    defer self.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
+fn maybeMergeMemorySegments(self: *Self, shard: *Shard) !bool {
+    var upd = try shard.memory_segments.prepareMerge(self.allocator, self.getMergeLoad()) orelse return false;
+    defer shard.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
+
+    var snapshot = try self.allocSnapshot();
+    defer self.freeSnapshot(&snapshot);
 
     defer self.updateDocsMetrics();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
 
-    self.memory_segments.commitUpdate(&upd);
+    shard.memory_segments.commitUpdate(&upd);
+    self.publishSnapshot(&snapshot);
 
     metrics.memorySegmentMerge();
 
-    self.maybeScheduleCheckpoint();
+    self.maybeScheduleCheckpoint(shard);
 
     return true;
 }
@@ -292,10 +938,12 @@ pub fn open(self: *Self, create: bool) !void {
         return error.AlreadyOpening;
     }
 
-    const manifest = filefmt.readManifestFile(self.dir, self.allocator) catch |err| {
+    try self.recoverManifestFiles();
+
+    const manifests = self.readManifestFiles() catch |err| {
         if (err == error.FileNotFound) {
             if (create) {
-                try self.updateManifestFile(self.file_segments.segments.value);
+                try self.createManifestFiles();
                 try self.load(&.{});
                 return;
             }
@@ -303,68 +951,213 @@ pub fn open(self: *Self, create: bool) !void {
         }
         return err;
     };
-    errdefer self.allocator.free(manifest);
+    errdefer self.freeManifests(manifests);
 
-    self.load_task = try self.scheduler.createTask(.medium, loadTask, .{ self, manifest });
+    self.load_task = try self.scheduler.createTask(.medium, loadTask, .{ self, manifests });
     self.scheduler.scheduleTask(self.load_task.?);
 }
 
-fn load(self: *Self, manifest: []SegmentInfo) !void {
-    defer self.allocator.free(manifest);
+// The first shard's manifest is written last, so if it exists, the other shards have theirs too.
+fn createManifestFiles(self: *Self) !void {
+    var i = self.shards.len;
+    while (i > 0) {
+        i -= 1;
+        const shard = &self.shards[i];
+        try updateManifestFile(self.allocator, shard, shard.file_segments.segments.value);
+    }
+}
+
+fn readManifestFiles(self: *Self) ![][]SegmentInfo {
+    const manifests = try self.allocator.alloc([]SegmentInfo, self.shards.len);
+    var num_manifests: usize = 0;
+    errdefer {
+        for (manifests[0..num_manifests]) |manifest| {
+            self.allocator.free(manifest);
+        }
+        self.allocator.free(manifests);
+    }
+
+    for (self.shards, manifests) |*shard, *manifest| {
+        manifest.* = filefmt.readManifestFile(shard.dir, self.allocator) catch |err| {
+            if (err == error.FileNotFound and num_manifests > 0) {
+                return error.ShardManifestNotFound;
+            }
+            return err;
+        };
+        num_manifests += 1;
+    }
+    return manifests;
+}
+
+fn freeManifests(self: *Self, manifests: [][]SegmentInfo) void {
+    for (manifests) |manifest| {
+        self.allocator.free(manifest);
+    }
+    self.allocator.free(manifests);
+}
 
-    log.info("found {} segments in manifest", .{manifest.len});
+// An empty list of manifests means a new index, otherwise there is one manifest per shard.
+fn load(self: *Self, manifests: [][]SegmentInfo) !void {
+    defer self.freeManifests(manifests);
 
-    try self.file_segments.segments.value.nodes.ensureTotalCapacity(self.allocator, manifest.len);
-    var last_commit_id: u64 = 0;
-    for (manifest, 1..) |segment_id, i| {
-        const node = try FileSegmentList.loadSegment(self.allocator, segment_id, .{ .dir = self.dir });
-        self.file_segments.segments.value.nodes.appendAssumeCapacity(node);
-        last_commit_id = node.value.info.getLastCommitId();
-        log.info("loaded segment {} ({}/{})", .{ last_commit_id, i, manifest.len });
+    var num_segments: usize = 0;
+    for (manifests) |manifest| {
+        num_segments += manifest.len;
     }
+    log.info("found {} segments in manifest", .{num_segments});
+
+    if (manifests.len > 0) {
+        for (self.shards, manifests) |*shard, manifest| {
+            try shard.file_segments.segments.value.nodes.ensureTotalCapacity(self.allocator, manifest.len);
+        }
+        try self.loadFileSegments(manifests);
+    }
+
+    // shards are checkpointed separately, the oplog is replayed from the oldest checkpoint
+    // and each shard skips the changes it already has
+    const last_commit_id = self.getCheckpointedCommitId();
 
-    self.memory_segment_merge_task = try self.scheduler.createTask(.high, memorySegmentMergeTask, .{self});
-    self.checkpoint_task = try self.scheduler.createTask(.medium, checkpointTask, .{self});
-    self.file_segment_merge_task = try self.scheduler.createTask(.low, fileSegmentMergeTask, .{self});
+    for (self.shards) |*shard| {
+        shard.memory_segment_merge_task = try self.scheduler.createTask(.high, memorySegmentMergeTask, .{ self, shard });
+        if (!self.options.replica) {
+            shard.checkpoint_task = try self.scheduler.createTask(.medium, checkpointTask, .{ self, shard });
+            shard.file_segment_merge_task = try self.scheduler.createTask(.low, fileSegmentMergeTask, .{ self, shard });
+        }
+    }
 
-    try self.oplog.open(last_commit_id + 1, updateInternal, self);
+    try self.oplog.open(last_commit_id + 1, replayUpdate, self);
+    self.next_commit_id_to_apply = self.oplog.getNextCommitId();
 
     log.info("index loaded", .{});
 
     self.is_ready.set();
+
+    if (self.options.replica) {
+        if (self.options.leader_url) |leader_url| {
+            const replicator = try self.allocator.create(Replicator);
+            errdefer self.allocator.destroy(replicator);
+
+            replicator.* = try Replicator.init(self.allocator, self, leader_url, self.options.replication);
+            errdefer replicator.deinit();
+
+            try replicator.start();
+            self.replicator = replicator;
+        }
+    }
+
+    if (self.options.fast_open and num_segments > 0) {
+        self.verify_segments_task = try self.scheduler.createTask(.low, verifySegmentsTask, .{self});
+        self.scheduler.scheduleTask(self.verify_segments_task.?);
+    }
+}
+
+const SegmentLoader = struct {
+    index: *Self,
+    shard: *Shard,
+    info: SegmentInfo,
+    node: ?FileSegmentNode = null,
+    err: ?anyerror = null,
+
+    fn run(self: *SegmentLoader) void {
+        self.node = FileSegmentList.loadSegment(self.index.allocator, self.info, self.shard.file_segments.options) catch |err| {
+            self.err = err;
+            return;
+        };
+    }
+};
+
+// Segments are loaded in parallel on the scheduler threads, the loading thread
+// runs the ones that no worker has picked up yet.
+fn loadFileSegments(self: *Self, manifests: []const []SegmentInfo) !void {
+    var num_segments: usize = 0;
+    for (manifests) |manifest| {
+        num_segments += manifest.len;
+    }
+
+    const loaders = try self.allocator.alloc(SegmentLoader, num_segments);
+    defer self.allocator.free(loaders);
+
+    var n: usize = 0;
+    for (self.shards, manifests) |*shard, manifest| {
+        for (manifest) |info| {
+            loaders[n] = .{ .index = self, .shard = shard, .info = info };
+            n += 1;
+        }
+    }
+
+    defer for (loaders) |*loader| {
+        if (loader.node) |*node| {
+            FileSegmentList.destroySegment(self.allocator, node);
+        }
+    };
+
+    {
+        const tasks = try self.allocator.alloc(Scheduler.Task, loaders.len);
+        defer self.allocator.free(tasks);
+
+        var num_tasks: usize = 0;
+        defer for (tasks[0..num_tasks]) |task| self.scheduler.destroyTask(task);
+
+        for (loaders, tasks) |*loader, *task| {
+            task.* = try self.scheduler.createTask(.high, SegmentLoader.run, .{loader});
+            num_tasks += 1;
+            self.scheduler.scheduleTask(task.*);
+        }
+
+        for (tasks, 1..) |task, i| {
+            self.scheduler.waitTask(task);
+            log.info("loaded segment ({}/{})", .{ i, num_segments });
+        }
+    }
+
+    for (loaders) |loader| {
+        if (loader.err) |err| {
+            log.err("failed to load segment {}: {}", .{ loader.info.getLastCommitId(), err });
+            return err;
+        }
+    }
+
+    for (loaders) |*loader| {
+        loader.shard.file_segments.segments.value.nodes.appendAssumeCapacity(loader.node.?);
+        loader.node = null;
+    }
+
+    for (self.shards) |*shard| {
+        shard.file_segments.countSupersededDocs();
+    }
 }
 
-fn loadTask(self: *Self, manifest: []SegmentInfo) void {
+fn loadTask(self: *Self, manifests: [][]SegmentInfo) void {
     self.open_lock.lock();
     defer self.open_lock.unlock();
 
-    self.load(manifest) catch |err| {
+    self.load(manifests) catch |err| {
         log.err("load failed: {}", .{err});
     };
 }
 
-fn maybeScheduleMemorySegmentMerge(self: *Self) void {
-    if (self.memory_segments.needsMerge()) {
-        if (self.memory_segment_merge_task) |task| {
+fn maybeScheduleMemorySegmentMerge(self: *Self, shard: *Shard) void {
+    if (shard.memory_segments.needsMerge()) {
+        if (shard.memory_segment_merge_task) |task| {
             log.debug("too many memory segments, scheduling merging", .{});
             self.scheduler.scheduleTask(task);
         }
     }
 }
 
-fn maybeScheduleFileSegmentMerge(self: *Self) void {
-    if (self.file_segments.needsMerge()) {
-        if (self.file_segment_merge_task) |task| {
+fn maybeScheduleFileSegmentMerge(self: *Self, shard: *Shard) void {
+    if (shard.file_segments.needsMerge()) {
+        if (shard.file_segment_merge_task) |task| {
             log.debug("too many file segments, scheduling merging", .{});
             self.scheduler.scheduleTask(task);
         }
     }
 }
 
-fn maybeScheduleCheckpoint(self: *Self) void {
-    if (self.memory_segments.segments.value.getFirst()) |first_node| {
-        if (first_node.value.getSize() >= self.options.min_segment_size) {
-            if (self.checkpoint_task) |task| {
+fn maybeScheduleCheckpoint(self: *Self, shard: *Shard) void {
+    if (shard.memory_segments.segments.value.getFirst()) |first_node| {
+        if (first_node.value.getSize() >= shard.min_segment_size) {
+            if (shard.checkpoint_task) |task| {
                 log.debug("the first memory segment is too big, scheduling checkpoint", .{});
                 self.scheduler.scheduleTask(task);
             }
@@ -382,59 +1175,522 @@ pub fn checkReady(self: *Self) !void {
     }
 }
 
+/// Fails if the index is not ready, or if a segment failed the background verification,
+/// so that health checks don't report a corrupted index as healthy after a fast open.
+pub fn checkHealthy(self: *Self) !void {
+    try self.checkReady();
+    if (self.corrupted.load(.monotonic)) {
+        return error.IndexCorrupted;
+    }
+}
+
+pub fn checkWritable(self: *Self) !void {
+    if (self.options.replica) {
+        return error.ReadOnlyIndex;
+    }
+}
+
 pub fn update(self: *Self, changes: []const Change) !void {
     try self.checkReady();
-    try self.updateInternal(changes, null);
+    try self.checkWritable();
+    try self.updateInternal(changes, null, null);
+}
+
+/// Returns true if `updateEncoded` can save re-encoding the changes, i.e. the oplog is in the msgpack format.
+pub fn usesEncodedChanges(self: *Self) bool {
+    return self.oplog.usesEncodedChanges();
+}
+
+/// Same as `update`, with the changes also encoded as a msgpack array,
+/// which is written to the oplog as it is.
+pub fn updateEncoded(self: *Self, changes: []const Change, encoded_changes: []const u8) !void {
+    try self.checkReady();
+    try self.checkWritable();
+    try self.updateInternal(changes, encoded_changes, null);
+}
+
+/// Returns the committed transactions starting at `first_commit_id`, for followers.
+pub fn readOplog(self: *Self, first_commit_id: u64) !Oplog.OplogIterator {
+    try self.checkReady();
+    return self.oplog.iterate(first_commit_id);
+}
+
+pub fn getNumShards(self: *Self) usize {
+    return self.shards.len;
+}
+
+/// Returns the directory with the segment files of the shard.
+pub fn getShardDir(self: *Self, shard_no: usize) !std.fs.Dir {
+    if (shard_no >= self.shards.len) {
+        return error.ShardNotFound;
+    }
+    return self.shards[shard_no].dir;
+}
+
+/// Returns the infos of the current file segments of the shard, in the same order as in its manifest.
+pub fn getFileSegmentInfos(self: *Self, allocator: Allocator, shard_no: usize) ![]SegmentInfo {
+    var reader = try self.acquireReader();
+    defer self.releaseReader(&reader);
+
+    if (shard_no >= reader.shards.len) {
+        return error.ShardNotFound;
+    }
+
+    const nodes = reader.shards[shard_no].file_segments.value.nodes.items;
+    const infos = try allocator.alloc(SegmentInfo, nodes.len);
+    for (nodes, infos) |node, *info| {
+        info.* = node.value.info;
+    }
+    return infos;
+}
+
+pub const MergePlan = struct {
+    shard: usize,
+    tier: []const u8,
+    num_segments: usize,
+    num_allowed_segments: usize,
+    // positions of the segments that would be merged, empty if there is nothing to merge
+    start: usize = 0,
+    end: usize = 0,
+    // items in the merged segments and the estimated items of superseded docs among them
+    size: usize = 0,
+    reclaimable_size: usize = 0,
+    // a bigger merge was put off because of the search load
+    deferred: bool = false,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+fn makeMergePlan(shard_no: usize, tier: []const u8, plan: anytype) MergePlan {
+    var result = MergePlan{
+        .shard = shard_no,
+        .tier = tier,
+        .num_segments = plan.num_segments,
+        .num_allowed_segments = plan.num_allowed_segments,
+        .deferred = plan.deferred,
+    };
+    if (plan.candidate) |candidate| {
+        result.start = candidate.start;
+        result.end = candidate.end;
+        result.size = candidate.size;
+        result.reclaimable_size = candidate.reclaimable_size;
+    }
+    return result;
+}
+
+/// Returns the next merge of each shard and tier, as it would be chosen now, without merging anything.
+pub fn planMerges(self: *Self, allocator: Allocator) ![]MergePlan {
+    try self.checkReady();
+
+    const load = self.getMergeLoad();
+
+    const plans = try allocator.alloc(MergePlan, self.shards.len * 2);
+    for (self.shards, 0..) |*shard, i| {
+        plans[i * 2] = makeMergePlan(i, MemorySegment.tier_name, shard.memory_segments.planMerge(self.allocator, load));
+        plans[i * 2 + 1] = makeMergePlan(i, FileSegment.tier_name, shard.file_segments.planMerge(self.allocator, load));
+    }
+    return plans;
+}
+
+/// Opens the file of a current file segment of the shard, so that it can be copied to a follower.
+/// The file stays readable even if the segment is merged away while it's being copied.
+pub fn openSegmentFile(self: *Self, shard_no: usize, file_name: []const u8) !std.fs.File {
+    var reader = try self.acquireReader();
+    defer self.releaseReader(&reader);
+
+    if (shard_no >= reader.shards.len) {
+        return error.ShardNotFound;
+    }
+
+    for (reader.shards[shard_no].file_segments.value.nodes.items) |node| {
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        if (std.mem.eql(u8, filefmt.buildSegmentFileName(&file_name_buf, node.value.info), file_name)) {
+            return self.shards[shard_no].dir.openFile(file_name, .{});
+        }
+    }
+    return error.SegmentNotFound;
+}
+
+/// Commit id of the next transaction a replica expects from the leader.
+pub fn getNextReplicatedCommitId(self: *Self) u64 {
+    self.commit_order_lock.lock();
+    defer self.commit_order_lock.unlock();
+
+    return self.next_commit_id_to_apply;
+}
+
+/// Applies a transaction received from the leader, with the leader's commit id.
+/// Transactions that are already included in the file segments are skipped.
+pub fn applyReplicatedTransaction(self: *Self, changes: []const Change, commit_id: u64) !void {
+    try self.checkReady();
+
+    if (commit_id < self.getNextReplicatedCommitId()) {
+        return;
+    }
+
+    try self.updateInternal(changes, null, commit_id);
+
+    self.commit_order_lock.lock();
+    defer self.commit_order_lock.unlock();
+
+    self.next_commit_id_to_apply = commit_id + 1;
+}
+
+/// Switches a shard of a replica to the file segments of the leader's manifest. Segments that are
+/// not loaded yet are opened from files that must have been already copied to the shard directory,
+/// segments missing from the manifest are deleted. Memory segments with changes that are now
+/// in the file segments are dropped.
+pub fn replaceFileSegments(self: *Self, shard_no: usize, manifest: []const SegmentInfo) !void {
+    try self.checkReady();
+
+    if (shard_no >= self.shards.len) {
+        return error.ShardNotFound;
+    }
+    const shard = &self.shards[shard_no];
+
+    var nodes = std.ArrayList(FileSegmentNode).init(self.allocator);
+    defer {
+        for (nodes.items) |*node| FileSegmentList.destroySegment(self.allocator, node);
+        nodes.deinit();
+    }
+    try nodes.ensureTotalCapacity(manifest.len);
+
+    // same order as in checkpoints, memory segments first
+    var memory_segments_update = try shard.memory_segments.beginUpdate(self.allocator);
+    defer shard.memory_segments.cleanupAfterUpdate(self.allocator, &memory_segments_update);
+
+    var file_segments_update = try shard.file_segments.beginUpdate(self.allocator);
+    defer shard.file_segments.cleanupAfterUpdate(self.allocator, &file_segments_update);
+
+    // the current list can't change while we hold the update
+    for (manifest) |info| {
+        const existing: ?FileSegmentNode = for (shard.file_segments.segments.value.nodes.items) |node| {
+            if (std.meta.eql(node.value.info, info)) {
+                break node;
+            }
+        } else null;
+        if (existing) |node| {
+            nodes.appendAssumeCapacity(node.acquire());
+        } else {
+            nodes.appendAssumeCapacity(try FileSegmentList.loadSegment(self.allocator, info, shard.file_segments.options));
+        }
+    }
+
+    try file_segments_update.replaceSegments(self.allocator, nodes.items);
+
+    const last_commit_id = if (manifest.len > 0) manifest[manifest.len - 1].getLastCommitId() else 0;
+
+    memory_segments_update.removeSegmentsUpTo(last_commit_id);
+
+    var snapshot = try self.allocSnapshot();
+    defer self.freeSnapshot(&snapshot);
+
+    try updateManifestFile(self.allocator, shard, file_segments_update.segments.value);
+
+    defer self.updateDocsMetrics();
+
+    const checkpointed_commit_id = blk: {
+        self.segments_lock.lock();
+        defer self.segments_lock.unlock();
+
+        shard.memory_segments.commitUpdate(&memory_segments_update);
+        shard.file_segments.commitUpdate(&file_segments_update);
+        self.publishSnapshot(&snapshot);
+
+        break :blk self.getCheckpointedCommitId();
+    };
+
+    // transactions after the oldest checkpoint of all shards still need to be replicated,
+    // shards that already have them in file segments skip them
+    self.commit_order_lock.lock();
+    defer self.commit_order_lock.unlock();
+
+    self.next_commit_id_to_apply = @max(self.next_commit_id_to_apply, checkpointed_commit_id + 1);
+}
+
+// Adds a batch of consecutive transactions from the oplog as one memory segment per shard.
+// Each shard gets only the transactions newer than its checkpoint.
+fn replayUpdate(self: *Self, txns: []const Transaction) !void {
+    const last_commit_id = txns[txns.len - 1].id;
+
+    // later changes of a doc win when the segment is built
+    var changes = std.ArrayList(Change).init(self.allocator);
+    defer changes.deinit();
+    for (txns) |txn| {
+        try changes.appendSlice(txn.changes);
+    }
+
+    var targets: [max_shards]MemorySegmentNode = undefined;
+    var num_targets: usize = 0;
+    defer for (targets[0..num_targets]) |*target| {
+        MemorySegmentList.destroySegment(self.allocator, target);
+    };
+
+    for (self.shards) |*shard| {
+        const checkpointed_commit_id = blk: {
+            self.segments_lock.lock();
+            defer self.segments_lock.unlock();
+            break :blk shard.getCheckpointedCommitId();
+        };
+
+        var first: usize = 0;
+        var offset: usize = 0;
+        while (first < txns.len and txns[first].id <= checkpointed_commit_id) : (first += 1) {
+            offset += txns[first].changes.len;
+        }
+
+        targets[num_targets] = try MemorySegmentList.createSegment(self.allocator, shard.memory_segments.options);
+        num_targets += 1;
+
+        // an empty segment with version 0 is skipped
+        if (first < txns.len) {
+            const target = targets[num_targets - 1];
+            try target.value.buildRange(changes.items[offset..], shard.hash_range);
+            target.value.info = .{ .version = txns[first].id, .merges = last_commit_id - txns[first].id };
+        }
+    }
+
+    try self.appendMemorySegments(targets[0..num_targets]);
 }
 
-fn updateInternal(self: *Self, changes: []const Change, commit_id: ?u64) !void {
-    var target = try MemorySegmentList.createSegment(self.allocator, .{});
-    defer MemorySegmentList.destroySegment(self.allocator, &target);
+fn updateInternal(self: *Self, changes: []const Change, encoded_changes: ?[]const u8, commit_id: ?u64) !void {
+    // each shard gets the changes with the hashes of its range
+    var targets: [max_shards]MemorySegmentNode = undefined;
+    var num_targets: usize = 0;
+    defer for (targets[0..num_targets]) |*target| {
+        MemorySegmentList.destroySegment(self.allocator, target);
+    };
 
-    try target.value.build(changes);
+    for (self.shards) |*shard| {
+        targets[num_targets] = try MemorySegmentList.createSegment(self.allocator, shard.memory_segments.options);
+        num_targets += 1;
+        try targets[num_targets - 1].value.buildRange(changes, shard.hash_range);
+    }
+    const shard_targets = targets[0..num_targets];
 
-    var upd = try self.memory_segments.beginUpdate(self.allocator);
-    defer self.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
+    if (commit_id) |id| {
+        // replaying the oplog, there are no concurrent updates
+        for (shard_targets) |target| {
+            target.value.info.version = id;
+        }
+        try self.appendMemorySegments(shard_targets);
+        return;
+    }
+
+    // Once the update is durable, the index must not fail to apply it, so everything that needs
+    // memory is reserved before it's written. Reserved lists have room for the segments of earlier
+    // reservations, so they are made in the same order as commit ids.
+    var reservation, const id = blk: {
+        self.reserve_lock.lock();
+        defer self.reserve_lock.unlock();
+
+        var reserved = try self.reserveMemorySegments();
+        errdefer self.cancelMemorySegments(&reserved);
+
+        break :blk .{ reserved, try self.oplog.beginWrite(changes, encoded_changes) };
+    };
 
-    target.value.info.version = commit_id orelse try self.oplog.write(changes);
+    // No index locks are held while waiting for the oplog, so concurrent updates can share one fsync.
+    self.oplog.waitForWrite(id) catch |err| {
+        self.cancelMemorySegments(&reservation);
+        return err;
+    };
+    for (shard_targets) |target| {
+        target.value.info.version = id;
+    }
+
+    self.waitForCommitTurn(id);
+    defer self.endCommitTurn(id);
+
+    self.applyMemorySegments(&reservation, shard_targets);
+}
+
+fn waitForCommitTurn(self: *Self, commit_id: u64) void {
+    self.commit_order_lock.lock();
+    defer self.commit_order_lock.unlock();
+
+    while (self.next_commit_id_to_apply != commit_id) {
+        self.commit_order_cond.wait(&self.commit_order_lock);
+    }
+}
+
+fn endCommitTurn(self: *Self, commit_id: u64) void {
+    self.commit_order_lock.lock();
+    defer self.commit_order_lock.unlock();
+
+    self.next_commit_id_to_apply = commit_id + 1;
+    self.commit_order_cond.broadcast();
+}
+
+// Adds the memory segments of one update to all shards at once. When the oplog is replayed,
+// or a replica catches up, shards that already have the update in file segments skip it.
+fn appendMemorySegments(self: *Self, targets: []const MemorySegmentNode) !void {
+    var reservation = try self.reserveMemorySegments();
+    self.applyMemorySegments(&reservation, targets);
+}
+
+// Memory needed to add the segments of one update, so that it can't fail after the update is committed.
+const MemorySegmentsReservation = struct {
+    segments: [max_shards]SharedPtr(MemorySegmentList) = undefined,
+    num_segments: usize = 0,
+    snapshot: ?SharedPtr(IndexReader.Snapshot) = null,
+};
+
+fn reserveMemorySegments(self: *Self) !MemorySegmentsReservation {
+    var reservation: MemorySegmentsReservation = .{};
+    errdefer self.cancelMemorySegments(&reservation);
+
+    for (self.shards) |*shard| {
+        reservation.segments[reservation.num_segments] = try shard.memory_segments.reserveAppend(self.allocator);
+        reservation.num_segments += 1;
+    }
+    reservation.snapshot = try self.allocSnapshot();
+
+    return reservation;
+}
+
+fn cancelMemorySegments(self: *Self, reservation: *MemorySegmentsReservation) void {
+    for (self.shards[0..reservation.num_segments], reservation.segments[0..reservation.num_segments]) |*shard, *segments| {
+        shard.memory_segments.cancelReservedAppend(self.allocator, segments);
+    }
+    reservation.num_segments = 0;
+    self.freeSnapshot(&reservation.snapshot);
+}
+
+// Adds the segments with memory reserved by `reserveMemorySegments`, in commit order.
+fn applyMemorySegments(self: *Self, reservation: *MemorySegmentsReservation, targets: []const MemorySegmentNode) void {
+    assert(reservation.num_segments == self.shards.len);
+
+    var updates: [max_shards]MemorySegmentListManager.Update = undefined;
+    for (self.shards, reservation.segments[0..reservation.num_segments], updates[0..self.shards.len]) |*shard, segments, *upd| {
+        upd.* = shard.memory_segments.beginReservedUpdate(segments);
+    }
+    reservation.num_segments = 0;
+    defer for (self.shards, updates[0..self.shards.len]) |*shard, *upd| {
+        shard.memory_segments.cleanupAfterUpdate(self.allocator, upd);
+    };
+
+    var snapshot = reservation.snapshot;
+    reservation.snapshot = null;
+    defer self.freeSnapshot(&snapshot);
 
     defer self.updateDocsMetrics();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
 
-    upd.appendSegment(target);
+    for (self.shards, updates[0..self.shards.len], targets) |*shard, *upd, target| {
+        if (target.value.info.version <= shard.getCheckpointedCommitId()) {
+            continue;
+        }
+        upd.appendSegment(target);
+        shard.memory_segments.commitUpdate(upd);
+    }
+    self.publishSnapshot(&snapshot);
 
-    self.memory_segments.commitUpdate(&upd);
+    for (self.shards) |*shard| {
+        self.maybeScheduleMemorySegmentMerge(shard);
+        self.maybeScheduleCheckpoint(shard);
+    }
+}
+
+fn allocSnapshotFor(allocator: std.mem.Allocator, num_shards: usize) !SharedPtr(IndexReader.Snapshot) {
+    const shards = try allocator.alloc(IndexReader.Shard, num_shards);
+    errdefer allocator.free(shards);
+
+    return try SharedPtr(IndexReader.Snapshot).create(allocator, .{ .shards = shards });
+}
 
-    self.maybeScheduleMemorySegmentMerge();
-    self.maybeScheduleCheckpoint();
+// Snapshots are allocated before the segment lists are changed, so that publishing them can't fail.
+fn allocSnapshot(self: *Self) !?SharedPtr(IndexReader.Snapshot) {
+    return try allocSnapshotFor(self.allocator, self.shards.len);
+}
+
+fn freeSnapshot(self: *Self, snapshot: *?SharedPtr(IndexReader.Snapshot)) void {
+    if (snapshot.*) |*ptr| {
+        ptr.release(self.allocator, IndexReader.Snapshot.discard, .{self.allocator});
+        snapshot.* = null;
+    }
+}
+
+// Makes the current segment lists visible to searches, must be called with `segments_lock` held.
+fn publishSnapshot(self: *Self, snapshot: *?SharedPtr(IndexReader.Snapshot)) void {
+    const ptr = snapshot.*.?;
+    snapshot.* = null;
+
+    for (ptr.value.shards, self.shards) |*snapshot_shard, *shard| {
+        snapshot_shard.* = .{
+            .hash_range = shard.hash_range,
+            .file_segments = shard.file_segments.segments.acquire(),
+            .memory_segments = shard.memory_segments.segments.acquire(),
+        };
+    }
+    self.snapshot.store(ptr, self.allocator, IndexReader.Snapshot.destroy, .{self.allocator});
 }
 
 pub fn acquireReader(self: *Self) !IndexReader {
     try self.checkReady();
 
-    self.segments_lock.lockShared();
-    defer self.segments_lock.unlockShared();
+    const snapshot = self.snapshot.acquire();
 
     return IndexReader{
-        .file_segments = self.file_segments.segments.acquire(),
-        .memory_segments = self.memory_segments.segments.acquire(),
+        .shards = snapshot.value.shards,
+        .snapshot = snapshot,
+        .search_pool = self.options.search_pool,
+        .allocator = self.allocator,
     };
 }
 
 pub fn releaseReader(self: *Self, reader: *IndexReader) void {
-    MemorySegmentList.destroySegments(self.allocator, &reader.memory_segments);
-    FileSegmentList.destroySegments(self.allocator, &reader.file_segments);
+    if (reader.snapshot) |*snapshot| {
+        snapshot.release(self.allocator, IndexReader.Snapshot.destroy, .{self.allocator});
+        reader.snapshot = null;
+    }
 }
 
 pub fn search(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
+    if (self.options.rate_limiter) |rate_limiter| rate_limiter.beginSearch();
+    defer if (self.options.rate_limiter) |rate_limiter| rate_limiter.endSearch();
+
+    var start = std.time.nanoTimestamp();
+
     var reader = try self.acquireReader();
     defer self.releaseReader(&reader);
 
+    results.timings.acquire_reader_ns = SearchTimings.lap(&start);
+
+    // profiled searches always scan the segments
+    if (results.profile != null) {
+        return reader.search(hashes, results, deadline);
+    }
+
+    if (self.search_cache) |*cache| {
+        std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
+        if (try cache.get(hashes, results.options, &reader, results)) {
+            return;
+        }
+        try reader.search(hashes, results, deadline);
+        cache.put(hashes, results.options, &reader, results.getResults()) catch |err| {
+            log.warn("failed to cache search results: {}", .{err});
+        };
+        return;
+    }
+
     try reader.search(hashes, results, deadline);
 }
 
+pub fn multiSearch(self: *Self, results: *MultiSearchResults, deadline: Deadline) !void {
+    if (self.options.rate_limiter) |rate_limiter| rate_limiter.beginSearch();
+    defer if (self.options.rate_limiter) |rate_limiter| rate_limiter.endSearch();
+
+    var reader = try self.acquireReader();
+    defer self.releaseReader(&reader);
+
+    try reader.multiSearch(results, deadline);
+}
+
 test {
     _ = @import("index_tests.zig");
 }
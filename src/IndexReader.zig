@@ -4,10 +4,16 @@ const Self = @This();
 
 const metrics = @import("metrics.zig");
 const Deadline = @import("utils/Deadline.zig");
+const getMajorPageFaults = @import("utils/page_faults.zig").getMajorPageFaults;
 const SearchResults = @import("common.zig").SearchResults;
+const MultiSearchResults = @import("common.zig").MultiSearchResults;
 const SearchOptions = @import("common.zig").SearchOptions;
+const SearchTimings = @import("common.zig").SearchTimings;
+const SegmentProfile = @import("common.zig").SegmentProfile;
 const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
 const DocInfo = @import("common.zig").DocInfo;
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const HashRange = @import("segment.zig").HashRange;
 
 const SegmentList = @import("segment_list.zig").SegmentList;
 
@@ -22,34 +28,283 @@ const segment_lists = [_][]const u8{
     "memory_segments",
 };
 
-file_segments: SharedPtr(FileSegmentList),
-memory_segments: SharedPtr(MemorySegmentList),
+/// Segment lists of one hash range of the index. Every shard has all docs and attributes,
+/// only the hashes are split.
+pub const Shard = struct {
+    hash_range: HashRange = .{},
+    file_segments: SharedPtr(FileSegmentList),
+    memory_segments: SharedPtr(MemorySegmentList),
 
-pub fn hasNewerVersion(self: *const Self, doc_id: u32, version: u64) bool {
-    inline for (segment_lists) |n| {
-        const segments = @field(self, n);
-        if (segments.value.hasNewerVersion(doc_id, version)) {
-            return true;
+    pub fn hasNewerVersion(self: *const Shard, doc_id: u32, version: u64) bool {
+        inline for (segment_lists) |n| {
+            const segments = @field(self, n);
+            if (segments.value.hasNewerVersion(doc_id, version)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    fn release(self: *Shard, allocator: std.mem.Allocator) void {
+        MemorySegmentList.destroySegments(allocator, &self.memory_segments);
+        FileSegmentList.destroySegments(allocator, &self.file_segments);
+    }
+};
+
+/// Summary of the index for info requests.
+pub const Info = struct {
+    version: u64,
+    num_segments: usize,
+    num_docs: u32,
+    // names are owned by the segments
+    attributes: std.StringHashMapUnmanaged(u64),
+};
+
+/// Segment lists that are searched together, published by the index as one pointer.
+pub const Snapshot = struct {
+    shards: []Shard,
+    // the segments don't change, so the info is computed once, by the first reader that needs it
+    info_lock: std.Thread.Mutex = .{},
+    info: ?Info = null,
+
+    pub fn destroy(self: *Snapshot, allocator: std.mem.Allocator) void {
+        if (self.info) |*info| {
+            info.attributes.deinit(allocator);
+        }
+        for (self.shards) |*shard| {
+            shard.release(allocator);
         }
+        allocator.free(self.shards);
+    }
+
+    /// Frees a snapshot whose shards were never filled in.
+    pub fn discard(self: *Snapshot, allocator: std.mem.Allocator) void {
+        allocator.free(self.shards);
+    }
+};
+
+// one shard with the whole hash range, unless the index is sharded
+shards: []const Shard,
+
+// If set, the reader borrows the segment lists from this snapshot and keeps it alive.
+snapshot: ?SharedPtr(Snapshot) = null,
+
+// If set, file segments (or shards) are searched in parallel on this pool.
+search_pool: ?*std.Thread.Pool = null,
+
+// Allocator of the snapshot, used for data cached in it.
+allocator: ?std.mem.Allocator = null,
+
+// Hits of sharded indexes are checked in their shard before they are merged, see `searchShard`,
+// so only hits of unsharded indexes can have newer versions when the results are finished.
+pub fn hasNewerVersion(self: *const Self, doc_id: u32, version: u64) bool {
+    if (self.shards.len != 1) {
+        return false;
     }
-    return false;
+    return self.shards[0].hasNewerVersion(doc_id, version);
 }
 
 pub fn search(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
     std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
 
-    inline for (segment_lists) |n| {
-        const segments = @field(self, n);
-        try segments.value.search(hashes, results, deadline);
+    var start = std.time.nanoTimestamp();
+
+    if (self.shards.len > 1) {
+        // each shard times its own tiers, see `collectShard`
+        try self.searchShards(hashes, results, deadline);
+        _ = SearchTimings.lap(&start);
+    } else {
+        const shard = &self.shards[0];
+
+        if (self.search_pool) |pool| {
+            try shard.file_segments.value.searchParallel(pool, hashes, results, deadline);
+        } else {
+            const faults = getMajorPageFaults();
+            defer results.major_faults += getMajorPageFaults() - faults;
+            try shard.file_segments.value.search(hashes, results, deadline);
+        }
+        results.timings.file_segments_ns = SearchTimings.lap(&start);
+
+        try shard.memory_segments.value.search(hashes, results, deadline);
+        results.timings.memory_segments_ns = SearchTimings.lap(&start);
     }
 
     try results.finish(self);
+    results.timings.finish_ns = SearchTimings.lap(&start);
+}
+
+/// Searches all queries in one pass over the segments. Hits are collected
+/// per query, so this doesn't use the parallel search pool.
+pub fn multiSearch(self: *Self, results: *MultiSearchResults, deadline: Deadline) !void {
+    self.searchSegments(results.hashes, results, deadline) catch |err| {
+        if (err != error.Timeout) {
+            return err;
+        }
+        results.expireAll();
+    };
+
+    try results.finish(self);
+}
+
+fn searchSegments(self: *Self, sorted_hashes: []const u32, results: anytype, deadline: Deadline) !void {
+    if (self.shards.len > 1) {
+        for (self.shards) |*shard| {
+            try searchShard(shard, sorted_hashes, results, deadline);
+        }
+        return;
+    }
+    inline for (segment_lists) |n| {
+        const segments = @field(self.shards[0], n);
+        try segments.value.search(sorted_hashes, results, deadline);
+    }
+}
+
+// Collects hits of one shard, with the versions of its segments. The shard only has part of
+// the hashes, so their positions are moved to match the hashes of the whole search.
+fn ShardResults(comptime Results: type) type {
+    return struct {
+        results: *Results,
+        // position of the shard's first hash in the hashes of the whole search
+        hash_offset: usize,
+        allocator: std.mem.Allocator,
+        profile: ?*std.ArrayList(SegmentProfile) = null,
+        scanned_blocks: u64 = 0,
+        scanned_hits: u64 = 0,
+
+        pub fn startHash(self: *@This(), hash_index: usize) void {
+            self.results.startHash(self.hash_offset + hash_index);
+        }
+
+        pub fn getMaxDocsPerHash(self: @This()) u32 {
+            return self.results.getMaxDocsPerHash();
+        }
+
+        pub fn countScanned(self: *@This(), num_blocks: u64, num_hits: u64) void {
+            self.scanned_blocks += num_blocks;
+            self.scanned_hits += num_hits;
+            self.results.countScanned(num_blocks, num_hits);
+        }
+
+        pub fn incr(self: *@This(), id: u32, version: u64) !void {
+            try self.results.incr(id, version);
+        }
+    };
+}
+
+// Searches the shard for the hashes in its range, the hits are not merged into other shards yet.
+fn collectShard(shard: *const Shard, sorted_hashes: []const u32, results: anytype, deadline: Deadline) !void {
+    const offset, const len = shard.hash_range.find(sorted_hashes);
+    if (len == 0) {
+        return;
+    }
+    const hashes = sorted_hashes[offset .. offset + len];
+
+    var shard_results = ShardResults(@TypeOf(results.*)){
+        .results = results,
+        .hash_offset = offset,
+        .allocator = results.allocator,
+    };
+    if (@hasField(@TypeOf(results.*), "profile")) {
+        shard_results.profile = results.profile;
+    }
+
+    var start = std.time.nanoTimestamp();
+    try shard.file_segments.value.search(hashes, &shard_results, deadline);
+    const file_segments_ns = SearchTimings.lap(&start);
+    try shard.memory_segments.value.search(hashes, &shard_results, deadline);
+
+    // added up across shards when they are merged, even if they were searched in parallel
+    if (@hasField(@TypeOf(results.*), "timings")) {
+        results.timings.file_segments_ns += file_segments_ns;
+        results.timings.memory_segments_ns += SearchTimings.lap(&start);
+    }
+}
+
+// Searches the shard into results shared with other shards. Segments of different shards
+// are merged separately, so their versions can't be compared. Hits are first collected
+// with their real versions, then each doc is checked for a newer version in the shard
+// once, when the hits are merged.
+fn searchShard(shard: *const Shard, sorted_hashes: []const u32, results: anytype, deadline: Deadline) !void {
+    var partial = try results.initPartial(results.allocator);
+    defer partial.deinit();
+
+    try collectShard(shard, sorted_hashes, &partial, deadline);
+    try results.mergeShard(&partial, shard);
+}
+
+const PartialSearch = struct {
+    results: SearchResults,
+    err: ?anyerror = null,
+};
+
+fn searchShardPartial(shard: *const Shard, sorted_hashes: []const u32, partial: *PartialSearch, deadline: Deadline, wait_group: *std.Thread.WaitGroup) void {
+    defer wait_group.finish();
+
+    const faults = getMajorPageFaults();
+    defer partial.results.major_faults += getMajorPageFaults() - faults;
+
+    collectShard(shard, sorted_hashes, &partial.results, deadline) catch |err| {
+        partial.err = err;
+    };
 }
 
+// Each shard is searched on the search thread pool into partial results, which are merged
+// once all shards are done. Within a shard, segments are searched one by one. Profiled
+// searches go one shard at a time.
+fn searchShards(self: *Self, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+    if (self.search_pool == null or results.profile != null) {
+        const faults = getMajorPageFaults();
+        defer results.major_faults += getMajorPageFaults() - faults;
+        for (self.shards) |*shard| {
+            try searchShard(shard, sorted_hashes, results, deadline);
+        }
+        return;
+    }
+    const pool = self.search_pool.?;
+
+    // partial results are filled in from different threads, so they can't use the request arena
+    const partials = try pool.allocator.alloc(PartialSearch, self.shards.len);
+    defer pool.allocator.free(partials);
+
+    for (partials) |*partial| {
+        partial.* = .{ .results = SearchResults.init(pool.allocator, results.options) };
+    }
+    defer {
+        for (partials) |*partial| {
+            partial.results.deinit();
+        }
+    }
+
+    var wait_group: std.Thread.WaitGroup = .{};
+    for (self.shards[1..], partials[1..]) |*shard, *partial| {
+        wait_group.start();
+        pool.spawn(searchShardPartial, .{ shard, sorted_hashes, partial, deadline, &wait_group }) catch {
+            searchShardPartial(shard, sorted_hashes, partial, deadline, &wait_group);
+        };
+    }
+
+    wait_group.start();
+    searchShardPartial(&self.shards[0], sorted_hashes, &partials[0], deadline, &wait_group);
+
+    wait_group.wait();
+
+    for (partials) |*partial| {
+        if (partial.err) |err| {
+            return err;
+        }
+    }
+
+    for (self.shards, partials) |*shard, *partial| {
+        try results.mergeShard(&partial.results, shard);
+    }
+}
+
+// Docs are the same in every shard, so they are read from the first one.
+
 pub fn getNumDocs(self: *Self) u32 {
     var result: u32 = 0;
     inline for (segment_lists) |n| {
-        const segments = @field(self, n);
+        const segments = @field(self.shards[0], n);
         result += segments.value.getNumDocs();
     }
     return result;
@@ -59,7 +314,7 @@ pub fn getDocInfo(self: *Self, doc_id: u32) !?DocInfo {
     // TODO optimize, read from the end
     var result: ?DocInfo = null;
     inline for (segment_lists) |n| {
-        const segments = @field(self, n);
+        const segments = @field(self.shards[0], n);
         if (segments.value.getDocInfo(doc_id)) |res| {
             result = res;
         }
@@ -75,7 +330,7 @@ pub fn getDocInfo(self: *Self, doc_id: u32) !?DocInfo {
 pub fn getMinDocId(self: *Self) u32 {
     var result: u32 = 0;
     inline for (segment_lists) |n| {
-        const segments = @field(self, n);
+        const segments = @field(self.shards[0], n);
         const doc_id = segments.value.getMinDocId();
         if (result == 0 or doc_id < result) {
             result = doc_id;
@@ -87,7 +342,7 @@ pub fn getMinDocId(self: *Self) u32 {
 pub fn getMaxDocId(self: *Self) u32 {
     var result: u32 = 0;
     inline for (segment_lists) |n| {
-        const segments = @field(self, n);
+        const segments = @field(self.shards[0], n);
         const doc_id = segments.value.getMaxDocId();
         if (result == 0 or doc_id > result) {
             result = doc_id;
@@ -97,25 +352,69 @@ pub fn getMaxDocId(self: *Self) u32 {
 }
 
 pub fn getVersion(self: *Self) u64 {
-    if (self.memory_segments.value.getLast()) |node| {
-        return node.value.info.version;
-    }
-    if (self.file_segments.value.getLast()) |node| {
-        return node.value.info.version;
+    var result: u64 = 0;
+    for (self.shards) |shard| {
+        if (shard.memory_segments.value.getLast()) |node| {
+            result = @max(result, node.value.info.version);
+        } else if (shard.file_segments.value.getLast()) |node| {
+            result = @max(result, node.value.info.version);
+        }
     }
-    return 0;
+    return result;
 }
 
 pub fn getNumSegments(self: *Self) usize {
-    return self.memory_segments.value.count() + self.file_segments.value.count();
+    var result: usize = 0;
+    for (self.shards) |shard| {
+        result += shard.memory_segments.value.count() + shard.file_segments.value.count();
+    }
+    return result;
+}
+
+pub fn getSegmentInfos(self: *const Self, allocator: std.mem.Allocator) ![]SegmentInfo {
+    var num_segments: usize = 0;
+    for (self.shards) |shard| {
+        inline for (segment_lists) |n| {
+            num_segments += @field(shard, n).value.count();
+        }
+    }
+
+    const infos = try allocator.alloc(SegmentInfo, num_segments);
+    var i: usize = 0;
+    for (self.shards) |shard| {
+        inline for (segment_lists) |n| {
+            for (@field(shard, n).value.nodes.items) |node| {
+                infos[i] = node.value.info;
+                i += 1;
+            }
+        }
+    }
+    return infos;
+}
+
+/// Checks if the reader has exactly the given segments, as returned by `getSegmentInfos`.
+pub fn hasSegmentInfos(self: *const Self, infos: []const SegmentInfo) bool {
+    var i: usize = 0;
+    for (self.shards) |shard| {
+        inline for (segment_lists) |n| {
+            for (@field(shard, n).value.nodes.items) |node| {
+                if (i >= infos.len or !std.meta.eql(infos[i], node.value.info)) {
+                    return false;
+                }
+                i += 1;
+            }
+        }
+    }
+    return i == infos.len;
 }
 
 pub fn getAttributes(self: *Self, allocator: std.mem.Allocator) !std.StringHashMapUnmanaged(u64) {
     var attributes: std.StringHashMapUnmanaged(u64) = .{};
     errdefer attributes.deinit(allocator);
 
+    // attributes are the same in every shard
     inline for (segment_lists) |n| {
-        const segments = @field(self, n);
+        const segments = @field(self.shards[0], n);
         for (segments.value.nodes.items) |node| {
             var iter = node.value.attributes.iterator();
             while (iter.next()) |entry| {
@@ -130,3 +429,30 @@ pub fn getAttributes(self: *Self, allocator: std.mem.Allocator) !std.StringHashM
 
     return attributes;
 }
+
+fn buildInfo(self: *Self, allocator: std.mem.Allocator) !Info {
+    return .{
+        .version = self.getVersion(),
+        .num_segments = self.getNumSegments(),
+        .num_docs = self.getNumDocs(),
+        .attributes = try self.getAttributes(allocator),
+    };
+}
+
+/// Returns the info of the index, cached in the snapshot, so that it's only computed once after each change.
+/// The result is valid until the reader is released, readers without a snapshot allocate it with `allocator`.
+pub fn getInfo(self: *Self, allocator: std.mem.Allocator) !*const Info {
+    const snapshot = if (self.snapshot) |ptr| ptr.value else {
+        const info = try allocator.create(Info);
+        info.* = try self.buildInfo(allocator);
+        return info;
+    };
+
+    snapshot.info_lock.lock();
+    defer snapshot.info_lock.unlock();
+
+    if (snapshot.info == null) {
+        snapshot.info = try self.buildInfo(self.allocator.?);
+    }
+    return &snapshot.info.?;
+}
@@ -7,30 +7,44 @@ const KeepOrDelete = common.KeepOrDelete;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
 const SegmentStatus = @import("segment.zig").SegmentStatus;
 const Item = @import("segment.zig").Item;
+const HashRange = @import("segment.zig").HashRange;
 
 const Change = @import("change.zig").Change;
 
 const Deadline = @import("utils/Deadline.zig");
+const metrics = @import("metrics.zig");
+const BloomFilter = @import("utils/BloomFilter.zig");
+const BufferPool = @import("utils/buffer_pool.zig").BufferPool;
+const radixSort = @import("utils/radix_sort.zig").radixSort;
 
 const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
 
 const Self = @This();
 
-pub const Options = struct {};
+pub const tier_name = "memory";
+
+pub const ItemPool = BufferPool(Item);
+
+pub const Options = struct {
+    // if set, item buffers are taken from, and returned to, this pool
+    items_pool: ?*ItemPool = null,
+};
 
 allocator: std.mem.Allocator,
+items_pool: ?*ItemPool = null,
 info: SegmentInfo = .{},
 status: SegmentStatus = .{},
 attributes: std.StringHashMapUnmanaged(u64) = .{},
 docs: std.AutoHashMapUnmanaged(u32, bool) = .{},
+doc_filter: BloomFilter = .{},
 min_doc_id: u32 = 0,
 max_doc_id: u32 = 0,
 items: std.ArrayListUnmanaged(Item) = .{},
 
 pub fn init(allocator: std.mem.Allocator, opts: Options) Self {
-    _ = opts;
     return .{
         .allocator = allocator,
+        .items_pool = opts.items_pool,
     };
 }
 
@@ -43,15 +57,28 @@ pub fn deinit(self: *Self, delete_file: KeepOrDelete) void {
     }
     self.attributes.deinit(self.allocator);
     self.docs.deinit(self.allocator);
-    self.items.deinit(self.allocator);
+    self.doc_filter.deinit(self.allocator);
+    if (self.items_pool) |pool| {
+        pool.free(self.items.allocatedSlice());
+        self.items = .{};
+    } else {
+        self.items.deinit(self.allocator);
+    }
 }
 
-pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+pub fn search(self: Self, sorted_hashes: []const u32, results: anytype, deadline: Deadline) !void {
     var items = self.items.items;
-    for (sorted_hashes) |hash| {
+    for (sorted_hashes, 0..) |hash, i| {
+        results.startHash(i);
         const matches = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, items, {}, Item.cmpByHash);
-        for (matches[0]..matches[1]) |i| {
-            try results.incr(items[i].id, self.info.version);
+        const max_docs = results.getMaxDocsPerHash();
+        results.countScanned(0, matches[1] - matches[0]);
+        if (max_docs > 0 and matches[1] - matches[0] > max_docs) {
+            metrics.skippedHash();
+        } else {
+            for (matches[0]..matches[1]) |j| {
+                try results.incr(items[j].id, self.info.version);
+            }
         }
         items = items[matches[1]..];
     }
@@ -62,7 +89,33 @@ pub fn getSize(self: Self) usize {
     return self.items.items.len;
 }
 
+/// Approximate number of bytes held by the segment.
+pub fn getMemoryUsage(self: Self) usize {
+    const doc_size = @sizeOf(u32) + @sizeOf(bool) + 1;
+    return self.items.capacity * @sizeOf(Item) + self.docs.capacity() * doc_size + self.doc_filter.buffer.len * @sizeOf(u32);
+}
+
+fn ensureItemsCapacity(self: *Self, num_items: usize) !void {
+    const pool = self.items_pool orelse return self.items.ensureTotalCapacity(self.allocator, num_items);
+    if (self.items.capacity >= num_items) {
+        return;
+    }
+    const buffer = try pool.alloc(num_items);
+    const len = self.items.items.len;
+    @memcpy(buffer[0..len], self.items.items);
+    pool.free(self.items.allocatedSlice());
+    self.items = .{ .items = buffer[0..len], .capacity = buffer.len };
+}
+
 pub fn build(self: *Self, changes: []const Change) !void {
+    return self.buildRange(changes, .{});
+}
+
+/// Same as `build`, but only hashes in `range` are added. Docs and attributes are added
+/// regardless of the range, so that newer versions of docs are known in every range.
+pub fn buildRange(self: *Self, changes: []const Change, range: HashRange) !void {
+    const whole_range = range.start == 0 and range.end == null;
+
     var num_attributes: u32 = 0;
     var num_docs: u32 = 0;
     var num_items: usize = 0;
@@ -83,7 +136,7 @@ pub fn build(self: *Self, changes: []const Change) !void {
 
     try self.attributes.ensureTotalCapacity(self.allocator, num_attributes);
     try self.docs.ensureTotalCapacity(self.allocator, num_docs);
-    try self.items.ensureTotalCapacity(self.allocator, num_items);
+    try self.ensureItemsCapacity(num_items);
 
     self.min_doc_id = 0;
     self.max_doc_id = 0;
@@ -96,9 +149,17 @@ pub fn build(self: *Self, changes: []const Change) !void {
                 const result = self.docs.getOrPutAssumeCapacity(op.id);
                 if (!result.found_existing) {
                     result.value_ptr.* = true;
-                    var items = self.items.addManyAsSliceAssumeCapacity(op.hashes.len);
-                    for (op.hashes, 0..) |hash, j| {
-                        items[j] = .{ .hash = hash, .id = op.id };
+                    if (whole_range) {
+                        var items = self.items.addManyAsSliceAssumeCapacity(op.hashes.len);
+                        for (op.hashes, 0..) |hash, j| {
+                            items[j] = .{ .hash = hash, .id = op.id };
+                        }
+                    } else {
+                        for (op.hashes) |hash| {
+                            if (range.contains(hash)) {
+                                self.items.appendAssumeCapacity(.{ .hash = hash, .id = op.id });
+                            }
+                        }
                     }
                     if (self.min_doc_id == 0 or op.id < self.min_doc_id) {
                         self.min_doc_id = op.id;
@@ -131,7 +192,65 @@ pub fn build(self: *Self, changes: []const Change) !void {
         }
     }
 
-    std.sort.pdq(Item, self.items.items, {}, Item.cmp);
+    try self.sortItems();
+
+    try self.buildDocFilter();
+}
+
+// below this, radix sort is not worth allocating the temporary buffer
+const min_radix_sort_items = 1024;
+
+fn sortItems(self: *Self) !void {
+    const items = self.items.items;
+    if (items.len < min_radix_sort_items) {
+        std.sort.pdq(Item, items, {}, Item.cmp);
+        return;
+    }
+    const tmp = try self.allocTempItems(items.len);
+    defer self.freeTempItems(tmp);
+    radixSort(Item, items, tmp);
+}
+
+fn allocTempItems(self: *Self, len: usize) ![]Item {
+    if (self.items_pool) |pool| {
+        return pool.alloc(len);
+    }
+    return self.allocator.alloc(Item, len);
+}
+
+fn freeTempItems(self: *Self, buffer: []Item) void {
+    if (self.items_pool) |pool| {
+        pool.free(buffer);
+    } else {
+        self.allocator.free(buffer);
+    }
+}
+
+fn mergeSortedRuns(a: []const Item, b: []const Item, dest: []Item) void {
+    var i: usize = 0;
+    var j: usize = 0;
+    var k: usize = 0;
+    while (i < a.len and j < b.len) : (k += 1) {
+        if (Item.cmp({}, b[j], a[i])) {
+            dest[k] = b[j];
+            j += 1;
+        } else {
+            dest[k] = a[i];
+            i += 1;
+        }
+    }
+    @memcpy(dest[k..][0 .. a.len - i], a[i..]);
+    k += a.len - i;
+    @memcpy(dest[k..][0 .. b.len - j], b[j..]);
+}
+
+fn buildDocFilter(self: *Self) !void {
+    self.doc_filter.deinit(self.allocator);
+    self.doc_filter = try BloomFilter.init(self.allocator, self.docs.count());
+    var iter = self.docs.keyIterator();
+    while (iter.next()) |doc_id| {
+        self.doc_filter.add(doc_id.*);
+    }
 }
 
 pub fn cleanup(self: *Self) void {
@@ -148,15 +267,77 @@ pub fn merge(self: *Self, merger: *SegmentMerger(Self)) !void {
 
     self.docs.deinit(self.allocator);
     self.docs = merger.segment.docs.move();
+    try self.buildDocFilter();
 
     self.max_doc_id = merger.segment.max_doc_id;
 
     self.items.clearRetainingCapacity();
-    try self.items.ensureTotalCapacity(self.allocator, merger.estimated_size);
-    while (true) {
-        const item = try merger.read() orelse break;
-        try self.items.append(self.allocator, item);
-        merger.advance();
+    try self.mergeItems(merger);
+}
+
+// All sources are sorted memory segments, so instead of pulling items one by one
+// through the merger, the live items of each source are copied as one run and
+// the runs are merged pairwise.
+fn mergeItems(self: *Self, merger: *SegmentMerger(Self)) !void {
+    const sources = merger.sources.items;
+
+    var total_items: usize = 0;
+    for (sources) |source| {
+        total_items += source.reader.segment.items.items.len;
+    }
+    try self.ensureItemsCapacity(total_items);
+
+    const runs = try self.allocator.alloc(usize, sources.len + 1);
+    defer self.allocator.free(runs);
+
+    runs[0] = 0;
+    for (sources, 1..) |source, i| {
+        const source_items = source.reader.segment.items.items;
+        if (source.skip_docs.count() == 0) {
+            self.items.appendSliceAssumeCapacity(source_items);
+        } else {
+            for (source_items) |item| {
+                if (!source.skip_docs.contains(item.id)) {
+                    self.items.appendAssumeCapacity(item);
+                }
+            }
+        }
+        runs[i] = self.items.items.len;
+    }
+
+    var num_runs = sources.len;
+    if (num_runs <= 1) {
+        return;
+    }
+
+    const len = self.items.items.len;
+    const tmp = try self.allocTempItems(len);
+    defer self.freeTempItems(tmp);
+
+    var src = self.items.items;
+    var dest = tmp[0..len];
+    while (num_runs > 1) {
+        var i: usize = 0;
+        var j: usize = 0;
+        while (i < num_runs) : (i += 2) {
+            const start = runs[i];
+            if (i + 1 < num_runs) {
+                const mid = runs[i + 1];
+                const end = runs[i + 2];
+                mergeSortedRuns(src[start..mid], src[mid..end], dest[start..end]);
+            } else {
+                @memcpy(dest[start..runs[i + 1]], src[start..runs[i + 1]]);
+            }
+            runs[j] = start;
+            j += 1;
+        }
+        runs[j] = len;
+        num_runs = j;
+        std.mem.swap([]Item, &src, &dest);
+    }
+
+    if (src.ptr != self.items.items.ptr) {
+        @memcpy(self.items.items, src);
     }
 }
 
@@ -188,4 +369,93 @@ pub const Reader = struct {
             self.index += 1;
         }
     }
+
+    /// Positions the reader at the first item with hash >= `hash`.
+    pub fn seek(self: *Reader, hash: u32) !void {
+        const key = Item{ .hash = hash, .id = 0 };
+        self.index = std.sort.lowerBound(Item, key, self.segment.items.items, {}, Item.cmpByHash);
+    }
 };
+
+test "build with items pool" {
+    var pool = ItemPool.init(std.testing.allocator, .{});
+    defer pool.deinit();
+
+    var segment = Self.init(std.testing.allocator, .{ .items_pool = &pool });
+
+    try segment.build(&.{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 2, 3 } } },
+    });
+    try std.testing.expectEqual(3, segment.getSize());
+    try std.testing.expect(segment.getMemoryUsage() > 0);
+
+    segment.deinit(.delete);
+
+    // the items buffer is retired to the pool
+    try std.testing.expect(pool.getPooledBytes() > 0);
+}
+
+test "build with hash range" {
+    var segment = Self.init(std.testing.allocator, .{});
+    defer segment.deinit(.delete);
+
+    try segment.buildRange(&.{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 20, 30 } } },
+        .{ .insert = .{ .id = 2, .hashes = &[_]u32{40} } },
+        .{ .delete = .{ .id = 3 } },
+    }, .{ .start = 10, .end = 40 });
+
+    try std.testing.expectEqualSlices(Item, &.{
+        .{ .hash = 20, .id = 1 },
+        .{ .hash = 30, .id = 1 },
+    }, segment.items.items);
+
+    // docs without hashes in the range are still known
+    try std.testing.expectEqual(3, segment.docs.count());
+    try std.testing.expectEqual(true, segment.docs.get(2));
+    try std.testing.expectEqual(false, segment.docs.get(3));
+}
+
+test "merge" {
+    const SegmentList = @import("segment_list.zig").SegmentList;
+    const List = SegmentList(Self);
+
+    var collection = try List.init(std.testing.allocator, 3);
+    defer collection.deinit(std.testing.allocator, .delete);
+
+    var expected = std.ArrayList(Item).init(std.testing.allocator);
+    defer expected.deinit();
+
+    for (0..3) |i| {
+        const node = try List.createSegment(std.testing.allocator, .{});
+        collection.nodes.appendAssumeCapacity(node);
+
+        var hashes: [2000]u32 = undefined;
+        for (&hashes, 0..) |*hash, j| {
+            hash.* = @intCast((j * 7919 + i * 104729) % 100_000);
+        }
+        const doc_id: u32 = @intCast(i + 1);
+        node.value.info = .{ .version = i + 1 };
+        try node.value.build(&.{
+            .{ .insert = .{ .id = doc_id, .hashes = &hashes } },
+        });
+        try std.testing.expect(std.sort.isSorted(Item, node.value.items.items, {}, Item.cmp));
+        try expected.appendSlice(node.value.items.items);
+    }
+    std.sort.pdq(Item, expected.items, {}, Item.cmp);
+
+    var merger = try SegmentMerger(Self).init(std.testing.allocator, &collection, 3);
+    defer merger.deinit();
+
+    for (collection.nodes.items) |node| {
+        merger.addSource(node.value);
+    }
+    try merger.prepare();
+
+    var segment = Self.init(std.testing.allocator, .{});
+    defer segment.deinit(.delete);
+
+    try segment.merge(&merger);
+
+    try std.testing.expectEqualSlices(Item, expected.items, segment.items.items);
+}
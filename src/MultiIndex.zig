@@ -4,9 +4,32 @@ const assert = std.debug.assert;
 
 const Index = @import("Index.zig");
 const Scheduler = @import("utils/Scheduler.zig");
+const metrics = @import("metrics.zig");
 
 const Self = @This();
 
+// Limits for all indexes of the node. While the node is over budget, indexes that use more
+// than an equal share of the budget are checkpointed early, if their memory segments are big
+// enough to be worth a file segment. When the node is still over budget, or has too many open
+// indexes, the least recently used indexes that are not in use are closed. They are opened
+// again on the next request, in the fast-open mode. Replicas stay open, so that they keep
+// following the leader.
+pub const Options = struct {
+    // memory budget in bytes for all open indexes, zero disables the limit
+    max_memory: usize = 0,
+    // indexes with less memory in memory segments are not checkpointed early,
+    // tiny file segments would only be merged again
+    min_forced_checkpoint_size: usize = 16 * 1024 * 1024,
+    // maximum number of open indexes, zero disables the limit
+    max_open_indexes: usize = 0,
+    // indexes not used for this long are closed, zero keeps them open
+    idle_timeout_ms: u64 = 0,
+    // how often the limits are checked
+    check_interval_ms: u64 = 1000,
+};
+
+// Allocated separately, so that the index stays in place when it's removed from the map
+// and closed without the lock.
 pub const IndexRef = struct {
     index: Index,
     name: []const u8,
@@ -18,6 +41,11 @@ pub const IndexRef = struct {
         self.index.deinit();
     }
 
+    fn destroy(self: *IndexRef, allocator: std.mem.Allocator) void {
+        self.deinit(allocator);
+        allocator.destroy(self);
+    }
+
     pub fn incRef(self: *IndexRef) void {
         self.references += 1;
         self.last_used_at = std.time.milliTimestamp();
@@ -35,7 +63,18 @@ lock: std.Thread.Mutex = .{},
 allocator: std.mem.Allocator,
 scheduler: *Scheduler,
 dir: std.fs.Dir,
-indexes: std.StringHashMap(IndexRef),
+index_options: Index.Options,
+options: Options,
+indexes: std.StringHashMap(*IndexRef),
+// indexes closed by the governor, they are opened again without reading all segment blocks
+closed_indexes: std.StringHashMapUnmanaged(void) = .{},
+// indexes the governor is closing, they can't be opened or deleted until their files are released
+closing_indexes: std.StringHashMapUnmanaged(void) = .{},
+closing_done: std.Thread.Condition = .{},
+
+governor_thread: ?std.Thread = null,
+stopping: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+wake: std.Thread.ResetEvent = .{},
 
 fn isValidName(name: []const u8) bool {
     for (name, 0..) |c, i| {
@@ -65,25 +104,215 @@ test "isValidName" {
     try std.testing.expect(!isValidName(".foo"));
 }
 
-pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, dir: std.fs.Dir) Self {
+pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, dir: std.fs.Dir, index_options: Index.Options, options: Options) Self {
     return .{
         .allocator = allocator,
         .scheduler = scheduler,
         .dir = dir,
-        .indexes = std.StringHashMap(IndexRef).init(allocator),
+        .index_options = index_options,
+        .options = options,
+        .indexes = std.StringHashMap(*IndexRef).init(allocator),
     };
 }
 
 pub fn deinit(self: *Self) void {
+    self.stop();
+
     self.lock.lock();
     defer self.lock.unlock();
 
-    var iter = self.indexes.iterator();
-    while (iter.next()) |entry| {
-        self.allocator.free(entry.key_ptr.*);
-        entry.value_ptr.index.deinit();
+    var iter = self.indexes.valueIterator();
+    while (iter.next()) |ref| {
+        ref.*.destroy(self.allocator);
     }
     self.indexes.deinit();
+
+    self.clearClosedIndexes();
+
+    // the governor has stopped, so nothing is being closed anymore
+    assert(self.closing_indexes.count() == 0);
+    self.closing_indexes.deinit(self.allocator);
+}
+
+/// Starts the thread that enforces the limits and reports memory usage.
+pub fn start(self: *Self) !void {
+    self.governor_thread = try std.Thread.spawn(.{}, runGovernor, .{self});
+}
+
+pub fn stop(self: *Self) void {
+    if (self.governor_thread) |thread| {
+        self.stopping.store(true, .release);
+        self.wake.set();
+        thread.join();
+        self.governor_thread = null;
+    }
+}
+
+fn runGovernor(self: *Self) void {
+    while (!self.stopping.load(.acquire)) {
+        self.enforceLimits(std.time.milliTimestamp()) catch |err| {
+            log.warn("failed to enforce index limits: {}", .{err});
+        };
+        self.wake.timedWait(self.options.check_interval_ms * std.time.ns_per_ms) catch {};
+    }
+}
+
+fn clearClosedIndexes(self: *Self) void {
+    var iter = self.closed_indexes.keyIterator();
+    while (iter.next()) |name| {
+        self.allocator.free(name.*);
+    }
+    self.closed_indexes.deinit(self.allocator);
+}
+
+fn forgetClosedIndex(self: *Self, name: []const u8) void {
+    if (self.closed_indexes.fetchRemove(name)) |entry| {
+        self.allocator.free(entry.key);
+    }
+}
+
+fn rememberClosedIndex(self: *Self, name: []const u8) !void {
+    if (self.closed_indexes.contains(name)) {
+        return;
+    }
+    const closed_name = try self.allocator.dupe(u8, name);
+    errdefer self.allocator.free(closed_name);
+    try self.closed_indexes.put(self.allocator, closed_name, {});
+}
+
+// Must be called with the lock held.
+fn waitForClosing(self: *Self, name: []const u8) void {
+    while (self.closing_indexes.contains(name)) {
+        self.closing_done.wait(&self.lock);
+    }
+}
+
+const IndexUsage = struct {
+    name: []const u8,
+    last_used_at: i64,
+    usage: Index.MemoryUsage,
+    closable: bool,
+
+    fn cmpByLastUsed(_: void, a: IndexUsage, b: IndexUsage) bool {
+        return a.last_used_at < b.last_used_at;
+    }
+
+    fn cmpByMemorySegments(_: void, a: IndexUsage, b: IndexUsage) bool {
+        return a.usage.memory_segments > b.usage.memory_segments;
+    }
+};
+
+// Removes the index with the lock held and marks it as closing, so that it can't be opened
+// again while its files are still in use. The index is closed by `finishCloseIndex`.
+fn beginCloseIndex(self: *Self, name: []const u8) !?*IndexRef {
+    try self.closing_indexes.ensureUnusedCapacity(self.allocator, 1);
+
+    const entry = self.indexes.fetchRemove(name) orelse return null;
+    const ref = entry.value;
+
+    log.info("closing unused index {s}", .{name});
+
+    for ([_][]const u8{ "memory_segments", "file_segments", "block_cache", "mapped" }) |kind| {
+        metrics.indexMemoryBytes(name, kind, 0);
+    }
+
+    self.closing_indexes.putAssumeCapacityNoClobber(ref.name, {});
+    return ref;
+}
+
+// Closing waits for running merges and checkpoints of the index, so it's done without
+// the lock, searches of other indexes are not blocked meanwhile.
+fn finishCloseIndex(self: *Self, ref: *IndexRef) void {
+    ref.index.deinit();
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    self.rememberClosedIndex(ref.name) catch |err| {
+        log.warn("failed to remember closed index {s}: {}", .{ ref.name, err });
+    };
+    _ = self.closing_indexes.remove(ref.name);
+    self.closing_done.broadcast();
+
+    self.allocator.free(ref.name);
+    self.allocator.destroy(ref);
+
+    metrics.closedIndex();
+}
+
+fn enforceLimits(self: *Self, now: i64) !void {
+    var closing = std.ArrayList(*IndexRef).init(self.allocator);
+    defer closing.deinit();
+    defer for (closing.items) |ref| self.finishCloseIndex(ref);
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    var usages = std.ArrayList(IndexUsage).init(self.allocator);
+    defer usages.deinit();
+
+    var total: usize = 0;
+    var iter = self.indexes.valueIterator();
+    while (iter.next()) |ref_ptr| {
+        const ref = ref_ptr.*;
+        const usage = ref.index.getMemoryUsage();
+        total += usage.getTotal();
+
+        metrics.indexMemoryBytes(ref.name, "memory_segments", usage.memory_segments);
+        metrics.indexMemoryBytes(ref.name, "file_segments", usage.file_segments);
+        metrics.indexMemoryBytes(ref.name, "block_cache", usage.block_cache);
+        metrics.indexMemoryBytes(ref.name, "mapped", usage.mapped);
+
+        try usages.append(.{
+            .name = ref.name,
+            .last_used_at = ref.last_used_at,
+            .usage = usage,
+            .closable = ref.references == 0 and !ref.index.options.replica,
+        });
+    }
+
+    var excess: usize = 0;
+    if (self.options.max_memory > 0 and total > self.options.max_memory) {
+        excess = total - self.options.max_memory;
+
+        // the memory can be used by file segments or caches, only indexes over their share are checkpointed
+        const share = self.options.max_memory / usages.items.len;
+
+        // memory segments are the cheapest to release, the biggest ones go first
+        std.sort.pdq(IndexUsage, usages.items, {}, IndexUsage.cmpByMemorySegments);
+        for (usages.items) |u| {
+            if (excess == 0 or u.usage.memory_segments < self.options.min_forced_checkpoint_size) break;
+            if (u.usage.getTotal() <= share) continue;
+            if (self.indexes.get(u.name)) |ref| {
+                if (ref.index.forceCheckpoint()) {
+                    log.debug("index {s} is over its share of the memory budget, forcing checkpoint", .{u.name});
+                }
+            }
+            excess -|= u.usage.memory_segments;
+        }
+    }
+
+    var num_open = usages.items.len;
+
+    std.sort.pdq(IndexUsage, usages.items, {}, IndexUsage.cmpByLastUsed);
+    for (usages.items) |u| {
+        if (!u.closable) continue;
+
+        const over_count = self.options.max_open_indexes > 0 and num_open > self.options.max_open_indexes;
+        const idle = self.options.idle_timeout_ms > 0 and now -| u.last_used_at >= @as(i64, @intCast(self.options.idle_timeout_ms));
+        if (excess == 0 and !over_count and !idle) continue;
+
+        const usage = u.usage.getTotal();
+        try closing.ensureUnusedCapacity(1);
+        const ref = try self.beginCloseIndex(u.name) orelse continue;
+        closing.appendAssumeCapacity(ref);
+        num_open -= 1;
+        total -|= usage;
+        excess -|= usage;
+    }
+
+    metrics.memoryBytes(total);
+    metrics.openIndexes(num_open);
 }
 
 fn deleteIndexFiles(self: *Self, name: []const u8) !void {
@@ -99,9 +328,8 @@ fn deleteIndexFiles(self: *Self, name: []const u8) !void {
 }
 
 fn removeIndex(self: *Self, name: []const u8) void {
-    if (self.indexes.getEntry(name)) |entry| {
-        entry.value_ptr.deinit(self.allocator);
-        self.indexes.removeByPtr(entry.key_ptr);
+    if (self.indexes.fetchRemove(name)) |entry| {
+        entry.value.destroy(self.allocator);
     }
 }
 
@@ -124,26 +352,40 @@ fn acquireIndex(self: *Self, name: []const u8, create: bool) !*IndexRef {
     self.lock.lock();
     defer self.lock.unlock();
 
+    self.waitForClosing(name);
+
     var result = try self.indexes.getOrPutAdapted(name, self.indexes.ctx);
     if (result.found_existing) {
-        result.value_ptr.incRef();
-        return result.value_ptr;
+        result.value_ptr.*.incRef();
+        return result.value_ptr.*;
     }
     errdefer self.indexes.removeByPtr(result.key_ptr);
 
+    const ref = try self.allocator.create(IndexRef);
+    errdefer self.allocator.destroy(ref);
+
     result.key_ptr.* = try self.allocator.dupe(u8, name);
     errdefer self.allocator.free(result.key_ptr.*);
 
-    result.value_ptr.* = .{
-        .index = try Index.init(self.allocator, self.scheduler, self.dir, result.key_ptr.*, .{}),
+    // closed indexes were fully loaded before, so their blocks are verified in the background
+    var index_options = self.index_options;
+    if (self.closed_indexes.contains(name)) {
+        index_options.fast_open = true;
+    }
+
+    ref.* = .{
+        .index = try Index.init(self.allocator, self.scheduler, self.dir, result.key_ptr.*, index_options),
         .name = result.key_ptr.*,
     };
-    errdefer result.value_ptr.index.deinit();
+    errdefer ref.index.deinit();
+
+    try ref.index.open(create);
+    self.forgetClosedIndex(name);
 
-    try result.value_ptr.index.open(create);
+    result.value_ptr.* = ref;
 
-    result.value_ptr.incRef();
-    return result.value_ptr;
+    ref.incRef();
+    return ref;
 }
 
 pub fn getIndex(self: *Self, name: []const u8) !*Index {
@@ -170,11 +412,42 @@ pub fn deleteIndex(self: *Self, name: []const u8) !void {
     self.lock.lock();
     defer self.lock.unlock();
 
-    if (self.indexes.getEntry(name)) |entry| {
-        entry.value_ptr.index.deinit();
-        self.allocator.free(entry.key_ptr.*);
-        self.indexes.removeByPtr(entry.key_ptr);
-    }
+    self.waitForClosing(name);
+
+    self.removeIndex(name);
+    self.forgetClosedIndex(name);
 
     try self.deleteIndexFiles(name);
 }
+
+test "close least recently used indexes" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var indexes = Self.init(std.testing.allocator, &scheduler, tmp_dir.dir, .{}, .{ .max_open_indexes = 1 });
+    defer indexes.deinit();
+
+    try indexes.createIndex("a");
+    try indexes.createIndex("b");
+
+    indexes.indexes.get("a").?.last_used_at = 1;
+    indexes.indexes.get("b").?.last_used_at = 2;
+
+    try indexes.enforceLimits(std.time.milliTimestamp());
+
+    try std.testing.expectEqual(1, indexes.indexes.count());
+    try std.testing.expect(indexes.indexes.contains("b"));
+    try std.testing.expect(indexes.closed_indexes.contains("a"));
+    try std.testing.expectEqual(0, indexes.closing_indexes.count());
+
+    // opened again on the next request
+    const index = try indexes.getIndex("a");
+    indexes.releaseIndex(index);
+
+    try std.testing.expect(!indexes.closed_indexes.contains("a"));
+}
@@ -17,11 +17,45 @@ pub const FileInfo = struct {
     }
 };
 
+pub const Format = enum {
+    // one msgpack-encoded transaction after another, encoded changes are written as they are
+    msgpack,
+    // each batch is one checksummed frame, with delta-encoded hashes
+    compact,
+};
+
+pub const Options = struct {
+    // how long the writer flushing a batch waits for more transactions to join it
+    max_batch_wait_ns: u64 = 0,
+    // writers wait with adding more transactions if the pending batch is this big
+    max_batch_size: usize = 1024 * 1024,
+    // format of new writes, files in both formats can be read
+    format: Format = .compact,
+    // consecutive transactions are replayed together, until they have this many hashes
+    max_replay_batch_size: usize = 100_000,
+};
+
 allocator: std.mem.Allocator,
 dir: std.fs.Dir,
+options: Options,
 
+// protects the files
 write_lock: std.Thread.Mutex = .{},
 
+// Group commit: transactions are encoded into the pending buffer and one of the
+// waiting writers (the leader) writes and syncs the whole batch, while others
+// wait for it. Everything below is protected by batch_lock.
+batch_lock: std.Thread.Mutex = .{},
+batch_cond: std.Thread.Condition = .{},
+pending: std.ArrayListUnmanaged(u8) = .{},
+pending_first_commit_id: u64 = 0,
+flush_buffer: std.ArrayListUnmanaged(u8) = .{},
+sort_buffer: std.ArrayListUnmanaged(u32) = .{},
+flushing: bool = false,
+synced_commit_id: u64 = 0,
+// set if writing a batch failed, the oplog can't be written to after that
+failed: ?anyerror = null,
+
 files: std.ArrayList(FileInfo),
 
 current_file: ?std.fs.File = null,
@@ -30,13 +64,14 @@ max_file_size: usize = 16 * 1024 * 1024,
 
 next_commit_id: u64 = 1,
 
-pub fn init(allocator: std.mem.Allocator, parent_dir: std.fs.Dir) !Self {
+pub fn init(allocator: std.mem.Allocator, parent_dir: std.fs.Dir, options: Options) !Self {
     var dir = try parent_dir.makeOpenPath("oplog", .{ .iterate = true });
     errdefer dir.close();
 
     return Self{
         .allocator = allocator,
         .dir = dir,
+        .options = options,
         .files = std.ArrayList(FileInfo).init(allocator),
     };
 }
@@ -51,6 +86,10 @@ pub fn deinit(self: *Self) void {
 
     self.files.deinit();
 
+    self.pending.deinit(self.allocator);
+    self.flush_buffer.deinit(self.allocator);
+    self.sort_buffer.deinit(self.allocator);
+
     self.dir.close();
 }
 
@@ -74,14 +113,100 @@ pub fn open(self: *Self, first_commit_id: u64, receiver: anytype, ctx: anytype)
 
     try self.truncateNoLock(first_commit_id);
 
+    // The iterator reuses its memory, so batched transactions are copied.
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    var batch = std.ArrayList(Transaction).init(self.allocator);
+    defer batch.deinit();
+    var batch_size: usize = 0;
+
     var max_commit_id: u64 = 0;
     var oplog_it = OplogIterator.init(self.allocator, self.dir, self.files, first_commit_id);
     defer oplog_it.deinit();
     while (try oplog_it.next()) |txn| {
         max_commit_id = @max(max_commit_id, txn.id);
-        try receiver(ctx, txn.changes, txn.id);
+        // only consecutive transactions can end up in one segment
+        if (batch.items.len > 0 and (txn.id != batch.getLast().id + 1 or batch_size >= self.options.max_replay_batch_size)) {
+            try receiver(ctx, batch.items);
+            batch.clearRetainingCapacity();
+            batch_size = 0;
+            _ = arena.reset(.retain_capacity);
+        }
+        try batch.append(try copyTransaction(arena.allocator(), txn));
+        batch_size += getTransactionSize(txn);
     }
-    self.next_commit_id = max_commit_id + 1;
+    if (batch.items.len > 0) {
+        try receiver(ctx, batch.items);
+    }
+    // the oplog can contain only transactions that are older than first_commit_id
+    self.next_commit_id = @max(max_commit_id + 1, first_commit_id);
+    self.synced_commit_id = self.next_commit_id - 1;
+}
+
+fn getTransactionSize(txn: Transaction) usize {
+    var size: usize = txn.changes.len;
+    for (txn.changes) |change| {
+        switch (change) {
+            .insert => |op| size += op.hashes.len,
+            else => {},
+        }
+    }
+    return size;
+}
+
+fn copyTransaction(allocator: std.mem.Allocator, txn: Transaction) !Transaction {
+    const changes = try allocator.dupe(Change, txn.changes);
+    for (changes) |*change| {
+        switch (change.*) {
+            .insert => |*op| op.hashes = try allocator.dupe(u32, op.hashes),
+            .delete => {},
+            .set_attribute => |*op| op.name = try allocator.dupe(u8, op.name),
+        }
+    }
+    return .{ .id = txn.id, .changes = changes };
+}
+
+/// Returns the synced transactions starting at `first_commit_id`, e.g. to send them to a follower.
+/// Fails with `error.CommitIdNotAvailable` if the oplog was already truncated past that commit.
+pub fn iterate(self: *Self, first_commit_id: u64) !OplogIterator {
+    self.write_lock.lock();
+    defer self.write_lock.unlock();
+
+    const last_commit_id = blk: {
+        self.batch_lock.lock();
+        defer self.batch_lock.unlock();
+        break :blk self.synced_commit_id;
+    };
+
+    if (first_commit_id <= last_commit_id) {
+        if (self.files.items.len == 0 or self.files.items[0].id > first_commit_id) {
+            return error.CommitIdNotAvailable;
+        }
+    }
+
+    // the writer can add or truncate files while we read, so we need our own copy of the list
+    var it = OplogIterator.init(self.allocator, self.dir, try self.files.clone(), first_commit_id);
+    it.last_commit_id = last_commit_id;
+    it.owns_files = true;
+    return it;
+}
+
+pub fn getNextCommitId(self: *Self) u64 {
+    self.batch_lock.lock();
+    defer self.batch_lock.unlock();
+
+    return self.next_commit_id;
+}
+
+/// Allocates a commit id for changes that are not written to the oplog, like imported segments.
+pub fn reserveCommitId(self: *Self) u64 {
+    self.batch_lock.lock();
+    defer self.batch_lock.unlock();
+
+    const commit_id = self.next_commit_id;
+    self.next_commit_id += 1;
+    return commit_id;
 }
 
 fn parseFileName(file_name: []const u8) !u64 {
@@ -203,26 +328,149 @@ pub fn truncate(self: *Self, commit_id: u64) !void {
 }
 
 pub fn write(self: *Self, changes: []const Change) !u64 {
-    self.write_lock.lock();
-    defer self.write_lock.unlock();
+    const commit_id = try self.beginWrite(changes, null);
+    try self.waitForWrite(commit_id);
+    return commit_id;
+}
 
-    const commit_id = self.next_commit_id;
+/// Returns true if `writeEncoded` uses the encoded changes, the compact format encodes them itself.
+pub fn usesEncodedChanges(self: Self) bool {
+    return self.options.format == .msgpack;
+}
+
+/// Same as `write`, but the changes are also passed already encoded as a msgpack array,
+/// e.g. straight from the request body, and the bytes are appended to the oplog verbatim
+/// in the msgpack format. The caller must have validated that `encoded_changes` decodes to `changes`.
+pub fn writeEncoded(self: *Self, changes: []const Change, encoded_changes: []const u8) !u64 {
+    const commit_id = try self.beginWrite(changes, encoded_changes);
+    try self.waitForWrite(commit_id);
+    return commit_id;
+}
+
+const msgpack_empty_array = 0x90;
+
+fn encodeTransaction(self: *Self, commit_id: u64, changes: []const Change, encoded_changes: ?[]const u8) !void {
+    const writer = self.pending.writer(self.allocator);
+    if (self.options.format == .compact) {
+        try encodeCompactTransaction(changes, writer, &self.sort_buffer, self.allocator);
+    } else if (encoded_changes) |data| {
+        // changes is the last field, so everything up to the empty array is the transaction header
+        try msgpack.encode(Transaction{ .id = commit_id, .changes = &.{} }, writer);
+        assert(self.pending.items[self.pending.items.len - 1] == msgpack_empty_array);
+        self.pending.items.len -= 1;
+        try self.pending.appendSlice(self.allocator, data);
+    } else {
+        try msgpack.encode(Transaction{ .id = commit_id, .changes = changes }, writer);
+    }
+}
+
+/// Adds the changes to the pending batch and returns their commit id, see `writeEncoded` for `encoded_changes`.
+/// They are not durable until `waitForWrite` returns, which must be called with the commit id.
+/// Commit ids are assigned in the order of the calls, so callers can prepare for them under their own lock.
+pub fn beginWrite(self: *Self, changes: []const Change, encoded_changes: ?[]const u8) !u64 {
+    self.batch_lock.lock();
+    defer self.batch_lock.unlock();
 
-    const file = try self.getFile(commit_id);
-    var counting_writer = std.io.countingWriter(file.writer());
-    var bufferred_writer = std.io.bufferedWriter(counting_writer.writer());
-    const writer = bufferred_writer.writer();
+    while (self.pending.items.len >= self.options.max_batch_size and self.failed == null) {
+        self.batch_cond.wait(&self.batch_lock);
+    }
+    if (self.failed) |err| {
+        return err;
+    }
 
-    try msgpack.encode(Transaction{
-        .id = commit_id,
-        .changes = changes,
-    }, writer);
+    const commit_id = self.next_commit_id;
 
-    try bufferred_writer.flush();
+    const prev_len = self.pending.items.len;
+    self.encodeTransaction(commit_id, changes, encoded_changes) catch |err| {
+        self.pending.shrinkRetainingCapacity(prev_len);
+        return err;
+    };
 
-    self.current_file_size += counting_writer.bytes_written;
+    if (prev_len == 0) {
+        self.pending_first_commit_id = commit_id;
+    }
     self.next_commit_id += 1;
 
+    // wake up the leader, in case it's waiting for the batch to fill up
+    self.batch_cond.broadcast();
+
+    return commit_id;
+}
+
+/// Waits until the transaction started by `beginWrite` is written and synced, or joins
+/// the batch and writes it, if nobody else is writing.
+pub fn waitForWrite(self: *Self, commit_id: u64) !void {
+    self.batch_lock.lock();
+    defer self.batch_lock.unlock();
+
+    while (self.synced_commit_id < commit_id) {
+        if (self.failed) |err| {
+            return err;
+        }
+        if (self.flushing) {
+            self.batch_cond.wait(&self.batch_lock);
+        } else {
+            // nobody is writing, so our transaction is still in the pending batch
+            try self.flushBatch();
+        }
+    }
+}
+
+// Must be called with batch_lock held, the lock is released while writing the file.
+fn flushBatch(self: *Self) !void {
+    self.flushing = true;
+    defer {
+        self.flushing = false;
+        self.batch_cond.broadcast();
+    }
+
+    if (self.options.max_batch_wait_ns > 0) {
+        const start_time = std.time.nanoTimestamp();
+        while (self.pending.items.len < self.options.max_batch_size) {
+            const elapsed: u64 = @intCast(@max(0, std.time.nanoTimestamp() - start_time));
+            if (elapsed >= self.options.max_batch_wait_ns) {
+                break;
+            }
+            self.batch_cond.timedWait(&self.batch_lock, self.options.max_batch_wait_ns - elapsed) catch break;
+        }
+    }
+
+    std.mem.swap(std.ArrayListUnmanaged(u8), &self.pending, &self.flush_buffer);
+    self.pending.clearRetainingCapacity();
+    self.batch_cond.broadcast();
+
+    const first_commit_id = self.pending_first_commit_id;
+    const last_commit_id = self.next_commit_id - 1;
+
+    // other writers can fill the next batch while we are writing this one
+    self.batch_lock.unlock();
+    const result = self.writeBatch(self.flush_buffer.items, first_commit_id, last_commit_id);
+    self.batch_lock.lock();
+
+    result catch |err| {
+        // we don't know how much of the batch made it to the file
+        log.err("failed to write oplog: {s}", .{@errorName(err)});
+        self.failed = err;
+        return err;
+    };
+
+    self.synced_commit_id = last_commit_id;
+}
+
+fn writeBatch(self: *Self, data: []const u8, first_commit_id: u64, last_commit_id: u64) !void {
+    self.write_lock.lock();
+    defer self.write_lock.unlock();
+
+    const file = try self.getFile(first_commit_id);
+    if (self.options.format == .compact) {
+        const header = try buildFrameHeader(data, first_commit_id, last_commit_id - first_commit_id + 1);
+        try file.writeAll(&header);
+        self.current_file_size += header.len;
+    }
+    try file.writeAll(data);
+
+    self.current_file_size += data.len;
+
     file.sync() catch |err| {
         if (err == error.InputOutput) {
             // FIXME: maybe we try to reload the oplog from disk, there is no other way to know what happened
@@ -230,22 +478,143 @@ pub fn write(self: *Self, changes: []const Change) !u64 {
         }
         return err;
     };
+}
 
-    return commit_id;
+// A compact frame holds the transactions of one batch, which have consecutive commit ids:
+// magic, first commit id (u64), number of transactions (u32), payload size (u32), CRC32 of the
+// header fields and the payload (u32), all little-endian, followed by the payload. The payload
+// is a sequence of ULEB128-encoded transactions, insert hashes are sorted and delta-encoded.
+// The first magic byte is never used in msgpack, so frames and plain transactions can be told apart.
+const frame_magic = [_]u8{ 0xc1, 'O', 'P', 'L' };
+const frame_header_size = 24;
+
+fn frameChecksum(header: []const u8, payload: []const u8) u32 {
+    var crc = std.hash.Crc32.init();
+    crc.update(header);
+    crc.update(payload);
+    return crc.final();
+}
+
+fn buildFrameHeader(payload: []const u8, first_commit_id: u64, num_transactions: u64) ![frame_header_size]u8 {
+    if (payload.len > std.math.maxInt(u32) or num_transactions > std.math.maxInt(u32)) {
+        return error.BatchTooLarge;
+    }
+    var header: [frame_header_size]u8 = undefined;
+    @memcpy(header[0..4], &frame_magic);
+    std.mem.writeInt(u64, header[4..12], first_commit_id, .little);
+    std.mem.writeInt(u32, header[12..16], @intCast(num_transactions), .little);
+    std.mem.writeInt(u32, header[16..20], @intCast(payload.len), .little);
+    std.mem.writeInt(u32, header[20..24], frameChecksum(header[4..20], payload), .little);
+    return header;
+}
+
+fn encodeCompactTransaction(changes: []const Change, writer: anytype, sort_buffer: *std.ArrayListUnmanaged(u32), allocator: std.mem.Allocator) !void {
+    try std.leb.writeULEB128(writer, changes.len);
+    for (changes) |change| {
+        try writer.writeByte(@intFromEnum(std.meta.activeTag(change)));
+        switch (change) {
+            .insert => |op| {
+                try std.leb.writeULEB128(writer, op.id);
+                try std.leb.writeULEB128(writer, op.hashes.len);
+                // the order of hashes doesn't matter to segments, sorted hashes have small deltas
+                sort_buffer.clearRetainingCapacity();
+                try sort_buffer.appendSlice(allocator, op.hashes);
+                std.sort.pdq(u32, sort_buffer.items, {}, std.sort.asc(u32));
+                var prev: u32 = 0;
+                for (sort_buffer.items) |hash| {
+                    try std.leb.writeULEB128(writer, hash - prev);
+                    prev = hash;
+                }
+            },
+            .delete => |op| {
+                try std.leb.writeULEB128(writer, op.id);
+            },
+            .set_attribute => |op| {
+                try std.leb.writeULEB128(writer, op.name.len);
+                try writer.writeAll(op.name);
+                try std.leb.writeULEB128(writer, op.value);
+            },
+        }
+    }
+}
+
+fn decodeCompactTransaction(allocator: std.mem.Allocator, stream: *std.io.FixedBufferStream([]const u8), commit_id: u64) !Transaction {
+    const reader = stream.reader();
+
+    const num_changes = try std.leb.readULEB128(u32, reader);
+    const changes = try allocator.alloc(Change, num_changes);
+    for (changes) |*change| {
+        const tag = std.meta.intToEnum(std.meta.Tag(Change), try reader.readByte()) catch return error.InvalidOplogFrame;
+        switch (tag) {
+            .insert => {
+                const id = try std.leb.readULEB128(u32, reader);
+                const hashes = try allocator.alloc(u32, try std.leb.readULEB128(u32, reader));
+                var prev: u32 = 0;
+                for (hashes) |*hash| {
+                    prev = std.math.add(u32, prev, try std.leb.readULEB128(u32, reader)) catch return error.InvalidOplogFrame;
+                    hash.* = prev;
+                }
+                change.* = .{ .insert = .{ .id = id, .hashes = hashes } };
+            },
+            .delete => {
+                change.* = .{ .delete = .{ .id = try std.leb.readULEB128(u32, reader) } };
+            },
+            .set_attribute => {
+                const name_len = try std.leb.readULEB128(u32, reader);
+                if (name_len > stream.buffer.len - stream.pos) {
+                    return error.InvalidOplogFrame;
+                }
+                // the name stays in the payload buffer
+                const name = stream.buffer[stream.pos..][0..name_len];
+                stream.pos += name_len;
+                change.* = .{ .set_attribute = .{ .name = name, .value = try std.leb.readULEB128(u64, reader) } };
+            },
+        }
+    }
+    return .{ .id = commit_id, .changes = changes };
+}
+
+test "compact transaction encoding" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var sort_buffer: std.ArrayListUnmanaged(u32) = .{};
+    defer sort_buffer.deinit(std.testing.allocator);
+
+    const changes = [_]Change{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 300, 1, 0xffffffff, 300 } } },
+        .{ .delete = .{ .id = 2 } },
+        .{ .set_attribute = .{ .name = "foo", .value = 1234567890123 } },
+    };
+
+    var data = std.ArrayList(u8).init(std.testing.allocator);
+    defer data.deinit();
+
+    try encodeCompactTransaction(&changes, data.writer(), &sort_buffer, std.testing.allocator);
+
+    var stream = std.io.fixedBufferStream(@as([]const u8, data.items));
+    const txn = try decodeCompactTransaction(arena.allocator(), &stream, 5);
+
+    try std.testing.expectEqual(data.items.len, stream.pos);
+    try std.testing.expectEqual(5, txn.id);
+    try std.testing.expectEqualDeep(&[_]Change{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 300, 300, 0xffffffff } } },
+        .{ .delete = .{ .id = 2 } },
+        .{ .set_attribute = .{ .name = "foo", .value = 1234567890123 } },
+    }, txn.changes);
 }
 
 test "write entries" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir);
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{ .format = .msgpack });
     defer oplog.deinit();
 
     const Updater = struct {
-        pub fn receive(self: *@This(), changes: []const Change, commit_id: u64) !void {
+        pub fn receive(self: *@This(), txns: []const Transaction) !void {
             _ = self;
-            _ = changes;
-            _ = commit_id;
+            _ = txns;
         }
     };
 
@@ -273,11 +642,336 @@ test "write entries" {
     try std.testing.expectEqualDeep(&changes, txn.changes);
 }
 
+test "write encoded entries" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{ .format = .msgpack });
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), txns: []const Transaction) !void {
+            _ = self;
+            _ = txns;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(0, Updater.receive, &updater);
+
+    const changes = [_]Change{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 2, 3 } } },
+        .{ .delete = .{ .id = 2 } },
+    };
+
+    var encoded_changes = std.ArrayList(u8).init(std.testing.allocator);
+    defer encoded_changes.deinit();
+
+    try msgpack.encode(@as([]const Change, &changes), encoded_changes.writer());
+
+    _ = try oplog.writeEncoded(&changes, encoded_changes.items);
+    _ = try oplog.write(&changes);
+
+    var file = try tmp_dir.dir.openFile("oplog/0000000000000001.xlog", .{});
+    defer file.close();
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    var unpacker = msgpack.unpacker(file.reader(), arena.allocator());
+
+    for (1..3) |i| {
+        const txn = try unpacker.read(Transaction);
+        try std.testing.expectEqual(i, txn.id);
+        try std.testing.expectEqualDeep(&changes, txn.changes);
+    }
+}
+
+test "concurrent writes" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{ .max_batch_wait_ns = std.time.ns_per_ms });
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), txns: []const Transaction) !void {
+            _ = self;
+            _ = txns;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(1, Updater.receive, &updater);
+
+    const num_threads = 8;
+    const num_writes = 10;
+
+    const Writer = struct {
+        fn run(o: *Self, commit_ids: []u64) void {
+            const changes = [_]Change{.{ .delete = .{ .id = 1 } }};
+            for (commit_ids) |*commit_id| {
+                commit_id.* = o.write(&changes) catch 0;
+            }
+        }
+    };
+
+    var commit_ids: [num_threads * num_writes]u64 = undefined;
+    var threads: [num_threads]std.Thread = undefined;
+    for (&threads, 0..) |*thread, i| {
+        thread.* = try std.Thread.spawn(.{}, Writer.run, .{ &oplog, commit_ids[i * num_writes .. (i + 1) * num_writes] });
+    }
+    for (threads) |thread| {
+        thread.join();
+    }
+
+    std.sort.pdq(u64, &commit_ids, {}, std.sort.asc(u64));
+    for (commit_ids, 1..) |commit_id, expected| {
+        try std.testing.expectEqual(expected, commit_id);
+    }
+    try std.testing.expectEqual(commit_ids.len + 1, oplog.getNextCommitId());
+
+    var it = try oplog.iterate(1);
+    defer it.deinit();
+
+    for (1..commit_ids.len + 1) |expected| {
+        const txn = (try it.next()).?;
+        try std.testing.expectEqual(expected, txn.id);
+    }
+    try std.testing.expectEqual(null, try it.next());
+}
+
+test "iterate" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), txns: []const Transaction) !void {
+            _ = self;
+            _ = txns;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(1, Updater.receive, &updater);
+
+    // one file per transaction
+    oplog.max_file_size = 1;
+
+    const changes = [_]Change{.{ .delete = .{ .id = 1 } }};
+    for (0..4) |_| {
+        _ = try oplog.write(&changes);
+    }
+
+    {
+        var it = try oplog.iterate(2);
+        defer it.deinit();
+
+        for (2..5) |expected| {
+            const txn = (try it.next()).?;
+            try std.testing.expectEqual(expected, txn.id);
+        }
+        try std.testing.expectEqual(null, try it.next());
+    }
+
+    {
+        // nothing new yet
+        var it = try oplog.iterate(5);
+        defer it.deinit();
+
+        try std.testing.expectEqual(null, try it.next());
+    }
+
+    try oplog.truncate(3);
+
+    try std.testing.expectError(error.CommitIdNotAvailable, oplog.iterate(1));
+
+    {
+        var it = try oplog.iterate(2);
+        defer it.deinit();
+
+        try std.testing.expectEqual(2, (try it.next()).?.id);
+    }
+}
+
+const TestReceiver = struct {
+    num_batches: usize = 0,
+    commit_ids: std.ArrayListUnmanaged(u64) = .{},
+
+    fn deinit(self: *TestReceiver) void {
+        self.commit_ids.deinit(std.testing.allocator);
+    }
+
+    fn receive(self: *TestReceiver, txns: []const Transaction) !void {
+        self.num_batches += 1;
+        for (txns) |txn| {
+            try self.commit_ids.append(std.testing.allocator, txn.id);
+        }
+    }
+};
+
+fn writeTestTransactions(dir: std.fs.Dir, options: Options, num_transactions: usize) !void {
+    var oplog = try Self.init(std.testing.allocator, dir, options);
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try oplog.open(1, TestReceiver.receive, &receiver);
+
+    const hashes = [_]u32{ 1, 2, 3 };
+    for (0..num_transactions) |i| {
+        _ = try oplog.write(&.{.{ .insert = .{ .id = @intCast(i + 1), .hashes = &hashes } }});
+    }
+}
+
+test "replay batches consecutive transactions" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    try writeTestTransactions(tmp_dir.dir, .{}, 10);
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{ .max_replay_batch_size = 8 });
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try oplog.open(1, TestReceiver.receive, &receiver);
+
+    // each transaction has one change with three hashes
+    try std.testing.expectEqual(5, receiver.num_batches);
+    try std.testing.expectEqualSlices(u64, &.{ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 }, receiver.commit_ids.items);
+    try std.testing.expectEqual(11, oplog.getNextCommitId());
+}
+
+test "replay reads both formats" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    try writeTestTransactions(tmp_dir.dir, .{ .format = .msgpack }, 2);
+
+    {
+        var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+        defer oplog.deinit();
+
+        var receiver: TestReceiver = .{};
+        defer receiver.deinit();
+
+        try oplog.open(1, TestReceiver.receive, &receiver);
+        try std.testing.expectEqualSlices(u64, &.{ 1, 2 }, receiver.commit_ids.items);
+
+        _ = try oplog.write(&.{.{ .delete = .{ .id = 1 } }});
+    }
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try oplog.open(1, TestReceiver.receive, &receiver);
+
+    try std.testing.expectEqual(1, receiver.num_batches);
+    try std.testing.expectEqualSlices(u64, &.{ 1, 2, 3 }, receiver.commit_ids.items);
+}
+
+test "replay skips torn frame at the end" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    try writeTestTransactions(tmp_dir.dir, .{}, 2);
+
+    {
+        var file = try tmp_dir.dir.openFile("oplog/0000000000000001.xlog", .{ .mode = .read_write });
+        defer file.close();
+
+        try file.setEndPos(try file.getEndPos() - 3);
+    }
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try oplog.open(1, TestReceiver.receive, &receiver);
+
+    try std.testing.expectEqualSlices(u64, &.{1}, receiver.commit_ids.items);
+    try std.testing.expectEqual(2, oplog.getNextCommitId());
+}
+
+test "replay skips frame with invalid size at the end" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    try writeTestTransactions(tmp_dir.dir, .{}, 2);
+
+    {
+        var file = try tmp_dir.dir.openFile("oplog/0000000000000001.xlog", .{ .mode = .read_write });
+        defer file.close();
+
+        // payload size of the second frame, which starts after the payload of the first one
+        var buf: [4]u8 = undefined;
+        _ = try file.preadAll(&buf, 16);
+        const offset = frame_header_size + std.mem.readInt(u32, &buf, .little) + 16;
+        std.mem.writeInt(u32, &buf, 0xfffffff0, .little);
+        try file.pwriteAll(&buf, offset);
+    }
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try oplog.open(1, TestReceiver.receive, &receiver);
+
+    try std.testing.expectEqualSlices(u64, &.{1}, receiver.commit_ids.items);
+    try std.testing.expectEqual(2, oplog.getNextCommitId());
+}
+
+test "replay fails on corrupted frame" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    try writeTestTransactions(tmp_dir.dir, .{}, 2);
+
+    {
+        var file = try tmp_dir.dir.openFile("oplog/0000000000000001.xlog", .{ .mode = .read_write });
+        defer file.close();
+
+        // first payload byte of the first frame
+        var buf: [1]u8 = undefined;
+        _ = try file.preadAll(&buf, frame_header_size);
+        buf[0] ^= 0xff;
+        try file.pwriteAll(&buf, frame_header_size);
+    }
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    var receiver: TestReceiver = .{};
+    defer receiver.deinit();
+
+    try std.testing.expectError(error.InvalidOplogChecksum, oplog.open(1, TestReceiver.receive, &receiver));
+}
+
 pub const OplogIterator = struct {
     allocator: std.mem.Allocator,
     dir: std.fs.Dir,
     files: std.ArrayList(FileInfo),
     first_commit_id: u64,
+    // transactions after this one may still be written, so they are not returned
+    last_commit_id: u64 = std.math.maxInt(u64),
+    owns_files: bool = false,
+    done: bool = false,
     current_iterator: ?OplogFileIterator = null,
     current_file_index: usize = 0,
 
@@ -294,15 +988,25 @@ pub const OplogIterator = struct {
         if (self.current_iterator) |*iterator| {
             iterator.deinit();
         }
+        if (self.owns_files) {
+            self.files.deinit();
+        }
     }
 
     pub fn next(self: *OplogIterator) !?Transaction {
-        while (true) {
+        while (!self.done) {
             if (self.current_iterator) |*iterator| {
                 if (try iterator.next()) |entry| {
                     if (entry.id < self.first_commit_id) {
                         continue;
                     }
+                    if (entry.id >= self.last_commit_id) {
+                        // don't read the partially written data after the last synced transaction
+                        self.done = true;
+                        if (entry.id > self.last_commit_id) {
+                            return null;
+                        }
+                    }
                     return entry;
                 }
                 iterator.deinit();
@@ -318,7 +1022,7 @@ pub const OplogIterator = struct {
             const file = try self.dir.openFile(file_name, .{});
             self.current_iterator = OplogFileIterator.init(self.allocator, file);
         }
-        unreachable;
+        return null;
     }
 };
 
@@ -326,6 +1030,9 @@ pub const OplogFileIterator = struct {
     arena: std.heap.ArenaAllocator,
     file: std.fs.File,
     buffered_reader: std.io.BufferedReader(4096, std.fs.File.Reader),
+    // transactions of the current compact frame
+    frame: []Transaction = &.{},
+    frame_pos: usize = 0,
 
     pub fn init(allocator: std.mem.Allocator, file: std.fs.File) OplogFileIterator {
         return OplogFileIterator{
@@ -341,13 +1048,97 @@ pub const OplogFileIterator = struct {
     }
 
     pub fn next(self: *OplogFileIterator) !?Transaction {
+        if (self.frame_pos < self.frame.len) {
+            self.frame_pos += 1;
+            return self.frame[self.frame_pos - 1];
+        }
+
         _ = self.arena.reset(.retain_capacity);
+        self.frame = &.{};
+        self.frame_pos = 0;
+
+        // a partially written transaction or frame at the end of the file was never synced, so it's skipped
+        var stream = std.io.peekStream(1, self.buffered_reader.reader());
+        const first_byte = stream.reader().readByte() catch |err| {
+            if (err == error.EndOfStream) {
+                return null;
+            }
+            return err;
+        };
 
-        return msgpack.decodeLeaky(Transaction, self.arena.allocator(), self.buffered_reader.reader()) catch |err| {
+        if (first_byte != frame_magic[0]) {
+            try stream.putBackByte(first_byte);
+            return msgpack.decodeLeaky(Transaction, self.arena.allocator(), stream.reader()) catch |err| {
+                if (err == error.EndOfStream) {
+                    return null;
+                }
+                return err;
+            };
+        }
+
+        self.frame = self.readFrame(stream.reader()) catch |err| {
             if (err == error.EndOfStream) {
                 return null;
             }
             return err;
         };
+        if (self.frame.len == 0) {
+            return error.InvalidOplogFrame;
+        }
+        self.frame_pos = 1;
+        return self.frame[0];
+    }
+
+    // Number of bytes not read yet, including ones in the read buffer.
+    fn getRemainingSize(self: *OplogFileIterator) !u64 {
+        const buffered = self.buffered_reader.end - self.buffered_reader.start;
+        return (try self.file.getEndPos()) -| (try self.file.getPos()) + buffered;
+    }
+
+    fn readFrame(self: *OplogFileIterator, reader: anytype) ![]Transaction {
+        var header: [frame_header_size]u8 = undefined;
+        header[0] = frame_magic[0];
+        try reader.readNoEof(header[1..]);
+        if (!std.mem.eql(u8, header[0..4], &frame_magic)) {
+            return error.InvalidOplogFrame;
+        }
+
+        const first_commit_id = std.mem.readInt(u64, header[4..12], .little);
+        const num_transactions = std.mem.readInt(u32, header[12..16], .little);
+        const payload_size = std.mem.readInt(u32, header[16..20], .little);
+        const checksum = std.mem.readInt(u32, header[20..24], .little);
+
+        // the header is not verified yet, a torn one must not make us allocate an arbitrary amount of memory
+        if (payload_size > try self.getRemainingSize()) {
+            log.warn("ignoring oplog frame with invalid size at the end of the file", .{});
+            return error.EndOfStream;
+        }
+
+        const payload = try self.arena.allocator().alloc(u8, payload_size);
+        try reader.readNoEof(payload);
+
+        if (frameChecksum(header[4..20], payload) != checksum) {
+            // a torn write at the end of the file is the same as a partial frame
+            _ = reader.readByte() catch |err| {
+                if (err == error.EndOfStream) {
+                    log.warn("ignoring oplog frame with invalid checksum at the end of the file", .{});
+                    return error.EndOfStream;
+                }
+                return err;
+            };
+            return error.InvalidOplogChecksum;
+        }
+
+        const txns = try self.arena.allocator().alloc(Transaction, num_transactions);
+        var payload_stream = std.io.fixedBufferStream(@as([]const u8, payload));
+        for (txns, 0..) |*txn, i| {
+            txn.* = decodeCompactTransaction(self.arena.allocator(), &payload_stream, first_commit_id + i) catch |err| {
+                if (err == error.EndOfStream or err == error.Overflow) {
+                    return error.InvalidOplogFrame;
+                }
+                return err;
+            };
+        }
+        return txns;
     }
 };
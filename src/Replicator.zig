@@ -0,0 +1,257 @@
+//! Keeps a replica index in sync with the index of the same name on the leader.
+//! Committed transactions are pulled from the leader's oplog and applied with the
+//! leader's commit ids. Finished file segments are downloaded as they are, so the
+//! replica never runs checkpoints or file segment merges itself. A replica that falls
+//! behind the truncated part of the leader's oplog catches up from the segments.
+
+const std = @import("std");
+const log = std.log.scoped(.replicator);
+
+const msgpack = @import("msgpack");
+
+const Index = @import("Index.zig");
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const Transaction = @import("change.zig").Transaction;
+const filefmt = @import("filefmt.zig");
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+pub const Options = struct {
+    // how long to wait for new transactions, when the replica is up to date
+    poll_interval_ms: u64 = 1000,
+    // how often to check the leader for new file segments
+    segment_sync_interval_ms: u64 = 10_000,
+    // maximum number of transactions requested at once
+    max_transactions: usize = 1000,
+};
+
+/// Body of the leader's segment list response, for one shard of the index.
+pub const SegmentsResponse = struct {
+    num_shards: usize,
+    segments: []const SegmentInfo,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const msgpack_content_type = "application/vnd.msgpack";
+
+const max_segments_response_size = 1024 * 1024;
+const max_oplog_response_size = 64 * 1024 * 1024;
+
+allocator: std.mem.Allocator,
+index: *Index,
+options: Options,
+// URL of the index on the leader
+base_url: []const u8,
+client: std.http.Client,
+thread: ?std.Thread = null,
+stopping: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+wake: std.Thread.ResetEvent = .{},
+// the first sync also catches up a new replica, without replaying the whole oplog
+needs_segment_sync: bool = true,
+last_segment_sync_ms: i64 = 0,
+
+pub fn init(allocator: std.mem.Allocator, index: *Index, leader_url: []const u8, options: Options) !Self {
+    const base_url = try std.fmt.allocPrint(allocator, "{s}/{s}", .{ std.mem.trimRight(u8, leader_url, "/"), index.name });
+    return .{
+        .allocator = allocator,
+        .index = index,
+        .options = options,
+        .base_url = base_url,
+        .client = .{ .allocator = allocator },
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.stop();
+    self.client.deinit();
+    self.allocator.free(self.base_url);
+}
+
+pub fn start(self: *Self) !void {
+    log.info("replicating index {s} from {s}", .{ self.index.name, self.base_url });
+    self.thread = try std.Thread.spawn(.{}, run, .{self});
+}
+
+/// Waits for the request in progress, if any, to finish.
+pub fn stop(self: *Self) void {
+    if (self.thread) |thread| {
+        self.stopping.store(true, .release);
+        self.wake.set();
+        thread.join();
+        self.thread = null;
+    }
+}
+
+fn run(self: *Self) void {
+    while (!self.stopping.load(.acquire)) {
+        const has_more = self.step() catch |err| blk: {
+            log.warn("failed to replicate index {s}: {}", .{ self.index.name, err });
+            metrics.replicationError(self.index.name);
+            break :blk false;
+        };
+        if (!has_more) {
+            self.wake.timedWait(self.options.poll_interval_ms * std.time.ns_per_ms) catch {};
+        }
+    }
+}
+
+// Returns true if there might be more work right away.
+fn step(self: *Self) !bool {
+    const now = std.time.milliTimestamp();
+    const segment_sync_interval_ms: i64 = @intCast(self.options.segment_sync_interval_ms);
+    if (self.needs_segment_sync or now - self.last_segment_sync_ms >= segment_sync_interval_ms) {
+        try self.syncSegments();
+        self.needs_segment_sync = false;
+        self.last_segment_sync_ms = now;
+    }
+
+    const num_transactions = self.pullTransactions() catch |err| {
+        if (err == error.CommitIdNotAvailable) {
+            // the leader has checkpointed and truncated the transactions we need
+            log.info("index {s} is behind the leader's oplog, syncing segments", .{self.index.name});
+            self.needs_segment_sync = true;
+            return true;
+        }
+        return err;
+    };
+    return num_transactions >= self.options.max_transactions;
+}
+
+fn get(self: *Self, allocator: std.mem.Allocator, url: []const u8, max_size: usize) ![]const u8 {
+    var body = std.ArrayList(u8).init(allocator);
+
+    const result = try self.client.fetch(.{
+        .location = .{ .url = url },
+        .method = .GET,
+        .response_storage = .{ .dynamic = &body },
+        .max_append_size = max_size,
+        .extra_headers = &.{.{ .name = "accept", .value = msgpack_content_type }},
+    });
+
+    switch (result.status) {
+        .ok => return body.items,
+        .gone => return error.CommitIdNotAvailable,
+        else => {
+            log.warn("unexpected response from {s}: {}", .{ url, result.status });
+            return error.UnexpectedResponse;
+        },
+    }
+}
+
+fn pullTransactions(self: *Self) !usize {
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    const first_commit_id = self.index.getNextReplicatedCommitId();
+
+    const url = try std.fmt.allocPrint(arena.allocator(), "{s}/_replication/oplog?from={}&limit={}", .{ self.base_url, first_commit_id, self.options.max_transactions });
+    const body = try self.get(arena.allocator(), url, max_oplog_response_size);
+
+    // the body is a sequence of msgpack-encoded transactions
+    var stream = std.io.fixedBufferStream(body);
+    var num_transactions: usize = 0;
+    while (stream.pos < body.len) {
+        const txn = try msgpack.decodeLeaky(Transaction, arena.allocator(), stream.reader());
+        try self.index.applyReplicatedTransaction(txn.changes, txn.id);
+        num_transactions += 1;
+    }
+
+    if (num_transactions > 0) {
+        metrics.replicatedTransactions(self.index.name, num_transactions);
+    }
+    return num_transactions;
+}
+
+fn containsSegment(infos: []const SegmentInfo, info: SegmentInfo) bool {
+    for (infos) |i| {
+        if (std.meta.eql(i, info)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+fn syncSegments(self: *Self) !void {
+    for (0..self.index.getNumShards()) |shard_no| {
+        try self.syncShardSegments(shard_no);
+    }
+}
+
+fn syncShardSegments(self: *Self, shard_no: usize) !void {
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    const url = try std.fmt.allocPrint(arena.allocator(), "{s}/_replication/segments?shard={}", .{ self.base_url, shard_no });
+    const body = try self.get(arena.allocator(), url, max_segments_response_size);
+    const manifest = try msgpack.decodeFromSliceLeaky(SegmentsResponse, arena.allocator(), body);
+
+    // the segments only fit the same hash ranges
+    if (manifest.num_shards != self.index.getNumShards()) {
+        log.err("index {s} has {} shards, but the leader has {}", .{ self.index.name, self.index.getNumShards(), manifest.num_shards });
+        return error.ShardCountMismatch;
+    }
+
+    const current = try self.index.getFileSegmentInfos(arena.allocator(), shard_no);
+    if (current.len == manifest.segments.len) {
+        for (current, manifest.segments) |a, b| {
+            if (!std.meta.eql(a, b)) break;
+        } else return;
+    }
+
+    for (manifest.segments) |info| {
+        if (!containsSegment(current, info)) {
+            try self.downloadSegment(arena.allocator(), shard_no, info);
+        }
+    }
+
+    try self.index.replaceFileSegments(shard_no, manifest.segments);
+
+    log.info("index {s} switched to {} segments from the leader (shard {})", .{ self.index.name, manifest.segments.len, shard_no });
+}
+
+fn downloadSegment(self: *Self, allocator: std.mem.Allocator, shard_no: usize, info: SegmentInfo) !void {
+    var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+    const file_name = filefmt.buildSegmentFileName(&file_name_buf, info);
+
+    const url = try std.fmt.allocPrint(allocator, "{s}/_replication/segments/{s}?shard={}", .{ self.base_url, file_name, shard_no });
+    const uri = try std.Uri.parse(url);
+
+    var header_buf: [16 * 1024]u8 = undefined;
+    var req = try self.client.open(.GET, uri, .{ .server_header_buffer = &header_buf });
+    defer req.deinit();
+
+    try req.send();
+    try req.finish();
+    try req.wait();
+
+    if (req.response.status != .ok) {
+        log.warn("unexpected response from {s}: {}", .{ url, req.response.status });
+        return error.UnexpectedResponse;
+    }
+
+    // segment files can be large, so they are streamed to disk
+    const dir = try self.index.getShardDir(shard_no);
+    var file = try dir.atomicFile(file_name, .{});
+    defer file.deinit();
+
+    const buffer = try allocator.alloc(u8, 256 * 1024);
+    var size: usize = 0;
+    while (true) {
+        const n = try req.reader().read(buffer);
+        if (n == 0) {
+            break;
+        }
+        try file.file.writeAll(buffer[0..n]);
+        size += n;
+    }
+
+    try file.file.sync();
+    try file.finish();
+
+    log.info("downloaded segment file {s} ({} bytes)", .{ file_name, size });
+    metrics.replicatedSegment(self.index.name);
+}
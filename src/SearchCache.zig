@@ -0,0 +1,224 @@
+const std = @import("std");
+const log = std.log.scoped(.search_cache);
+
+const common = @import("common.zig");
+const SearchOptions = common.SearchOptions;
+const SearchResult = common.SearchResult;
+const SearchResults = common.SearchResults;
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const IndexReader = @import("IndexReader.zig");
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Each shard has its own lock and LRU list, so that concurrent searches
+// rarely wait for each other.
+const num_shards = 16;
+
+const Entry = struct {
+    key: u64,
+    hashes: []u32,
+    options: SearchOptions,
+    // segments the results were computed against, the entry is stale if the index has different segments
+    segments: []SegmentInfo,
+    results: []SearchResult,
+};
+
+const List = std.DoublyLinkedList(Entry);
+const Node = List.Node;
+
+const Shard = struct {
+    lock: std.Thread.Mutex = .{},
+    entries: std.AutoHashMapUnmanaged(u64, *Node) = .{},
+    // most recently used entries are at the front
+    lru: List = .{},
+};
+
+allocator: std.mem.Allocator,
+shards: [num_shards]Shard = [_]Shard{.{}} ** num_shards,
+max_entries_per_shard: usize,
+
+pub fn init(allocator: std.mem.Allocator, max_entries: usize) Self {
+    return .{
+        .allocator = allocator,
+        .max_entries_per_shard = @max(1, std.math.divCeil(usize, max_entries, num_shards) catch unreachable),
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    for (&self.shards) |*shard| {
+        while (shard.lru.pop()) |node| {
+            self.destroyNode(node);
+        }
+        shard.entries.deinit(self.allocator);
+    }
+}
+
+fn computeKey(sorted_hashes: []const u32, options: SearchOptions) u64 {
+    var hasher = std.hash.Wyhash.init(0);
+    hasher.update(std.mem.sliceAsBytes(sorted_hashes));
+    hasher.update(std.mem.asBytes(&options));
+    return hasher.final();
+}
+
+fn getShard(self: *Self, key: u64) *Shard {
+    return &self.shards[key % num_shards];
+}
+
+fn createNode(self: *Self, key: u64, sorted_hashes: []const u32, options: SearchOptions, reader: *const IndexReader, results: []const SearchResult) !*Node {
+    const node = try self.allocator.create(Node);
+    errdefer self.allocator.destroy(node);
+
+    const hashes = try self.allocator.dupe(u32, sorted_hashes);
+    errdefer self.allocator.free(hashes);
+
+    const segments = try reader.getSegmentInfos(self.allocator);
+    errdefer self.allocator.free(segments);
+
+    const results_copy = try self.allocator.dupe(SearchResult, results);
+    errdefer self.allocator.free(results_copy);
+
+    node.* = .{
+        .data = .{
+            .key = key,
+            .hashes = hashes,
+            .options = options,
+            .segments = segments,
+            .results = results_copy,
+        },
+    };
+    return node;
+}
+
+fn destroyNode(self: *Self, node: *Node) void {
+    self.allocator.free(node.data.hashes);
+    self.allocator.free(node.data.segments);
+    self.allocator.free(node.data.results);
+    self.allocator.destroy(node);
+}
+
+/// Fills `results` from the cache, if there is an entry for the same query
+/// that was computed against the same segments as `reader` has.
+pub fn get(self: *Self, sorted_hashes: []const u32, options: SearchOptions, reader: *const IndexReader, results: *SearchResults) !bool {
+    const key = computeKey(sorted_hashes, options);
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    const node = shard.entries.get(key) orelse {
+        metrics.searchCacheMiss();
+        return false;
+    };
+
+    const entry = &node.data;
+    if (!std.meta.eql(entry.options, options) or !std.mem.eql(u32, entry.hashes, sorted_hashes) or !reader.hasSegmentInfos(entry.segments)) {
+        metrics.searchCacheMiss();
+        return false;
+    }
+
+    shard.lru.remove(node);
+    shard.lru.prepend(node);
+
+    try results.setResults(entry.results);
+    results.cached = true;
+
+    metrics.searchCacheHit();
+    return true;
+}
+
+pub fn put(self: *Self, sorted_hashes: []const u32, options: SearchOptions, reader: *const IndexReader, results: []const SearchResult) !void {
+    const key = computeKey(sorted_hashes, options);
+
+    const node = try self.createNode(key, sorted_hashes, options, reader, results);
+    errdefer self.destroyNode(node);
+
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    const gop = try shard.entries.getOrPut(self.allocator, key);
+    if (gop.found_existing) {
+        shard.lru.remove(gop.value_ptr.*);
+        self.destroyNode(gop.value_ptr.*);
+    }
+    gop.value_ptr.* = node;
+    shard.lru.prepend(node);
+
+    while (shard.entries.count() > self.max_entries_per_shard) {
+        const last = shard.lru.pop() orelse break;
+        _ = shard.entries.remove(last.data.key);
+        self.destroyNode(last);
+    }
+}
+
+pub fn count(self: *Self) usize {
+    var result: usize = 0;
+    for (&self.shards) |*shard| {
+        shard.lock.lock();
+        defer shard.lock.unlock();
+        result += shard.entries.count();
+    }
+    return result;
+}
+
+test "SearchCache" {
+    const SegmentList = @import("segment_list.zig").SegmentList;
+    const FileSegmentList = SegmentList(@import("FileSegment.zig"));
+    const MemorySegmentList = SegmentList(@import("MemorySegment.zig"));
+
+    const allocator = std.testing.allocator;
+
+    var cache = Self.init(allocator, 32);
+    defer cache.deinit();
+
+    var shards1 = [_]IndexReader.Shard{.{
+        .file_segments = try FileSegmentList.createSharedEmpty(allocator),
+        .memory_segments = try MemorySegmentList.createSharedEmpty(allocator),
+    }};
+    defer FileSegmentList.destroySegments(allocator, &shards1[0].file_segments);
+    defer MemorySegmentList.destroySegments(allocator, &shards1[0].memory_segments);
+    const reader1 = IndexReader{ .shards = &shards1 };
+
+    var shards2 = [_]IndexReader.Shard{.{
+        .file_segments = try FileSegmentList.createSharedEmpty(allocator),
+        .memory_segments = try MemorySegmentList.createShared(allocator, 1),
+    }};
+    defer FileSegmentList.destroySegments(allocator, &shards2[0].file_segments);
+    defer MemorySegmentList.destroySegments(allocator, &shards2[0].memory_segments);
+    const reader2 = IndexReader{ .shards = &shards2 };
+
+    var segment = try MemorySegmentList.createSegment(allocator, .{});
+    defer MemorySegmentList.destroySegment(allocator, &segment);
+    segment.value.info = .{ .version = 1 };
+    shards2[0].memory_segments.value.nodes.appendAssumeCapacity(segment.acquire());
+
+    const hashes = [_]u32{ 1, 2, 3 };
+    const cached = [_]SearchResult{.{ .id = 1, .score = 3 }};
+
+    try cache.put(&hashes, .{}, &reader1, &cached);
+
+    var results = SearchResults.init(allocator, .{});
+    defer results.deinit();
+
+    try std.testing.expect(try cache.get(&hashes, .{}, &reader1, &results));
+    try std.testing.expectEqualSlices(SearchResult, &cached, results.getResults());
+    try std.testing.expect(results.cached);
+
+    // different segments
+    try std.testing.expect(!try cache.get(&hashes, .{}, &reader2, &results));
+
+    // different options
+    try std.testing.expect(!try cache.get(&hashes, .{ .max_results = 1 }, &reader1, &results));
+
+    // different query
+    try std.testing.expect(!try cache.get(hashes[1..], .{}, &reader1, &results));
+
+    // the number of entries is bounded
+    for (0..1000) |i| {
+        const query = [_]u32{@intCast(i)};
+        try cache.put(&query, .{}, &reader1, &cached);
+    }
+    try std.testing.expect(cache.count() <= 32);
+}
@@ -0,0 +1,479 @@
+//! Microbenchmarks of the hot paths and an end-to-end load test on a synthetic index.
+//!
+//!     zig build bench -Doptimize=ReleaseFast -- --docs 100000 --queries 10000
+//!
+//! Each benchmark prints one JSON object per line to stdout, so that results from
+//! different builds can be compared by a script.
+
+const std = @import("std");
+const log = std.log.scoped(.bench);
+const zul = @import("zul");
+
+const Item = @import("segment.zig").Item;
+const Change = @import("change.zig").Change;
+const Transaction = @import("change.zig").Transaction;
+const common = @import("common.zig");
+const SearchResults = common.SearchResults;
+const MemorySegment = @import("MemorySegment.zig");
+const SegmentList = @import("segment_list.zig").SegmentList;
+const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
+const Oplog = @import("Oplog.zig");
+const Index = @import("Index.zig");
+const Scheduler = @import("utils/Scheduler.zig");
+const filefmt = @import("filefmt.zig");
+const Deadline = @import("utils/Deadline.zig");
+
+pub const std_options = .{
+    .log_level = .warn,
+};
+
+const Result = struct {
+    name: []const u8,
+    ops: u64,
+    elapsed_ms: f64,
+    ops_per_sec: f64,
+    ns_per_op: f64,
+    p50_us: ?f64 = null,
+    p99_us: ?f64 = null,
+    bytes_per_item: ?f64 = null,
+};
+
+fn report(name: []const u8, ops: u64, elapsed_ns: u64, latencies_ns: ?[]u64) !void {
+    try writeResult(makeResult(name, ops, elapsed_ns, latencies_ns));
+}
+
+fn makeResult(name: []const u8, ops: u64, elapsed_ns: u64, latencies_ns: ?[]u64) Result {
+    var result = Result{
+        .name = name,
+        .ops = ops,
+        .elapsed_ms = @as(f64, @floatFromInt(elapsed_ns)) / std.time.ns_per_ms,
+        .ops_per_sec = @as(f64, @floatFromInt(ops)) * std.time.ns_per_s / @as(f64, @floatFromInt(@max(1, elapsed_ns))),
+        .ns_per_op = @as(f64, @floatFromInt(elapsed_ns)) / @as(f64, @floatFromInt(@max(1, ops))),
+    };
+    if (latencies_ns) |latencies| {
+        if (latencies.len > 0) {
+            std.sort.pdq(u64, latencies, {}, std.sort.asc(u64));
+            result.p50_us = @as(f64, @floatFromInt(latencies[latencies.len * 50 / 100])) / std.time.ns_per_us;
+            result.p99_us = @as(f64, @floatFromInt(latencies[latencies.len * 99 / 100])) / std.time.ns_per_us;
+        }
+    }
+    return result;
+}
+
+fn writeResult(result: Result) !void {
+    const stdout = std.io.getStdOut().writer();
+    try std.json.stringify(result, .{ .emit_null_optional_fields = false }, stdout);
+    try stdout.writeByte('\n');
+}
+
+// Chromaprint hashes of neighbouring frames differ in only a few bits, and some values,
+// e.g. from silence, are very common across all fingerprints.
+const HashGenerator = struct {
+    rand: std.Random,
+    prev: u32 = 0,
+
+    const common_hashes = [_]u32{ 0x00000000, 0xffffffff, 0x55555555, 0xaaaaaaaa, 0x0f0f0f0f, 0xf0f0f0f0, 0x33333333, 0xcccccccc };
+
+    fn next(self: *HashGenerator) u32 {
+        const r = self.rand.uintLessThan(u32, 100);
+        const hash = if (r < 3)
+            common_hashes[self.rand.uintLessThan(usize, common_hashes.len)]
+        else if (r < 60)
+            self.prev ^ (@as(u32, 1) << self.rand.int(u5)) ^ (@as(u32, 1) << self.rand.int(u5))
+        else
+            self.rand.int(u32);
+        self.prev = hash;
+        return hash;
+    }
+
+    fn fill(self: *HashGenerator, hashes: []u32) void {
+        for (hashes) |*hash| {
+            hash.* = self.next();
+        }
+    }
+};
+
+const hashes_per_doc = 120;
+
+const ItemReader = struct {
+    items: []const Item,
+    index: usize = 0,
+
+    pub fn read(self: *ItemReader) !?Item {
+        return if (self.index < self.items.len) self.items[self.index] else null;
+    }
+
+    pub fn advance(self: *ItemReader) void {
+        if (self.index < self.items.len) {
+            self.index += 1;
+        }
+    }
+};
+
+fn generateItems(allocator: std.mem.Allocator, rand: std.Random, num_docs: usize) ![]Item {
+    var gen = HashGenerator{ .rand = rand };
+    const items = try allocator.alloc(Item, num_docs * hashes_per_doc);
+    for (0..num_docs) |i| {
+        for (items[i * hashes_per_doc ..][0..hashes_per_doc]) |*item| {
+            item.* = .{ .hash = gen.next(), .id = @intCast(i + 1) };
+        }
+    }
+    std.sort.pdq(Item, items, {}, Item.cmp);
+    return items;
+}
+
+const block_sizes = [_]usize{ 256, 512, 1024, 2048, 4096 };
+
+fn benchBlocks(allocator: std.mem.Allocator, rand: std.Random, num_docs: usize, num_queries: usize) !void {
+    const items = try generateItems(allocator, rand, num_docs);
+    defer allocator.free(items);
+
+    // hashes that are in the blocks, looked up the same way as in file segments
+    const lookups = try allocator.alloc(u32, num_queries * hashes_per_doc / 10);
+    defer allocator.free(lookups);
+    for (lookups) |*hash| {
+        hash.* = items[rand.uintLessThan(usize, items.len)].hash;
+    }
+
+    inline for (std.meta.fields(filefmt.BlockFormat)) |field| {
+        inline for (block_sizes) |block_size| {
+            const format: filefmt.BlockFormat = @enumFromInt(field.value);
+            const suffix = std.fmt.comptimePrint("{s}/{}", .{ field.name, block_size });
+
+            var blocks = std.ArrayList(u8).init(allocator);
+            defer blocks.deinit();
+
+            var index = std.ArrayList(u32).init(allocator);
+            defer index.deinit();
+
+            var reader = ItemReader{ .items = items };
+            var timer = try std.time.Timer.start();
+            while (true) {
+                const first_hash = if (reader.index < items.len) items[reader.index].hash else 0;
+                const block = try blocks.addManyAsSlice(block_size);
+                if (try filefmt.encodeBlock(format, block, &reader, 1) == 0) {
+                    blocks.shrinkRetainingCapacity(blocks.items.len - block_size);
+                    break;
+                }
+                try index.append(first_hash);
+            }
+            var result = makeResult("encodeBlock/" ++ suffix, items.len, timer.read(), null);
+            result.bytes_per_item = @as(f64, @floatFromInt(blocks.items.len)) / @as(f64, @floatFromInt(@max(1, items.len)));
+            try writeResult(result);
+
+            var block_items = std.ArrayList(Item).init(allocator);
+            defer block_items.deinit();
+
+            var num_items: usize = 0;
+            timer.reset();
+            var pos: usize = 0;
+            while (pos < blocks.items.len) : (pos += block_size) {
+                block_items.clearRetainingCapacity();
+                try filefmt.readBlock(format, blocks.items[pos..][0..block_size], &block_items, 1);
+                num_items += block_items.items.len;
+            }
+            try report("readBlock/" ++ suffix, num_items, timer.read(), null);
+
+            var num_hits: usize = 0;
+            timer.reset();
+            for (lookups) |hash| {
+                var block_no = std.sort.lowerBound(u32, hash, index.items, {}, std.sort.asc(u32));
+                if (block_no > 0) {
+                    block_no -= 1;
+                }
+                while (block_no < index.items.len and index.items[block_no] <= hash) : (block_no += 1) {
+                    const block_data = blocks.items[block_no * block_size ..][0..block_size];
+                    block_items.clearRetainingCapacity();
+                    switch (format) {
+                        .varint => {
+                            try filefmt.readVarintBlock(block_data, &block_items, 1);
+                            const range = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, block_items.items, {}, Item.cmpByHash);
+                            num_hits += range[1] - range[0];
+                        },
+                        .bitpacked => {
+                            try filefmt.searchBitpackedBlock(block_data, hash, &block_items, 1);
+                            num_hits += block_items.items.len;
+                        },
+                    }
+                }
+            }
+            std.mem.doNotOptimizeAway(num_hits);
+            try report("lookupBlock/" ++ suffix, lookups.len, timer.read(), null);
+        }
+    }
+}
+
+const NoNewerVersions = struct {
+    pub fn hasNewerVersion(_: NoNewerVersions, doc_id: u32, version: u64) bool {
+        _ = doc_id;
+        _ = version;
+        return false;
+    }
+};
+
+fn benchSearchResults(allocator: std.mem.Allocator, rand: std.Random) !void {
+    const num_hits = 1_000_000;
+
+    const ids = try allocator.alloc(u32, num_hits);
+    defer allocator.free(ids);
+
+    // a few docs match most of the query, the rest are random collisions
+    for (ids) |*id| {
+        id.* = if (rand.boolean()) rand.uintLessThan(u32, 10) + 1 else rand.uintLessThan(u32, 200_000) + 1;
+    }
+
+    var timer = try std.time.Timer.start();
+
+    var results = SearchResults.init(allocator, .{});
+    defer results.deinit();
+
+    for (ids, 0..) |id, i| {
+        try results.incr(id, i / (num_hits / 4));
+    }
+    try results.finish(NoNewerVersions{});
+
+    try report("SearchResults", num_hits, timer.read(), null);
+}
+
+fn benchSegmentMerger(allocator: std.mem.Allocator, rand: std.Random, num_docs: usize) !void {
+    const List = SegmentList(MemorySegment);
+    const num_segments = 8;
+
+    var collection = try List.init(allocator, num_segments);
+    defer collection.deinit(allocator, .delete);
+
+    var gen = HashGenerator{ .rand = rand };
+    var hashes: [hashes_per_doc]u32 = undefined;
+
+    var changes = std.ArrayList(Change).init(allocator);
+    defer changes.deinit();
+
+    var all_hashes = std.ArrayList(u32).init(allocator);
+    defer all_hashes.deinit();
+
+    const docs_per_segment = @max(1, num_docs / num_segments);
+    var num_items: usize = 0;
+    for (0..num_segments) |i| {
+        changes.clearRetainingCapacity();
+        all_hashes.clearRetainingCapacity();
+        try all_hashes.ensureTotalCapacity(docs_per_segment * hashes_per_doc);
+        for (0..docs_per_segment) |_| {
+            gen.fill(&hashes);
+            all_hashes.appendSliceAssumeCapacity(&hashes);
+        }
+        // each segment updates half of the docs from the previous one
+        for (0..docs_per_segment) |j| {
+            try changes.append(.{ .insert = .{
+                .id = @intCast(i * docs_per_segment / 2 + j + 1),
+                .hashes = all_hashes.items[j * hashes_per_doc ..][0..hashes_per_doc],
+            } });
+        }
+
+        const node = try List.createSegment(allocator, .{});
+        collection.nodes.appendAssumeCapacity(node);
+        node.value.info = .{ .version = i + 1 };
+        try node.value.build(changes.items);
+        num_items += node.value.getSize();
+    }
+
+    var timer = try std.time.Timer.start();
+
+    var merger = try SegmentMerger(MemorySegment).init(allocator, &collection, num_segments);
+    defer merger.deinit();
+
+    for (collection.nodes.items) |node| {
+        merger.addSource(node.value);
+    }
+    try merger.prepare();
+
+    var segment = MemorySegment.init(allocator, .{});
+    defer segment.deinit(.delete);
+
+    try segment.merge(&merger);
+
+    try report("SegmentMerger", num_items, timer.read(), null);
+}
+
+fn benchOplog(allocator: std.mem.Allocator, rand: std.Random, dir: std.fs.Dir) !void {
+    const num_writes = 1000;
+
+    const Receiver = struct {
+        num_transactions: usize = 0,
+
+        fn receive(self: *@This(), txns: []const Transaction) !void {
+            self.num_transactions += txns.len;
+        }
+    };
+
+    {
+        var oplog = try Oplog.init(allocator, dir, .{});
+        defer oplog.deinit();
+
+        var receiver: Receiver = .{};
+        try oplog.open(1, Receiver.receive, &receiver);
+
+        var gen = HashGenerator{ .rand = rand };
+        var hashes: [hashes_per_doc]u32 = undefined;
+
+        const latencies = try allocator.alloc(u64, num_writes);
+        defer allocator.free(latencies);
+
+        var timer = try std.time.Timer.start();
+        for (0..num_writes) |i| {
+            gen.fill(&hashes);
+            const start = timer.read();
+            _ = try oplog.write(&.{.{ .insert = .{ .id = @intCast(i + 1), .hashes = &hashes } }});
+            latencies[i] = timer.read() - start;
+        }
+
+        try report("Oplog.write", num_writes, timer.read(), latencies);
+    }
+
+    var oplog = try Oplog.init(allocator, dir, .{});
+    defer oplog.deinit();
+
+    var receiver: Receiver = .{};
+
+    var timer = try std.time.Timer.start();
+    try oplog.open(1, Receiver.receive, &receiver);
+    std.debug.assert(receiver.num_transactions == num_writes);
+
+    try report("Oplog.replay", num_writes, timer.read(), null);
+}
+
+fn benchIndex(allocator: std.mem.Allocator, rand: std.Random, dir: std.fs.Dir, num_docs: usize, num_queries: usize, threads: usize) !void {
+    var scheduler = Scheduler.init(allocator);
+    defer scheduler.deinit();
+
+    try scheduler.start(threads);
+
+    var index = try Index.init(allocator, &scheduler, dir, "bench", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    const batch_size = 100;
+
+    var gen = HashGenerator{ .rand = rand };
+
+    const all_hashes = try allocator.alloc(u32, batch_size * hashes_per_doc);
+    defer allocator.free(all_hashes);
+
+    var changes = try std.ArrayList(Change).initCapacity(allocator, batch_size);
+    defer changes.deinit();
+
+    // queries are taken from the indexed docs, seed the same generator again to recreate them
+    const seed = rand.int(u64);
+    var prng = std.Random.DefaultPrng.init(seed);
+    gen.rand = prng.random();
+
+    var timer = try std.time.Timer.start();
+    var doc_id: u32 = 0;
+    while (doc_id < num_docs) {
+        changes.clearRetainingCapacity();
+        const n = @min(batch_size, num_docs - doc_id);
+        gen.fill(all_hashes[0 .. n * hashes_per_doc]);
+        for (0..n) |j| {
+            doc_id += 1;
+            changes.appendAssumeCapacity(.{ .insert = .{
+                .id = doc_id,
+                .hashes = all_hashes[j * hashes_per_doc ..][0..hashes_per_doc],
+            } });
+        }
+        try index.update(changes.items);
+    }
+    try report("Index.update", num_docs, timer.read(), null);
+
+    // one query per indexed doc, with part of the hashes replaced by noise
+    const queries = try allocator.alloc([hashes_per_doc]u32, @min(num_queries, num_docs));
+    defer allocator.free(queries);
+
+    prng = std.Random.DefaultPrng.init(seed);
+    gen = .{ .rand = prng.random() };
+    for (queries) |*query| {
+        gen.fill(query);
+        for (query) |*hash| {
+            if (rand.uintLessThan(u32, 100) < 20) {
+                hash.* = rand.int(u32);
+            }
+        }
+    }
+
+    const latencies = try allocator.alloc(u64, num_queries);
+    defer allocator.free(latencies);
+
+    var query_hashes: [hashes_per_doc]u32 = undefined;
+
+    timer.reset();
+    for (latencies, 0..) |*latency, i| {
+        query_hashes = queries[rand.uintLessThan(usize, queries.len)];
+
+        var results = SearchResults.init(allocator, .{});
+        defer results.deinit();
+
+        const start = timer.read();
+        try index.search(&query_hashes, &results, Deadline.init(0));
+        latency.* = timer.read() - start;
+
+        if (i == 0) {
+            log.debug("first query returned {} results", .{results.getResults().len});
+        }
+    }
+    try report("Index.search", num_queries, timer.read(), latencies);
+}
+
+fn isEnabled(filter: []const u8, name: []const u8) bool {
+    return std.mem.indexOf(u8, name, filter) != null;
+}
+
+pub fn main() !void {
+    var gpa: std.heap.GeneralPurposeAllocator(.{}) = .{};
+    defer _ = gpa.deinit();
+
+    const allocator = gpa.allocator();
+
+    var args = try zul.CommandLineArgs.parse(allocator);
+    defer args.deinit();
+
+    const num_docs = try std.fmt.parseInt(usize, args.get("docs") orelse "100000", 10);
+    const num_queries = try std.fmt.parseInt(usize, args.get("queries") orelse "10000", 10);
+    const seed = try std.fmt.parseInt(u64, args.get("seed") orelse "0", 10);
+    const filter = args.get("filter") orelse "";
+
+    var threads = try std.fmt.parseInt(usize, args.get("threads") orelse "0", 10);
+    if (threads == 0) {
+        threads = try std.Thread.getCpuCount();
+    }
+
+    // scratch data goes to a new subdirectory, so that only files created by the benchmarks are deleted
+    var parent_dir = try std.fs.cwd().makeOpenPath(args.get("dir") orelse "/tmp", .{});
+    defer parent_dir.close();
+
+    var dir_name_buf: [64]u8 = undefined;
+    const dir_name = try std.fmt.bufPrint(&dir_name_buf, "fpindex-bench-{x}", .{std.crypto.random.int(u64)});
+    try parent_dir.makeDir(dir_name);
+    var dir = try parent_dir.openDir(dir_name, .{ .iterate = true });
+    defer {
+        dir.close();
+        parent_dir.deleteTree(dir_name) catch {};
+    }
+
+    var prng = std.Random.DefaultPrng.init(seed);
+    const rand = prng.random();
+
+    if (isEnabled(filter, "blocks")) {
+        try benchBlocks(allocator, rand, num_docs, num_queries);
+    }
+    if (isEnabled(filter, "results")) {
+        try benchSearchResults(allocator, rand);
+    }
+    if (isEnabled(filter, "merger")) {
+        try benchSegmentMerger(allocator, rand, num_docs);
+    }
+    if (isEnabled(filter, "oplog")) {
+        try benchOplog(allocator, rand, dir);
+    }
+    if (isEnabled(filter, "index")) {
+        try benchIndex(allocator, rand, dir, num_docs, num_queries, threads);
+    }
+}
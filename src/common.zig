@@ -3,6 +3,7 @@ const testing = std.testing;
 
 const msgpack = @import("msgpack");
 const SegmentInfo = @import("segment.zig").SegmentInfo;
+const Deadline = @import("utils/Deadline.zig");
 
 pub const DocInfo = struct {
     version: u64,
@@ -23,17 +24,79 @@ pub const SearchOptions = struct {
     max_results: u32 = 10,
     min_score: u32 = 1,
     min_score_pct: u32 = 10,
+    // Hashes found in more docs than this in one segment are skipped. Such hashes, e.g. from
+    // silence, match a large part of the index, cost a lot to scan and add mostly noise
+    // to the scores. Zero disables the limit. The limit is per segment, not per index, so
+    // a hash can still be counted from segments where it's below the limit, and results can
+    // change as segments are merged.
+    max_docs_per_hash: u32 = 1000,
+};
+
+/// Time spent in the stages of a single search, in nanoseconds.
+pub const SearchTimings = struct {
+    acquire_reader_ns: u64 = 0,
+    file_segments_ns: u64 = 0,
+    memory_segments_ns: u64 = 0,
+    finish_ns: u64 = 0,
+
+    /// Returns the time since `start` and moves `start` to now.
+    pub fn lap(start: *i128) u64 {
+        const now = std.time.nanoTimestamp();
+        defer start.* = now;
+        return @intCast(@max(0, now - start.*));
+    }
+};
+
+/// What a search did in one segment, collected if the search is profiled.
+pub const SegmentProfile = struct {
+    tier: []const u8,
+    version: u64,
+    merges: u64,
+    blocks: u64,
+    hits: u64,
+    major_faults: u64,
+    duration_ns: u64,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .field_name } };
+    }
 };
 
 pub const SearchResults = struct {
     allocator: std.mem.Allocator,
     options: SearchOptions,
     results: std.ArrayListUnmanaged(SearchResult) = .{},
-    hits: std.AutoHashMapUnmanaged(u32, Hit) = .{},
+    entries: []Entry = &.{},
+    num_entries: usize = 0,
+    versions: std.ArrayListUnmanaged(u64) = .{},
+    timings: SearchTimings = .{},
+    // set if the results came from the search cache, without searching the segments
+    cached: bool = false,
+    // if set, segments are searched one by one and each adds its profile here
+    profile: ?*std.ArrayList(SegmentProfile) = null,
+    scanned_blocks: u64 = 0,
+    scanned_hits: u64 = 0,
+    // major page faults while reading mmaped file segment blocks
+    major_faults: u64 = 0,
 
-    const Hit = packed struct {
-        version: u64,
+    // Hits are stored in a flat linear-probing table. Every segment has a single
+    // version, so instead of storing the version in each hit, we store the index
+    // into the list of versions we have seen.
+    const Entry = packed struct(u64) {
+        id: u32,
+        score: u16, // zero means the slot is empty
+        version_slot: u16,
+    };
+
+    const empty_entry = Entry{ .id = 0, .score = 0, .version_slot = 0 };
+
+    const min_capacity = 256;
+    const max_load_pct = 75;
+
+    pub const Hit = struct {
+        id: u32,
         score: u32,
+        version: u64,
     };
 
     pub fn init(allocator: std.mem.Allocator, options: SearchOptions) SearchResults {
@@ -44,75 +107,613 @@ pub const SearchResults = struct {
     }
 
     pub fn deinit(self: *SearchResults) void {
-        self.hits.deinit(self.allocator);
+        self.allocator.free(self.entries);
+        self.versions.deinit(self.allocator);
         self.results.deinit(self.allocator);
     }
 
+    pub fn count(self: SearchResults) usize {
+        return self.num_entries;
+    }
+
+    /// Makes sure that `additional` new hits can be added without growing the table.
+    pub fn ensureUnusedCapacity(self: *SearchResults, additional: usize) !void {
+        const needed = self.num_entries + additional;
+        if (needed * 100 <= self.entries.len * max_load_pct) {
+            return;
+        }
+        var new_len: usize = @max(self.entries.len, min_capacity);
+        while (needed * 100 > new_len * max_load_pct) {
+            new_len *= 2;
+        }
+
+        const new_entries = try self.allocator.alloc(Entry, new_len);
+        @memset(new_entries, empty_entry);
+        for (self.entries) |entry| {
+            if (entry.score > 0) {
+                new_entries[findSlot(new_entries, entry.id)] = entry;
+            }
+        }
+        self.allocator.free(self.entries);
+        self.entries = new_entries;
+    }
+
+    fn findSlot(entries: []const Entry, id: u32) usize {
+        const mask = entries.len - 1;
+        var h = id *% 0x9E3779B1;
+        h ^= h >> 16;
+        var i = h & mask;
+        while (true) : (i = (i + 1) & mask) {
+            const entry = entries[i];
+            if (entry.score == 0 or entry.id == id) {
+                return i;
+            }
+        }
+    }
+
+    fn getVersionSlot(self: *SearchResults, version: u64) !u16 {
+        const versions = self.versions.items;
+        // hits usually come in long runs from the same segment
+        if (versions.len > 0 and versions[versions.len - 1] == version) {
+            return @intCast(versions.len - 1);
+        }
+        for (versions, 0..) |v, i| {
+            if (v == version) {
+                return @intCast(i);
+            }
+        }
+        if (versions.len > std.math.maxInt(u16)) {
+            return error.TooManyVersions;
+        }
+        try self.versions.append(self.allocator, version);
+        return @intCast(versions.len);
+    }
+
+    fn upsert(self: *SearchResults, id: u32, score: u16, version_slot: u16) void {
+        const entry = &self.entries[findSlot(self.entries, id)];
+        if (entry.score == 0) {
+            entry.* = .{ .id = id, .score = score, .version_slot = version_slot };
+            self.num_entries += 1;
+        } else if (entry.version_slot == version_slot) {
+            entry.score +|= score;
+        } else if (self.versions.items[entry.version_slot] < self.versions.items[version_slot]) {
+            entry.score = score;
+            entry.version_slot = version_slot;
+        }
+    }
+
+    /// Called by segments before reporting hits for `sorted_hashes[hash_index]`.
+    /// A single query doesn't care which hash a hit came from.
+    pub fn startHash(self: *SearchResults, hash_index: usize) void {
+        _ = self;
+        _ = hash_index;
+    }
+
+    /// Returns the maximum number of docs for the current hash, zero if unlimited.
+    pub fn getMaxDocsPerHash(self: SearchResults) u32 {
+        return self.options.max_docs_per_hash;
+    }
+
+    /// Called by segments after each hash, with the number of decoded blocks and matching docs.
+    pub fn countScanned(self: *SearchResults, num_blocks: u64, num_hits: u64) void {
+        self.scanned_blocks += num_blocks;
+        self.scanned_hits += num_hits;
+    }
+
     pub fn incr(self: *SearchResults, id: u32, version: u64) !void {
-        const r = try self.hits.getOrPut(self.allocator, id);
-        if (!r.found_existing or r.value_ptr.version < version) {
-            r.value_ptr.score = 1;
-            r.value_ptr.version = version;
-        } else if (r.value_ptr.version == version) {
-            r.value_ptr.score += 1;
+        try self.ensureUnusedCapacity(1);
+        const version_slot = try self.getVersionSlot(version);
+        self.upsert(id, 1, version_slot);
+    }
+
+    /// Merges hits collected by another instance, e.g. a partial result from
+    /// a segment searched on a different thread. Versions are resolved the
+    /// same way as in `incr`, so the order of merging does not matter.
+    pub fn merge(self: *SearchResults, other: *const SearchResults) !void {
+        try self.ensureUnusedCapacity(other.num_entries);
+
+        const slot_map = try self.allocator.alloc(u16, other.versions.items.len);
+        defer self.allocator.free(slot_map);
+        for (other.versions.items, slot_map) |version, *slot| {
+            slot.* = try self.getVersionSlot(version);
         }
+
+        for (other.entries) |entry| {
+            if (entry.score > 0) {
+                self.upsert(entry.id, entry.score, slot_map[entry.version_slot]);
+            }
+        }
+
+        self.countScanned(other.scanned_blocks, other.scanned_hits);
+        self.major_faults += other.major_faults;
+    }
+
+    /// Returns empty results with the same options, e.g. to collect the hits of one shard.
+    pub fn initPartial(self: *const SearchResults, allocator: std.mem.Allocator) !SearchResults {
+        var result = SearchResults.init(allocator, self.options);
+        result.profile = self.profile;
+        return result;
+    }
+
+    /// Merges hits collected from one shard of a sharded index. Versions of different
+    /// shards can't be compared, so each doc is checked for a newer version in its own
+    /// shard and the rest are added with the same version, so that scores from all
+    /// shards add up.
+    pub fn mergeShard(self: *SearchResults, other: *const SearchResults, shard: anytype) !void {
+        try self.ensureUnusedCapacity(other.num_entries);
+        const version_slot = try self.getVersionSlot(0);
+
+        for (other.entries) |entry| {
+            if (entry.score > 0 and !shard.hasNewerVersion(entry.id, other.versions.items[entry.version_slot])) {
+                self.upsert(entry.id, entry.score, version_slot);
+            }
+        }
+
+        self.countScanned(other.scanned_blocks, other.scanned_hits);
+        self.major_faults += other.major_faults;
+        self.timings.file_segments_ns += other.timings.file_segments_ns;
+        self.timings.memory_segments_ns += other.timings.memory_segments_ns;
     }
 
-    pub fn get(self: SearchResults, id: u32) ?SearchResult {
-        const hit = self.hits.get(id) orelse return null;
+    pub fn get(self: SearchResults, id: u32) ?Hit {
+        if (self.entries.len == 0) {
+            return null;
+        }
+        const entry = self.entries[findSlot(self.entries, id)];
+        if (entry.score == 0) {
+            return null;
+        }
         return .{
             .id = id,
-            .score = hit.score,
-            .version = hit.version,
+            .score = entry.score,
+            .version = self.versions.items[entry.version_slot],
         };
     }
 
-    pub fn finish(self: *SearchResults, collection: anytype) !void {
-        var ids = try std.ArrayListUnmanaged(u32).initCapacity(self.allocator, self.hits.count());
-        defer ids.deinit(self.allocator);
+    // Sorting by the key orders hits by score descending, then by id ascending.
+    fn sortKey(entry: Entry) u64 {
+        return (@as(u64, entry.score) << 48) | (@as(u64, ~entry.id) << 16) | entry.version_slot;
+    }
 
+    pub fn finish(self: *SearchResults, collection: anytype) !void {
         var min_score = self.options.min_score;
 
-        var iter = self.hits.iterator();
-        while (iter.next()) |entry| {
-            if (entry.value_ptr.*.score >= min_score) {
-                ids.appendAssumeCapacity(entry.key_ptr.*);
+        var candidates = try std.ArrayListUnmanaged(u64).initCapacity(self.allocator, self.num_entries);
+        defer candidates.deinit(self.allocator);
+
+        for (self.entries) |entry| {
+            if (entry.score > 0 and entry.score >= min_score) {
+                candidates.appendAssumeCapacity(sortKey(entry));
             }
         }
 
-        std.sort.pdq(u32, ids.items, self, compareResults);
-
         self.results.clearRetainingCapacity();
         try self.results.ensureTotalCapacity(self.allocator, self.options.max_results);
 
-        for (ids.items) |id| {
-            if (self.results.items.len == self.options.max_results) {
-                break;
+        // We only need the top hits, but some of them can be skipped because
+        // of newer versions, so we select and sort them in growing batches.
+        var remaining = candidates.items;
+        var batch_size = @as(usize, @max(self.options.max_results, 1)) * 2;
+        outer: while (remaining.len > 0 and self.results.items.len < self.options.max_results) {
+            const n = @min(batch_size, remaining.len);
+            selectTop(remaining, n);
+            const batch = remaining[0..n];
+            std.sort.pdq(u64, batch, {}, std.sort.desc(u64));
+
+            for (batch) |key| {
+                if (self.results.items.len == self.options.max_results) {
+                    break :outer;
+                }
+                const id = ~@as(u32, @truncate(key >> 16));
+                const score: u32 = @intCast(key >> 48);
+                const version = self.versions.items[@as(u16, @truncate(key))];
+                if (collection.hasNewerVersion(id, version)) {
+                    continue;
+                }
+                if (score < min_score) {
+                    break :outer;
+                }
+                if (self.results.items.len == 0) {
+                    min_score = @max(min_score, score * self.options.min_score_pct / 100);
+                }
+                self.results.appendAssumeCapacity(.{
+                    .id = id,
+                    .score = score,
+                });
             }
-            const hit = self.hits.get(id) orelse unreachable;
-            if (collection.hasNewerVersion(id, hit.version)) {
-                continue;
+
+            remaining = remaining[n..];
+            batch_size *= 2;
+        }
+    }
+
+    /// Replaces the final results, e.g. with ones computed by an earlier identical search.
+    pub fn setResults(self: *SearchResults, results: []const SearchResult) !void {
+        self.results.clearRetainingCapacity();
+        try self.results.appendSlice(self.allocator, results);
+    }
+
+    pub fn getResults(self: *SearchResults) []SearchResult {
+        return self.results.items;
+    }
+};
+
+/// Collects hits for multiple queries in one pass over the segments. The
+/// segments are searched for the sorted union of all query hashes and each
+/// hit is dispatched to the queries that contain the current hash.
+pub const MultiSearchResults = struct {
+    allocator: std.mem.Allocator,
+    queries: []Query,
+    hashes: []u32 = &.{},
+    // queries for hashes[i] are hash_queries[hash_offsets[i]..hash_offsets[i + 1]]
+    hash_offsets: []u32 = &.{},
+    hash_queries: []u32 = &.{},
+    current: []const u32 = &.{},
+    // partial results borrow the hash index of the results they were created from
+    owns_hashes: bool = true,
+
+    // how often (in hashes) to check deadlines of individual queries
+    const deadline_check_interval = 32;
+
+    pub const Query = struct {
+        hashes: []const u32,
+        results: SearchResults,
+        deadline: Deadline,
+        timed_out: bool = false,
+    };
+
+    pub const QueryInput = struct {
+        hashes: []const u32,
+        options: SearchOptions = .{},
+        deadline: Deadline = .{},
+    };
+
+    pub fn init(allocator: std.mem.Allocator, inputs: []const QueryInput) !MultiSearchResults {
+        const queries = try allocator.alloc(Query, inputs.len);
+
+        var num_pairs: usize = 0;
+        for (inputs, queries) |input, *query| {
+            query.* = .{
+                .hashes = input.hashes,
+                .results = SearchResults.init(allocator, input.options),
+                .deadline = input.deadline,
+            };
+            num_pairs += input.hashes.len;
+        }
+
+        var self = MultiSearchResults{ .allocator = allocator, .queries = queries };
+        errdefer self.deinit();
+
+        const HashQuery = struct {
+            hash: u32,
+            query: u32,
+
+            fn cmp(_: void, a: @This(), b: @This()) bool {
+                return a.hash < b.hash or (a.hash == b.hash and a.query < b.query);
             }
-            if (hit.score < min_score) {
-                break;
+        };
+
+        const pairs = try allocator.alloc(HashQuery, num_pairs);
+        defer allocator.free(pairs);
+
+        var i: usize = 0;
+        for (inputs, 0..) |input, query| {
+            for (input.hashes) |hash| {
+                pairs[i] = .{ .hash = hash, .query = @intCast(query) };
+                i += 1;
+            }
+        }
+        std.sort.pdq(HashQuery, pairs, {}, HashQuery.cmp);
+
+        var num_hashes: usize = 0;
+        for (pairs, 0..) |pair, j| {
+            if (j == 0 or pairs[j - 1].hash != pair.hash) {
+                num_hashes += 1;
             }
-            if (self.results.items.len == 0) {
-                min_score = @max(min_score, hit.score * self.options.min_score_pct / 100);
+        }
+
+        self.hashes = try allocator.alloc(u32, num_hashes);
+        self.hash_offsets = try allocator.alloc(u32, num_hashes + 1);
+        self.hash_queries = try allocator.alloc(u32, num_pairs);
+
+        var k: usize = 0;
+        for (pairs, 0..) |pair, j| {
+            if (j == 0 or pairs[j - 1].hash != pair.hash) {
+                self.hashes[k] = pair.hash;
+                self.hash_offsets[k] = @intCast(j);
+                k += 1;
             }
-            self.results.appendAssumeCapacity(.{
-                .id = id,
-                .score = hit.score,
-            });
+            self.hash_queries[j] = pair.query;
         }
+        self.hash_offsets[num_hashes] = @intCast(num_pairs);
+
+        return self;
     }
 
-    pub fn compareResults(self: *SearchResults, a: u32, b: u32) bool {
-        const a_hit = self.hits.get(a) orelse unreachable;
-        const b_hit = self.hits.get(b) orelse unreachable;
-        return a_hit.score > b_hit.score or (a_hit.score == b_hit.score and a < b);
+    pub fn deinit(self: *MultiSearchResults) void {
+        for (self.queries) |*query| {
+            query.results.deinit();
+        }
+        self.allocator.free(self.queries);
+        if (self.owns_hashes) {
+            self.allocator.free(self.hashes);
+            self.allocator.free(self.hash_offsets);
+            self.allocator.free(self.hash_queries);
+        }
     }
 
-    pub fn getResults(self: *SearchResults) []SearchResult {
-        return self.results.items;
+    /// Returns empty results for the same queries, sharing the hash index, e.g. to collect the hits of one shard.
+    pub fn initPartial(self: *const MultiSearchResults, allocator: std.mem.Allocator) !MultiSearchResults {
+        const queries = try allocator.alloc(Query, self.queries.len);
+        for (self.queries, queries) |query, *partial| {
+            partial.* = .{
+                .hashes = query.hashes,
+                .results = try query.results.initPartial(allocator),
+                .deadline = query.deadline,
+                .timed_out = query.timed_out,
+            };
+        }
+        return .{
+            .allocator = allocator,
+            .queries = queries,
+            .hashes = self.hashes,
+            .hash_offsets = self.hash_offsets,
+            .hash_queries = self.hash_queries,
+            .owns_hashes = false,
+        };
+    }
+
+    /// Merges hits collected from one shard of a sharded index, see `SearchResults.mergeShard`.
+    pub fn mergeShard(self: *MultiSearchResults, other: *const MultiSearchResults, shard: anytype) !void {
+        for (self.queries, other.queries) |*query, *partial| {
+            if (partial.timed_out) {
+                query.timed_out = true;
+            }
+            if (!query.timed_out) {
+                try query.results.mergeShard(&partial.results, shard);
+            }
+        }
+    }
+
+    pub fn startHash(self: *MultiSearchResults, hash_index: usize) void {
+        if (hash_index % deadline_check_interval == 0) {
+            self.checkDeadlines();
+        }
+        self.current = self.hash_queries[self.hash_offsets[hash_index]..self.hash_offsets[hash_index + 1]];
+    }
+
+    /// Returns the highest limit of the queries that contain the current hash, zero if unlimited.
+    /// Queries with lower limits still get the hits, the segment scan is shared.
+    pub fn getMaxDocsPerHash(self: MultiSearchResults) u32 {
+        var result: u32 = 0;
+        for (self.current, 0..) |i, j| {
+            const limit = self.queries[i].results.getMaxDocsPerHash();
+            if (limit == 0) {
+                return 0;
+            }
+            result = if (j == 0) limit else @max(result, limit);
+        }
+        return result;
+    }
+
+    pub fn countScanned(self: *MultiSearchResults, num_blocks: u64, num_hits: u64) void {
+        _ = self;
+        _ = num_blocks;
+        _ = num_hits;
+    }
+
+    pub fn incr(self: *MultiSearchResults, id: u32, version: u64) !void {
+        for (self.current) |i| {
+            const query = &self.queries[i];
+            if (!query.timed_out) {
+                try query.results.incr(id, version);
+            }
+        }
+    }
+
+    fn checkDeadlines(self: *MultiSearchResults) void {
+        for (self.queries) |*query| {
+            if (!query.timed_out and query.deadline.isExpired()) {
+                query.timed_out = true;
+            }
+        }
+    }
+
+    /// Marks all queries as timed out, used when the shared search deadline expires.
+    pub fn expireAll(self: *MultiSearchResults) void {
+        for (self.queries) |*query| {
+            query.timed_out = true;
+        }
+    }
+
+    pub fn finish(self: *MultiSearchResults, collection: anytype) !void {
+        self.checkDeadlines();
+        for (self.queries) |*query| {
+            if (!query.timed_out) {
+                try query.results.finish(collection);
+            }
+        }
     }
 };
+
+/// Reorders `items` so that the `k` largest values are at the beginning, in no particular order.
+fn selectTop(items: []u64, k: usize) void {
+    if (k >= items.len) {
+        return;
+    }
+    var lo: usize = 0;
+    var hi: usize = items.len;
+    while (hi - lo > 1) {
+        const pivot = items[lo + (hi - lo) / 2];
+        // [lo, lt) > pivot, [lt, gt) == pivot, [gt, hi) < pivot
+        var lt = lo;
+        var gt = hi;
+        var i = lo;
+        while (i < gt) {
+            if (items[i] > pivot) {
+                std.mem.swap(u64, &items[lt], &items[i]);
+                lt += 1;
+                i += 1;
+            } else if (items[i] < pivot) {
+                gt -= 1;
+                std.mem.swap(u64, &items[i], &items[gt]);
+            } else {
+                i += 1;
+            }
+        }
+        if (k < lt) {
+            hi = lt;
+        } else if (k <= gt) {
+            return;
+        } else {
+            lo = gt;
+        }
+    }
+}
+
+test "selectTop" {
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    var items: [1000]u64 = undefined;
+    for (&items) |*item| {
+        item.* = rand.int(u64) % 500;
+    }
+    var sorted = items;
+    std.sort.pdq(u64, &sorted, {}, std.sort.desc(u64));
+
+    for ([_]usize{ 0, 1, 10, 500, 999, 1000 }) |k| {
+        selectTop(&items, k);
+        std.sort.pdq(u64, items[0..k], {}, std.sort.desc(u64));
+        try testing.expectEqualSlices(u64, sorted[0..k], items[0..k]);
+    }
+}
+
+test "SearchResults.merge" {
+    var results1 = SearchResults.init(testing.allocator, .{});
+    defer results1.deinit();
+
+    var results2 = SearchResults.init(testing.allocator, .{});
+    defer results2.deinit();
+
+    try results1.incr(1, 1);
+    try results1.incr(2, 1);
+    try results1.incr(3, 2);
+
+    try results2.incr(1, 1);
+    try results2.incr(2, 2);
+    try results2.incr(3, 1);
+    try results2.incr(4, 1);
+
+    try results1.merge(&results2);
+
+    try testing.expectEqual(4, results1.count());
+    try testing.expectEqual(2, results1.get(1).?.score);
+    try testing.expectEqual(2, results1.get(2).?.version);
+    try testing.expectEqual(1, results1.get(2).?.score);
+    try testing.expectEqual(2, results1.get(3).?.version);
+    try testing.expectEqual(1, results1.get(3).?.score);
+    try testing.expectEqual(1, results1.get(4).?.score);
+}
+
+test "SearchResults.mergeShard" {
+    const Shard = struct {
+        pub fn hasNewerVersion(_: @This(), id: u32, version: u64) bool {
+            return id == 2 and version < 10;
+        }
+    };
+
+    var results = SearchResults.init(testing.allocator, .{});
+    defer results.deinit();
+
+    var shard1 = try results.initPartial(testing.allocator);
+    defer shard1.deinit();
+
+    var shard2 = try results.initPartial(testing.allocator);
+    defer shard2.deinit();
+
+    try shard1.incr(1, 5);
+    try shard1.incr(2, 5);
+    try shard1.incr(2, 5);
+
+    // versions of different shards are not compared
+    try shard2.incr(1, 1);
+    try shard2.incr(2, 20);
+    try shard2.incr(3, 1);
+    shard2.countScanned(1, 3);
+
+    try results.mergeShard(&shard1, Shard{});
+    try results.mergeShard(&shard2, Shard{});
+
+    try testing.expectEqual(3, results.count());
+    try testing.expectEqual(2, results.get(1).?.score);
+    try testing.expectEqual(1, results.get(2).?.score);
+    try testing.expectEqual(1, results.get(3).?.score);
+    try testing.expectEqual(3, results.scanned_hits);
+}
+
+test "SearchResults.finish" {
+    const Collection = struct {
+        pub fn hasNewerVersion(_: @This(), id: u32, version: u64) bool {
+            return id == 2 and version < 10;
+        }
+    };
+
+    var results = SearchResults.init(testing.allocator, .{ .max_results = 3 });
+    defer results.deinit();
+
+    for (0..1000) |i| {
+        const id: u32 = @intCast(i + 1);
+        // ids 1..10 get scores 10..1, the rest gets score 1
+        for (0..@max(1, 11 -| id)) |_| {
+            try results.incr(id, 1);
+        }
+    }
+    try testing.expectEqual(1000, results.count());
+
+    try results.finish(Collection{});
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 1, .score = 10 },
+        .{ .id = 3, .score = 8 },
+        .{ .id = 4, .score = 7 },
+    }, results.getResults());
+}
+
+test "MultiSearchResults" {
+    const Collection = struct {
+        pub fn hasNewerVersion(_: @This(), _: u32, _: u64) bool {
+            return false;
+        }
+    };
+
+    var results = try MultiSearchResults.init(testing.allocator, &.{
+        .{ .hashes = &.{ 3, 1, 2 } },
+        .{ .hashes = &.{ 2, 4 } },
+        .{ .hashes = &.{} },
+    });
+    defer results.deinit();
+
+    try testing.expectEqualSlices(u32, &.{ 1, 2, 3, 4 }, results.hashes);
+
+    // doc 1 has hashes 1, 2, 3; doc 2 has hashes 2, 4
+    const postings = [_][]const u32{ &.{1}, &.{ 1, 2 }, &.{1}, &.{2} };
+    for (postings, 0..) |ids, i| {
+        results.startHash(i);
+        for (ids) |id| {
+            try results.incr(id, 1);
+        }
+    }
+
+    try results.finish(Collection{});
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 1, .score = 3 },
+        .{ .id = 2, .score = 1 },
+    }, results.queries[0].results.getResults());
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 2, .score = 2 },
+        .{ .id = 1, .score = 1 },
+    }, results.queries[1].results.getResults());
+    try testing.expectEqualSlices(SearchResult, &.{}, results.queries[2].results.getResults());
+}
@@ -1,4 +1,5 @@
 const std = @import("std");
+const builtin = @import("builtin");
 const testing = std.testing;
 const assert = std.debug.assert;
 const math = std.math;
@@ -12,6 +13,9 @@ const Item = @import("segment.zig").Item;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
 const MemorySegment = @import("MemorySegment.zig");
 const FileSegment = @import("FileSegment.zig");
+const DocTable = @import("DocTable.zig");
+const BloomFilter = @import("utils/BloomFilter.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
 
 pub const default_block_size = 1024;
 pub const min_block_size = 256;
@@ -93,17 +97,67 @@ pub const max_file_name_size = 64;
 const segment_file_name_fmt = "{x:0>16}-{x:0>8}.data";
 pub const manifest_file_name = "manifest";
 
+// new manifests of a change that covers all shards, renamed to `manifest` once all are written
+pub const pending_manifest_file_name = "manifest.pending";
+// written to the index directory when the pending manifests of all shards are complete
+pub const manifest_commit_file_name = "manifest.commit";
+
 pub fn buildSegmentFileName(buf: []u8, info: SegmentInfo) []u8 {
     assert(buf.len == max_file_name_size);
     return std.fmt.bufPrint(buf, segment_file_name_fmt, .{ info.version, info.merges }) catch unreachable;
 }
 
+pub const BlockFormat = enum(u8) {
+    // (hash-delta, docid-delta) pairs, each encoded as varint
+    varint = 1,
+    // separate hash-delta and docid-delta columns, bit-packed with a fixed width per block
+    bitpacked = 2,
+};
+
+pub const default_block_format: BlockFormat = .bitpacked;
+
+/// How the items of a segment file are split into blocks.
+pub const BlockLayout = struct {
+    block_size: usize = default_block_size,
+    block_format: BlockFormat = default_block_format,
+
+    /// Block sizes must be powers of two, so that blocks never cross the write chunks.
+    pub fn validate(self: BlockLayout) !void {
+        if (self.block_size < min_block_size or self.block_size > max_block_size or !std.math.isPowerOfTwo(self.block_size)) {
+            return error.InvalidBlockSize;
+        }
+    }
+};
+
+const max_items_per_block = maxItemsPerBlock(max_block_size);
+
 const BlockHeader = struct {
     num_items: u16,
     first_item: Item,
 };
 
-pub fn decodeBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
+pub fn decodeBlockHeader(format: BlockFormat, data: []const u8, min_doc_id: u32) !BlockHeader {
+    return switch (format) {
+        .varint => decodeVarintBlockHeader(data, min_doc_id),
+        .bitpacked => decodeBitpackedBlockHeader(data, min_doc_id),
+    };
+}
+
+pub fn readBlock(format: BlockFormat, data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+    return switch (format) {
+        .varint => readVarintBlock(data, items, min_doc_id),
+        .bitpacked => readBitpackedBlock(data, items, min_doc_id),
+    };
+}
+
+pub fn encodeBlock(format: BlockFormat, data: []u8, reader: anytype, min_doc_id: u32) !u16 {
+    return switch (format) {
+        .varint => encodeVarintBlock(data, reader, min_doc_id),
+        .bitpacked => encodeBitpackedBlock(data, reader, min_doc_id),
+    };
+}
+
+pub fn decodeVarintBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
     assert(data.len >= min_block_size);
 
     const num_items = std.mem.readInt(u16, data[0..2], .little);
@@ -123,7 +177,7 @@ pub fn decodeBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
     };
 }
 
-pub fn readBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+pub fn readVarintBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
     var ptr: usize = 0;
 
     if (data.len < 2) {
@@ -161,7 +215,7 @@ pub fn readBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32)
     }
 }
 
-pub fn encodeBlock(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
+pub fn encodeVarintBlock(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
     assert(data.len >= 2);
 
     var ptr: usize = 2;
@@ -210,40 +264,459 @@ test "writeBlock/readBlock/readFirstItemFromBlock" {
     const block_size = 1024;
     var block_data: [block_size]u8 = undefined;
 
+    inline for (std.meta.fields(BlockFormat)) |field| {
+        const format: BlockFormat = @enumFromInt(field.value);
+
+        var reader = segment.reader();
+        const num_items = try encodeBlock(format, block_data[0..], &reader, 0);
+        try testing.expectEqual(segment.items.items.len, num_items);
+
+        var items = std.ArrayList(Item).init(std.testing.allocator);
+        defer items.deinit();
+
+        try readBlock(format, block_data[0..], &items, 0);
+        try testing.expectEqualSlices(
+            Item,
+            &[_]Item{
+                .{ .hash = 1, .id = 1 },
+                .{ .hash = 2, .id = 1 },
+                .{ .hash = 3, .id = 1 },
+                .{ .hash = 3, .id = 2 },
+                .{ .hash = 4, .id = 1 },
+            },
+            items.items,
+        );
+
+        const header = try decodeBlockHeader(format, block_data[0..], 0);
+        try testing.expectEqual(items.items.len, header.num_items);
+        try testing.expectEqual(items.items[0], header.first_item);
+    }
+}
+
+// Bit-packed block layout:
+//
+//   u16  number of items
+//   u8   bit width of hash deltas
+//   u8   bit width of docid deltas
+//   u32  skip table, absolute hash of every 16th item
+//   ...  hash deltas, bit-packed, padded to a multiple of 8 values
+//   ...  docid deltas, bit-packed, padded to a multiple of 8 values
+//   ...  zero padding, at least 8 bytes
+//
+// Items are split into groups of 16, each group can be decoded independently.
+// Hash deltas are relative to the previous item, the first one in each group
+// is always zero and the hash is taken from the skip table instead. Docid
+// deltas are relative to the previous item if the hash did not change,
+// otherwise (and at the start of each group) relative to the segment's
+// min_doc_id.
+//
+// A group of 8 values with bit width N takes exactly N bytes, so the decoder
+// can unpack 8 values at a time using fixed per-lane offsets and shifts. The
+// trailing padding guarantees all 8-byte loads stay within the block.
+
+const bitpacked_header_size = 4;
+const bitpacked_lanes = 8;
+const bitpacked_padding = 8;
+const bitpacked_group_size = 16;
+
+const BitpackedWords = @Vector(bitpacked_lanes, u64);
+const BitpackedShifts = @Vector(bitpacked_lanes, u6);
+const BitpackedValues = @Vector(bitpacked_lanes, u32);
+
+fn bitWidth(value: u32) u8 {
+    return 32 - @as(u8, @clz(value));
+}
+
+test "check bitWidth" {
+    try testing.expectEqual(0, bitWidth(0));
+    try testing.expectEqual(1, bitWidth(1));
+    try testing.expectEqual(2, bitWidth(2));
+    try testing.expectEqual(8, bitWidth(255));
+    try testing.expectEqual(9, bitWidth(256));
+    try testing.expectEqual(32, bitWidth(math.maxInt(u32)));
+}
+
+fn bitpackedNumGroups(num_items: usize) usize {
+    return std.math.divCeil(usize, num_items, bitpacked_group_size) catch unreachable;
+}
+
+fn bitpackedColumnSize(num_items: usize, bits: u8) usize {
+    return std.mem.alignForward(usize, num_items, bitpacked_lanes) * bits / 8;
+}
+
+fn bitpackedBlockSize(num_items: usize, hash_bits: u8, doc_bits: u8) usize {
+    return bitpacked_header_size + 4 * bitpackedNumGroups(num_items) + bitpackedColumnSize(num_items, hash_bits) + bitpackedColumnSize(num_items, doc_bits) + bitpacked_padding;
+}
+
+const BitpackedBlock = struct {
+    data: []const u8,
+    num_items: usize,
+    num_groups: usize,
+    hash_bits: u8,
+    doc_bits: u8,
+    hashes_ptr: usize,
+    docs_ptr: usize,
+
+    fn parse(data: []const u8) !BitpackedBlock {
+        if (data.len < bitpacked_header_size) {
+            return error.InvalidBlock;
+        }
+        const num_items = std.mem.readInt(u16, data[0..2], .little);
+        const hash_bits = data[2];
+        const doc_bits = data[3];
+        if (num_items > max_items_per_block or hash_bits > 32 or doc_bits > 32) {
+            return error.InvalidBlock;
+        }
+        if (num_items > 0 and bitpackedBlockSize(num_items, hash_bits, doc_bits) > data.len) {
+            return error.InvalidBlock;
+        }
+        const num_groups = bitpackedNumGroups(num_items);
+        const hashes_ptr = bitpacked_header_size + 4 * num_groups;
+        return .{
+            .data = data,
+            .num_items = num_items,
+            .num_groups = num_groups,
+            .hash_bits = hash_bits,
+            .doc_bits = doc_bits,
+            .hashes_ptr = hashes_ptr,
+            .docs_ptr = hashes_ptr + bitpackedColumnSize(num_items, hash_bits),
+        };
+    }
+
+    fn groupHash(self: BitpackedBlock, group: usize) u32 {
+        return std.mem.readInt(u32, self.data[bitpacked_header_size + group * 4 ..][0..4], .little);
+    }
+
+    // Returns the first group that can contain the given hash.
+    fn findGroup(self: BitpackedBlock, hash: u32) usize {
+        var low: usize = 0;
+        var high: usize = self.num_groups;
+        while (low < high) {
+            const mid = low + (high - low) / 2;
+            if (self.groupHash(mid) < hash) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        // The previous group can end with the hash we are looking for.
+        return if (low > 0) low - 1 else 0;
+    }
+
+    fn decodeGroup(self: BitpackedBlock, group: usize, min_doc_id: u32, items: []Item) []Item {
+        const start = group * bitpacked_group_size;
+        const count = @min(bitpacked_group_size, self.num_items - start);
+        const num_values = std.mem.alignForward(usize, count, bitpacked_lanes);
+
+        var hash_deltas: [bitpacked_group_size]u32 = undefined;
+        var doc_deltas: [bitpacked_group_size]u32 = undefined;
+
+        // Each group of 16 values takes exactly 2 * bits bytes.
+        unpackBits(self.data[self.hashes_ptr + group * 2 * self.hash_bits ..], self.hash_bits, hash_deltas[0..num_values]);
+        unpackBits(self.data[self.docs_ptr + group * 2 * self.doc_bits ..], self.doc_bits, doc_deltas[0..num_values]);
+
+        var hash = self.groupHash(group);
+        var doc_id: u32 = 0;
+        for (hash_deltas[0..count], doc_deltas[0..count], 0..) |diff_hash, diff_doc_id, i| {
+            hash +%= diff_hash;
+            doc_id = if (i == 0 or diff_hash > 0) min_doc_id +% diff_doc_id else doc_id +% diff_doc_id;
+            items[i] = .{ .hash = hash, .id = doc_id };
+        }
+        return items[0..count];
+    }
+};
+
+fn packBits(dest: []u8, values: []const u32, bits: u8) void {
+    if (bits == 0) {
+        return;
+    }
+    for (values, 0..) |value, i| {
+        const bit = i * bits;
+        const ptr = dest[bit / 8 ..][0..8];
+        const word = std.mem.readInt(u64, ptr, .little) | (@as(u64, value) << @as(u6, @intCast(bit % 8)));
+        std.mem.writeInt(u64, ptr, word, .little);
+    }
+}
+
+fn unpackBits(src: []const u8, bits: u8, values: []u32) void {
+    assert(values.len % bitpacked_lanes == 0);
+
+    if (bits == 0) {
+        @memset(values, 0);
+        return;
+    }
+
+    var offsets: [bitpacked_lanes]usize = undefined;
+    var shifts: [bitpacked_lanes]u6 = undefined;
+    for (0..bitpacked_lanes) |j| {
+        offsets[j] = j * bits / 8;
+        shifts[j] = @intCast(j * bits % 8);
+    }
+    const shift_vec: BitpackedShifts = shifts;
+    const mask_vec: BitpackedWords = @splat((@as(u64, 1) << @as(u6, @intCast(bits))) - 1);
+
+    var ptr: usize = 0;
+    var i: usize = 0;
+    while (i < values.len) : (i += bitpacked_lanes) {
+        var words: [bitpacked_lanes]u64 = undefined;
+        inline for (0..bitpacked_lanes) |j| {
+            words[j] = std.mem.readInt(u64, src[ptr + offsets[j] ..][0..8], .little);
+        }
+        const word_vec: BitpackedWords = words;
+        const value_vec: BitpackedValues = @truncate((word_vec >> shift_vec) & mask_vec);
+        values[i..][0..bitpacked_lanes].* = value_vec;
+        ptr += bits;
+    }
+}
+
+fn readPackedValue(src: []const u8, bits: u8, index: usize) u32 {
+    if (bits == 0) {
+        return 0;
+    }
+    const bit = index * bits;
+    const word = std.mem.readInt(u64, src[bit / 8 ..][0..8], .little);
+    const mask = (@as(u64, 1) << @as(u6, @intCast(bits))) - 1;
+    return @truncate((word >> @as(u6, @intCast(bit % 8))) & mask);
+}
+
+test "packBits/unpackBits" {
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    var values: [100]u32 = undefined;
+    var unpacked: [104]u32 = undefined;
+    var buf: [4 * 104 + bitpacked_padding]u8 = undefined;
+
+    for (0..33) |b| {
+        const bits: u8 = @intCast(b);
+        for (&values) |*v| {
+            v.* = if (bits == 0) 0 else @truncate(rand.int(u64) & ((@as(u64, 1) << @as(u6, @intCast(bits))) - 1));
+        }
+        @memset(&buf, 0);
+        packBits(&buf, &values, bits);
+        unpackBits(&buf, bits, &unpacked);
+        try testing.expectEqualSlices(u32, &values, unpacked[0..values.len]);
+        for (values, 0..) |v, i| {
+            try testing.expectEqual(v, readPackedValue(&buf, bits, i));
+        }
+    }
+}
+
+pub fn decodeBitpackedBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
+    assert(data.len >= min_block_size);
+
+    const block = try BitpackedBlock.parse(data);
+    if (block.num_items == 0) {
+        return .{ .num_items = 0, .first_item = .{ .hash = 0, .id = 0 } };
+    }
+
+    const hash = block.groupHash(0);
+    const id = readPackedValue(data[block.docs_ptr..], block.doc_bits, 0);
+
+    return .{
+        .num_items = @intCast(block.num_items),
+        .first_item = Item{ .hash = hash, .id = id +% min_doc_id },
+    };
+}
+
+pub fn readBitpackedBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+    const block = try BitpackedBlock.parse(data);
+    if (block.num_items == 0) {
+        return;
+    }
+
+    try items.ensureUnusedCapacity(block.num_items);
+
+    for (0..block.num_groups) |group| {
+        const dest = items.unusedCapacitySlice();
+        items.items.len += block.decodeGroup(group, min_doc_id, dest).len;
+    }
+}
+
+// Appends all items with the given hash to `items`. Only the groups that can
+// contain the hash are decoded, the skip table is used to find the first one.
+pub fn searchBitpackedBlock(data: []const u8, hash: u32, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+    const block = try BitpackedBlock.parse(data);
+    if (block.num_items == 0) {
+        return;
+    }
+
+    var group_items: [bitpacked_group_size]Item = undefined;
+
+    var group = block.findGroup(hash);
+    while (group < block.num_groups) : (group += 1) {
+        if (block.groupHash(group) > hash) {
+            break;
+        }
+        for (block.decodeGroup(group, min_doc_id, &group_items)) |item| {
+            if (item.hash == hash) {
+                try items.append(item);
+            } else if (item.hash > hash) {
+                return;
+            }
+        }
+    }
+}
+
+pub fn encodeBitpackedBlock(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
+    assert(data.len >= min_block_size and data.len <= max_block_size);
+
+    var hash_deltas: [max_items_per_block]u32 = undefined;
+    var doc_deltas: [max_items_per_block]u32 = undefined;
+    var group_hashes: [bitpackedNumGroups(max_items_per_block)]u32 = undefined;
+
+    const max_items = maxItemsPerBlock(data.len);
+
+    var num_items: usize = 0;
+    var last_hash: u32 = 0;
+    var last_doc_id: u32 = 0;
+    var hash_bits: u8 = 0;
+    var doc_bits: u8 = 0;
+
+    while (num_items < max_items) {
+        const item = try reader.read() orelse break;
+        assert(num_items == 0 or item.hash > last_hash or (item.hash == last_hash and item.id >= last_doc_id));
+
+        const group_start = num_items % bitpacked_group_size == 0;
+        const diff_hash = if (group_start) 0 else item.hash - last_hash;
+        const diff_doc_id = if (group_start or diff_hash > 0) item.id - min_doc_id else item.id - last_doc_id;
+
+        const new_hash_bits = @max(hash_bits, bitWidth(diff_hash));
+        const new_doc_bits = @max(doc_bits, bitWidth(diff_doc_id));
+        if (bitpackedBlockSize(num_items + 1, new_hash_bits, new_doc_bits) > data.len) {
+            break;
+        }
+        hash_bits = new_hash_bits;
+        doc_bits = new_doc_bits;
+
+        if (group_start) {
+            group_hashes[num_items / bitpacked_group_size] = item.hash;
+        }
+        hash_deltas[num_items] = diff_hash;
+        doc_deltas[num_items] = diff_doc_id;
+
+        last_hash = item.hash;
+        last_doc_id = item.id;
+
+        num_items += 1;
+        reader.advance();
+    }
+
+    @memset(data, 0);
+
+    std.mem.writeInt(u16, data[0..2], @intCast(num_items), .little);
+    if (num_items == 0) {
+        return 0;
+    }
+    data[2] = hash_bits;
+    data[3] = doc_bits;
+
+    const num_groups = bitpackedNumGroups(num_items);
+    for (group_hashes[0..num_groups], 0..) |hash, group| {
+        std.mem.writeInt(u32, data[bitpacked_header_size + group * 4 ..][0..4], hash, .little);
+    }
+
+    const hashes_ptr = bitpacked_header_size + 4 * num_groups;
+    const docs_ptr = hashes_ptr + bitpackedColumnSize(num_items, hash_bits);
+    packBits(data[hashes_ptr..], hash_deltas[0..num_items], hash_bits);
+    packBits(data[docs_ptr..], doc_deltas[0..num_items], doc_bits);
+
+    return @intCast(num_items);
+}
+
+test "encodeBitpackedBlock/readBitpackedBlock" {
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    var segment = MemorySegment.init(std.testing.allocator, .{});
+    defer segment.deinit(.delete);
+
+    try segment.items.ensureTotalCapacity(std.testing.allocator, 10000);
+    for (0..10000) |_| {
+        segment.items.appendAssumeCapacity(.{ .hash = rand.int(u32) % 100000, .id = 1000 + rand.int(u32) % 10000 });
+    }
+    std.sort.pdq(Item, segment.items.items, {}, Item.cmp);
+
+    var items = std.ArrayList(Item).init(std.testing.allocator);
+    defer items.deinit();
+
+    var block_data: [default_block_size]u8 = undefined;
+    var reader = segment.reader();
+    while (true) {
+        const n = try encodeBitpackedBlock(&block_data, &reader, 1000);
+        if (n == 0) {
+            break;
+        }
+        const header = try decodeBitpackedBlockHeader(&block_data, 1000);
+        try testing.expectEqual(n, header.num_items);
+        try testing.expectEqual(segment.items.items[items.items.len], header.first_item);
+        try readBitpackedBlock(&block_data, &items, 1000);
+    }
+
+    try testing.expectEqualSlices(Item, segment.items.items, items.items);
+}
+
+test "searchBitpackedBlock" {
+    var segment = MemorySegment.init(std.testing.allocator, .{});
+    defer segment.deinit(.delete);
+
+    // long runs of the same hash crossing group boundaries
+    try segment.items.ensureTotalCapacity(std.testing.allocator, 100);
+    for (0..100) |i| {
+        segment.items.appendAssumeCapacity(.{ .hash = @intCast(10 + i / 20 * 10), .id = @intCast(1 + i) });
+    }
+
+    var block_data: [default_block_size]u8 = undefined;
     var reader = segment.reader();
-    const num_items = try encodeBlock(block_data[0..], &reader, 0);
-    try testing.expectEqual(segment.items.items.len, num_items);
+    const n = try encodeBitpackedBlock(&block_data, &reader, 1);
+    try testing.expectEqual(100, n);
 
     var items = std.ArrayList(Item).init(std.testing.allocator);
     defer items.deinit();
 
-    try readBlock(block_data[0..], &items, 0);
-    try testing.expectEqualSlices(
-        Item,
-        &[_]Item{
-            .{ .hash = 1, .id = 1 },
-            .{ .hash = 2, .id = 1 },
-            .{ .hash = 3, .id = 1 },
-            .{ .hash = 3, .id = 2 },
-            .{ .hash = 4, .id = 1 },
-        },
-        items.items,
-    );
+    for (0..70) |hash| {
+        items.clearRetainingCapacity();
+        try searchBitpackedBlock(&block_data, @intCast(hash), &items, 1);
 
-    const header = try decodeBlockHeader(block_data[0..], 0);
-    try testing.expectEqual(items.items.len, header.num_items);
-    try testing.expectEqual(items.items[0], header.first_item);
+        const matches = std.sort.equalRange(Item, Item{ .hash = @intCast(hash), .id = 0 }, segment.items.items, {}, Item.cmpByHash);
+        try testing.expectEqualSlices(Item, segment.items.items[matches[0]..matches[1]], items.items);
+    }
 }
 
 const segment_file_header_magic_v1: u32 = 0x53474D31; // "SGM1" in big endian
 const segment_file_footer_magic_v1: u32 = @byteSwap(segment_file_header_magic_v1);
 
+// v2 adds the block_format field to the header
+const segment_file_header_magic_v2: u32 = 0x53474D32; // "SGM2" in big endian
+const segment_file_footer_magic_v2: u32 = @byteSwap(segment_file_header_magic_v2);
+
+// v3 adds min/max doc id to the footer, followed by the block index and a trailer
+const segment_file_header_magic_v3: u32 = 0x53474D33; // "SGM3" in big endian
+const segment_file_footer_magic_v3: u32 = @byteSwap(segment_file_header_magic_v3);
+
+// v4 stores docs as a doc table instead of a msgpack map
+const segment_file_header_magic_v4: u32 = 0x53474D34; // "SGM4" in big endian
+const segment_file_footer_magic_v4: u32 = @byteSwap(segment_file_header_magic_v4);
+
+// footer offset (u64) and footer magic (u32) at the end of v3+ files
+const segment_file_trailer_size = 12;
+
+pub const DocsFormat = enum(u8) {
+    msgpack_map = 0,
+    // see DocTable.zig, aligned to DocTable.alignment
+    table = 1,
+};
+
 pub const SegmentFileHeader = struct {
     magic: u32,
     info: SegmentInfo,
     has_attributes: bool,
     has_docs: bool,
     block_size: u32,
+    block_format: u8 = @intFromEnum(BlockFormat.varint),
+    docs_format: u8 = @intFromEnum(DocsFormat.msgpack_map),
+    // Bloom filter over doc ids, after the docs, aligned to BloomFilter.alignment
+    has_doc_filter: bool = false,
 
     pub fn msgpackFormat() msgpack.StructFormat {
         return .{
@@ -262,6 +735,9 @@ pub const SegmentFileHeader = struct {
             .has_attributes => 0x02,
             .has_docs => 0x03,
             .block_size => 0x04,
+            .block_format => 0x05,
+            .docs_format => 0x06,
+            .has_doc_filter => 0x07,
         };
     }
 };
@@ -271,6 +747,8 @@ pub const SegmentFileFooter = struct {
     num_items: u32,
     num_blocks: u32,
     checksum: u64,
+    min_doc_id: u32 = 0,
+    max_doc_id: u32 = 0,
 
     pub fn msgpackFormat() msgpack.StructFormat {
         return .{
@@ -288,6 +766,8 @@ pub const SegmentFileFooter = struct {
             .num_items => 0x01,
             .num_blocks => 0x02,
             .checksum => 0x03,
+            .min_doc_id => 0x04,
+            .max_doc_id => 0x05,
         };
     }
 };
@@ -301,28 +781,204 @@ pub fn deleteSegmentFile(dir: std.fs.Dir, info: SegmentInfo) !void {
     try dir.deleteFile(file_name);
 }
 
-pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
-    const segment = reader.segment;
+/// Block index collected while writing a segment file, it can be used to open
+/// the file without scanning all the blocks again.
+pub const BlockIndex = struct {
+    // first hash of each block
+    hashes: std.ArrayListUnmanaged(u32) = .{},
+    num_items: u32 = 0,
+    checksum: u64 = 0,
 
-    var file_name_buf: [max_file_name_size]u8 = undefined;
-    const file_name = buildSegmentFileName(&file_name_buf, segment.info);
+    pub fn deinit(self: *BlockIndex, allocator: std.mem.Allocator) void {
+        self.hashes.deinit(allocator);
+    }
+};
 
-    log.info("writing segment file {s}", .{file_name});
+pub const WriteOptions = struct {
+    layout: BlockLayout = .{},
+    rate_limiter: ?*RateLimiter = null,
+    // drop the written pages from the page cache, so that writing a large segment file
+    // doesn't evict blocks of other segments that searches need
+    drop_cache: bool = false,
+};
 
-    var file = try dir.atomicFile(file_name, .{});
-    defer file.deinit();
+// how much data is written before it's synced and dropped from the page cache
+const drop_cache_interval = 16 * 1024 * 1024;
 
-    const block_size = default_block_size;
+/// Tells the kernel that the cached pages of the file are not needed anymore.
+/// Only clean pages are dropped, so the file should be synced first.
+pub fn dropCachedPages(file: std.fs.File) void {
+    if (builtin.os.tag == .linux) {
+        _ = std.os.linux.fadvise(file.handle, 0, 0, std.os.linux.POSIX_FADV.DONTNEED);
+    }
+}
 
-    var buffered_writer = std.io.bufferedWriter(file.file.writer());
+/// Tells the kernel that the file is going to be read sequentially with read/pread,
+/// so that it reads ahead more. Memory-mapped access is not affected.
+pub fn adviseSequentialReads(file: std.fs.File) void {
+    if (builtin.os.tag == .linux) {
+        _ = std.os.linux.fadvise(file.handle, 0, 0, std.os.linux.POSIX_FADV.SEQUENTIAL);
+    }
+}
+
+// Counts written bytes, throttles writes and periodically drops them from the page cache.
+const WriteThrottle = struct {
+    options: WriteOptions,
+    unsynced: usize = 0,
+
+    fn write(self: *WriteThrottle, file: std.fs.File, data: []const u8) !void {
+        if (self.options.rate_limiter) |rate_limiter| {
+            rate_limiter.acquire(data.len);
+        }
+        try file.writeAll(data);
+        if (self.options.drop_cache) {
+            self.unsynced += data.len;
+            if (self.unsynced >= drop_cache_interval) {
+                try std.posix.fdatasync(file.handle);
+                dropCachedPages(file);
+                self.unsynced = 0;
+            }
+        }
+    }
+
+    fn finish(self: *WriteThrottle, file: std.fs.File) !void {
+        try file.sync();
+        if (self.options.drop_cache) {
+            dropCachedPages(file);
+        }
+    }
+};
+
+// Blocks are encoded on the calling thread into large chunks, which are
+// checksummed and written to the file on a separate thread, so that the
+// encoding doesn't have to wait for I/O.
+const BlockWriter = struct {
+    const num_chunks = 4;
+    const chunk_size = 256 * 1024;
+
+    const Chunk = struct {
+        data: []u8,
+        len: usize = 0,
+        // the terminating empty block is not included in the checksum
+        checksum_len: usize = 0,
+    };
+
+    file: std.fs.File,
+    chunks: [num_chunks]Chunk,
+    throttle: WriteThrottle,
+    lock: std.Thread.Mutex = .{},
+    cond: std.Thread.Condition = .{},
+    num_filled: usize = 0,
+    finished: bool = false,
+    err: ?anyerror = null,
+    crc: std.hash.crc.Crc64Xz = std.hash.crc.Crc64Xz.init(),
+
+    fn run(self: *BlockWriter) void {
+        var chunk_no: usize = 0;
+        while (true) : (chunk_no += 1) {
+            {
+                self.lock.lock();
+                defer self.lock.unlock();
+
+                while (self.num_filled == 0 and !self.finished) {
+                    self.cond.wait(&self.lock);
+                }
+                if (self.num_filled == 0) {
+                    return;
+                }
+            }
+
+            const chunk = &self.chunks[chunk_no % num_chunks];
+            self.crc.update(chunk.data[0..chunk.checksum_len]);
+            const result = self.throttle.write(self.file, chunk.data[0..chunk.len]);
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            self.num_filled -= 1;
+            self.cond.broadcast();
+
+            result catch |err| {
+                self.err = err;
+                return;
+            };
+        }
+    }
+
+    fn acquireChunk(self: *BlockWriter, chunk_no: usize) !*Chunk {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        while (self.num_filled == num_chunks and self.err == null) {
+            self.cond.wait(&self.lock);
+        }
+        if (self.err) |err| {
+            return err;
+        }
+
+        const chunk = &self.chunks[chunk_no % num_chunks];
+        chunk.len = 0;
+        chunk.checksum_len = 0;
+        return chunk;
+    }
+
+    fn submitChunk(self: *BlockWriter) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        self.num_filled += 1;
+        self.cond.broadcast();
+    }
+
+    fn finish(self: *BlockWriter) void {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        self.finished = true;
+        self.cond.broadcast();
+    }
+};
+
+fn encodeBlocks(allocator: std.mem.Allocator, block_writer: *BlockWriter, layout: BlockLayout, reader: anytype, min_doc_id: u32, block_index: *BlockIndex) !void {
+    const block_size = layout.block_size;
+    const block_format = layout.block_format;
+    assert(BlockWriter.chunk_size % block_size == 0);
+
+    var chunk_no: usize = 0;
+    var done = false;
+    while (!done) : (chunk_no += 1) {
+        const chunk = try block_writer.acquireChunk(chunk_no);
+        while (chunk.len < chunk.data.len) {
+            const block_data = chunk.data[chunk.len..][0..block_size];
+            const n = try encodeBlock(block_format, block_data, reader, min_doc_id);
+            chunk.len += block_size;
+            if (n == 0) {
+                done = true;
+                break;
+            }
+            chunk.checksum_len = chunk.len;
+
+            const block_header = try decodeBlockHeader(block_format, block_data, min_doc_id);
+            try block_index.hashes.append(allocator, block_header.first_item.hash);
+            block_index.num_items += n;
+        }
+        block_writer.submitChunk();
+    }
+}
+
+fn writeSegmentFileHeader(allocator: std.mem.Allocator, file: std.fs.File, segment: anytype, layout: BlockLayout) !void {
+    var buffered_writer = std.io.bufferedWriter(file.writer());
     var counting_writer = std.io.countingWriter(buffered_writer.writer());
     const writer = counting_writer.writer();
 
     const packer = msgpack.packer(writer);
 
     const header = SegmentFileHeader{
-        .magic = segment_file_header_magic_v1,
-        .block_size = block_size,
+        .magic = segment_file_header_magic_v4,
+        .block_size = @intCast(layout.block_size),
+        .block_format = @intFromEnum(layout.block_format),
+        .docs_format = @intFromEnum(DocsFormat.table),
+        .has_doc_filter = true,
         .info = segment.info,
         .has_attributes = true,
         .has_docs = true,
@@ -330,40 +986,170 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
     try packer.write(SegmentFileHeader, header);
 
     try packer.writeMap(segment.attributes);
-    try packer.writeMap(segment.docs);
 
-    try buffered_writer.flush();
+    const docs_padding_size = std.mem.alignForward(u64, counting_writer.bytes_written, DocTable.alignment) - counting_writer.bytes_written;
+    try writer.writeByteNTimes(0, docs_padding_size);
+    try DocTable.write(allocator, writer, segment.docs);
+
+    var doc_filter = try BloomFilter.init(allocator, segment.docs.count());
+    defer doc_filter.deinit(allocator);
+
+    var docs_iter = segment.docs.keyIterator();
+    while (docs_iter.next()) |doc_id| {
+        doc_filter.add(doc_id.*);
+    }
+
+    const filter_padding_size = std.mem.alignForward(u64, counting_writer.bytes_written, BloomFilter.alignment) - counting_writer.bytes_written;
+    try writer.writeByteNTimes(0, filter_padding_size);
+    try doc_filter.write(writer);
 
-    const padding_size = block_size - counting_writer.bytes_written % block_size;
+    const padding_size = layout.block_size - counting_writer.bytes_written % layout.block_size;
     try writer.writeByteNTimes(0, padding_size);
 
-    var num_items: u32 = 0;
-    var num_blocks: u32 = 0;
-    var crc = std.hash.crc.Crc64Xz.init();
+    try buffered_writer.flush();
+}
 
-    var block_data: [block_size]u8 = undefined;
-    while (true) {
-        const n = try encodeBlock(block_data[0..], reader, segment.min_doc_id);
-        try writer.writeAll(block_data[0..]);
-        if (n == 0) {
-            break;
-        }
-        num_items += n;
-        num_blocks += 1;
-        crc.update(block_data[0..]);
-    }
+fn writeSegmentFileFooter(file: std.fs.File, segment: anytype, block_index: *const BlockIndex) !SegmentFileFooter {
+    const footer_offset = try file.getPos();
+
+    var buffered_writer = std.io.bufferedWriter(file.writer());
+    const writer = buffered_writer.writer();
+
+    const packer = msgpack.packer(writer);
 
     const footer = SegmentFileFooter{
-        .magic = segment_file_footer_magic_v1,
-        .num_items = num_items,
-        .num_blocks = num_blocks,
-        .checksum = crc.final(),
+        .magic = segment_file_footer_magic_v4,
+        .num_items = block_index.num_items,
+        .num_blocks = @intCast(block_index.hashes.items.len),
+        .checksum = block_index.checksum,
+        .min_doc_id = segment.min_doc_id,
+        .max_doc_id = segment.max_doc_id,
     };
     try packer.write(SegmentFileFooter, footer);
 
+    for (block_index.hashes.items) |hash| {
+        try writer.writeInt(u32, hash, .little);
+    }
+
+    try writer.writeInt(u64, footer_offset, .little);
+    try writer.writeInt(u32, segment_file_footer_magic_v4, .little);
+
     try buffered_writer.flush();
+    return footer;
+}
 
-    try file.file.sync();
+/// Writes the blocks from the reader, including the terminating empty block,
+/// at the current position of the file.
+pub fn writeSegmentFileBlocks(allocator: std.mem.Allocator, file: std.fs.File, reader: anytype, min_doc_id: u32, block_index: *BlockIndex, options: WriteOptions) !void {
+    try options.layout.validate();
+
+    const chunks_data = try allocator.alloc(u8, BlockWriter.num_chunks * BlockWriter.chunk_size);
+    defer allocator.free(chunks_data);
+
+    var block_writer = BlockWriter{ .file = file, .chunks = undefined, .throttle = .{ .options = options } };
+    for (&block_writer.chunks, 0..) |*chunk, i| {
+        chunk.* = .{ .data = chunks_data[i * BlockWriter.chunk_size ..][0..BlockWriter.chunk_size] };
+    }
+
+    block_index.hashes.clearRetainingCapacity();
+    block_index.num_items = 0;
+
+    const write_thread = try std.Thread.spawn(.{}, BlockWriter.run, .{&block_writer});
+    const encode_result = encodeBlocks(allocator, &block_writer, options.layout, reader, min_doc_id, block_index);
+    block_writer.finish();
+    write_thread.join();
+
+    try encode_result;
+    if (block_writer.err) |err| {
+        return err;
+    }
+
+    block_index.checksum = block_writer.crc.final();
+}
+
+pub fn writeSegmentFile(allocator: std.mem.Allocator, dir: std.fs.Dir, reader: anytype, block_index: *BlockIndex, options: WriteOptions) !void {
+    try options.layout.validate();
+
+    const segment = reader.segment;
+
+    var file_name_buf: [max_file_name_size]u8 = undefined;
+    const file_name = buildSegmentFileName(&file_name_buf, segment.info);
+
+    log.info("writing segment file {s}", .{file_name});
+
+    var file = try dir.atomicFile(file_name, .{});
+    defer file.deinit();
+
+    try writeSegmentFileHeader(allocator, file.file, segment, options.layout);
+    try writeSegmentFileBlocks(allocator, file.file, reader, segment.min_doc_id, block_index, options);
+    const footer = try writeSegmentFileFooter(file.file, segment, block_index);
+
+    var throttle = WriteThrottle{ .options = options };
+    try throttle.finish(file.file);
+
+    try file.finish();
+
+    log.info("wrote segment file {s} (blocks = {}, items = {}, checksum = {})", .{
+        file_name,
+        footer.num_blocks,
+        footer.num_items,
+        footer.checksum,
+    });
+}
+
+/// Writes a segment file from parts, each written by `writeSegmentFileBlocks` and covering
+/// a hash range, in the order of the ranges. The part files are left at the end of their data.
+pub fn writeSegmentFileFromParts(allocator: std.mem.Allocator, dir: std.fs.Dir, segment: anytype, parts: []const std.fs.File, part_indexes: []const BlockIndex, block_index: *BlockIndex, options: WriteOptions) !void {
+    assert(parts.len == part_indexes.len);
+
+    var file_name_buf: [max_file_name_size]u8 = undefined;
+    const file_name = buildSegmentFileName(&file_name_buf, segment.info);
+
+    log.info("writing segment file {s} from {} parts", .{ file_name, parts.len });
+
+    var file = try dir.atomicFile(file_name, .{});
+    defer file.deinit();
+
+    try options.layout.validate();
+    const block_size = options.layout.block_size;
+
+    try writeSegmentFileHeader(allocator, file.file, segment, options.layout);
+
+    block_index.hashes.clearRetainingCapacity();
+    block_index.num_items = 0;
+
+    const buffer = try allocator.alloc(u8, BlockWriter.chunk_size);
+    defer allocator.free(buffer);
+
+    var throttle = WriteThrottle{ .options = options };
+
+    var crc = std.hash.crc.Crc64Xz.init();
+    for (parts, part_indexes) |part, part_index| {
+        try block_index.hashes.appendSlice(allocator, part_index.hashes.items);
+        block_index.num_items += part_index.num_items;
+
+        // copy everything except the terminating empty block
+        var remaining = part_index.hashes.items.len * block_size;
+        try part.seekTo(0);
+        while (remaining > 0) {
+            const chunk = buffer[0..@min(buffer.len, remaining)];
+            const n = try part.readAll(chunk);
+            if (n != chunk.len) {
+                return error.UnexpectedEndOfFile;
+            }
+            crc.update(chunk);
+            try throttle.write(file.file, chunk);
+            remaining -= chunk.len;
+        }
+    }
+    block_index.checksum = crc.final();
+
+    @memset(buffer[0..block_size], 0);
+    try file.file.writeAll(buffer[0..block_size]);
+
+    const footer = try writeSegmentFileFooter(file.file, segment, block_index);
+
+    try throttle.finish(file.file);
 
     try file.finish();
 
@@ -376,6 +1162,18 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
 }
 
 pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !void {
+    return openSegmentFile(dir, info, segment, .{});
+}
+
+pub const OpenOptions = struct {
+    // block index from writing the same file, it's used instead of scanning and verifying all blocks
+    block_index: ?*BlockIndex = null,
+    // use the block index and doc id range stored in the file and trust the footer checksum,
+    // the blocks are not read until they are needed, use verifySegmentBlocks to check them later
+    fast: bool = false,
+};
+
+pub fn openSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment, options: OpenOptions) !void {
     var file_name_buf: [max_file_name_size]u8 = undefined;
     const file_name = buildSegmentFileName(&file_name_buf, info);
 
@@ -386,11 +1184,15 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
 
     const file_size = try file.getEndPos();
 
+    const block_index = options.block_index;
+    const lazy = block_index != null or options.fast;
+
     var raw_data = try std.posix.mmap(
         null,
         file_size,
         std.posix.PROT.READ,
-        .{ .TYPE = .PRIVATE, .POPULATE = true },
+        // a freshly written file is most likely still in the page cache
+        .{ .TYPE = .PRIVATE, .POPULATE = !lazy },
         file.handle,
         0,
     );
@@ -399,7 +1201,7 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     try std.posix.madvise(
         raw_data.ptr,
         raw_data.len,
-        std.posix.MADV.RANDOM | std.posix.MADV.WILLNEED,
+        if (lazy) std.posix.MADV.RANDOM else std.posix.MADV.RANDOM | std.posix.MADV.WILLNEED,
     );
 
     var fixed_buffer_stream = std.io.fixedBufferStream(raw_data[0..]);
@@ -409,15 +1211,58 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
 
     const header = try unpacker.read(SegmentFileHeader);
 
-    if (header.magic != segment_file_header_magic_v1) {
-        return error.InvalidSegment;
-    }
+    const footer_magic: u32 = switch (header.magic) {
+        segment_file_header_magic_v1 => segment_file_footer_magic_v1,
+        segment_file_header_magic_v2 => segment_file_footer_magic_v2,
+        segment_file_header_magic_v3 => segment_file_footer_magic_v3,
+        segment_file_header_magic_v4 => segment_file_footer_magic_v4,
+        else => return error.InvalidSegment,
+    };
+    const docs_format: DocsFormat = switch (header.magic) {
+        segment_file_header_magic_v1, segment_file_header_magic_v2, segment_file_header_magic_v3 => .msgpack_map,
+        else => std.meta.intToEnum(DocsFormat, header.docs_format) catch return error.InvalidSegment,
+    };
+    const block_format: BlockFormat = switch (header.magic) {
+        segment_file_header_magic_v1 => .varint,
+        else => std.meta.intToEnum(BlockFormat, header.block_format) catch return error.InvalidSegment,
+    };
     if (header.block_size < min_block_size or header.block_size > max_block_size) {
         return error.InvalidSegment;
     }
 
     segment.info = header.info;
     segment.block_size = header.block_size;
+    segment.block_format = block_format;
+
+    // v3+ files have the footer and block index at the end of the file, which
+    // has the doc id range and allows opening the file without scanning the blocks
+    var stored_footer: ?SegmentFileFooter = null;
+    var stored_block_index: []const u8 = &.{};
+    const has_trailer = header.magic == segment_file_header_magic_v3 or header.magic == segment_file_header_magic_v4;
+    if (has_trailer) {
+        if (raw_data.len < segment_file_trailer_size) {
+            return error.InvalidSegment;
+        }
+        const trailer_start = raw_data.len - segment_file_trailer_size;
+        const trailer = raw_data[trailer_start..];
+        const footer_offset = std.mem.readInt(u64, trailer[0..8], .little);
+        if (std.mem.readInt(u32, trailer[8..12], .little) != footer_magic or footer_offset > trailer_start) {
+            return error.InvalidSegment;
+        }
+
+        var footer_stream = std.io.fixedBufferStream(raw_data[footer_offset..trailer_start]);
+        const footer_unpacker = msgpack.unpacker(footer_stream.reader(), null);
+        const stored = try footer_unpacker.read(SegmentFileFooter);
+        if (stored.magic != footer_magic) {
+            return error.InvalidSegment;
+        }
+
+        stored_block_index = raw_data[footer_offset + footer_stream.pos .. trailer_start];
+        if (stored_block_index.len != @as(usize, stored.num_blocks) * @sizeOf(u32)) {
+            return error.InvalidSegment;
+        }
+        stored_footer = stored;
+    }
 
     if (header.has_attributes) {
         // FIXME nicer api in msgpack.zig
@@ -429,22 +1274,53 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     }
 
     if (header.has_docs) {
-        // FIXME nicer api in msgpack.zig
-        var docs = std.AutoHashMap(u32, bool).init(segment.allocator);
-        defer docs.deinit();
-        try unpacker.readMapInto(&docs);
         segment.docs.deinit(segment.allocator);
-        segment.docs = docs.unmanaged.move();
-
-        var iter = segment.docs.keyIterator();
-        segment.min_doc_id = 0;
-        segment.max_doc_id = 0;
-        while (iter.next()) |key_ptr| {
-            if (segment.min_doc_id == 0 or key_ptr.* < segment.min_doc_id) {
-                segment.min_doc_id = key_ptr.*;
+        switch (docs_format) {
+            .msgpack_map => {
+                // FIXME nicer api in msgpack.zig
+                var docs = std.AutoHashMap(u32, bool).init(segment.allocator);
+                defer docs.deinit();
+                try unpacker.readMapInto(&docs);
+                segment.docs = try DocTable.fromMap(segment.allocator, docs.unmanaged);
+            },
+            .table => {
+                // served directly from the mmaped file
+                const docs_start = std.mem.alignForward(usize, fixed_buffer_stream.pos, DocTable.alignment);
+                const docs = DocTable.decode(raw_data[docs_start..]) catch return error.InvalidSegment;
+                segment.docs = docs.table;
+                try fixed_buffer_stream.seekTo(docs_start + docs.size);
+            },
+        }
+
+        segment.doc_filter.deinit(segment.allocator);
+        if (header.has_doc_filter) {
+            // served directly from the mmaped file
+            const filter_start = std.mem.alignForward(usize, fixed_buffer_stream.pos, BloomFilter.alignment);
+            const filter = BloomFilter.decode(raw_data[filter_start..]) catch return error.InvalidSegment;
+            segment.doc_filter = filter.filter;
+            try fixed_buffer_stream.seekTo(filter_start + filter.size);
+        } else {
+            segment.doc_filter = try BloomFilter.init(segment.allocator, segment.docs.count());
+            var iter = segment.docs.iterator();
+            while (iter.next()) |doc| {
+                segment.doc_filter.add(doc.id);
             }
-            if (segment.max_doc_id == 0 or key_ptr.* > segment.max_doc_id) {
-                segment.max_doc_id = key_ptr.*;
+        }
+
+        if (stored_footer) |stored| {
+            segment.min_doc_id = stored.min_doc_id;
+            segment.max_doc_id = stored.max_doc_id;
+        } else {
+            var iter = segment.docs.iterator();
+            segment.min_doc_id = 0;
+            segment.max_doc_id = 0;
+            while (iter.next()) |doc| {
+                if (segment.min_doc_id == 0 or doc.id < segment.min_doc_id) {
+                    segment.min_doc_id = doc.id;
+                }
+                if (segment.max_doc_id == 0 or doc.id > segment.max_doc_id) {
+                    segment.max_doc_id = doc.id;
+                }
             }
         }
     }
@@ -455,33 +1331,60 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
 
     const blocks_data_start = fixed_buffer_stream.pos;
 
-    const max_possible_block_count = (raw_data.len - fixed_buffer_stream.pos) / block_size;
-    try segment.index.ensureTotalCapacity(segment.allocator, max_possible_block_count);
-
     var num_items: u32 = 0;
     var num_blocks: u32 = 0;
-    var crc = std.hash.crc.Crc64Xz.init();
+    var checksum: u64 = 0;
+
+    const use_stored_block_index = options.fast and block_index == null and stored_footer != null;
+
+    if (block_index != null or use_stored_block_index) {
+        if (block_index) |known| {
+            num_items = known.num_items;
+            num_blocks = @intCast(known.hashes.items.len);
+            checksum = known.checksum;
+        } else if (stored_footer) |stored| {
+            num_items = stored.num_items;
+            num_blocks = stored.num_blocks;
+            checksum = stored.checksum;
+        }
 
-    var ptr = blocks_data_start;
-    while (ptr + block_size <= raw_data.len) {
-        const block_data = raw_data[ptr .. ptr + block_size];
-        ptr += block_size;
-        const block_header = try decodeBlockHeader(block_data, segment.min_doc_id);
-        if (block_header.num_items == 0) {
-            break;
+        // blocks and the terminating empty block
+        const blocks_data_end = blocks_data_start + (@as(usize, num_blocks) + 1) * block_size;
+        if (blocks_data_end > raw_data.len) {
+            return error.InvalidSegment;
         }
-        segment.index.appendAssumeCapacity(block_header.first_item.hash);
-        num_items += block_header.num_items;
-        num_blocks += 1;
-        crc.update(block_data);
+        segment.blocks = raw_data[blocks_data_start..blocks_data_end];
+        segment.checksum_verified = block_index != null;
+    } else {
+        const max_possible_block_count = (raw_data.len - fixed_buffer_stream.pos) / block_size;
+        try segment.index.ensureTotalCapacity(segment.allocator, max_possible_block_count);
+
+        var crc = std.hash.crc.Crc64Xz.init();
+
+        var ptr = blocks_data_start;
+        while (ptr + block_size <= raw_data.len) {
+            const block_data = raw_data[ptr .. ptr + block_size];
+            ptr += block_size;
+            const block_header = try decodeBlockHeader(block_format, block_data, segment.min_doc_id);
+            if (block_header.num_items == 0) {
+                break;
+            }
+            segment.index.appendAssumeCapacity(block_header.first_item.hash);
+            num_items += block_header.num_items;
+            num_blocks += 1;
+            crc.update(block_data);
+        }
+        const blocks_data_end = ptr;
+        segment.blocks = raw_data[blocks_data_start..blocks_data_end];
+
+        checksum = crc.final();
+        segment.checksum_verified = true;
     }
-    const blocks_data_end = ptr;
-    segment.blocks = raw_data[blocks_data_start..blocks_data_end];
 
     try fixed_buffer_stream.seekBy(@intCast(segment.blocks.len));
 
     const footer = try unpacker.read(SegmentFileFooter);
-    if (footer.magic != segment_file_footer_magic_v1) {
+    if (footer.magic != footer_magic) {
         return error.InvalidSegment;
     }
     if (footer.num_items != num_items) {
@@ -492,19 +1395,54 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     if (footer.num_blocks != num_blocks) {
         return error.InvalidSegment;
     }
-    if (footer.checksum != crc.final()) {
+    if (footer.checksum != checksum) {
         return error.InvalidSegment;
     }
+    segment.checksum = checksum;
+
+    if (block_index) |known| {
+        segment.index.deinit(segment.allocator);
+        segment.index = known.hashes;
+        known.hashes = .{};
+    } else if (use_stored_block_index) {
+        segment.index.clearRetainingCapacity();
+        try segment.index.ensureTotalCapacity(segment.allocator, num_blocks);
+        for (0..num_blocks) |i| {
+            segment.index.appendAssumeCapacity(std.mem.readInt(u32, stored_block_index[i * @sizeOf(u32) ..][0..@sizeOf(u32)], .little));
+        }
+    }
 
     segment.mmaped_file = file;
 }
 
+/// Checks the blocks of a segment that was opened without verification
+/// against the checksum and the block index from the footer.
+pub fn verifySegmentBlocks(segment: *const FileSegment) !void {
+    var crc = std.hash.crc.Crc64Xz.init();
+    var num_items: usize = 0;
+    for (segment.index.items, 0..) |hash, i| {
+        const block_data = segment.getBlockData(i);
+        const block_header = try decodeBlockHeader(segment.block_format, block_data, segment.min_doc_id);
+        if (block_header.num_items == 0 or block_header.first_item.hash != hash) {
+            return error.InvalidSegment;
+        }
+        num_items += block_header.num_items;
+        crc.update(block_data);
+    }
+    if (num_items != segment.num_items or crc.final() != segment.checksum) {
+        return error.InvalidSegment;
+    }
+}
+
 test "writeFile/readFile" {
     var tmp = testing.tmpDir(.{});
     defer tmp.cleanup();
 
     const info: SegmentInfo = .{ .version = 1, .merges = 0 };
 
+    var block_index: BlockIndex = .{};
+    defer block_index.deinit(testing.allocator);
+
     {
         var in_memory_segment = MemorySegment.init(testing.allocator, .{});
         defer in_memory_segment.deinit(.delete);
@@ -518,29 +1456,64 @@ test "writeFile/readFile" {
         var reader = in_memory_segment.reader();
         defer reader.close();
 
-        try writeSegmentFile(tmp.dir, &reader);
+        try writeSegmentFile(testing.allocator, tmp.dir, &reader, &block_index, .{});
+
+        try testing.expectEqualSlices(u32, &.{1}, block_index.hashes.items);
+        try testing.expectEqual(2, block_index.num_items);
     }
 
     {
         var segment = FileSegment.init(testing.allocator, .{ .dir = tmp.dir });
-        defer segment.deinit(.delete);
+        defer segment.deinit(.keep);
 
         try readSegmentFile(tmp.dir, info, &segment);
 
         try testing.expectEqualDeep(info, segment.info);
         try testing.expectEqual(1, segment.docs.count());
+        try testing.expect(segment.doc_filter.mayContain(1));
+        try testing.expectEqual(true, segment.docs.get(1));
         try testing.expectEqual(1, segment.index.items.len);
         try testing.expectEqual(1, segment.index.items[0]);
+        try testing.expectEqual(block_index.checksum, std.hash.crc.Crc64Xz.hash(segment.getBlockData(0)));
 
         var items = std.ArrayList(Item).init(testing.allocator);
         defer items.deinit();
 
-        try readBlock(segment.getBlockData(0), &items, segment.min_doc_id);
+        try readBlock(segment.block_format, segment.getBlockData(0), &items, segment.min_doc_id);
         try std.testing.expectEqualSlices(Item, &[_]Item{
             Item{ .hash = 1, .id = 1 },
             Item{ .hash = 2, .id = 1 },
         }, items.items);
     }
+
+    {
+        var segment = FileSegment.init(testing.allocator, .{ .dir = tmp.dir });
+        defer segment.deinit(.keep);
+
+        // the block index is moved to the segment
+        try openSegmentFile(tmp.dir, info, &segment, .{ .block_index = &block_index });
+
+        try testing.expectEqual(1, segment.index.items.len);
+        try testing.expectEqual(1, segment.index.items[0]);
+        try testing.expectEqual(2, segment.num_items);
+        try testing.expectEqual(0, block_index.hashes.items.len);
+    }
+
+    {
+        var segment = FileSegment.init(testing.allocator, .{ .dir = tmp.dir });
+        defer segment.deinit(.delete);
+
+        // the block index and doc id range are read from the end of the file
+        try openSegmentFile(tmp.dir, info, &segment, .{ .fast = true });
+
+        try testing.expectEqualSlices(u32, &.{1}, segment.index.items);
+        try testing.expectEqual(2, segment.num_items);
+        try testing.expectEqual(1, segment.min_doc_id);
+        try testing.expectEqual(1, segment.max_doc_id);
+        try testing.expect(!segment.checksum_verified);
+
+        try verifySegmentBlocks(&segment);
+    }
 }
 
 const manifest_header_magic_v1: u32 = 0x49445831; // "IDX1" in big endian
@@ -554,9 +1527,13 @@ const ManifestFileHeader = struct {
 };
 
 pub fn writeManifestFile(dir: std.fs.Dir, segments: []const SegmentInfo) !void {
-    log.info("writing manifest file {s}", .{manifest_file_name});
+    try writeManifestFileAs(dir, manifest_file_name, segments);
+}
+
+pub fn writeManifestFileAs(dir: std.fs.Dir, file_name: []const u8, segments: []const SegmentInfo) !void {
+    log.info("writing manifest file {s}", .{file_name});
 
-    var file = try dir.atomicFile(manifest_file_name, .{});
+    var file = try dir.atomicFile(file_name, .{});
     defer file.deinit();
 
     var buffered_writer = std.io.bufferedWriter(file.file.writer());
@@ -572,11 +1549,19 @@ pub fn writeManifestFile(dir: std.fs.Dir, segments: []const SegmentInfo) !void {
     try file.finish();
 
     log.info("wrote index file {s} (segments = {})", .{
-        manifest_file_name,
+        file_name,
         segments.len,
     });
 }
 
+pub fn writeManifestCommitFile(dir: std.fs.Dir) !void {
+    var file = try dir.atomicFile(manifest_commit_file_name, .{});
+    defer file.deinit();
+
+    try file.file.sync();
+    try file.finish();
+}
+
 pub fn readManifestFile(dir: std.fs.Dir, allocator: std.mem.Allocator) ![]SegmentInfo {
     log.info("reading manifest file {s}", .{manifest_file_name});
 
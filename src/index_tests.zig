@@ -1,4 +1,5 @@
 const std = @import("std");
+const msgpack = @import("msgpack");
 
 const common = @import("common.zig");
 const Change = @import("change.zig").Change;
@@ -8,6 +9,7 @@ const Scheduler = @import("utils/Scheduler.zig");
 const Deadline = @import("utils/Deadline.zig");
 
 const Index = @import("Index.zig");
+const filefmt = @import("filefmt.zig");
 
 fn generateRandomHashes(buf: []u32, seed: u64) []u32 {
     var prng = std.rand.DefaultPrng.init(seed);
@@ -70,6 +72,80 @@ test "index create, update and search" {
     }
 }
 
+test "index info is cached per snapshot" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [10]u32 = undefined;
+
+    try index.update(&[_]Change{
+        .{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 1) } },
+        .{ .set_attribute = .{ .name = "foo", .value = 42 } },
+    });
+
+    var reader1 = try index.acquireReader();
+    defer index.releaseReader(&reader1);
+
+    const info1 = try reader1.getInfo(std.testing.allocator);
+    try std.testing.expectEqual(1, info1.num_docs);
+    try std.testing.expectEqual(42, info1.attributes.get("foo"));
+    try std.testing.expectEqual(1, info1.attributes.get("max_document_id"));
+
+    // same snapshot, same info
+    {
+        var reader2 = try index.acquireReader();
+        defer index.releaseReader(&reader2);
+        try std.testing.expectEqual(info1, try reader2.getInfo(std.testing.allocator));
+    }
+
+    try index.update(&[_]Change{.{ .insert = .{ .id = 2, .hashes = generateRandomHashes(&hashes, 2) } }});
+
+    var reader3 = try index.acquireReader();
+    defer index.releaseReader(&reader3);
+
+    const info3 = try reader3.getInfo(std.testing.allocator);
+    try std.testing.expect(info3 != info1);
+    try std.testing.expectEqual(2, info3.num_docs);
+    try std.testing.expect(info3.version > info1.version);
+
+    // the old reader still sees its own snapshot
+    try std.testing.expectEqual(1, info1.num_docs);
+}
+
+test "index forced checkpoint is not repeated while pending" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    // not started, so the checkpoint stays pending
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    try std.testing.expect(!index.forceCheckpoint());
+
+    var hashes: [100]u32 = undefined;
+
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 1,
+        .hashes = generateRandomHashes(&hashes, 1),
+    } }});
+
+    try std.testing.expect(index.forceCheckpoint());
+    try std.testing.expect(!index.forceCheckpoint());
+}
+
 test "index create, update, reopen and search" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
@@ -199,3 +275,413 @@ test "index, multiple fingerprints with the same hashes" {
         },
     }, collector.getResults());
 }
+
+test "index import" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 1,
+        .hashes = generateRandomHashes(&hashes, 1),
+    } }});
+
+    var data = std.ArrayList(u8).init(std.testing.allocator);
+    defer data.deinit();
+
+    for (2..10) |i| {
+        try msgpack.encode(Change{ .insert = .{
+            .id = @intCast(i),
+            .hashes = generateRandomHashes(&hashes, i),
+        } }, data.writer());
+    }
+    try msgpack.encode(Change{ .delete = .{ .id = 1 } }, data.writer());
+    try msgpack.encode(Change{ .delete = .{ .id = 5 } }, data.writer());
+
+    // two inserts per run
+    var stream = std.io.fixedBufferStream(data.items);
+    try index.import(stream.reader(), .{ .max_items_per_run = 2 * hashes.len });
+
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 10,
+        .hashes = generateRandomHashes(&hashes, 10),
+    } }});
+
+    for (1..11) |i| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, i), &collector, .{});
+
+        if (i == 1 or i == 5) {
+            try std.testing.expectEqualSlices(SearchResult, &.{}, collector.getResults());
+        } else {
+            try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = @intCast(i), .score = hashes.len }}, collector.getResults());
+        }
+    }
+}
+
+test "index search profile" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    // doc 1 in a file segment, doc 2 in a memory segment
+    var data = std.ArrayList(u8).init(std.testing.allocator);
+    defer data.deinit();
+
+    try msgpack.encode(Change{ .insert = .{
+        .id = 1,
+        .hashes = generateRandomHashes(&hashes, 1),
+    } }, data.writer());
+
+    var stream = std.io.fixedBufferStream(data.items);
+    try index.import(stream.reader(), .{});
+
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 2,
+        .hashes = generateRandomHashes(&hashes, 2),
+    } }});
+
+    var profile = std.ArrayList(common.SegmentProfile).init(std.testing.allocator);
+    defer profile.deinit();
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+    collector.profile = &profile;
+
+    try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = hashes.len }}, collector.getResults());
+
+    var num_file_segments: usize = 0;
+    var num_memory_segments: usize = 0;
+    for (profile.items) |segment| {
+        if (std.mem.eql(u8, segment.tier, "file")) {
+            num_file_segments += 1;
+            try std.testing.expectEqual(hashes.len, segment.hits);
+            try std.testing.expect(segment.blocks > 0);
+        } else {
+            num_memory_segments += 1;
+            try std.testing.expectEqual(0, segment.hits);
+        }
+    }
+    try std.testing.expectEqual(1, num_file_segments);
+    try std.testing.expectEqual(1, num_memory_segments);
+}
+
+test "index replication" {
+    const filefmt = @import("filefmt.zig");
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var leader = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "leader", .{});
+    defer leader.deinit();
+
+    try leader.open(true);
+
+    var replica = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "replica", .{ .replica = true });
+    defer replica.deinit();
+
+    try replica.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    // doc 1 and doc 2 end up in file segments, doc 3 stays in a memory segment
+    try leader.update(&[_]Change{.{ .insert = .{
+        .id = 1,
+        .hashes = generateRandomHashes(&hashes, 1),
+    } }});
+
+    var data = std.ArrayList(u8).init(std.testing.allocator);
+    defer data.deinit();
+
+    try msgpack.encode(Change{ .insert = .{
+        .id = 2,
+        .hashes = generateRandomHashes(&hashes, 2),
+    } }, data.writer());
+
+    var stream = std.io.fixedBufferStream(data.items);
+    try leader.import(stream.reader(), .{});
+
+    try leader.update(&[_]Change{.{ .insert = .{
+        .id = 3,
+        .hashes = generateRandomHashes(&hashes, 3),
+    } }});
+
+    try std.testing.expectError(error.ReadOnlyIndex, replica.update(&[_]Change{.{ .delete = .{ .id = 1 } }}));
+
+    // copy the segment files, the same way the replicator downloads them
+    const infos = try leader.getFileSegmentInfos(std.testing.allocator, 0);
+    defer std.testing.allocator.free(infos);
+
+    try std.testing.expectEqual(2, infos.len);
+
+    for (infos) |info| {
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        const file_name = filefmt.buildSegmentFileName(&file_name_buf, info);
+        try leader.dir.copyFile(file_name, replica.dir, file_name, .{});
+    }
+
+    try replica.replaceFileSegments(0, infos);
+    try std.testing.expectEqual(infos[1].getLastCommitId() + 1, replica.getNextReplicatedCommitId());
+
+    // the same manifest again doesn't change anything
+    try replica.replaceFileSegments(0, infos);
+
+    {
+        var it = try leader.readOplog(replica.getNextReplicatedCommitId());
+        defer it.deinit();
+
+        var num_transactions: usize = 0;
+        while (try it.next()) |txn| {
+            try replica.applyReplicatedTransaction(txn.changes, txn.id);
+            num_transactions += 1;
+        }
+        try std.testing.expectEqual(1, num_transactions);
+    }
+
+    for (1..4) |i| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try replica.search(generateRandomHashes(&hashes, i), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = @intCast(i), .score = hashes.len }}, collector.getResults());
+    }
+}
+
+test "sharded index" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = std.testing.allocator, .n_jobs = 2 });
+    defer pool.deinit();
+
+    const options = Index.Options{ .num_shards = 4, .search_pool = &pool };
+
+    var hashes: [100]u32 = undefined;
+
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", options);
+        defer index.deinit();
+
+        try index.open(true);
+
+        // doc 1 ends up in file segments, the rest stays in memory segments
+        var data = std.ArrayList(u8).init(std.testing.allocator);
+        defer data.deinit();
+
+        try msgpack.encode(Change{ .insert = .{
+            .id = 1,
+            .hashes = generateRandomHashes(&hashes, 1),
+        } }, data.writer());
+
+        var stream = std.io.fixedBufferStream(data.items);
+        try index.import(stream.reader(), .{});
+
+        for (2..5) |i| {
+            try index.update(&[_]Change{.{ .insert = .{
+                .id = @intCast(i),
+                .hashes = generateRandomHashes(&hashes, i),
+            } }});
+        }
+
+        // doc 2 gets new hashes, doc 3 is deleted
+        try index.update(&[_]Change{
+            .{ .insert = .{ .id = 2, .hashes = generateRandomHashes(&hashes, 5) } },
+            .{ .delete = .{ .id = 3 } },
+        });
+    }
+
+    // the number of shards can't change
+    try std.testing.expectError(error.ShardCountMismatch, Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{}));
+    try std.testing.expectError(error.ShardCountMismatch, Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{ .num_shards = 2 }));
+    try std.testing.expectError(error.ShardCountMismatch, Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{ .num_shards = 8 }));
+
+    // and trying doesn't create the directories of the extra shards
+    try std.testing.expectError(error.FileNotFound, tmp_dir.dir.access("idx/shard-4", .{}));
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", options);
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    const expected = [_]struct { seed: u64, results: []const SearchResult }{
+        .{ .seed = 1, .results = &.{.{ .id = 1, .score = hashes.len }} },
+        .{ .seed = 2, .results = &.{} },
+        .{ .seed = 3, .results = &.{} },
+        .{ .seed = 4, .results = &.{.{ .id = 4, .score = hashes.len }} },
+        .{ .seed = 5, .results = &.{.{ .id = 2, .score = hashes.len }} },
+    };
+
+    for (expected) |e| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, e.seed), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, e.results, collector.getResults());
+    }
+
+    var reader = try index.acquireReader();
+    defer index.releaseReader(&reader);
+
+    try std.testing.expectEqual(4, reader.shards.len);
+    try std.testing.expect(try reader.getDocInfo(1) != null);
+    try std.testing.expect(try reader.getDocInfo(3) == null);
+}
+
+test "sharded index with block cache" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{ .num_shards = 4, .block_cache_size = 1024 * 1024 });
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    // the file segments of all shards get the same segment info
+    var data = std.ArrayList(u8).init(std.testing.allocator);
+    defer data.deinit();
+
+    for (1..4) |i| {
+        try msgpack.encode(Change{ .insert = .{
+            .id = @intCast(i),
+            .hashes = generateRandomHashes(&hashes, i),
+        } }, data.writer());
+    }
+
+    var stream = std.io.fixedBufferStream(data.items);
+    try index.import(stream.reader(), .{});
+
+    // the second round is served from the cache
+    for (0..2) |_| {
+        for (1..4) |i| {
+            var collector = SearchResults.init(std.testing.allocator, .{});
+            defer collector.deinit();
+
+            try index.search(generateRandomHashes(&hashes, i), &collector, .{});
+
+            try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = @intCast(i), .score = hashes.len }}, collector.getResults());
+        }
+    }
+}
+
+test "sharded index recovers interrupted manifest updates" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    const options = Index.Options{ .num_shards = 4 };
+
+    var hashes: [100]u32 = undefined;
+
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", options);
+        defer index.deinit();
+
+        try index.open(true);
+
+        var data = std.ArrayList(u8).init(std.testing.allocator);
+        defer data.deinit();
+
+        try msgpack.encode(Change{ .insert = .{
+            .id = 1,
+            .hashes = generateRandomHashes(&hashes, 1),
+        } }, data.writer());
+
+        var stream = std.io.fixedBufferStream(data.items);
+        try index.import(stream.reader(), .{});
+    }
+
+    const Check = struct {
+        fn search(index: *Index, expected: []const SearchResult) !void {
+            var buf: [100]u32 = undefined;
+
+            var collector = SearchResults.init(std.testing.allocator, .{});
+            defer collector.deinit();
+
+            try index.search(generateRandomHashes(&buf, 1), &collector, .{});
+
+            try std.testing.expectEqualSlices(SearchResult, expected, collector.getResults());
+        }
+
+        fn writePendingManifests(dir: std.fs.Dir, num_shards: usize) !void {
+            for (0..num_shards) |i| {
+                var path_buf: [32]u8 = undefined;
+                var shard_dir = try dir.openDir(try std.fmt.bufPrint(&path_buf, "idx/shard-{}", .{i}), .{});
+                defer shard_dir.close();
+                try filefmt.writeManifestFileAs(shard_dir, filefmt.pending_manifest_file_name, &.{});
+            }
+        }
+    };
+
+    // crashed before the commit file was written, the pending manifests are discarded
+    try Check.writePendingManifests(tmp_dir.dir, 2);
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", options);
+        defer index.deinit();
+
+        try index.open(false);
+        try index.waitForReady(10000);
+
+        try Check.search(&index, &.{.{ .id = 1, .score = hashes.len }});
+    }
+    try std.testing.expectError(error.FileNotFound, tmp_dir.dir.access("idx/shard-0/" ++ filefmt.pending_manifest_file_name, .{}));
+
+    // crashed after the commit file was written, the pending manifests replace the current ones
+    try Check.writePendingManifests(tmp_dir.dir, 4);
+    {
+        var file = try tmp_dir.dir.createFile("idx/" ++ filefmt.manifest_commit_file_name, .{});
+        file.close();
+    }
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", options);
+        defer index.deinit();
+
+        try index.open(false);
+        try index.waitForReady(10000);
+
+        try Check.search(&index, &.{});
+    }
+    try std.testing.expectError(error.FileNotFound, tmp_dir.dir.access("idx/" ++ filefmt.manifest_commit_file_name, .{}));
+}
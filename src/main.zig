@@ -4,9 +4,11 @@ const log = std.log.scoped(.main);
 const zul = @import("zul");
 
 const Scheduler = @import("utils/Scheduler.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
 const MultiIndex = @import("MultiIndex.zig");
 const server = @import("server.zig");
 const metrics = @import("metrics.zig");
+const filefmt = @import("filefmt.zig");
 
 pub const std_options = .{
     .log_level = .debug,
@@ -37,6 +39,18 @@ pub fn logHandler(
     }
 }
 
+fn parseBlockLayout(args: *zul.CommandLineArgs, comptime prefix: []const u8, default: filefmt.BlockLayout) !filefmt.BlockLayout {
+    var layout = default;
+    if (args.get(prefix ++ "block-size")) |block_size_str| {
+        layout.block_size = try std.fmt.parseInt(usize, block_size_str, 10);
+    }
+    if (args.get(prefix ++ "block-format")) |block_format_name| {
+        layout.block_format = std.meta.stringToEnum(filefmt.BlockFormat, block_format_name) orelse return error.InvalidBlockFormat;
+    }
+    try layout.validate();
+    return layout;
+}
+
 pub fn main() !void {
     var gpa: std.heap.GeneralPurposeAllocator(.{}) = .{};
     defer _ = gpa.deinit();
@@ -76,20 +90,149 @@ pub fn main() !void {
     }
     log.info("using {} threads", .{threads});
 
+    const search_threads_str = args.get("search-threads") orelse "0";
+    const search_threads = try std.fmt.parseInt(u16, search_threads_str, 10);
+
+    var search_pool: std.Thread.Pool = undefined;
+    if (search_threads > 0) {
+        try search_pool.init(.{ .allocator = allocator, .n_jobs = search_threads });
+        log.info("using {} search threads", .{search_threads});
+    }
+    defer if (search_threads > 0) search_pool.deinit();
+
+    const search_cache_size_str = args.get("search-cache-size") orelse "0";
+    const search_cache_size = try std.fmt.parseInt(usize, search_cache_size_str, 10);
+
+    const block_cache_size_str = args.get("block-cache-size") orelse "0";
+    const block_cache_size = try std.fmt.parseInt(usize, block_cache_size_str, 10);
+
+    const oplog_max_batch_wait_us_str = args.get("oplog-max-batch-wait-us") orelse "0";
+    const oplog_max_batch_wait_us = try std.fmt.parseInt(u64, oplog_max_batch_wait_us_str, 10);
+
+    const merge_threads_str = args.get("merge-threads") orelse "1";
+    const merge_threads = try std.fmt.parseInt(usize, merge_threads_str, 10);
+
+    const fast_open = args.get("fast-open") != null;
+
+    const max_merge_write_rate_str = args.get("max-merge-write-rate") orelse "0";
+    const max_merge_write_rate = try std.fmt.parseInt(u64, max_merge_write_rate_str, 10);
+
+    var rate_limiter = RateLimiter.init(max_merge_write_rate * 1024 * 1024);
+
+    const min_reclaim_ratio_str = args.get("min-reclaim-ratio") orelse "0.33";
+    const min_reclaim_ratio = try std.fmt.parseFloat(f64, min_reclaim_ratio_str);
+
+    const busy_search_rate_str = args.get("busy-search-rate") orelse "0";
+    const busy_search_rate = try std.fmt.parseFloat(f64, busy_search_rate_str);
+
+    const busy_max_merge_size_str = args.get("busy-max-merge-size") orelse "50000000";
+    const busy_max_merge_size = try std.fmt.parseInt(usize, busy_max_merge_size_str, 10);
+
+    const block_layout = try parseBlockLayout(&args, "", .{});
+
+    var large_segment_layout: ?filefmt.BlockLayout = null;
+    if (args.get("large-segment-block-size") != null or args.get("large-segment-block-format") != null) {
+        large_segment_layout = try parseBlockLayout(&args, "large-segment-", block_layout);
+    }
+
+    const large_segment_min_size_str = args.get("large-segment-min-size") orelse "100000000";
+    const large_segment_min_size = try std.fmt.parseInt(usize, large_segment_min_size_str, 10);
+
+    // only used for new indexes, existing indexes must be opened with the same number
+    const shards_str = args.get("shards") orelse "1";
+    const num_shards = try std.fmt.parseInt(usize, shards_str, 10);
+
+    // replicas serve searches only, their indexes follow the leader
+    const leader_url = args.get("leader");
+
+    // limits for all indexes of the node
+    const max_memory_str = args.get("max-memory") orelse "0";
+    const max_memory = try std.fmt.parseInt(usize, max_memory_str, 10);
+
+    const max_open_indexes_str = args.get("max-open-indexes") orelse "0";
+    const max_open_indexes = try std.fmt.parseInt(usize, max_open_indexes_str, 10);
+
+    const index_idle_timeout_ms_str = args.get("index-idle-timeout-ms") orelse "0";
+    const index_idle_timeout_ms = try std.fmt.parseInt(u64, index_idle_timeout_ms_str, 10);
+
+    const replication_poll_interval_ms_str = args.get("replication-poll-interval-ms") orelse "1000";
+    const replication_poll_interval_ms = try std.fmt.parseInt(u64, replication_poll_interval_ms_str, 10);
+
     try metrics.initializeMetrics(allocator, .{ .prefix = "aindex_" });
     defer metrics.deinitMetrics();
 
     var scheduler = Scheduler.init(allocator);
     defer scheduler.deinit();
 
-    var indexes = MultiIndex.init(allocator, &scheduler, dir);
+    var indexes = MultiIndex.init(allocator, &scheduler, dir, .{
+        .search_pool = if (search_threads > 0) &search_pool else null,
+        .search_cache_size = search_cache_size,
+        .block_cache_size = block_cache_size * 1024 * 1024,
+        .oplog_max_batch_wait_us = oplog_max_batch_wait_us,
+        .merge_threads = merge_threads,
+        .fast_open = fast_open,
+        .rate_limiter = &rate_limiter,
+        .block_layout = block_layout,
+        .large_segment_layout = large_segment_layout,
+        .large_segment_min_size = large_segment_min_size,
+        .num_shards = num_shards,
+        .min_reclaim_ratio = min_reclaim_ratio,
+        .busy_search_rate = busy_search_rate,
+        .busy_max_merge_size = busy_max_merge_size,
+        .replica = leader_url != null,
+        .leader_url = leader_url,
+        .replication = .{ .poll_interval_ms = replication_poll_interval_ms },
+    }, .{
+        .max_memory = max_memory * 1024 * 1024,
+        .max_open_indexes = max_open_indexes,
+        .idle_timeout_ms = index_idle_timeout_ms,
+    });
     defer indexes.deinit();
 
     try scheduler.start(threads);
 
+    if (leader_url != null) {
+        if (args.get("replicate")) |index_names| {
+            var iter = std.mem.tokenizeScalar(u8, index_names, ',');
+            while (iter.next()) |index_name| {
+                try indexes.createIndex(index_name);
+            }
+        }
+    }
+
+    if (args.get("import")) |import_path| {
+        const index_name = args.get("index") orelse return error.MissingIndexName;
+        return runImport(&indexes, index_name, import_path);
+    }
+
+    try indexes.start();
+
     try server.run(allocator, &indexes, address, port, threads);
 }
 
+fn runImport(indexes: *MultiIndex, index_name: []const u8, path: []const u8) !void {
+    const file = if (std.mem.eql(u8, path, "-")) std.io.getStdIn() else try std.fs.cwd().openFile(path, .{});
+    defer file.close();
+
+    try indexes.createIndex(index_name);
+
+    const index = try indexes.getIndex(index_name);
+    defer indexes.releaseIndex(index);
+
+    while (true) {
+        index.waitForReady(1000) catch |err| {
+            if (err == error.Timeout) continue;
+            return err;
+        };
+        break;
+    }
+
+    log.info("importing {s} into index {s}", .{ path, index_name });
+
+    var buffered_reader = std.io.bufferedReader(file.reader());
+    try index.import(buffered_reader.reader(), .{});
+}
+
 test {
     std.testing.refAllDecls(@This());
 }
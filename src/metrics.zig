@@ -5,10 +5,19 @@ var metrics = m.initializeNoop(Metrics);
 var arena: ?std.heap.ArenaAllocator = null;
 
 const WithIndex = struct { index: []const u8 };
+const WithPriority = struct { priority: []const u8 };
+const WithIndexAndStage = struct { index: []const u8, stage: []const u8 };
+const WithIndexAndKind = struct { index: []const u8, kind: []const u8 };
 
 const SearchDuration = m.Histogram(
     f64,
-    &.{ 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 },
+    &.{ 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 },
+);
+
+const SearchStageDuration = m.HistogramVec(
+    f64,
+    WithIndexAndStage,
+    &.{ 0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1 },
 );
 
 const ScannedDocsPerHash = m.Histogram(
@@ -21,18 +30,47 @@ const ScannedBlocksPerHash = m.Histogram(
     &.{ 1, 2, 3, 5, 10 },
 );
 
+const SchedulerTaskLatency = m.Histogram(
+    f64,
+    &.{ 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60 },
+);
+
 const Metrics = struct {
     search_hits: m.Counter(u64),
     search_misses: m.Counter(u64),
     search_duration: SearchDuration,
+    search_stage_duration: SearchStageDuration,
+    search_major_page_faults: m.CounterVec(u64, WithIndex),
     searches: m.Counter(u64),
+    search_cache_hits: m.Counter(u64),
+    search_cache_misses: m.Counter(u64),
+    block_cache_hits: m.Counter(u64),
+    block_cache_misses: m.Counter(u64),
+    block_cache_evictions: m.Counter(u64),
+    skipped_hashes: m.Counter(u64),
     updates: m.Counter(u64),
     checkpoints: m.Counter(u64),
     memory_segment_merges: m.Counter(u64),
     file_segment_merges: m.Counter(u64),
     docs: m.GaugeVec(u32, WithIndex),
+    memory_segment_bytes: m.GaugeVec(u64, WithIndex),
+    memory_segment_pool_bytes: m.GaugeVec(u64, WithIndex),
     scanned_docs_per_hash: ScannedDocsPerHash,
     scanned_blocks_per_hash: ScannedBlocksPerHash,
+    scheduler_queue_depth: m.GaugeVec(u64, WithPriority),
+    scheduler_task_latency: SchedulerTaskLatency,
+    replicated_transactions: m.CounterVec(u64, WithIndex),
+    replicated_segments: m.CounterVec(u64, WithIndex),
+    replication_errors: m.CounterVec(u64, WithIndex),
+    index_memory_bytes: m.GaugeVec(u64, WithIndexAndKind),
+    memory_bytes: m.Gauge(u64),
+    open_indexes: m.Gauge(u64),
+    closed_indexes: m.Counter(u64),
+    forced_checkpoints: m.Counter(u64),
+    file_segment_ingested_items: m.Counter(u64),
+    file_segment_merge_input_items: m.Counter(u64),
+    file_segment_merge_written_items: m.Counter(u64),
+    deferred_merges: m.Counter(u64),
 };
 
 pub fn search() void {
@@ -47,8 +85,39 @@ pub fn searchMiss() void {
     metrics.search_misses.incr();
 }
 
-pub fn searchDuration(duration_ms: i64) void {
-    metrics.search_duration.observe(@as(f64, @floatFromInt(duration_ms)) / 1000.0);
+pub fn searchCacheHit() void {
+    metrics.search_cache_hits.incr();
+}
+
+pub fn searchCacheMiss() void {
+    metrics.search_cache_misses.incr();
+}
+
+pub fn searchDuration(duration_ns: u64) void {
+    metrics.search_duration.observe(@as(f64, @floatFromInt(duration_ns)) / std.time.ns_per_s);
+}
+
+/// Records the time spent in one stage of a search, e.g. "acquire_reader" or "file_segments".
+pub fn searchStageDuration(index_name: []const u8, stage: []const u8, duration_ns: u64) void {
+    metrics.search_stage_duration.observe(.{ .index = index_name, .stage = stage }, @as(f64, @floatFromInt(duration_ns)) / std.time.ns_per_s) catch {};
+}
+
+pub fn searchMajorPageFaults(index_name: []const u8, count: u64) void {
+    if (count > 0) {
+        metrics.search_major_page_faults.incrBy(.{ .index = index_name }, count) catch {};
+    }
+}
+
+pub fn blockCacheHit() void {
+    metrics.block_cache_hits.incr();
+}
+
+pub fn blockCacheMiss() void {
+    metrics.block_cache_misses.incr();
+}
+
+pub fn blockCacheEviction() void {
+    metrics.block_cache_evictions.incr();
 }
 
 pub fn scannedDocsPerHash(num_docs: u64) void {
@@ -59,6 +128,10 @@ pub fn scannedBlocksPerHash(num_blocks: u64) void {
     metrics.scanned_blocks_per_hash.observe(num_blocks);
 }
 
+pub fn skippedHash() void {
+    metrics.skipped_hashes.incr();
+}
+
 pub fn update(count: usize) void {
     metrics.updates.incrBy(@intCast(count));
 }
@@ -71,14 +144,73 @@ pub fn memorySegmentMerge() void {
     metrics.memory_segment_merges.incr();
 }
 
-pub fn fileSegmentMerge() void {
+pub fn fileSegmentMerge(input_items: usize, written_items: usize) void {
     metrics.file_segment_merges.incr();
+    metrics.file_segment_merge_input_items.incrBy(@intCast(input_items));
+    metrics.file_segment_merge_written_items.incrBy(@intCast(written_items));
+}
+
+// Items written to new file segments by checkpoints and imports, before any merges.
+pub fn fileSegmentIngest(num_items: usize) void {
+    metrics.file_segment_ingested_items.incrBy(@intCast(num_items));
+}
+
+pub fn deferredMerge() void {
+    metrics.deferred_merges.incr();
 }
 
 pub fn docs(index_name: []const u8, value: u32) void {
     metrics.docs.set(.{ .index = index_name }, value) catch {};
 }
 
+pub fn memorySegmentBytes(index_name: []const u8, value: usize) void {
+    metrics.memory_segment_bytes.set(.{ .index = index_name }, @intCast(value)) catch {};
+}
+
+pub fn memorySegmentPoolBytes(index_name: []const u8, value: usize) void {
+    metrics.memory_segment_pool_bytes.set(.{ .index = index_name }, @intCast(value)) catch {};
+}
+
+pub fn schedulerQueueDepth(priority: []const u8, value: usize) void {
+    metrics.scheduler_queue_depth.set(.{ .priority = priority }, @intCast(value)) catch {};
+}
+
+pub fn schedulerTaskLatency(latency_ns: u64) void {
+    metrics.scheduler_task_latency.observe(@as(f64, @floatFromInt(latency_ns)) / std.time.ns_per_s);
+}
+
+pub fn replicatedTransactions(index_name: []const u8, count: usize) void {
+    metrics.replicated_transactions.incrBy(.{ .index = index_name }, @intCast(count)) catch {};
+}
+
+pub fn replicatedSegment(index_name: []const u8) void {
+    metrics.replicated_segments.incrBy(.{ .index = index_name }, 1) catch {};
+}
+
+pub fn replicationError(index_name: []const u8) void {
+    metrics.replication_errors.incrBy(.{ .index = index_name }, 1) catch {};
+}
+
+pub fn indexMemoryBytes(index_name: []const u8, kind: []const u8, value: usize) void {
+    metrics.index_memory_bytes.set(.{ .index = index_name, .kind = kind }, @intCast(value)) catch {};
+}
+
+pub fn memoryBytes(value: usize) void {
+    metrics.memory_bytes.set(@intCast(value));
+}
+
+pub fn openIndexes(value: usize) void {
+    metrics.open_indexes.set(@intCast(value));
+}
+
+pub fn closedIndex() void {
+    metrics.closed_indexes.incr();
+}
+
+pub fn forcedCheckpoint() void {
+    metrics.forced_checkpoints.incr();
+}
+
 pub fn initializeMetrics(allocator: std.mem.Allocator, comptime opts: m.RegistryOpts) !void {
     arena = std.heap.ArenaAllocator.init(allocator);
     const alloc = arena.?.allocator();
@@ -87,14 +219,38 @@ pub fn initializeMetrics(allocator: std.mem.Allocator, comptime opts: m.Registry
         .search_hits = m.Counter(u64).init("search_hits_total", .{}, opts),
         .search_misses = m.Counter(u64).init("search_misses_total", .{}, opts),
         .search_duration = SearchDuration.init("search_duration_seconds", .{}, opts),
+        .search_stage_duration = try SearchStageDuration.init(alloc, "search_stage_duration_seconds", .{}, opts),
+        .search_major_page_faults = try m.CounterVec(u64, WithIndex).init(alloc, "search_major_page_faults_total", .{}, opts),
         .searches = m.Counter(u64).init("searches_total", .{}, opts),
+        .search_cache_hits = m.Counter(u64).init("search_cache_hits_total", .{}, opts),
+        .search_cache_misses = m.Counter(u64).init("search_cache_misses_total", .{}, opts),
+        .block_cache_hits = m.Counter(u64).init("block_cache_hits_total", .{}, opts),
+        .block_cache_misses = m.Counter(u64).init("block_cache_misses_total", .{}, opts),
+        .block_cache_evictions = m.Counter(u64).init("block_cache_evictions_total", .{}, opts),
+        .skipped_hashes = m.Counter(u64).init("search_skipped_hashes_total", .{}, opts),
         .updates = m.Counter(u64).init("updates_total", .{}, opts),
         .checkpoints = m.Counter(u64).init("checkpoints_total", .{}, opts),
         .memory_segment_merges = m.Counter(u64).init("memory_segment_merges_total", .{}, opts),
         .file_segment_merges = m.Counter(u64).init("file_segment_merges_total", .{}, opts),
         .docs = try m.GaugeVec(u32, WithIndex).init(alloc, "docs", .{}, opts),
+        .memory_segment_bytes = try m.GaugeVec(u64, WithIndex).init(alloc, "memory_segment_bytes", .{}, opts),
+        .memory_segment_pool_bytes = try m.GaugeVec(u64, WithIndex).init(alloc, "memory_segment_pool_bytes", .{}, opts),
         .scanned_docs_per_hash = ScannedDocsPerHash.init("scanned_docs_per_hash", .{}, opts),
         .scanned_blocks_per_hash = ScannedBlocksPerHash.init("scanned_blocks_per_hash", .{}, opts),
+        .scheduler_queue_depth = try m.GaugeVec(u64, WithPriority).init(alloc, "scheduler_queue_depth", .{}, opts),
+        .scheduler_task_latency = SchedulerTaskLatency.init("scheduler_task_latency_seconds", .{}, opts),
+        .replicated_transactions = try m.CounterVec(u64, WithIndex).init(alloc, "replicated_transactions_total", .{}, opts),
+        .replicated_segments = try m.CounterVec(u64, WithIndex).init(alloc, "replicated_segments_total", .{}, opts),
+        .replication_errors = try m.CounterVec(u64, WithIndex).init(alloc, "replication_errors_total", .{}, opts),
+        .index_memory_bytes = try m.GaugeVec(u64, WithIndexAndKind).init(alloc, "index_memory_bytes", .{}, opts),
+        .memory_bytes = m.Gauge(u64).init("memory_bytes", .{}, opts),
+        .open_indexes = m.Gauge(u64).init("open_indexes", .{}, opts),
+        .closed_indexes = m.Counter(u64).init("closed_indexes_total", .{}, opts),
+        .forced_checkpoints = m.Counter(u64).init("forced_checkpoints_total", .{}, opts),
+        .file_segment_ingested_items = m.Counter(u64).init("file_segment_ingested_items_total", .{}, opts),
+        .file_segment_merge_input_items = m.Counter(u64).init("file_segment_merge_input_items_total", .{}, opts),
+        .file_segment_merge_written_items = m.Counter(u64).init("file_segment_merge_written_items_total", .{}, opts),
+        .deferred_merges = m.Counter(u64).init("deferred_merges_total", .{}, opts),
     };
 }
 
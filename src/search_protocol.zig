@@ -0,0 +1,146 @@
+//! Compact binary encoding of multi-searches, for clients that send many small queries over
+//! one connection, e.g. the legacy proxy. There are no field names, all numbers are
+//! little-endian u32, so both sides can read them without a msgpack or JSON parser.
+//!
+//! Request: the number of queries, then for each query its result limit and timeout in
+//! milliseconds (zero for the defaults), the number of hashes and the hashes.
+//!
+//! Response: the number of queries, then for each query, in the same order, a flags word
+//! (bit 0 is set if the query timed out), the number of results and the (id, score) pairs.
+
+const std = @import("std");
+
+const SearchResult = @import("common.zig").SearchResult;
+
+pub const content_type = "application/vnd.fpindex.search";
+
+pub const flag_timed_out: u32 = 1;
+
+pub const Query = struct {
+    limit: u32 = 0,
+    timeout: u32 = 0,
+    hashes: []u32,
+};
+
+const Decoder = struct {
+    data: []const u8,
+    pos: usize = 0,
+
+    fn readInt(self: *Decoder) !u32 {
+        if (self.data.len - self.pos < 4) {
+            return error.InvalidSearchRequest;
+        }
+        const value = std.mem.readInt(u32, self.data[self.pos..][0..4], .little);
+        self.pos += 4;
+        return value;
+    }
+};
+
+/// Decodes the queries of a request, the hashes are copied, so they can be sorted in place.
+pub fn decodeRequest(allocator: std.mem.Allocator, data: []const u8, max_queries: usize) ![]Query {
+    var decoder = Decoder{ .data = data };
+
+    const num_queries = try decoder.readInt();
+    if (num_queries > max_queries) {
+        return error.TooManyQueries;
+    }
+
+    const queries = try allocator.alloc(Query, num_queries);
+    for (queries) |*query| {
+        const limit = try decoder.readInt();
+        const timeout = try decoder.readInt();
+        const num_hashes = try decoder.readInt();
+        if (num_hashes > (data.len - decoder.pos) / 4) {
+            return error.InvalidSearchRequest;
+        }
+        const hashes = try allocator.alloc(u32, num_hashes);
+        for (hashes) |*hash| {
+            hash.* = try decoder.readInt();
+        }
+        query.* = .{ .limit = limit, .timeout = timeout, .hashes = hashes };
+    }
+
+    if (decoder.pos != data.len) {
+        return error.InvalidSearchRequest;
+    }
+    return queries;
+}
+
+pub fn writeRequest(writer: anytype, queries: []const Query) !void {
+    try writer.writeInt(u32, @intCast(queries.len), .little);
+    for (queries) |query| {
+        try writer.writeInt(u32, query.limit, .little);
+        try writer.writeInt(u32, query.timeout, .little);
+        try writer.writeInt(u32, @intCast(query.hashes.len), .little);
+        for (query.hashes) |hash| {
+            try writer.writeInt(u32, hash, .little);
+        }
+    }
+}
+
+pub fn writeResponseHeader(writer: anytype, num_queries: usize) !void {
+    try writer.writeInt(u32, @intCast(num_queries), .little);
+}
+
+/// Writes the results of one query, after the response header.
+pub fn writeResults(writer: anytype, results: []const SearchResult, timed_out: bool) !void {
+    try writer.writeInt(u32, if (timed_out) flag_timed_out else 0, .little);
+    try writer.writeInt(u32, @intCast(results.len), .little);
+    for (results) |result| {
+        try writer.writeInt(u32, result.id, .little);
+        try writer.writeInt(u32, result.score, .little);
+    }
+}
+
+test "decode request" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    var hashes1 = [_]u32{ 1, 2, 0xffffffff };
+    var hashes2 = [_]u32{};
+    const queries = [_]Query{
+        .{ .limit = 10, .timeout = 500, .hashes = &hashes1 },
+        .{ .hashes = &hashes2 },
+    };
+
+    var buf = std.ArrayList(u8).init(allocator);
+    try writeRequest(buf.writer(), &queries);
+    try std.testing.expectEqual(4 + 3 * 4 + 3 * 4 + 3 * 4, buf.items.len);
+
+    const decoded = try decodeRequest(allocator, buf.items, 10);
+    try std.testing.expectEqual(2, decoded.len);
+    try std.testing.expectEqual(10, decoded[0].limit);
+    try std.testing.expectEqual(500, decoded[0].timeout);
+    try std.testing.expectEqualSlices(u32, &hashes1, decoded[0].hashes);
+    try std.testing.expectEqual(0, decoded[1].limit);
+    try std.testing.expectEqual(0, decoded[1].hashes.len);
+
+    try std.testing.expectError(error.TooManyQueries, decodeRequest(allocator, buf.items, 1));
+
+    // truncated, or with trailing data
+    try std.testing.expectError(error.InvalidSearchRequest, decodeRequest(allocator, buf.items[0 .. buf.items.len - 1], 10));
+    try buf.append(0);
+    try std.testing.expectError(error.InvalidSearchRequest, decodeRequest(allocator, buf.items, 10));
+
+    // more hashes than the data could hold
+    const bogus = [_]u8{ 1, 0, 0, 0 } ++ [_]u8{0} ** 8 ++ [_]u8{ 0xff, 0xff, 0xff, 0xff };
+    try std.testing.expectError(error.InvalidSearchRequest, decodeRequest(allocator, &bogus, 10));
+}
+
+test "write response" {
+    var buf = std.ArrayList(u8).init(std.testing.allocator);
+    defer buf.deinit();
+
+    const results = [_]SearchResult{
+        .{ .id = 1, .score = 10 },
+        .{ .id = 7, .score = 3 },
+    };
+
+    try writeResponseHeader(buf.writer(), 2);
+    try writeResults(buf.writer(), &results, false);
+    try writeResults(buf.writer(), &.{}, true);
+
+    const expected = [_]u32{ 2, 0, 2, 1, 10, 7, 3, flag_timed_out, 0 };
+    try std.testing.expectEqualSlices(u8, std.mem.sliceAsBytes(&expected), buf.items);
+}
@@ -50,6 +50,71 @@ test "SegmentInfo.contains" {
     try std.testing.expect(c.contains(c));
 }
 
+/// Hashes in the range [start, end), a range without an end goes up to the last hash.
+pub const HashRange = struct {
+    start: u32 = 0,
+    end: ?u32 = null,
+
+    /// Returns the i-th of `n` ranges of equal width that together cover all hashes.
+    pub fn split(n: usize, i: usize) HashRange {
+        std.debug.assert(n > 0 and i < n);
+        return .{
+            .start = splitPoint(n, i),
+            .end = if (i + 1 < n) splitPoint(n, i + 1) else null,
+        };
+    }
+
+    // the first hash h for which h * n / 2^32 >= i
+    fn splitPoint(n: usize, i: usize) u32 {
+        return @intCast(((@as(u64, i) << 32) + n - 1) / n);
+    }
+
+    pub fn contains(self: HashRange, hash: u32) bool {
+        if (self.end) |end| {
+            if (hash >= end) {
+                return false;
+            }
+        }
+        return hash >= self.start;
+    }
+
+    /// Returns the offset and the length of the part of `sorted_hashes` that falls into the range.
+    pub fn find(self: HashRange, sorted_hashes: []const u32) struct { usize, usize } {
+        const start = std.sort.lowerBound(u32, self.start, sorted_hashes, {}, std.sort.asc(u32));
+        const end = if (self.end) |end| std.sort.lowerBound(u32, end, sorted_hashes, {}, std.sort.asc(u32)) else sorted_hashes.len;
+        return .{ start, end - start };
+    }
+};
+
+test "HashRange" {
+    const whole = HashRange.split(1, 0);
+    try std.testing.expectEqual(0, whole.start);
+    try std.testing.expectEqual(null, whole.end);
+    try std.testing.expect(whole.contains(std.math.maxInt(u32)));
+
+    // consecutive ranges cover all hashes without gaps
+    const n = 3;
+    for (0..n) |i| {
+        const range = HashRange.split(n, i);
+        if (i == 0) {
+            try std.testing.expectEqual(0, range.start);
+        } else {
+            try std.testing.expectEqual(HashRange.split(n, i - 1).end.?, range.start);
+        }
+        try std.testing.expect(range.contains(range.start));
+        try std.testing.expect(!range.contains(range.start -% 1) or i == 0);
+    }
+    try std.testing.expectEqual(null, HashRange.split(n, n - 1).end);
+
+    const hashes = [_]u32{ 1, 2, 0x60000000, 0xffffffff };
+    const expected = [_][2]usize{ .{ 0, 2 }, .{ 2, 1 }, .{ 3, 1 } };
+    for (expected, 0..) |e, i| {
+        const offset, const len = HashRange.split(n, i).find(&hashes);
+        try std.testing.expectEqual(e[0], offset);
+        try std.testing.expectEqual(e[1], len);
+    }
+}
+
 pub const Item = packed struct(u64) {
     id: u32,
     hash: u32,
@@ -67,6 +132,9 @@ pub const Item = packed struct(u64) {
 
 pub const SegmentStatus = struct {
     frozen: bool = false,
+    // docs that newer segments of the same list have newer versions of, merges drop them,
+    // it's not persisted and counted again when the segments are loaded
+    superseded_docs: u32 = 0,
 };
 
 test "Item binary" {
@@ -1,7 +1,9 @@
 const std = @import("std");
+const assert = std.debug.assert;
 const Allocator = std.mem.Allocator;
 
 const SearchResults = @import("common.zig").SearchResults;
+const SearchTimings = @import("common.zig").SearchTimings;
 
 const Change = @import("change.zig").Change;
 const KeepOrDelete = @import("common.zig").KeepOrDelete;
@@ -9,10 +11,15 @@ const SegmentInfo = @import("segment.zig").SegmentInfo;
 const DocInfo = @import("common.zig").DocInfo;
 
 const Deadline = @import("utils/Deadline.zig");
+const getMajorPageFaults = @import("utils/page_faults.zig").getMajorPageFaults;
 
 const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
 const TieredMergePolicy = @import("segment_merge_policy.zig").TieredMergePolicy;
+const MergeCandidate = @import("segment_merge_policy.zig").MergeCandidate;
+const MergeLoad = @import("segment_merge_policy.zig").MergeLoad;
 const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
+const getDoc = @import("segment_merger.zig").getDoc;
+const metrics = @import("metrics.zig");
 
 pub fn SegmentList(Segment: type) type {
     return struct {
@@ -95,6 +102,15 @@ pub fn SegmentList(Segment: type) type {
             }
         }
 
+        pub fn removeSegmentsUpToInto(self: Self, copy: *Self, commit_id: u64) void {
+            copy.nodes.clearRetainingCapacity();
+            for (self.nodes.items) |n| {
+                if (n.value.info.getLastCommitId() > commit_id) {
+                    copy.nodes.appendAssumeCapacity(n.acquire());
+                }
+            }
+        }
+
         pub fn replaceMergedSegmentInto(self: *Self, copy: *Self, node: Node) void {
             copy.nodes.clearRetainingCapacity();
             var inserted_merged = false;
@@ -141,13 +157,21 @@ pub fn SegmentList(Segment: type) type {
         pub fn getDocInfo(self: Self, doc_id: u32) ?DocInfo {
             var result: ?DocInfo = null;
             for (self.nodes.items) |node| {
+                if (!node.value.doc_filter.mayContain(doc_id)) {
+                    continue;
+                }
                 const active = node.value.docs.get(doc_id) orelse continue;
                 result = .{ .version = node.value.info.version, .deleted = !active };
             }
             return result;
         }
 
-        pub fn search(self: Self, hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+        pub fn search(self: Self, hashes: []const u32, results: anytype, deadline: Deadline) !void {
+            if (@hasField(@TypeOf(results.*), "profile")) {
+                if (results.profile != null) {
+                    return self.searchProfiled(hashes, results, deadline);
+                }
+            }
             var i: usize = self.nodes.items.len;
             while (i > 0) {
                 i -= 1;
@@ -157,6 +181,102 @@ pub fn SegmentList(Segment: type) type {
             }
         }
 
+        fn searchProfiled(self: Self, hashes: []const u32, results: anytype, deadline: Deadline) !void {
+            var i: usize = self.nodes.items.len;
+            while (i > 0) {
+                i -= 1;
+                const node = self.nodes.items[i];
+                try deadline.check();
+
+                const blocks = results.scanned_blocks;
+                const hits = results.scanned_hits;
+                const faults = getMajorPageFaults();
+                var start = std.time.nanoTimestamp();
+
+                try node.value.search(hashes, results, deadline);
+
+                try results.profile.?.append(.{
+                    .tier = Segment.tier_name,
+                    .version = node.value.info.version,
+                    .merges = node.value.info.merges,
+                    .blocks = results.scanned_blocks - blocks,
+                    .hits = results.scanned_hits - hits,
+                    .major_faults = getMajorPageFaults() - faults,
+                    .duration_ns = SearchTimings.lap(&start),
+                });
+            }
+        }
+
+        const PartialSearch = struct {
+            results: SearchResults,
+            err: ?anyerror = null,
+        };
+
+        fn searchPartial(segment: *const Segment, hashes: []const u32, partial: *PartialSearch, deadline: Deadline, wait_group: *std.Thread.WaitGroup) void {
+            defer wait_group.finish();
+
+            deadline.check() catch |err| {
+                partial.err = err;
+                return;
+            };
+
+            const faults = getMajorPageFaults();
+            defer partial.results.major_faults += getMajorPageFaults() - faults;
+
+            segment.search(hashes, &partial.results, deadline) catch |err| {
+                partial.err = err;
+            };
+        }
+
+        // Searches each segment on the search thread pool, collecting the hits into partial results,
+        // which are merged into the main results once all segments are done. The calling thread
+        // searches the first segment itself, so that it doesn't just sit idle waiting for the others.
+        pub fn searchParallel(self: Self, pool: *std.Thread.Pool, hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+            // profiled searches go one segment at a time, so that the time can be attributed to each
+            const nodes = self.nodes.items;
+            if (nodes.len < 2 or results.profile != null) {
+                const faults = getMajorPageFaults();
+                defer results.major_faults += getMajorPageFaults() - faults;
+                return self.search(hashes, results, deadline);
+            }
+
+            // partial results are filled in from different threads, so they can't use the request arena
+            const partials = try pool.allocator.alloc(PartialSearch, nodes.len);
+            defer pool.allocator.free(partials);
+
+            for (partials) |*partial| {
+                partial.* = .{ .results = SearchResults.init(pool.allocator, results.options) };
+            }
+            defer {
+                for (partials) |*partial| {
+                    partial.results.deinit();
+                }
+            }
+
+            var wait_group: std.Thread.WaitGroup = .{};
+            for (nodes[1..], partials[1..]) |node, *partial| {
+                wait_group.start();
+                pool.spawn(searchPartial, .{ node.value, hashes, partial, deadline, &wait_group }) catch {
+                    searchPartial(node.value, hashes, partial, deadline, &wait_group);
+                };
+            }
+
+            wait_group.start();
+            searchPartial(nodes[0].value, hashes, &partials[0], deadline, &wait_group);
+
+            wait_group.wait();
+
+            for (partials) |*partial| {
+                if (partial.err) |err| {
+                    return err;
+                }
+            }
+
+            for (partials) |*partial| {
+                try results.merge(&partial.results);
+            }
+        }
+
         fn compareByVersion(_: void, lhs: u32, rhs: Node) bool {
             return lhs < rhs.value.id.version;
         }
@@ -167,7 +287,7 @@ pub fn SegmentList(Segment: type) type {
                 i -= 1;
                 const node = self.nodes.items[i];
                 if (node.value.info.version > version) {
-                    if (doc_id >= node.value.min_doc_id and doc_id <= node.value.max_doc_id) {
+                    if (doc_id >= node.value.min_doc_id and doc_id <= node.value.max_doc_id and node.value.doc_filter.mayContain(doc_id)) {
                         if (node.value.docs.contains(doc_id)) {
                             return true;
                         }
@@ -179,6 +299,49 @@ pub fn SegmentList(Segment: type) type {
             return false;
         }
 
+        /// Counts the docs that `node` has newer versions of as superseded in the older segments.
+        /// A doc is only counted in the newest older segment that has it, the segments before
+        /// that one were counted when it was added.
+        pub fn markSupersededDocs(older: []const Node, node: Node) void {
+            var iter = node.value.docs.iterator();
+            while (iter.next()) |entry| {
+                const doc_id = getDoc(entry)[0];
+                var i = older.len;
+                while (i > 0) {
+                    i -= 1;
+                    const segment = older[i].value;
+                    if (segment.info.version >= node.value.info.version) {
+                        continue;
+                    }
+                    if (doc_id >= segment.min_doc_id and doc_id <= segment.max_doc_id and segment.doc_filter.mayContain(doc_id)) {
+                        if (segment.docs.contains(doc_id)) {
+                            segment.status.superseded_docs += 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        /// Returns the number of docs of `node` that the `newer` segments have newer versions of.
+        pub fn countDocsSupersededBy(node: Node, newer: []const Node) u32 {
+            var result: u32 = 0;
+            var iter = node.value.docs.iterator();
+            while (iter.next()) |entry| {
+                const doc_id = getDoc(entry)[0];
+                for (newer) |newer_node| {
+                    const segment = newer_node.value;
+                    if (doc_id >= segment.min_doc_id and doc_id <= segment.max_doc_id and segment.doc_filter.mayContain(doc_id)) {
+                        if (segment.docs.contains(doc_id)) {
+                            result += 1;
+                            break;
+                        }
+                    }
+                }
+            }
+            return result;
+        }
+
         pub fn count(self: Self) usize {
             return self.nodes.items.len;
         }
@@ -211,18 +374,37 @@ fn isFrozenFn(comptime T: type) fn (SharedPtr(T)) bool {
     return tmp.isFrozen;
 }
 
+// Items of superseded docs are estimated from the share of superseded docs.
+fn getReclaimableSizeFn(comptime T: type) fn (SharedPtr(T)) usize {
+    const tmp = struct {
+        fn getReclaimableSize(segment: SharedPtr(T)) usize {
+            const num_docs = segment.value.docs.count();
+            if (num_docs == 0) {
+                return 0;
+            }
+            const superseded_docs = @min(num_docs, segment.value.status.superseded_docs);
+            return segment.value.getSize() * superseded_docs / num_docs;
+        }
+    };
+    return tmp.getReclaimableSize;
+}
+
 pub fn SegmentListManager(Segment: type) type {
     return struct {
         pub const Self = @This();
         pub const List = SegmentList(Segment);
-        pub const MergePolicy = TieredMergePolicy(List.Node, getSizeFn(Segment), isFrozenFn(Segment));
+        pub const MergePolicy = TieredMergePolicy(List.Node, getSizeFn(Segment), isFrozenFn(Segment), getReclaimableSizeFn(Segment));
+        pub const MergePlan = MergePolicy.FindSegmentsToMergeResult;
 
         options: Segment.Options,
         segments: SharedPtr(List),
         merge_policy: MergePolicy,
         num_allowed_segments: std.atomic.Value(usize),
+        needs_reclaim: std.atomic.Value(bool),
         update_lock: std.Thread.Mutex,
         status_update_lock: std.Thread.Mutex,
+        // appends reserved with `reserveAppend`, but not started yet, guarded by `update_lock`
+        num_reserved_appends: usize,
 
         pub fn init(allocator: Allocator, options: Segment.Options, merge_policy: MergePolicy) !Self {
             const segments = try SharedPtr(List).create(allocator, List.initEmpty());
@@ -231,8 +413,10 @@ pub fn SegmentListManager(Segment: type) type {
                 .segments = segments,
                 .merge_policy = merge_policy,
                 .num_allowed_segments = std.atomic.Value(usize).init(0),
+                .needs_reclaim = std.atomic.Value(bool).init(false),
                 .update_lock = .{},
                 .status_update_lock = .{},
+                .num_reserved_appends = 0,
             };
         }
 
@@ -257,7 +441,48 @@ pub fn SegmentListManager(Segment: type) type {
         }
 
         pub fn needsMerge(self: Self) bool {
-            return self.segments.value.nodes.items.len > self.num_allowed_segments.load(.acquire);
+            return self.segments.value.nodes.items.len > self.num_allowed_segments.load(.acquire) or self.needs_reclaim.load(.acquire);
+        }
+
+        /// Counts superseded docs of all segments, e.g. after loading them.
+        /// Nothing else can be using the segments.
+        pub fn countSupersededDocs(self: *Self) void {
+            const nodes = self.segments.value.nodes.items;
+            for (nodes) |node| {
+                node.value.status.superseded_docs = 0;
+            }
+            for (nodes, 0..) |node, i| {
+                List.markSupersededDocs(nodes[0..i], node);
+            }
+            self.needs_reclaim.store(self.merge_policy.needsReclaim(nodes), .release);
+        }
+
+        // Must be called with `update_lock` held, before `node` is added to the list.
+        fn markSupersededDocs(self: *Self, node: List.Node) void {
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            const nodes = self.segments.value.nodes.items;
+            List.markSupersededDocs(nodes, node);
+            self.needs_reclaim.store(self.merge_policy.needsReclaim(nodes), .release);
+        }
+
+        fn updateNeedsReclaim(self: *Self, nodes: []List.Node) void {
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            self.needs_reclaim.store(self.merge_policy.needsReclaim(nodes), .release);
+        }
+
+        /// Returns the merge that would be done next, without doing it.
+        pub fn planMerge(self: *Self, allocator: Allocator, load: MergeLoad) MergePlan {
+            var segments = self.acquireSegments();
+            defer destroySegments(allocator, &segments);
+
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            return self.merge_policy.plan(segments.value.nodes.items, load);
         }
 
         pub fn prepareCheckpoint(self: *Self, allocator: Allocator) ?List.Node {
@@ -275,7 +500,25 @@ pub fn SegmentListManager(Segment: type) type {
             return null;
         }
 
-        pub fn prepareMerge(self: *Self, allocator: Allocator) !?Update {
+        /// Makes the first segment ready for checkpoint, regardless of its size.
+        /// Returns false if there is no segment, or it was already frozen.
+        pub fn freezeFirstSegment(self: *Self, allocator: Allocator) bool {
+            var segments = self.acquireSegments();
+            defer destroySegments(allocator, &segments);
+
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            if (segments.value.getFirst()) |node| {
+                if (!node.value.status.frozen) {
+                    node.value.status.frozen = true;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        pub fn prepareMerge(self: *Self, allocator: Allocator, load: MergeLoad) !?Update {
             var segments = self.acquireSegments();
             defer destroySegments(allocator, &segments);
 
@@ -296,12 +539,14 @@ pub fn SegmentListManager(Segment: type) type {
                     }
                 }
 
-                self.num_allowed_segments.store(self.merge_policy.calculateBudget(segments.value.nodes.items), .release);
-                if (!self.needsMerge()) {
-                    return null;
+                const plan = self.merge_policy.plan(segments.value.nodes.items, load);
+                self.num_allowed_segments.store(plan.num_allowed_segments, .release);
+                self.needs_reclaim.store(self.merge_policy.needsReclaim(segments.value.nodes.items), .release);
+                if (plan.deferred) {
+                    metrics.deferredMerge();
                 }
 
-                break :blk self.merge_policy.findSegmentsToMerge(segments.value.nodes.items) orelse return null;
+                break :blk plan.candidate orelse return null;
             };
 
             var target = try List.createSegment(allocator, self.options);
@@ -319,7 +564,22 @@ pub fn SegmentListManager(Segment: type) type {
             errdefer target.value.cleanup();
 
             var update = try self.beginUpdate(allocator);
+
+            // The target keeps the docs that the segments after the merged ones have newer versions of,
+            // including ones added during the merge. With `update_lock` held, the list can't change.
+            {
+                const nodes = self.segments.value.nodes.items;
+                const last_commit_id = target.value.info.getLastCommitId();
+                var first_newer: usize = nodes.len;
+                while (first_newer > 0 and nodes[first_newer - 1].value.info.version > last_commit_id) {
+                    first_newer -= 1;
+                }
+                target.value.status.superseded_docs = List.countDocsSupersededBy(target, nodes[first_newer..]);
+            }
+
             update.replaceMergedSegment(target);
+            update.merge = candidate;
+            update.merged_size = target.value.getSize();
 
             return update;
         }
@@ -328,6 +588,9 @@ pub fn SegmentListManager(Segment: type) type {
             manager: *Self,
             segments: SharedPtr(List),
             committed: bool = false,
+            // set for updates prepared by `prepareMerge`
+            merge: ?MergeCandidate = null,
+            merged_size: usize = 0,
 
             pub fn removeSegment(self: *@This(), node: List.Node) void {
                 self.manager.segments.value.removeSegmentInto(self.segments.value, node);
@@ -337,14 +600,30 @@ pub fn SegmentListManager(Segment: type) type {
                 if (node.value.getSize() > self.manager.merge_policy.max_segment_size) {
                     node.value.status.frozen = true;
                 }
+                self.manager.markSupersededDocs(node);
                 self.manager.segments.value.appendSegmentInto(self.segments.value, node);
             }
 
+            /// Removes segments that contain only changes up to `commit_id`.
+            pub fn removeSegmentsUpTo(self: *@This(), commit_id: u64) void {
+                self.manager.segments.value.removeSegmentsUpToInto(self.segments.value, commit_id);
+            }
+
+            /// Replaces the whole list, e.g. with segments copied from another node.
+            pub fn replaceSegments(self: *@This(), allocator: Allocator, nodes: []const List.Node) !void {
+                assert(self.segments.value.nodes.items.len == 0);
+                try self.segments.value.nodes.ensureTotalCapacity(allocator, nodes.len);
+                for (nodes) |node| {
+                    self.segments.value.nodes.appendAssumeCapacity(node.acquire());
+                }
+            }
+
             pub fn replaceMergedSegment(self: *@This(), node: List.Node) void {
                 if (node.value.getSize() > self.manager.merge_policy.max_segment_size) {
                     node.value.status.frozen = true;
                 }
                 self.manager.segments.value.replaceMergedSegmentInto(self.segments.value, node);
+                self.manager.updateNeedsReclaim(self.segments.value.nodes.items);
             }
         };
 
@@ -364,6 +643,44 @@ pub fn SegmentListManager(Segment: type) type {
             };
         }
 
+        /// Allocates the list for an update that appends one segment, so that it can be started
+        /// later with `beginReservedUpdate`, which can't fail. Reserved updates must be started
+        /// in the order they were reserved, the list has room for the segments of all earlier ones.
+        pub fn reserveAppend(self: *Self, allocator: Allocator) !SharedPtr(List) {
+            self.update_lock.lock();
+            defer self.update_lock.unlock();
+
+            var segments = try SharedPtr(List).create(allocator, List.initEmpty());
+            errdefer destroySegments(allocator, &segments);
+
+            try segments.value.nodes.ensureTotalCapacity(allocator, self.count() + self.num_reserved_appends + 1);
+            self.num_reserved_appends += 1;
+
+            return segments;
+        }
+
+        pub fn cancelReservedAppend(self: *Self, allocator: Allocator, segments: *SharedPtr(List)) void {
+            self.update_lock.lock();
+            self.num_reserved_appends -= 1;
+            self.update_lock.unlock();
+
+            destroySegments(allocator, segments);
+        }
+
+        /// Starts an update with a list from `reserveAppend`, only segments can be appended to it.
+        pub fn beginReservedUpdate(self: *Self, segments: SharedPtr(List)) Update {
+            self.update_lock.lock();
+            self.num_reserved_appends -= 1;
+
+            // other updates only append reserved segments, or remove some
+            assert(segments.value.nodes.capacity >= self.count() + 1);
+
+            return .{
+                .manager = self,
+                .segments = segments,
+            };
+        }
+
         pub fn commitUpdate(self: *Self, update: *Update) void {
             self.segments.swap(&update.segments);
             self.update_lock.unlock();
@@ -378,3 +695,173 @@ pub fn SegmentListManager(Segment: type) type {
         }
     };
 }
+
+test "SegmentList.searchParallel" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const List = SegmentList(MemorySegment);
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = std.testing.allocator, .n_jobs = 2 });
+    defer pool.deinit();
+
+    var segments = try List.init(std.testing.allocator, 3);
+    defer segments.deinit(std.testing.allocator, .delete);
+
+    for (0..3) |i| {
+        const node = try List.createSegment(std.testing.allocator, .{});
+        segments.nodes.appendAssumeCapacity(node);
+
+        const doc_id: u32 = @intCast(i + 2);
+        node.value.info = .{ .version = i + 1 };
+        try node.value.build(&.{
+            .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 2, 3 } } },
+            .{ .insert = .{ .id = doc_id, .hashes = &[_]u32{ 1, 2 } } },
+        });
+    }
+
+    var results = SearchResults.init(std.testing.allocator, .{});
+    defer results.deinit();
+
+    try segments.searchParallel(&pool, &[_]u32{ 1, 2, 3 }, &results, .{});
+
+    // doc 1 is in all segments, only the newest version counts
+    try std.testing.expectEqual(4, results.count());
+    try std.testing.expectEqual(3, results.get(1).?.version);
+    try std.testing.expectEqual(3, results.get(1).?.score);
+    try std.testing.expectEqual(2, results.get(2).?.score);
+}
+
+test "SegmentListManager reserved appends" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Manager = SegmentListManager(MemorySegment);
+    const allocator = std.testing.allocator;
+
+    var manager = try Manager.init(allocator, .{}, .{ .max_segments = 10 });
+    defer manager.deinit(allocator, .delete);
+
+    // both are reserved before either is started, the second one has room for the first segment
+    var reserved: [2]SharedPtr(Manager.List) = undefined;
+    for (&reserved) |*segments| {
+        segments.* = try manager.reserveAppend(allocator);
+    }
+    try std.testing.expectEqual(2, manager.num_reserved_appends);
+
+    for (reserved, 1..) |segments, version| {
+        var node = try Manager.List.createSegment(allocator, .{});
+        defer Manager.List.destroySegment(allocator, &node);
+        node.value.info = .{ .version = version };
+
+        var upd = manager.beginReservedUpdate(segments);
+        defer manager.cleanupAfterUpdate(allocator, &upd);
+        upd.appendSegment(node);
+        manager.commitUpdate(&upd);
+    }
+    try std.testing.expectEqual(2, manager.count());
+    try std.testing.expectEqual(0, manager.num_reserved_appends);
+
+    var cancelled = try manager.reserveAppend(allocator);
+    manager.cancelReservedAppend(allocator, &cancelled);
+    try std.testing.expectEqual(0, manager.num_reserved_appends);
+}
+
+test "SegmentListManager superseded docs" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Manager = SegmentListManager(MemorySegment);
+    const allocator = std.testing.allocator;
+
+    var manager = try Manager.init(allocator, .{}, .{ .max_segments = 10, .min_reclaim_ratio = 0.5 });
+    defer manager.deinit(allocator, .delete);
+
+    const segment_docs = [_][]const u32{ &.{ 1, 2, 3, 4 }, &.{ 1, 2 }, &.{ 2, 5 } };
+    for (segment_docs, 1..) |doc_ids, version| {
+        var node = try Manager.List.createSegment(allocator, .{});
+        defer Manager.List.destroySegment(allocator, &node);
+
+        var changes: [4]Change = undefined;
+        for (doc_ids, 0..) |doc_id, i| {
+            changes[i] = .{ .insert = .{ .id = doc_id, .hashes = &[_]u32{ 1, 2 } } };
+        }
+        node.value.info = .{ .version = version };
+        try node.value.build(changes[0..doc_ids.len]);
+
+        var upd = try manager.beginUpdate(allocator);
+        defer manager.cleanupAfterUpdate(allocator, &upd);
+        upd.appendSegment(node);
+        manager.commitUpdate(&upd);
+    }
+
+    // docs 1 and 2 of the first segment were updated by the second one, doc 2 of the second one by the third one
+    const check = struct {
+        fn run(m: *Manager) !void {
+            const nodes = m.segments.value.nodes.items;
+            try std.testing.expectEqual(2, nodes[0].value.status.superseded_docs);
+            try std.testing.expectEqual(1, nodes[1].value.status.superseded_docs);
+            try std.testing.expectEqual(0, nodes[2].value.status.superseded_docs);
+        }
+    };
+    try check.run(&manager);
+
+    manager.countSupersededDocs();
+    try check.run(&manager);
+
+    // few segments, but half of the first one is superseded
+    try std.testing.expect(manager.needsMerge());
+
+    const plan = manager.planMerge(allocator, .{});
+    try std.testing.expectEqual(3, plan.num_segments);
+    try std.testing.expectEqual(0, plan.candidate.?.start);
+
+    var upd = (try manager.prepareMerge(allocator, .{})).?;
+    defer manager.cleanupAfterUpdate(allocator, &upd);
+    manager.commitUpdate(&upd);
+
+    // the merged segment has only the newest versions of its docs
+    const nodes = manager.segments.value.nodes.items;
+    try std.testing.expectEqual(2, nodes.len);
+    try std.testing.expectEqual(3, nodes[0].value.docs.count());
+    try std.testing.expectEqual(0, nodes[0].value.status.superseded_docs);
+    try std.testing.expect(!manager.needsMerge());
+}
+
+test "SegmentListManager superseded docs after merging older segments" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Manager = SegmentListManager(MemorySegment);
+    const allocator = std.testing.allocator;
+
+    // the last segment is oversized, so only the first two can be merged
+    var manager = try Manager.init(allocator, .{}, .{ .max_segments = 10, .max_segment_size = 8, .min_reclaim_ratio = 0.5 });
+    defer manager.deinit(allocator, .delete);
+
+    const segment_docs = [_][]const u32{ &.{ 1, 2 }, &.{ 3, 4 }, &.{ 1, 3, 5, 6, 7 } };
+    for (segment_docs, 1..) |doc_ids, version| {
+        var node = try Manager.List.createSegment(allocator, .{});
+        defer Manager.List.destroySegment(allocator, &node);
+
+        var changes: [5]Change = undefined;
+        for (doc_ids, 0..) |doc_id, i| {
+            changes[i] = .{ .insert = .{ .id = doc_id, .hashes = &[_]u32{ 1, 2 } } };
+        }
+        node.value.info = .{ .version = version };
+        try node.value.build(changes[0..doc_ids.len]);
+
+        var upd = try manager.beginUpdate(allocator);
+        defer manager.cleanupAfterUpdate(allocator, &upd);
+        upd.appendSegment(node);
+        manager.commitUpdate(&upd);
+    }
+
+    var upd = (try manager.prepareMerge(allocator, .{})).?;
+    defer manager.cleanupAfterUpdate(allocator, &upd);
+    try std.testing.expectEqual(0, upd.merge.?.start);
+    try std.testing.expectEqual(2, upd.merge.?.end);
+    manager.commitUpdate(&upd);
+
+    // docs 1 and 3 of the merged segment still have newer versions in the last one
+    const nodes = manager.segments.value.nodes.items;
+    try std.testing.expectEqual(2, nodes.len);
+    try std.testing.expectEqual(4, nodes[0].value.docs.count());
+    try std.testing.expectEqual(2, nodes[0].value.status.superseded_docs);
+
+    manager.countSupersededDocs();
+    try std.testing.expectEqual(2, nodes[0].value.status.superseded_docs);
+}
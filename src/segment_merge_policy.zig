@@ -10,6 +10,11 @@ const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
 // The main difference is that we only merge adjacent segments, and restrict
 // merges, so that we always maintain the sorting order.
 //
+// Like in Lucene, merges that reclaim more items of superseded docs are preferred,
+// because less is written per reclaimed item. Segments with mostly superseded items
+// are rewritten on their own, and large merges can be deferred while the node is
+// busy with searches.
+//
 // The original code is licensed under this license:
 //
 // Licensed to the Apache Software Foundation (ASF) under one or more
@@ -33,18 +38,30 @@ pub const MergeCandidate = struct {
     start: usize,
     end: usize,
     size: usize = 0,
+    // estimated items of superseded docs that the merge drops
+    reclaimable_size: usize = 0,
     score: f64 = 0.0,
 };
 
+// Conditions on the node at the time of planning a merge.
+pub const MergeLoad = struct {
+    // searches per second
+    search_rate: f64 = 0,
+};
+
 pub fn GetSizeFn(comptime S: type) type {
     return fn (S) usize;
 }
 
+pub fn GetReclaimableSizeFn(comptime S: type) type {
+    return fn (S) usize;
+}
+
 pub fn IsFrozenFn(comptime S: type) type {
     return fn (S) bool;
 }
 
-pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(Segment), comptime isFrozenFn: IsFrozenFn(Segment)) type {
+pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(Segment), comptime isFrozenFn: IsFrozenFn(Segment), comptime getReclaimableSizeFn: GetReclaimableSizeFn(Segment)) type {
     return struct {
         max_segments: ?usize = null,
 
@@ -54,8 +71,44 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
         segments_per_merge: u32 = 10,
         segments_per_level: u32 = 10,
 
+        // how strongly merges that reclaim superseded items are favored, zero ignores them
+        reclaim_weight: f64 = 2.0,
+        // segments with at least this ratio of superseded items are merged, even on their own,
+        // zero disables it
+        min_reclaim_ratio: f64 = 0,
+
+        // while there are at least this many searches per second, merges bigger than
+        // `busy_max_merge_size` are deferred, zero disables it
+        busy_search_rate: f64 = 0,
+        busy_max_merge_size: usize = std.math.maxInt(usize),
+
         const Self = @This();
 
+        fn getReclaimRatio(segment: Segment) f64 {
+            const size = getSizeFn(segment);
+            if (size == 0) {
+                return 0;
+            }
+            return @as(f64, @floatFromInt(@min(size, getReclaimableSizeFn(segment)))) / @as(f64, @floatFromInt(size));
+        }
+
+        fn isReclaimable(self: Self, segment: Segment) bool {
+            if (self.min_reclaim_ratio == 0 or isFrozenFn(segment) or getSizeFn(segment) > self.max_segment_size) {
+                return false;
+            }
+            return getReclaimRatio(segment) >= self.min_reclaim_ratio;
+        }
+
+        /// Returns true if a segment has so many superseded items that it should be rewritten.
+        pub fn needsReclaim(self: Self, segments: []Segment) bool {
+            for (segments) |segment| {
+                if (self.isReclaimable(segment)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
         pub fn calculateBudget(self: Self, segments: []Segment) usize {
             var total_size: usize = 0;
             var num_oversized_segments: usize = 0;
@@ -96,14 +149,48 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
         }
 
         pub const FindSegmentsToMergeResult = struct {
+            num_segments: usize = 0,
             num_allowed_segments: usize,
             candidate: ?MergeCandidate,
+            // set if a better merge was not chosen because of the load
+            deferred: bool = false,
         };
 
-        pub fn findSegmentsToMerge(self: Self, segments: []Segment) ?MergeCandidate {
+        /// Returns the merge that would be done now, without doing it.
+        pub fn plan(self: Self, segments: []Segment, load: MergeLoad) FindSegmentsToMergeResult {
+            var result = FindSegmentsToMergeResult{
+                .num_segments = segments.len,
+                .num_allowed_segments = self.calculateBudget(segments),
+                .candidate = null,
+            };
+            if (segments.len <= result.num_allowed_segments and !self.needsReclaim(segments)) {
+                return result;
+            }
+            result.candidate = self.findSegmentsToMergeInternal(segments, load, segments.len <= result.num_allowed_segments, &result.deferred);
+            return result;
+        }
+
+        pub fn findSegmentsToMerge(self: Self, segments: []Segment, load: MergeLoad) ?MergeCandidate {
+            var deferred = false;
+            const within_budget = segments.len <= self.calculateBudget(segments);
+            return self.findSegmentsToMergeInternal(segments, load, within_budget, &deferred);
+        }
+
+        fn isBusy(self: Self, segments: []Segment, load: MergeLoad) bool {
+            if (self.busy_search_rate == 0 or load.search_rate < self.busy_search_rate) {
+                return false;
+            }
+            // don't let the number of segments grow without limits
+            return segments.len < 2 * self.calculateBudget(segments);
+        }
+
+        // Within the budget, only merges that include a segment with too many superseded items are considered.
+        fn findSegmentsToMergeInternal(self: Self, segments: []Segment, load: MergeLoad, reclaim_only: bool, deferred: *bool) ?MergeCandidate {
             var best_candidate: ?MergeCandidate = null;
             var best_score: f64 = 0.0;
 
+            const busy = self.isBusy(segments, load);
+
             var max_merge_size: usize = self.max_segment_size * 2;
 
             var start: usize = 0;
@@ -123,6 +210,7 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
                     .end = start,
                     .size = 0,
                 };
+                var has_reclaimable = false;
 
                 while (candidate.end < segments.len) {
                     if (isFrozenFn(segments[candidate.end])) {
@@ -136,6 +224,8 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
                     }
 
                     candidate.size += size;
+                    candidate.reclaimable_size += @min(size, getReclaimableSizeFn(segments[candidate.end]));
+                    has_reclaimable = has_reclaimable or self.isReclaimable(segments[candidate.end]);
                     candidate.end += 1;
 
                     if (candidate.end - candidate.start > self.segments_per_merge or candidate.size > max_merge_size) {
@@ -143,6 +233,21 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
                         break;
                     }
 
+                    if (busy and candidate.size > self.busy_max_merge_size) {
+                        // Large merges compete with searches for the disk, try again later
+                        deferred.* = true;
+                        break;
+                    }
+
+                    if (candidate.end - candidate.start == 1 and !self.isReclaimable(segments[candidate.start])) {
+                        // Rewriting a single segment is only worth it to drop superseded items
+                        continue;
+                    }
+
+                    if (reclaim_only and !has_reclaimable) {
+                        continue;
+                    }
+
                     // Roughly measure "skew" of the merge, i.e. how
                     // "balanced" the merge is (whether the segments are
                     // about the same size), which can range from
@@ -170,6 +275,12 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
                     // order to avoid the large merges
                     score *= std.math.pow(f64, @floatFromInt(candidate.size), 0.05);
 
+                    // Favor merges that reclaim more items, they write less per reclaimed item:
+                    const reclaim_ratio = @as(f64, @floatFromInt(candidate.reclaimable_size)) / @as(f64, @floatFromInt(@max(candidate.size, 1)));
+                    score *= std.math.pow(f64, 1.0 - reclaim_ratio, self.reclaim_weight);
+
+                    candidate.score = score;
+
                     if (score < best_score or best_candidate == null) {
                         best_candidate = candidate;
                         best_score = score;
@@ -192,11 +303,16 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
 const MockSegment = struct {
     id: u64,
     size: usize,
+    reclaimable_size: usize = 0,
 
     pub fn getSize(self: @This()) usize {
         return self.size;
     }
 
+    pub fn getReclaimableSize(self: @This()) usize {
+        return self.reclaimable_size;
+    }
+
     pub fn isFrozen(self: @This()) bool {
         _ = self;
         return false;
@@ -214,7 +330,7 @@ test "TieredMergePolicy" {
     var segments = std.ArrayList(MockSegment).init(std.testing.allocator);
     defer segments.deinit();
 
-    const policy = TieredMergePolicy(MockSegment, MockSegment.getSize, MockSegment.isFrozen){
+    const policy = TieredMergePolicy(MockSegment, MockSegment.getSize, MockSegment.isFrozen, MockSegment.getReclaimableSize){
         .min_segment_size = 100,
         .max_segment_size = 100000,
         .segments_per_merge = 10,
@@ -265,7 +381,7 @@ test "TieredMergePolicy" {
             }
         }
 
-        const candidate = policy.findSegmentsToMerge(segments.items) orelse continue;
+        const candidate = policy.findSegmentsToMerge(segments.items, .{}) orelse continue;
 
         total_merge_size += candidate.end - candidate.start;
         total_merge_count += 1;
@@ -281,3 +397,99 @@ test "TieredMergePolicy" {
         std.debug.print("avg merge size: {}\n", .{total_merge_size / total_merge_count});
     }
 }
+
+const MockPolicy = TieredMergePolicy(MockSegment, MockSegment.getSize, MockSegment.isFrozen, MockSegment.getReclaimableSize);
+
+test "TieredMergePolicy prefers merges that reclaim items" {
+    const policy = MockPolicy{
+        .min_segment_size = 100,
+        .max_segment_size = 100000,
+        .max_segments = 2,
+        .segments_per_merge = 2,
+    };
+
+    // merging the first two is better balanced, merging the last two reclaims more
+    var segments = [_]MockSegment{
+        .{ .id = 1, .size = 1000 },
+        .{ .id = 2, .size = 1000 },
+        .{ .id = 3, .size = 600, .reclaimable_size = 500 },
+        .{ .id = 4, .size = 300 },
+    };
+
+    const candidate = policy.findSegmentsToMerge(&segments, .{}) orelse return error.NoMerge;
+    try std.testing.expectEqual(2, candidate.start);
+    try std.testing.expectEqual(4, candidate.end);
+    try std.testing.expectEqual(500, candidate.reclaimable_size);
+
+    // without the weight, the balanced merge wins
+    const plain_policy = MockPolicy{
+        .min_segment_size = 100,
+        .max_segment_size = 100000,
+        .max_segments = 2,
+        .segments_per_merge = 2,
+        .reclaim_weight = 0,
+    };
+    const plain_candidate = plain_policy.findSegmentsToMerge(&segments, .{}) orelse return error.NoMerge;
+    try std.testing.expectEqual(0, plain_candidate.start);
+}
+
+test "TieredMergePolicy rewrites segments with mostly superseded items" {
+    const policy = MockPolicy{
+        .min_segment_size = 100,
+        .max_segment_size = 100000,
+        .max_segments = 10,
+        .min_reclaim_ratio = 0.5,
+    };
+
+    var segments = [_]MockSegment{
+        .{ .id = 1, .size = 10000, .reclaimable_size = 100 },
+        .{ .id = 2, .size = 10000, .reclaimable_size = 6000 },
+        .{ .id = 3, .size = 100 },
+    };
+
+    // every segment fits the budget, but the second one is mostly superseded
+    try std.testing.expect(policy.needsReclaim(&segments));
+
+    const result = policy.plan(&segments, .{});
+    try std.testing.expectEqual(10, result.num_allowed_segments);
+    const candidate = result.candidate orelse return error.NoMerge;
+    try std.testing.expectEqual(1, candidate.start);
+
+    segments[1].reclaimable_size = 100;
+    try std.testing.expect(!policy.needsReclaim(&segments));
+    try std.testing.expect(policy.plan(&segments, .{}).candidate == null);
+}
+
+test "TieredMergePolicy defers large merges while busy" {
+    const policy = MockPolicy{
+        .min_segment_size = 100,
+        .max_segment_size = 100000,
+        .max_segments = 3,
+        .busy_search_rate = 100,
+        .busy_max_merge_size = 1000,
+    };
+
+    var segments = [_]MockSegment{
+        .{ .id = 1, .size = 2000 },
+        .{ .id = 2, .size = 2000 },
+        .{ .id = 3, .size = 300 },
+        .{ .id = 4, .size = 300 },
+    };
+
+    const idle = policy.plan(&segments, .{ .search_rate = 10 });
+    try std.testing.expect(!idle.deferred);
+    try std.testing.expectEqual(0, (idle.candidate orelse return error.NoMerge).start);
+
+    // only the small merge is allowed
+    const busy = policy.plan(&segments, .{ .search_rate = 1000 });
+    try std.testing.expect(busy.deferred);
+    const candidate = busy.candidate orelse return error.NoMerge;
+    try std.testing.expectEqual(2, candidate.start);
+    try std.testing.expectEqual(4, candidate.end);
+
+    // far over the budget, nothing is deferred
+    var many_segments = [_]MockSegment{.{ .id = 1, .size = 5000 }} ** 6;
+    const overloaded = policy.plan(&many_segments, .{ .search_rate = 1000 });
+    try std.testing.expect(!overloaded.deferred);
+    try std.testing.expect(overloaded.candidate != null);
+}
@@ -22,6 +22,14 @@ pub const MergedSegmentInfo = struct {
     }
 };
 
+// Memory segments have docs in a hash map, file segments in a DocTable.
+pub fn getDoc(entry: anytype) struct { u32, bool } {
+    if (@hasField(@TypeOf(entry), "key_ptr")) {
+        return .{ entry.key_ptr.*, entry.value_ptr.* };
+    }
+    return .{ entry.id, entry.active };
+}
+
 pub fn SegmentMerger(comptime Segment: type) type {
     return struct {
         const Self = @This();
@@ -57,6 +65,17 @@ pub fn SegmentMerger(comptime Segment: type) type {
         segment: MergedSegmentInfo = .{},
         estimated_size: usize = 0,
 
+        // Loser tree over the sources, heads[i] is the next item from sources[i] (null if exhausted),
+        // tree[0] is the index of the source with the smallest item and tree[1..] are the losers
+        // of the matches in the internal nodes.
+        heads: []?Item = &.{},
+        tree: []usize = &.{},
+
+        // for range mergers, items with hash >= end_hash are not returned
+        end_hash: ?u32 = null,
+        // range mergers share skip_docs and segment info with their parent
+        is_range: bool = false,
+
         current_item: ?Item = null,
 
         pub fn init(allocator: std.mem.Allocator, collection: *SegmentList(Segment), num_sources: usize) !Self {
@@ -69,10 +88,18 @@ pub fn SegmentMerger(comptime Segment: type) type {
 
         pub fn deinit(self: *Self) void {
             for (self.sources.items) |*source| {
-                source.deinit(self.allocator);
+                if (self.is_range) {
+                    source.reader.close();
+                } else {
+                    source.deinit(self.allocator);
+                }
             }
             self.sources.deinit(self.allocator);
-            self.segment.deinit(self.allocator);
+            if (!self.is_range) {
+                self.segment.deinit(self.allocator);
+            }
+            self.allocator.free(self.heads);
+            self.allocator.free(self.tree);
             self.* = undefined;
         }
 
@@ -82,6 +109,33 @@ pub fn SegmentMerger(comptime Segment: type) type {
             });
         }
 
+        /// Creates a merger that returns only items with hashes in the range [start_hash, end_hash),
+        /// reading from the same sources. Range mergers can run in parallel, the parent must be
+        /// prepared and must outlive them.
+        pub fn initRange(self: *const Self, start_hash: u32, end_hash: ?u32) !Self {
+            var result = Self{
+                .allocator = self.allocator,
+                .collection = self.collection,
+                .sources = try std.ArrayListUnmanaged(Source).initCapacity(self.allocator, self.sources.items.len),
+                .segment = self.segment,
+                .estimated_size = self.estimated_size,
+                .end_hash = end_hash,
+                .is_range = true,
+            };
+            errdefer result.deinit();
+
+            for (self.sources.items) |source| {
+                result.sources.appendAssumeCapacity(.{
+                    .reader = source.reader.segment.reader(),
+                    .skip_docs = source.skip_docs,
+                });
+                try result.sources.items[result.sources.items.len - 1].reader.seek(start_hash);
+            }
+
+            try result.initTree();
+            return result;
+        }
+
         pub fn prepare(self: *Self) !void {
             const sources = self.sources.items;
             if (sources.len == 0) {
@@ -126,8 +180,7 @@ pub fn SegmentMerger(comptime Segment: type) type {
                 var iter = segment.docs.iterator();
                 while (iter.next()) |entry| {
                     docs_found += 1;
-                    const doc_id = entry.key_ptr.*;
-                    const doc_status = entry.value_ptr.*;
+                    const doc_id, const doc_status = getDoc(entry);
                     if (!self.collection.hasNewerVersion(doc_id, segment.info.version)) {
                         try self.segment.docs.put(self.allocator, doc_id, doc_status);
                         docs_added += 1;
@@ -146,26 +199,92 @@ pub fn SegmentMerger(comptime Segment: type) type {
                     self.estimated_size += segment.getSize() * @min(100, ratio + 10) / 100;
                 }
             }
+
+            try self.initTree();
+        }
+
+        fn initTree(self: *Self) !void {
+            const num_sources = self.sources.items.len;
+
+            self.allocator.free(self.heads);
+            self.heads = &.{};
+            self.allocator.free(self.tree);
+            self.tree = &.{};
+
+            if (num_sources == 0) {
+                return;
+            }
+
+            self.heads = try self.allocator.alloc(?Item, num_sources);
+            self.tree = try self.allocator.alloc(usize, num_sources);
+
+            for (self.sources.items, self.heads) |*source, *head| {
+                head.* = try source.read();
+            }
+            self.tree[0] = self.buildTree(1);
+        }
+
+        // Returns true if the head of source `a` should come before the head of source `b`.
+        fn isBefore(self: *const Self, a: usize, b: usize) bool {
+            const a_item = self.heads[a] orelse return false;
+            const b_item = self.heads[b] orelse return true;
+            if (Item.cmp({}, a_item, b_item)) {
+                return true;
+            }
+            if (Item.cmp({}, b_item, a_item)) {
+                return false;
+            }
+            return a < b;
+        }
+
+        // Leaves are at positions num_sources..2*num_sources-1, returns the winner of the subtree.
+        fn buildTree(self: *Self, node: usize) usize {
+            const num_sources = self.heads.len;
+            if (node >= num_sources) {
+                return node - num_sources;
+            }
+            const left = self.buildTree(2 * node);
+            const right = self.buildTree(2 * node + 1);
+            if (self.isBefore(right, left)) {
+                self.tree[node] = left;
+                return right;
+            } else {
+                self.tree[node] = right;
+                return left;
+            }
+        }
+
+        // Replays the matches on the path from the given source to the root, after its head changed.
+        fn updateTree(self: *Self, source_index: usize) void {
+            var winner = source_index;
+            var node = (source_index + self.heads.len) / 2;
+            while (node > 0) : (node /= 2) {
+                if (self.isBefore(self.tree[node], winner)) {
+                    std.mem.swap(usize, &self.tree[node], &winner);
+                }
+            }
+            self.tree[0] = winner;
         }
 
         pub fn read(self: *Self) !?Item {
             if (self.current_item == null) {
-                var min_item: ?Item = null;
-                var min_item_index: usize = 0;
-
-                for (self.sources.items, 0..) |*source, i| {
-                    if (try source.read()) |item| {
-                        if (min_item == null or Item.cmp({}, item, min_item.?)) {
-                            min_item = item;
-                            min_item_index = i;
-                        }
+                if (self.tree.len == 0) {
+                    return null;
+                }
+                const winner = self.tree[0];
+                const item = self.heads[winner] orelse return null;
+                if (self.end_hash) |end_hash| {
+                    if (item.hash >= end_hash) {
+                        return null;
                     }
                 }
 
-                if (min_item) |item| {
-                    self.sources.items[min_item_index].advance();
-                    self.current_item = item;
-                }
+                const source = &self.sources.items[winner];
+                source.advance();
+                self.heads[winner] = try source.read();
+                self.updateTree(winner);
+
+                self.current_item = item;
             }
             return self.current_item;
         }
@@ -213,3 +332,64 @@ test "merge segments" {
         }
     }
 }
+
+test "merge segments in hash ranges" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const List = SegmentList(MemorySegment);
+
+    var collection = try List.init(std.testing.allocator, 5);
+    defer collection.deinit(std.testing.allocator, .delete);
+
+    var expected = std.ArrayList(Item).init(std.testing.allocator);
+    defer expected.deinit();
+
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    for (0..5) |i| {
+        const node = try List.createSegment(std.testing.allocator, .{});
+        collection.nodes.appendAssumeCapacity(node);
+
+        node.value.info = .{ .version = 10 + i, .merges = 0 };
+        for (0..100) |_| {
+            const item = Item{ .hash = rand.int(u32) % 1000, .id = @intCast(i * 100 + rand.int(u32) % 100) };
+            try node.value.items.append(std.testing.allocator, item);
+            try expected.append(item);
+        }
+        std.sort.pdq(Item, node.value.items.items, {}, Item.cmp);
+    }
+    std.sort.pdq(Item, expected.items, {}, Item.cmp);
+
+    var merger = try SegmentMerger(MemorySegment).init(std.testing.allocator, &collection, 5);
+    defer merger.deinit();
+
+    for (collection.nodes.items) |node| {
+        merger.addSource(node.value);
+    }
+    try merger.prepare();
+
+    var items = std.ArrayList(Item).init(std.testing.allocator);
+    defer items.deinit();
+
+    while (try merger.read()) |item| {
+        try items.append(item);
+        merger.advance();
+    }
+    try std.testing.expectEqualSlices(Item, expected.items, items.items);
+
+    items.clearRetainingCapacity();
+
+    const boundaries = [_]u32{ 0, 250, 251, 600 };
+    for (boundaries, 0..) |start_hash, i| {
+        const end_hash = if (i + 1 < boundaries.len) boundaries[i + 1] else null;
+
+        var range_merger = try merger.initRange(start_hash, end_hash);
+        defer range_merger.deinit();
+
+        while (try range_merger.read()) |item| {
+            try items.append(item);
+            range_merger.advance();
+        }
+    }
+    try std.testing.expectEqualSlices(Item, expected.items, items.items);
+}
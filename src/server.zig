@@ -7,10 +7,13 @@ const msgpack = @import("msgpack");
 
 const MultiIndex = @import("MultiIndex.zig");
 const Index = @import("Index.zig");
+const Replicator = @import("Replicator.zig");
 const common = @import("common.zig");
 const SearchResults = common.SearchResults;
 const Change = @import("change.zig").Change;
 const Deadline = @import("utils/Deadline.zig");
+const msgpack_view = @import("utils/msgpack_view.zig");
+const search_protocol = @import("search_protocol.zig");
 
 const metrics = @import("metrics.zig");
 
@@ -78,13 +81,21 @@ pub fn run(allocator: std.mem.Allocator, indexes: *MultiIndex, address: []const
     router.get("/_metrics", handleMetrics);
     router.get("/_health", handleHealth);
     router.get("/:index/_health", handleIndexHealth);
+    router.get("/:index/_merge_plan", handleMergePlan);
 
     // Search API
     router.post("/:index/_search", handleSearch);
+    router.post("/:index/_msearch", handleMultiSearch);
+    router.post("/:index/_bsearch", handleBinarySearch);
 
     // Bulk API
     router.post("/:index/_update", handleUpdate);
 
+    // Replication API, used by replicas to follow this node
+    router.get("/:index/_replication/oplog", handleReplicationOplog);
+    router.get("/:index/_replication/segments", handleReplicationSegments);
+    router.get("/:index/_replication/segments/:name", handleReplicationSegmentFile);
+
     // Fingerprint API
     router.head("/:index/:id", handleHeadFingerprint);
     router.get("/:index/:id", handleGetFingerprint);
@@ -135,6 +146,56 @@ const SearchResultsJSON = struct {
     }
 };
 
+const SearchProfileJSON = struct {
+    decode_ns: u64,
+    acquire_reader_ns: u64,
+    file_segments_ns: u64,
+    memory_segments_ns: u64,
+    finish_ns: u64,
+    major_faults: u64,
+    segments: []const common.SegmentProfile,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .field_name } };
+    }
+};
+
+const ProfiledSearchResultsJSON = struct {
+    results: []SearchResultJSON,
+    profile: SearchProfileJSON,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const max_multi_search_queries = 1000;
+
+const MultiSearchRequestJSON = struct {
+    queries: []SearchRequestJSON,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const MultiSearchResponseJSON = struct {
+    results: []SearchResultJSON,
+    timed_out: bool = false,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const MultiSearchResultsJSON = struct {
+    responses: []MultiSearchResponseJSON,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
 fn getId(req: *httpz.Request, res: *httpz.Response, send_body: bool) !?u32 {
     const id_str = req.param("id") orelse {
         log.warn("missing id parameter", .{});
@@ -225,6 +286,76 @@ fn writeResponse(value: anytype, req: *httpz.Request, res: *httpz.Response) !voi
     }
 }
 
+// Sends the response body in HTTP chunks as it's encoded, instead of building all of it in memory
+// first. Bodies that fit in the buffer are sent as a normal response, with a content length.
+const ResponseStream = struct {
+    res: *httpz.Response,
+    buffer: []u8,
+    len: usize = 0,
+    chunked: bool = false,
+
+    const buffer_size = 64 * 1024;
+
+    pub const Writer = std.io.Writer(*ResponseStream, anyerror, write);
+
+    fn init(req: *httpz.Request, res: *httpz.Response) !ResponseStream {
+        return .{ .res = res, .buffer = try req.arena.alloc(u8, buffer_size) };
+    }
+
+    fn writer(self: *ResponseStream) Writer {
+        return .{ .context = self };
+    }
+
+    fn write(self: *ResponseStream, data: []const u8) anyerror!usize {
+        if (self.len + data.len > self.buffer.len) {
+            try self.flush();
+            if (data.len > self.buffer.len) {
+                try self.res.chunk(data);
+                self.chunked = true;
+                return data.len;
+            }
+        }
+        @memcpy(self.buffer[self.len..][0..data.len], data);
+        self.len += data.len;
+        return data.len;
+    }
+
+    fn flush(self: *ResponseStream) !void {
+        if (self.len > 0) {
+            try self.res.chunk(self.buffer[0..self.len]);
+            self.chunked = true;
+            self.len = 0;
+        }
+    }
+
+    fn finish(self: *ResponseStream) !void {
+        if (self.chunked) {
+            return self.flush();
+        }
+        try self.res.writer().writeAll(self.buffer[0..self.len]);
+        self.len = 0;
+    }
+};
+
+// Same as `writeResponse`, for responses that can be large, the status and headers can't be changed once
+// the first chunk is sent.
+fn writeStreamedResponse(value: anytype, req: *httpz.Request, res: *httpz.Response) !void {
+    const content_type = parseAcceptHeader(req);
+
+    var stream = try ResponseStream.init(req, res);
+    switch (content_type) {
+        .json => {
+            res.header("content-type", "application/json");
+            try json.stringify(value, .{}, stream.writer());
+        },
+        .msgpack => {
+            res.header("content-type", "application/vnd.msgpack");
+            try msgpack.encode(value, stream.writer());
+        },
+    }
+    try stream.finish();
+}
+
 const ErrorResponse = struct {
     @"error": []const u8,
 
@@ -245,6 +376,18 @@ fn handleError(_: *Context, req: *httpz.Request, res: *httpz.Response, err: anye
                 res.body = "not ready yet";
             };
         },
+        error.IndexCorrupted => {
+            writeErrorResponse(503, err, req, res) catch {
+                res.status = 503;
+                res.body = "index corrupted";
+            };
+        },
+        error.ReadOnlyIndex => {
+            writeErrorResponse(403, err, req, res) catch {
+                res.status = 403;
+                res.body = "read-only index";
+            };
+        },
         else => {
             log.err("unhandled error in {s}: {any}", .{ req.url.raw, err });
             writeErrorResponse(500, err, req, res) catch {
@@ -292,31 +435,58 @@ fn getRequestBody(comptime T: type, req: *httpz.Request, res: *httpz.Response) !
     unreachable;
 }
 
+fn getSearchOptions(body: SearchRequestJSON) common.SearchOptions {
+    return .{
+        .max_results = @max(@min(body.limit, max_search_limit), min_search_limit),
+        .min_score = @intCast((body.query.len + 19) / 20),
+        .min_score_pct = 10,
+    };
+}
+
+fn getSearchTimeout(body: SearchRequestJSON) u32 {
+    return @min(body.timeout, max_search_timeout);
+}
+
+fn buildSearchResultsJSON(allocator: std.mem.Allocator, results: []const common.SearchResult) ![]SearchResultJSON {
+    const results_json = try allocator.alloc(SearchResultJSON, results.len);
+    for (results, 0..) |r, i| {
+        results_json[i] = SearchResultJSON{ .id = r.id, .score = r.score };
+    }
+    return results_json;
+}
+
+fn isProfilingRequested(req: *httpz.Request) !bool {
+    const query = try req.query();
+    const value = query.get("profile") orelse return false;
+    return std.mem.eql(u8, value, "1") or std.mem.eql(u8, value, "true");
+}
+
 fn handleSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
-    const start_time = std.time.milliTimestamp();
-    defer metrics.searchDuration(std.time.milliTimestamp() - start_time);
+    var start_time = std.time.nanoTimestamp();
+    defer metrics.searchDuration(common.SearchTimings.lap(&start_time));
+
+    var stage_start = start_time;
 
     const body = try getRequestBody(SearchRequestJSON, req, res) orelse return;
+    const profile = try isProfilingRequested(req);
+
+    const decode_ns = common.SearchTimings.lap(&stage_start);
 
     const index = try getIndex(ctx, req, res, true) orelse return;
     defer releaseIndex(ctx, index);
 
-    const limit = @max(@min(body.limit, max_search_limit), min_search_limit);
-
-    var timeout = body.timeout;
-    if (timeout > max_search_timeout) {
-        timeout = max_search_timeout;
-    }
-    const deadline = Deadline.init(timeout);
+    const deadline = Deadline.init(getSearchTimeout(body));
 
     metrics.search();
 
-    var collector = SearchResults.init(req.arena, .{
-        .max_results = limit,
-        .min_score = @intCast((body.query.len + 19) / 20),
-        .min_score_pct = 10,
-    });
+    var collector = SearchResults.init(req.arena, getSearchOptions(body));
+
+    var segment_profiles = std.ArrayList(common.SegmentProfile).init(req.arena);
+    if (profile) {
+        collector.profile = &segment_profiles;
+    }
 
+    stage_start = std.time.nanoTimestamp();
     try index.search(body.query, &collector, deadline);
 
     const results = collector.getResults();
@@ -327,13 +497,139 @@ fn handleSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void
         metrics.searchHit();
     }
 
-    var results_json = SearchResultsJSON{
-        .results = try req.arena.alloc(SearchResultJSON, results.len),
+    const timings = collector.timings;
+    metrics.searchStageDuration(index.name, "decode", decode_ns);
+    metrics.searchStageDuration(index.name, "acquire_reader", timings.acquire_reader_ns);
+    // cached results skip the segments, zero durations would only drag the histograms down
+    if (!collector.cached) {
+        metrics.searchStageDuration(index.name, "file_segments", timings.file_segments_ns);
+        metrics.searchStageDuration(index.name, "memory_segments", timings.memory_segments_ns);
+        metrics.searchStageDuration(index.name, "finish", timings.finish_ns);
+        metrics.searchMajorPageFaults(index.name, collector.major_faults);
+    }
+
+    stage_start = std.time.nanoTimestamp();
+    defer metrics.searchStageDuration(index.name, "encode", common.SearchTimings.lap(&stage_start));
+
+    const results_json = try buildSearchResultsJSON(req.arena, results);
+    if (profile) {
+        return writeResponse(ProfiledSearchResultsJSON{
+            .results = results_json,
+            .profile = .{
+                .decode_ns = decode_ns,
+                .acquire_reader_ns = timings.acquire_reader_ns,
+                .file_segments_ns = timings.file_segments_ns,
+                .memory_segments_ns = timings.memory_segments_ns,
+                .finish_ns = timings.finish_ns,
+                .major_faults = collector.major_faults,
+                .segments = segment_profiles.items,
+            },
+        }, req, res);
+    }
+    return writeResponse(SearchResultsJSON{ .results = results_json }, req, res);
+}
+
+fn handleMultiSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    var start_time = std.time.nanoTimestamp();
+    defer metrics.searchDuration(common.SearchTimings.lap(&start_time));
+
+    const body = try getRequestBody(MultiSearchRequestJSON, req, res) orelse return;
+
+    if (body.queries.len > max_multi_search_queries) {
+        try writeErrorResponse(400, error.TooManyQueries, req, res);
+        return;
+    }
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const collector = try runMultiSearch(req, index, body.queries);
+
+    const responses_json = try req.arena.alloc(MultiSearchResponseJSON, collector.queries.len);
+    for (collector.queries, responses_json) |*query, *response_json| {
+        const results = query.results.getResults();
+        if (results.len == 0) {
+            metrics.searchMiss();
+        } else {
+            metrics.searchHit();
+        }
+        response_json.* = .{
+            .results = try buildSearchResultsJSON(req.arena, results),
+            .timed_out = query.timed_out,
+        };
+    }
+
+    return writeStreamedResponse(MultiSearchResultsJSON{ .responses = responses_json }, req, res);
+}
+
+fn runMultiSearch(req: *httpz.Request, index: *Index, queries: []const SearchRequestJSON) !common.MultiSearchResults {
+    // All queries share the segment scan, which runs until the longest timeout,
+    // queries with shorter timeouts stop collecting hits once they expire.
+    var max_timeout: u32 = 0;
+    const inputs = try req.arena.alloc(common.MultiSearchResults.QueryInput, queries.len);
+    for (queries, inputs) |query, *input| {
+        const timeout = getSearchTimeout(query);
+        max_timeout = @max(max_timeout, timeout);
+        input.* = .{
+            .hashes = query.query,
+            .options = getSearchOptions(query),
+            .deadline = Deadline.init(timeout),
+        };
+        metrics.search();
+    }
+    const deadline = Deadline.init(max_timeout);
+
+    var collector = try common.MultiSearchResults.init(req.arena, inputs);
+
+    try index.multiSearch(&collector, deadline);
+
+    return collector;
+}
+
+// Same as `_msearch`, in the compact encoding of `search_protocol`, for clients that
+// batch many small queries into one request.
+fn handleBinarySearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    var start_time = std.time.nanoTimestamp();
+    defer metrics.searchDuration(common.SearchTimings.lap(&start_time));
+
+    const content = req.body() orelse {
+        return writeErrorResponse(400, error.NoContent, req, res);
     };
-    for (results, 0..) |r, i| {
-        results_json.results[i] = SearchResultJSON{ .id = r.id, .score = r.score };
+
+    const queries = search_protocol.decodeRequest(req.arena, content, max_multi_search_queries) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const requests = try req.arena.alloc(SearchRequestJSON, queries.len);
+    for (queries, requests) |query, *request| {
+        request.* = .{
+            .query = query.hashes,
+            .limit = if (query.limit > 0) query.limit else default_search_limit,
+            .timeout = if (query.timeout > 0) query.timeout else default_search_timeout,
+        };
+    }
+
+    const collector = try runMultiSearch(req, index, requests);
+
+    res.header("content-type", search_protocol.content_type);
+
+    var stream = try ResponseStream.init(req, res);
+    const writer = stream.writer();
+
+    try search_protocol.writeResponseHeader(writer, collector.queries.len);
+    for (collector.queries) |*query| {
+        const results = query.results.getResults();
+        if (results.len == 0) {
+            metrics.searchMiss();
+        } else {
+            metrics.searchHit();
+        }
+        try search_protocol.writeResults(writer, results, query.timed_out);
     }
-    return writeResponse(results_json, req, res);
+    try stream.finish();
 }
 
 const UpdateRequestJSON = struct {
@@ -344,6 +640,15 @@ const UpdateRequestJSON = struct {
     }
 };
 
+fn getEncodedChanges(req: *httpz.Request) ?[]const u8 {
+    const content_type = parseContentTypeHeader(req) catch return null;
+    if (content_type != .msgpack) {
+        return null;
+    }
+    const content = req.body() orelse return null;
+    return msgpack_view.findMapValue(content, "c") catch null;
+}
+
 fn handleUpdate(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
     const body = try getRequestBody(UpdateRequestJSON, req, res) orelse return;
 
@@ -352,11 +657,120 @@ fn handleUpdate(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void
 
     metrics.update(body.changes.len);
 
-    try index.update(body.changes);
+    // msgpack bodies were already validated by decoding them, so the encoded
+    // changes can go to a msgpack oplog without encoding them again
+    const encoded_changes = if (index.usesEncodedChanges()) getEncodedChanges(req) else null;
+    if (encoded_changes) |data| {
+        try index.updateEncoded(body.changes, data);
+    } else {
+        try index.update(body.changes);
+    }
 
     return writeResponse(EmptyResponse{}, req, res);
 }
 
+const default_replication_transactions = 1000;
+const max_replication_transactions = 10000;
+
+// responses stop after the transaction that crosses this size
+const max_replication_response_size = 8 * 1024 * 1024;
+
+fn handleReplicationOplog(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const query = try req.query();
+    const first_commit_id = std.fmt.parseInt(u64, query.get("from") orelse "1", 10) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+    const limit_str = query.get("limit") orelse std.fmt.comptimePrint("{}", .{default_replication_transactions});
+    const limit = std.fmt.parseInt(usize, limit_str, 10) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+
+    var it = index.readOplog(first_commit_id) catch |err| {
+        if (err == error.CommitIdNotAvailable) {
+            return writeErrorResponse(410, err, req, res);
+        }
+        return err;
+    };
+    defer it.deinit();
+
+    // transactions are sent as one msgpack map after another, whatever the oplog file format
+    res.header("content-type", "application/vnd.msgpack");
+    var stream = try ResponseStream.init(req, res);
+    var counting_writer = std.io.countingWriter(stream.writer());
+
+    var num_transactions: usize = 0;
+    while (num_transactions < @min(limit, max_replication_transactions) and counting_writer.bytes_written < max_replication_response_size) {
+        const txn = try it.next() orelse break;
+        try msgpack.encode(txn, counting_writer.writer());
+        num_transactions += 1;
+    }
+    try stream.finish();
+}
+
+// sharded indexes are replicated one shard at a time
+fn getShardNo(req: *httpz.Request, res: *httpz.Response) !?usize {
+    const query = try req.query();
+    const shard_str = query.get("shard") orelse return 0;
+    return std.fmt.parseInt(usize, shard_str, 10) catch |err| {
+        log.warn("invalid shard parameter: {}", .{err});
+        try writeErrorResponse(400, err, req, res);
+        return null;
+    };
+}
+
+fn handleReplicationSegments(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const shard_no = try getShardNo(req, res) orelse return;
+
+    const segments = index.getFileSegmentInfos(req.arena, shard_no) catch |err| {
+        if (err == error.ShardNotFound) {
+            return writeErrorResponse(404, err, req, res);
+        }
+        return err;
+    };
+
+    return writeResponse(Replicator.SegmentsResponse{
+        .num_shards = index.getNumShards(),
+        .segments = segments,
+    }, req, res);
+}
+
+fn handleReplicationSegmentFile(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const file_name = req.param("name") orelse {
+        return writeErrorResponse(400, error.MissingSegmentName, req, res);
+    };
+
+    const shard_no = try getShardNo(req, res) orelse return;
+
+    // only files of current segments are served, the name is never used as a path otherwise
+    var file = index.openSegmentFile(shard_no, file_name) catch |err| {
+        if (err == error.SegmentNotFound or err == error.ShardNotFound) {
+            return writeErrorResponse(404, err, req, res);
+        }
+        return err;
+    };
+    defer file.close();
+
+    res.header("content-type", "application/octet-stream");
+
+    const buffer = try req.arena.alloc(u8, 256 * 1024);
+    while (true) {
+        const n = try file.read(buffer);
+        if (n == 0) {
+            break;
+        }
+        try res.chunk(buffer[0..n]);
+    }
+}
+
 fn handleHeadFingerprint(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
     const index = try getIndex(ctx, req, res, false) orelse return;
     defer releaseIndex(ctx, index);
@@ -477,15 +891,18 @@ fn handleGetIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !voi
     var index_reader = try index.acquireReader();
     defer index.releaseReader(&index_reader);
 
+    // computed once per snapshot, repeated requests between updates don't scan the segments
+    const info = try index_reader.getInfo(req.arena);
+
     const response = GetIndexResponse{
-        .version = index_reader.getVersion(),
-        .segments = index_reader.getNumSegments(),
-        .docs = index_reader.getNumDocs(),
+        .version = info.version,
+        .segments = info.num_segments,
+        .docs = info.num_docs,
         .attributes = .{
-            .attributes = try index_reader.getAttributes(req.arena),
+            .attributes = info.attributes,
         },
     };
-    return writeResponse(response, req, res);
+    return writeStreamedResponse(response, req, res);
 }
 
 const EmptyResponse = struct {};
@@ -511,11 +928,31 @@ fn handleHeadIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !vo
     defer releaseIndex(ctx, index);
 }
 
+const MergePlanResponse = struct {
+    search_rate: f64,
+    plans: []const Index.MergePlan,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+fn handleMergePlan(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const response = MergePlanResponse{
+        .search_rate = index.getSearchRate(),
+        .plans = try index.planMerges(req.arena),
+    };
+    return writeResponse(response, req, res);
+}
+
 fn handleIndexHealth(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
     const index = try getIndex(ctx, req, res, false) orelse return;
     defer releaseIndex(ctx, index);
 
-    try index.checkReady();
+    try index.checkHealthy();
 
     try res.writer().writeAll("OK\n");
 }
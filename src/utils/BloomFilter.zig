@@ -0,0 +1,156 @@
+//! Split block Bloom filter over u32 keys. Each key sets one bit in each of the
+//! eight words of one 256-bit block, so a lookup touches a single cache line.
+//! The encoded filter can be used directly from a memory-mapped file.
+
+const std = @import("std");
+
+const Self = @This();
+
+pub const alignment = @alignOf(u32);
+
+const words_per_block = 8;
+const bits_per_key = 10;
+
+const salts = [words_per_block]u32{
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+};
+
+// little endian, empty if there is no filter and every key may be contained
+words: []const u32 = &.{},
+// set if the filter was built in memory, instead of pointing to a file
+buffer: []u32 = &.{},
+
+pub fn init(allocator: std.mem.Allocator, num_keys: usize) !Self {
+    const num_blocks = @max(1, std.math.divCeil(usize, num_keys * bits_per_key, words_per_block * 32) catch unreachable);
+    const buffer = try allocator.alloc(u32, num_blocks * words_per_block);
+    @memset(buffer, 0);
+    return .{
+        .words = buffer,
+        .buffer = buffer,
+    };
+}
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    allocator.free(self.buffer);
+    self.* = .{};
+}
+
+fn hashKey(key: u32) u64 {
+    // murmur3 finalizer
+    var h: u64 = key;
+    h ^= h >> 33;
+    h *%= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    h *%= 0xc4ceb9fe1a85ec53;
+    h ^= h >> 33;
+    return h;
+}
+
+fn getBlock(self: Self, hash: u64) usize {
+    const num_blocks = self.words.len / words_per_block;
+    return @intCast(((hash >> 32) * num_blocks) >> 32);
+}
+
+fn getMask(hash: u64, i: usize) u32 {
+    const bit: u5 = @intCast((@as(u32, @truncate(hash)) *% salts[i]) >> 27);
+    return @as(u32, 1) << bit;
+}
+
+pub fn add(self: *Self, key: u32) void {
+    std.debug.assert(self.buffer.len > 0);
+    const hash = hashKey(key);
+    const block = self.buffer[self.getBlock(hash) * words_per_block ..][0..words_per_block];
+    for (block, 0..) |*word, i| {
+        word.* |= std.mem.nativeToLittle(u32, getMask(hash, i));
+    }
+}
+
+/// Returns false if the key was definitely not added to the filter.
+pub fn mayContain(self: Self, key: u32) bool {
+    if (self.words.len == 0) {
+        return true;
+    }
+    const hash = hashKey(key);
+    const block = self.words[self.getBlock(hash) * words_per_block ..][0..words_per_block];
+    for (block, 0..) |word, i| {
+        const mask = getMask(hash, i);
+        if (std.mem.littleToNative(u32, word) & mask != mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+pub fn encodedSize(self: Self) usize {
+    return @sizeOf(u32) + self.words.len * @sizeOf(u32);
+}
+
+/// Writes the filter, the writer must be at a position aligned to `alignment`.
+pub fn write(self: Self, writer: anytype) !void {
+    try writer.writeInt(u32, @intCast(self.words.len / words_per_block), .little);
+    try writer.writeAll(std.mem.sliceAsBytes(self.words));
+}
+
+/// Returns a filter pointing into the encoded data, and the size of the encoded filter.
+pub fn decode(data: []const u8) !struct { filter: Self, size: usize } {
+    if (data.len < @sizeOf(u32) or !std.mem.isAligned(@intFromPtr(data.ptr), alignment)) {
+        return error.InvalidBloomFilter;
+    }
+
+    const num_blocks = std.mem.readInt(u32, data[0..4], .little);
+    if (num_blocks == 0) {
+        return error.InvalidBloomFilter;
+    }
+
+    const num_words = @as(usize, num_blocks) * words_per_block;
+    const size = @sizeOf(u32) + num_words * @sizeOf(u32);
+    if (data.len < size) {
+        return error.InvalidBloomFilter;
+    }
+
+    const words_ptr: [*]const u32 = @ptrCast(@alignCast(data.ptr + @sizeOf(u32)));
+    return .{
+        .filter = .{ .words = words_ptr[0..num_words] },
+        .size = size,
+    };
+}
+
+test "BloomFilter" {
+    const allocator = std.testing.allocator;
+
+    var filter = try Self.init(allocator, 1000);
+    defer filter.deinit(allocator);
+
+    for (0..1000) |i| {
+        filter.add(@intCast(i * 3));
+    }
+
+    var false_positives: usize = 0;
+    for (0..3000) |i| {
+        const key: u32 = @intCast(i);
+        if (i % 3 == 0) {
+            try std.testing.expect(filter.mayContain(key));
+        } else if (filter.mayContain(key)) {
+            false_positives += 1;
+        }
+    }
+    // ~1% expected with 10 bits per key
+    try std.testing.expect(false_positives < 100);
+
+    var buffer: [16 * 1024]u8 align(alignment) = undefined;
+    var stream = std.io.fixedBufferStream(&buffer);
+    try filter.write(stream.writer());
+    try std.testing.expectEqual(filter.encodedSize(), stream.pos);
+
+    const decoded = try Self.decode(buffer[0..stream.pos]);
+    try std.testing.expectEqual(filter.encodedSize(), decoded.size);
+    for (0..1000) |i| {
+        try std.testing.expect(decoded.filter.mayContain(@intCast(i * 3)));
+    }
+}
+
+test "BloomFilter: no filter" {
+    const filter: Self = .{};
+    try std.testing.expect(filter.mayContain(1));
+}
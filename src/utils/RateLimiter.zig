@@ -0,0 +1,131 @@
+//! Limits the rate of background segment file writes, so that merges and checkpoints
+//! don't take all disk bandwidth from searches. Writes are only throttled while there
+//! are searches running, an idle node writes at full speed. It also tracks the recent
+//! search rate, so that merges can be planned around the load.
+
+const std = @import("std");
+
+const Self = @This();
+
+// how far ahead of the rate a writer can get, before it has to wait
+const max_burst_ns = 100 * std.time.ns_per_ms;
+
+// searches are counted per second, the rate is averaged over the complete seconds
+const search_rate_window_s = 10;
+
+const SearchCount = struct {
+    second: std.atomic.Value(i64) = std.atomic.Value(i64).init(0),
+    count: std.atomic.Value(u32) = std.atomic.Value(u32).init(0),
+};
+
+// zero means unlimited
+bytes_per_sec: u64,
+lock: std.Thread.Mutex = .{},
+// when the bytes acquired so far are paid off at the configured rate
+next_free_ns: i128 = 0,
+active_searches: std.atomic.Value(u32) = std.atomic.Value(u32).init(0),
+search_counts: [search_rate_window_s]SearchCount = [_]SearchCount{.{}} ** search_rate_window_s,
+
+pub fn init(bytes_per_sec: u64) Self {
+    return .{ .bytes_per_sec = bytes_per_sec };
+}
+
+pub fn beginSearch(self: *Self) void {
+    _ = self.active_searches.fetchAdd(1, .monotonic);
+    self.countSearch(std.time.timestamp());
+}
+
+pub fn endSearch(self: *Self) void {
+    _ = self.active_searches.fetchSub(1, .monotonic);
+}
+
+// Searches racing to reset the counter of a new second can be lost, the rate is only an estimate.
+fn countSearch(self: *Self, now_s: i64) void {
+    const counter = &self.search_counts[@intCast(@mod(now_s, search_rate_window_s))];
+    const second = counter.second.load(.monotonic);
+    if (second != now_s) {
+        if (counter.second.cmpxchgStrong(second, now_s, .monotonic, .monotonic) == null) {
+            counter.count.store(0, .monotonic);
+        }
+    }
+    _ = counter.count.fetchAdd(1, .monotonic);
+}
+
+fn getSearchRateAt(self: *Self, now_s: i64) f64 {
+    var total: u64 = 0;
+    for (&self.search_counts) |*counter| {
+        const second = counter.second.load(.monotonic);
+        if (second < now_s and second >= now_s - (search_rate_window_s - 1)) {
+            total += counter.count.load(.monotonic);
+        }
+    }
+    return @as(f64, @floatFromInt(total)) / (search_rate_window_s - 1);
+}
+
+/// Returns the number of searches per second, over the last few seconds.
+pub fn getSearchRate(self: *Self) f64 {
+    return self.getSearchRateAt(std.time.timestamp());
+}
+
+fn getDelay(self: *Self, num_bytes: usize, now: i128) u64 {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    if (self.bytes_per_sec == 0 or self.active_searches.load(.monotonic) == 0) {
+        self.next_free_ns = now;
+        return 0;
+    }
+
+    const cost: i128 = @divFloor(@as(i128, num_bytes) * std.time.ns_per_s, self.bytes_per_sec);
+    self.next_free_ns = @max(self.next_free_ns, now) + cost;
+
+    const ahead = self.next_free_ns - now - max_burst_ns;
+    return if (ahead > 0) @intCast(ahead) else 0;
+}
+
+/// Waits until `num_bytes` can be written.
+pub fn acquire(self: *Self, num_bytes: usize) void {
+    const delay = self.getDelay(num_bytes, std.time.nanoTimestamp());
+    if (delay > 0) {
+        std.time.sleep(delay);
+    }
+}
+
+test "RateLimiter" {
+    var limiter = Self.init(1024 * 1024);
+
+    // no searches, not throttled
+    try std.testing.expectEqual(0, limiter.getDelay(10 * 1024 * 1024, 0));
+
+    limiter.beginSearch();
+    defer limiter.endSearch();
+
+    // within the burst
+    try std.testing.expectEqual(0, limiter.getDelay(1024, 0));
+
+    // one second worth of bytes, minus the burst and what was already written
+    const delay = limiter.getDelay(1024 * 1024, 0);
+    try std.testing.expect(delay > 800 * std.time.ns_per_ms and delay < 1000 * std.time.ns_per_ms);
+}
+
+test "RateLimiter.getSearchRate" {
+    var limiter = Self.init(0);
+
+    try std.testing.expectEqual(0, limiter.getSearchRateAt(1000));
+
+    for (0..9) |i| {
+        for (0..20) |_| {
+            limiter.countSearch(1000 + @as(i64, @intCast(i)));
+        }
+    }
+
+    // the current second is not complete yet
+    limiter.countSearch(1009);
+    try std.testing.expectEqual(20, limiter.getSearchRateAt(1009));
+
+    // old seconds drop out of the window, their counters are reused
+    try std.testing.expectEqual(0, limiter.getSearchRateAt(2000));
+    limiter.countSearch(2000);
+    limiter.countSearch(2000);
+    try std.testing.expectApproxEqAbs(2.0 / 9.0, limiter.getSearchRateAt(2001), 0.0001);
+}
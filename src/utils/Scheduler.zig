@@ -1,6 +1,8 @@
 const std = @import("std");
 const log = std.log.scoped(.scheduler);
 
+const metrics = @import("../metrics.zig");
+
 const Priority = enum(u8) {
     high = 0,
     medium = 1,
@@ -8,10 +10,16 @@ const Priority = enum(u8) {
     do_not_run = 3,
 };
 
+// do_not_run tasks are never queued
+const num_queues = @intFromEnum(Priority.do_not_run);
+
 const TaskStatus = struct {
     reschedule: usize = 0,
     scheduled: bool = false,
     running: bool = false,
+    // running on a worker thread, counted in the concurrency limit
+    running_on_worker: bool = false,
+    enqueued_at: i128 = 0,
     done: std.Thread.ResetEvent = .{},
     priority: Priority,
     ctx: *anyopaque,
@@ -27,7 +35,13 @@ const Self = @This();
 allocator: std.mem.Allocator,
 threads: std.ArrayListUnmanaged(std.Thread) = .{},
 
-queue: Queue = .{},
+// One FIFO queue per priority. Higher priorities are always picked first, and within
+// a priority tasks run in the order they were scheduled, so a task that is scheduled
+// again goes to the back of the queue and tasks of different indexes take turns.
+queues: [num_queues]Queue = [_]Queue{.{}} ** num_queues,
+num_running: [num_queues]usize = [_]usize{0} ** num_queues,
+// maximum number of worker threads running tasks of each priority
+max_running: [num_queues]usize = [_]usize{std.math.maxInt(usize)} ** num_queues,
 queue_not_empty: std.Thread.Condition = .{},
 queue_mutex: std.Thread.Mutex = .{},
 stopping: bool = false,
@@ -89,15 +103,35 @@ pub fn createTask(self: *Self, priority: Priority, comptime func: anytype, args:
     return task;
 }
 
+/// Limits how many worker threads can run tasks of the given priority at the same time.
+/// Tasks run by `waitTask` on the waiting thread are not counted.
+pub fn setMaxRunning(self: *Self, priority: Priority, max_running: usize) void {
+    self.queue_mutex.lock();
+    defer self.queue_mutex.unlock();
+
+    self.max_running[@intFromEnum(priority)] = @max(1, max_running);
+    self.queue_not_empty.broadcast();
+}
+
+fn getQueue(self: *Self, task: Task) *Queue {
+    return &self.queues[@intFromEnum(task.data.priority)];
+}
+
+fn removeFromQueue(self: *Self, task: Task) void {
+    const queue = self.getQueue(task);
+    queue.remove(task);
+    task.next = null;
+    task.prev = null;
+    task.data.scheduled = false;
+    metrics.schedulerQueueDepth(@tagName(task.data.priority), queue.len);
+}
+
 fn dequeue(self: *Self, task: Task) void {
     self.queue_mutex.lock();
     defer self.queue_mutex.unlock();
 
     if (task.data.scheduled) {
-        self.queue.remove(task);
-        task.next = null;
-        task.prev = null;
-        task.data.scheduled = false;
+        self.removeFromQueue(task);
     }
 
     task.data.reschedule = 0;
@@ -126,10 +160,51 @@ pub fn scheduleTask(self: *Self, task: Task) void {
     }
 }
 
+/// Waits until the task is finished. If the task is still waiting in the queue,
+/// it's run on the calling thread, so a task can wait for tasks it scheduled
+/// even if all worker threads are busy.
+pub fn waitTask(self: *Self, task: Task) void {
+    const run_here = blk: {
+        self.queue_mutex.lock();
+        defer self.queue_mutex.unlock();
+
+        if (!task.data.scheduled) {
+            break :blk false;
+        }
+        self.removeFromQueue(task);
+        self.startTask(task, false);
+        break :blk true;
+    };
+
+    if (run_here) {
+        task.data.runFn(task.data.ctx);
+        self.markAsDone(task);
+    }
+
+    task.data.done.wait();
+}
+
 fn enqueue(self: *Self, task: *Queue.Node) void {
+    if (task.data.priority == .do_not_run) {
+        return;
+    }
+    const queue = self.getQueue(task);
     task.data.scheduled = true;
-    self.queue.prepend(task);
-    self.queue_not_empty.signal();
+    task.data.enqueued_at = std.time.nanoTimestamp();
+    queue.append(task);
+    metrics.schedulerQueueDepth(@tagName(task.data.priority), queue.len);
+    self.queue_not_empty.broadcast();
+}
+
+fn startTask(self: *Self, task: *Queue.Node, on_worker: bool) void {
+    task.data.running = true;
+    task.data.running_on_worker = on_worker;
+    task.data.done.reset();
+    if (on_worker) {
+        self.num_running[@intFromEnum(task.data.priority)] += 1;
+    }
+    const latency = std.time.nanoTimestamp() - task.data.enqueued_at;
+    metrics.schedulerTaskLatency(@intCast(@max(0, latency)));
 }
 
 fn getTaskToRun(self: *Self) ?*Queue.Node {
@@ -137,16 +212,16 @@ fn getTaskToRun(self: *Self) ?*Queue.Node {
     defer self.queue_mutex.unlock();
 
     while (!self.stopping) {
-        const task = self.queue.popFirst() orelse {
-            self.queue_not_empty.timedWait(&self.queue_mutex, std.time.us_per_min) catch {};
-            continue;
-        };
-        task.prev = null;
-        task.next = null;
-        task.data.scheduled = false;
-        task.data.running = true;
-        task.data.done.reset();
-        return task;
+        for (&self.queues, 0..) |*queue, i| {
+            if (self.num_running[i] >= self.max_running[i]) {
+                continue;
+            }
+            const task = queue.first orelse continue;
+            self.removeFromQueue(task);
+            self.startTask(task, true);
+            return task;
+        }
+        self.queue_not_empty.timedWait(&self.queue_mutex, std.time.ns_per_min) catch {};
     }
     return null;
 }
@@ -155,6 +230,13 @@ fn markAsDone(self: *Self, task: *Queue.Node) void {
     self.queue_mutex.lock();
     defer self.queue_mutex.unlock();
 
+    if (task.data.running_on_worker) {
+        self.num_running[@intFromEnum(task.data.priority)] -= 1;
+        task.data.running_on_worker = false;
+        // a task waiting for the concurrency limit can run now
+        self.queue_not_empty.broadcast();
+    }
+
     if (task.data.reschedule > 0) {
         task.data.reschedule -= 1;
         self.enqueue(task);
@@ -181,6 +263,12 @@ pub fn start(self: *Self, thread_count: usize) !void {
 
     self.stopping = false;
 
+    // keep one worker free for high and medium priority tasks (memory merges, checkpoints),
+    // so that long low priority tasks (file merges) can't hold all of them
+    if (thread_count > 1 and self.max_running[@intFromEnum(Priority.low)] >= thread_count) {
+        self.max_running[@intFromEnum(Priority.low)] = thread_count - 1;
+    }
+
     try self.threads.ensureUnusedCapacity(self.allocator, thread_count);
     for (0..thread_count) |_| {
         const thread = try std.Thread.spawn(.{}, workerThreadFunc, .{self});
@@ -231,3 +319,69 @@ test "Scheduler: smoke test" {
 
     try std.testing.expect(counter.count == 3);
 }
+
+test "Scheduler: wait for task without workers" {
+    var scheduler = Self.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    const Counter = struct {
+        count: usize = 0,
+
+        fn incr(self: *@This()) void {
+            self.count += 1;
+        }
+    };
+    var counter: Counter = .{};
+
+    const task = try scheduler.createTask(.high, Counter.incr, .{&counter});
+    defer scheduler.destroyTask(task);
+
+    scheduler.scheduleTask(task);
+    scheduler.waitTask(task);
+
+    try std.testing.expectEqual(1, counter.count);
+}
+
+test "Scheduler: priorities and concurrency limits" {
+    var scheduler = Self.init(std.testing.allocator);
+    defer scheduler.deinit();
+
+    const Recorder = struct {
+        lock: std.Thread.Mutex = .{},
+        order: std.BoundedArray(u8, 16) = .{},
+
+        fn record(self: *@This(), id: u8) void {
+            self.lock.lock();
+            defer self.lock.unlock();
+            self.order.appendAssumeCapacity(id);
+        }
+
+        fn count(self: *@This()) usize {
+            self.lock.lock();
+            defer self.lock.unlock();
+            return self.order.len;
+        }
+    };
+    var recorder: Recorder = .{};
+
+    const low1 = try scheduler.createTask(.low, Recorder.record, .{ &recorder, 1 });
+    defer scheduler.destroyTask(low1);
+    const low2 = try scheduler.createTask(.low, Recorder.record, .{ &recorder, 2 });
+    defer scheduler.destroyTask(low2);
+    const high = try scheduler.createTask(.high, Recorder.record, .{ &recorder, 3 });
+    defer scheduler.destroyTask(high);
+
+    scheduler.scheduleTask(low1);
+    scheduler.scheduleTask(low2);
+    scheduler.scheduleTask(high);
+
+    // with one worker, tasks run by priority, and in the scheduled order within a priority
+    try scheduler.start(1);
+    for (0..1000) |_| {
+        if (recorder.count() == 3) break;
+        std.time.sleep(std.time.ns_per_ms);
+    }
+    scheduler.stop();
+
+    try std.testing.expectEqualSlices(u8, &.{ 3, 1, 2 }, recorder.order.slice());
+}
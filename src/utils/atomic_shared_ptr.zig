@@ -0,0 +1,122 @@
+const std = @import("std");
+
+const Allocator = std.mem.Allocator;
+
+const SharedPtr = @import("shared_ptr.zig").SharedPtr;
+
+/// Holds a SharedPtr that can be replaced while other threads are acquiring it, without locks.
+/// A reader announces the pointer it's about to acquire in a hazard slot and checks that it's
+/// still current before incrementing the reference count. A writer waits until no slot holds
+/// the replaced pointer before releasing it. Slots are held only for those few instructions,
+/// so the writer never waits for long.
+pub fn AtomicSharedPtr(comptime T: type) type {
+    return struct {
+        const Self = @This();
+
+        const num_slots = 64;
+
+        // each slot on its own cache line, so that readers don't invalidate each other
+        const Slot = struct {
+            ptr: std.atomic.Value(usize) align(std.atomic.cache_line) = std.atomic.Value(usize).init(0),
+        };
+
+        current: std.atomic.Value(usize),
+        slots: [num_slots]Slot = [_]Slot{.{}} ** num_slots,
+
+        pub fn init(value: SharedPtr(T)) Self {
+            return .{ .current = std.atomic.Value(usize).init(@intFromPtr(value.value)) };
+        }
+
+        /// Releases the current value, no other thread can be using the instance.
+        pub fn deinit(self: *Self, allocator: Allocator, cleanupFn: anytype, cleanup_args: anytype) void {
+            var value = SharedPtr(T){ .value = @ptrFromInt(self.current.load(.acquire)) };
+            value.release(allocator, cleanupFn, cleanup_args);
+        }
+
+        /// Returns a new reference to the current value.
+        pub fn acquire(self: *Self) SharedPtr(T) {
+            var i: usize = std.Thread.getCurrentId() % num_slots;
+            while (true) : (i = (i + 1) % num_slots) {
+                const ptr = self.current.load(.seq_cst);
+                const slot = &self.slots[i].ptr;
+                if (slot.cmpxchgWeak(0, ptr, .seq_cst, .monotonic) != null) {
+                    continue;
+                }
+                defer slot.store(0, .release);
+
+                // if the pointer was not replaced before we announced it, it can't be released until we clear the slot
+                if (self.current.load(.seq_cst) == ptr) {
+                    const value = SharedPtr(T){ .value = @ptrFromInt(ptr) };
+                    return value.acquire();
+                }
+            }
+        }
+
+        /// Replaces the current value, taking over the reference, and releases the previous one.
+        pub fn store(self: *Self, value: SharedPtr(T), allocator: Allocator, cleanupFn: anytype, cleanup_args: anytype) void {
+            const prev_ptr = self.current.swap(@intFromPtr(value.value), .seq_cst);
+            for (&self.slots) |*slot| {
+                while (slot.ptr.load(.seq_cst) == prev_ptr) {
+                    std.atomic.spinLoopHint();
+                }
+            }
+            var prev = SharedPtr(T){ .value = @ptrFromInt(prev_ptr) };
+            prev.release(allocator, cleanupFn, cleanup_args);
+        }
+    };
+}
+
+test "AtomicSharedPtr" {
+    const allocator = std.testing.allocator;
+
+    const Value = struct {
+        n: usize,
+        destroyed: *std.atomic.Value(usize),
+
+        fn destroy(self: *@This()) void {
+            _ = self.destroyed.fetchAdd(1, .monotonic);
+        }
+    };
+
+    var destroyed = std.atomic.Value(usize).init(0);
+
+    var ptr = AtomicSharedPtr(Value).init(try SharedPtr(Value).create(allocator, .{ .n = 0, .destroyed = &destroyed }));
+
+    const Reader = struct {
+        fn run(p: *AtomicSharedPtr(Value), stop: *std.atomic.Value(bool)) void {
+            var last: usize = 0;
+            while (!stop.load(.acquire)) {
+                var value = p.acquire();
+                defer value.release(std.testing.allocator, Value.destroy, .{});
+                std.debug.assert(value.value.n >= last);
+                last = value.value.n;
+            }
+        }
+    };
+
+    var stop = std.atomic.Value(bool).init(false);
+    var threads: [4]std.Thread = undefined;
+    for (&threads) |*thread| {
+        thread.* = try std.Thread.spawn(.{}, Reader.run, .{ &ptr, &stop });
+    }
+
+    const num_updates = 1000;
+    for (1..num_updates + 1) |i| {
+        const value = try SharedPtr(Value).create(allocator, .{ .n = i, .destroyed = &destroyed });
+        ptr.store(value, allocator, Value.destroy, .{});
+    }
+
+    stop.store(true, .release);
+    for (threads) |thread| {
+        thread.join();
+    }
+
+    try std.testing.expectEqual(num_updates, destroyed.load(.monotonic));
+
+    var current = ptr.acquire();
+    try std.testing.expectEqual(num_updates, current.value.n);
+    current.release(allocator, Value.destroy, .{});
+
+    ptr.deinit(allocator, Value.destroy, .{});
+    try std.testing.expectEqual(num_updates + 1, destroyed.load(.monotonic));
+}
@@ -0,0 +1,122 @@
+//! Pool of retired buffers grouped in power-of-two size classes, so that frequently
+//! created and merged segments reuse memory instead of going to the allocator each time.
+
+const std = @import("std");
+
+pub fn BufferPool(comptime T: type) type {
+    return struct {
+        const Self = @This();
+
+        const min_size_class = 6;
+        const num_size_classes = 32;
+
+        pub const Options = struct {
+            // maximum number of bytes kept in the pool, over that retired buffers are freed
+            max_pooled_bytes: usize = 64 * 1024 * 1024,
+        };
+
+        allocator: std.mem.Allocator,
+        options: Options,
+        lock: std.Thread.Mutex = .{},
+        free_lists: [num_size_classes]std.ArrayListUnmanaged([]T) = [_]std.ArrayListUnmanaged([]T){.{}} ** num_size_classes,
+        pooled_bytes: usize = 0,
+
+        pub fn init(allocator: std.mem.Allocator, options: Options) Self {
+            return .{
+                .allocator = allocator,
+                .options = options,
+            };
+        }
+
+        pub fn deinit(self: *Self) void {
+            for (&self.free_lists) |*free_list| {
+                for (free_list.items) |buffer| {
+                    self.allocator.free(buffer);
+                }
+                free_list.deinit(self.allocator);
+            }
+            self.* = undefined;
+        }
+
+        fn getSizeClass(len: usize) usize {
+            return @max(min_size_class, std.math.log2_int_ceil(usize, @max(len, 1)));
+        }
+
+        /// Returns a buffer with at least `min_len` items.
+        pub fn alloc(self: *Self, min_len: usize) ![]T {
+            const size_class = getSizeClass(min_len);
+            if (size_class >= num_size_classes) {
+                return error.OutOfMemory;
+            }
+            const len = @as(usize, 1) << @intCast(size_class);
+
+            const buffer = blk: {
+                self.lock.lock();
+                defer self.lock.unlock();
+
+                if (self.free_lists[size_class].popOrNull()) |buffer| {
+                    self.pooled_bytes -= buffer.len * @sizeOf(T);
+                    break :blk buffer;
+                }
+                break :blk null;
+            } orelse try self.allocator.alloc(T, len);
+
+            return buffer;
+        }
+
+        /// Returns a buffer to the pool. The buffer must be allocated by `alloc`, or by the
+        /// pool's allocator, in which case it's freed unless it has the size of a size class.
+        pub fn free(self: *Self, buffer: []T) void {
+            if (buffer.len == 0) {
+                return;
+            }
+
+            if (std.math.isPowerOfTwo(buffer.len)) {
+                const size_class = std.math.log2_int(usize, buffer.len);
+                if (size_class >= min_size_class and size_class < num_size_classes) {
+                    self.lock.lock();
+                    defer self.lock.unlock();
+
+                    if (self.pooled_bytes + buffer.len * @sizeOf(T) <= self.options.max_pooled_bytes) {
+                        if (self.free_lists[size_class].append(self.allocator, buffer)) {
+                            self.pooled_bytes += buffer.len * @sizeOf(T);
+                            return;
+                        } else |_| {}
+                    }
+                }
+            }
+
+            self.allocator.free(buffer);
+        }
+
+        /// Bytes in retired buffers kept for reuse.
+        pub fn getPooledBytes(self: *Self) usize {
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            return self.pooled_bytes;
+        }
+    };
+}
+
+test "BufferPool" {
+    var pool = BufferPool(u64).init(std.testing.allocator, .{ .max_pooled_bytes = 1024 });
+    defer pool.deinit();
+
+    const a = try pool.alloc(100);
+    try std.testing.expectEqual(128, a.len);
+
+    pool.free(a);
+    try std.testing.expectEqual(128 * 8, pool.getPooledBytes());
+
+    // the retired buffer is reused
+    const b = try pool.alloc(65);
+    try std.testing.expectEqual(a.ptr, b.ptr);
+    try std.testing.expectEqual(0, pool.getPooledBytes());
+
+    // over the limit, buffers are freed
+    const c = try pool.alloc(1000);
+    pool.free(b);
+    pool.free(c);
+    try std.testing.expectEqual(128 * 8, pool.getPooledBytes());
+}
@@ -0,0 +1,139 @@
+//! Locating values in encoded msgpack data, without decoding them.
+
+const std = @import("std");
+
+fn readLength(data: []const u8, pos: usize, comptime T: type) !usize {
+    if (data.len < pos + @sizeOf(T)) {
+        return error.EndOfStream;
+    }
+    return std.mem.readInt(T, data[pos..][0..@sizeOf(T)], .big);
+}
+
+const Header = struct {
+    // size of the header, including any length fields
+    size: usize,
+    // number of raw bytes after the header
+    payload: usize = 0,
+    // number of nested values after the payload
+    children: usize = 0,
+};
+
+fn readHeader(data: []const u8, pos: usize) !Header {
+    if (pos >= data.len) {
+        return error.EndOfStream;
+    }
+    const b = data[pos];
+    return switch (b) {
+        0x00...0x7f, 0xe0...0xff, 0xc0, 0xc2, 0xc3 => .{ .size = 1 },
+        0x80...0x8f => .{ .size = 1, .children = 2 * @as(usize, b & 0x0f) },
+        0x90...0x9f => .{ .size = 1, .children = b & 0x0f },
+        0xa0...0xbf => .{ .size = 1, .payload = b & 0x1f },
+        0xc4, 0xd9 => .{ .size = 2, .payload = try readLength(data, pos + 1, u8) },
+        0xc5, 0xda => .{ .size = 3, .payload = try readLength(data, pos + 1, u16) },
+        0xc6, 0xdb => .{ .size = 5, .payload = try readLength(data, pos + 1, u32) },
+        0xc7 => .{ .size = 3, .payload = try readLength(data, pos + 1, u8) },
+        0xc8 => .{ .size = 4, .payload = try readLength(data, pos + 1, u16) },
+        0xc9 => .{ .size = 6, .payload = try readLength(data, pos + 1, u32) },
+        0xca => .{ .size = 1, .payload = 4 },
+        0xcb => .{ .size = 1, .payload = 8 },
+        0xcc, 0xd0 => .{ .size = 1, .payload = 1 },
+        0xcd, 0xd1 => .{ .size = 1, .payload = 2 },
+        0xce, 0xd2 => .{ .size = 1, .payload = 4 },
+        0xcf, 0xd3 => .{ .size = 1, .payload = 8 },
+        0xd4 => .{ .size = 2, .payload = 1 },
+        0xd5 => .{ .size = 2, .payload = 2 },
+        0xd6 => .{ .size = 2, .payload = 4 },
+        0xd7 => .{ .size = 2, .payload = 8 },
+        0xd8 => .{ .size = 2, .payload = 16 },
+        0xdc => .{ .size = 3, .children = try readLength(data, pos + 1, u16) },
+        0xdd => .{ .size = 5, .children = try readLength(data, pos + 1, u32) },
+        0xde => .{ .size = 3, .children = 2 * try readLength(data, pos + 1, u16) },
+        0xdf => .{ .size = 5, .children = 2 * try readLength(data, pos + 1, u32) },
+        0xc1 => error.InvalidFormat,
+    };
+}
+
+/// Returns the position right after the value that starts at `pos`.
+pub fn skipValue(data: []const u8, pos: usize) !usize {
+    var current = pos;
+    var remaining: usize = 1;
+    while (remaining > 0) {
+        remaining -= 1;
+        const header = try readHeader(data, current);
+        current += header.size + header.payload;
+        if (current > data.len) {
+            return error.EndOfStream;
+        }
+        remaining += header.children;
+    }
+    return current;
+}
+
+fn readString(data: []const u8, pos: usize) !?[]const u8 {
+    const b = data[pos];
+    if (!((b >= 0xa0 and b <= 0xbf) or b == 0xd9 or b == 0xda or b == 0xdb)) {
+        return null;
+    }
+    const header = try readHeader(data, pos);
+    const start = pos + header.size;
+    if (start + header.payload > data.len) {
+        return error.EndOfStream;
+    }
+    return data[start .. start + header.payload];
+}
+
+/// Returns the encoded value stored under a string key in the map at the start of `data`.
+/// Returns null if the key is missing, or if it's there more than once, because
+/// decoders differ in which one they use.
+pub fn findMapValue(data: []const u8, key: []const u8) !?[]const u8 {
+    const header = try readHeader(data, 0);
+    const is_map = (data[0] >= 0x80 and data[0] <= 0x8f) or data[0] == 0xde or data[0] == 0xdf;
+    if (!is_map) {
+        return error.InvalidFormat;
+    }
+
+    var result: ?[]const u8 = null;
+    var pos = header.size;
+    for (0..header.children / 2) |_| {
+        const key_end = try skipValue(data, pos);
+        const matches = if (try readString(data, pos)) |k| std.mem.eql(u8, k, key) else false;
+        const value_end = try skipValue(data, key_end);
+        if (matches) {
+            if (result != null) {
+                return null;
+            }
+            result = data[key_end..value_end];
+        }
+        pos = value_end;
+    }
+    return result;
+}
+
+test "skipValue" {
+    const data = [_]u8{
+        0x93, // array of 3
+        0x01, // 1
+        0xa3, 'a', 'b', 'c', // "abc"
+        0x81, 0xcd, 0x01, 0x00, 0xc3, // {256: true}
+        0x02, // next value
+    };
+    try std.testing.expectEqual(data.len - 1, try skipValue(&data, 0));
+    try std.testing.expectEqual(2, try skipValue(&data, 1));
+    try std.testing.expectError(error.EndOfStream, skipValue(data[0..5], 0));
+}
+
+test "findMapValue" {
+    const data = [_]u8{
+        0x82, // map of 2
+        0xa1, 'a', 0x01, // "a": 1
+        0xa1, 'c', 0x92, 0x02, 0x03, // "c": [2, 3]
+    };
+    try std.testing.expectEqualSlices(u8, &.{ 0x92, 0x02, 0x03 }, (try findMapValue(&data, "c")).?);
+    try std.testing.expectEqualSlices(u8, &.{0x01}, (try findMapValue(&data, "a")).?);
+    try std.testing.expectEqual(null, try findMapValue(&data, "b"));
+
+    const duplicate = [_]u8{ 0x82, 0xa1, 'c', 0x01, 0xa1, 'c', 0x02 };
+    try std.testing.expectEqual(null, try findMapValue(&duplicate, "c"));
+
+    try std.testing.expectError(error.InvalidFormat, findMapValue(&.{0x90}, "c"));
+}
@@ -0,0 +1,17 @@
+const std = @import("std");
+const builtin = @import("builtin");
+
+/// Returns the number of major page faults of the calling thread, i.e. the ones
+/// that had to wait for the disk. Always zero on systems without per-thread counters.
+pub fn getMajorPageFaults() u64 {
+    if (builtin.os.tag != .linux) {
+        return 0;
+    }
+    const usage = std.posix.getrusage(std.posix.rusage.THREAD);
+    return @intCast(usage.majflt);
+}
+
+test "getMajorPageFaults" {
+    const before = getMajorPageFaults();
+    try std.testing.expect(getMajorPageFaults() >= before);
+}
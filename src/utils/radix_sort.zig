@@ -0,0 +1,75 @@
+const std = @import("std");
+
+/// Sorts values by their 64-bit representation with a LSD radix sort, one byte per pass.
+/// Passes where all values have the same byte are skipped. `tmp` must be at least as long as `items`.
+pub fn radixSort(comptime T: type, items: []T, tmp: []T) void {
+    comptime std.debug.assert(@bitSizeOf(T) == 64);
+    std.debug.assert(tmp.len >= items.len);
+
+    const num_passes = 8;
+
+    var counts: [num_passes][256]usize = undefined;
+    for (&counts) |*c| {
+        @memset(c, 0);
+    }
+    for (items) |item| {
+        const key: u64 = @bitCast(item);
+        inline for (0..num_passes) |pass| {
+            counts[pass][@as(u8, @truncate(key >> (pass * 8)))] += 1;
+        }
+    }
+
+    var src = items;
+    var dest = tmp[0..items.len];
+    for (0..num_passes) |pass| {
+        const shift: u6 = @intCast(pass * 8);
+
+        var offsets: [256]usize = undefined;
+        var offset: usize = 0;
+        var skip = false;
+        for (counts[pass], 0..) |count, digit| {
+            if (count == items.len) {
+                skip = true;
+                break;
+            }
+            offsets[digit] = offset;
+            offset += count;
+        }
+        if (skip) {
+            continue;
+        }
+
+        for (src) |item| {
+            const key: u64 = @bitCast(item);
+            const digit: u8 = @truncate(key >> shift);
+            dest[offsets[digit]] = item;
+            offsets[digit] += 1;
+        }
+        std.mem.swap([]T, &src, &dest);
+    }
+
+    if (src.ptr != items.ptr) {
+        @memcpy(items, src);
+    }
+}
+
+test "radixSort" {
+    const Item = @import("../segment.zig").Item;
+
+    var prng = std.rand.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    var items: [1000]Item = undefined;
+    var expected: [1000]Item = undefined;
+    for (&items, 0..) |*item, i| {
+        // ids share the high bytes, so some passes are skipped
+        item.* = .{ .hash = rand.int(u32), .id = @intCast(i % 300) };
+    }
+    expected = items;
+    std.sort.pdq(Item, &expected, {}, Item.cmp);
+
+    var tmp: [1000]Item = undefined;
+    radixSort(Item, &items, &tmp);
+
+    try std.testing.expectEqualSlices(Item, &expected, &items);
+}
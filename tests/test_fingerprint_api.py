@@ -1,4 +1,5 @@
 import json
+import struct
 
 
 def test_insert_single(client, index_name, create_index):
@@ -286,3 +287,77 @@ def test_persistence_after_hard_restart(server, client, index_name, create_index
     assert json.loads(req.content) == {
         'version': 100,
     }
+
+
+def test_multi_search(client, index_name, create_index):
+    req = client.post(f'/{index_name}/_update', json={
+        'changes': [
+            {'insert': {'id': 1, 'hashes': [101, 201, 301]}},
+            {'insert': {'id': 2, 'hashes': [102, 202, 302]}},
+        ],
+    })
+    assert req.status_code == 200, req.content
+
+    req = client.post(f'/{index_name}/_msearch', json={
+        'queries': [
+            {'query': [101, 201, 301]},
+            {'query': [102, 202, 301]},
+            {'query': [999]},
+        ],
+    })
+    assert req.status_code == 200, req.content
+    assert json.loads(req.content) == {
+        'responses': [
+            {'results': [{'id': 1, 'score': 3}], 'timed_out': False},
+            {'results': [{'id': 2, 'score': 2}, {'id': 1, 'score': 1}], 'timed_out': False},
+            {'results': [], 'timed_out': False},
+        ],
+    }
+
+
+def encode_binary_search(queries):
+    data = struct.pack('<I', len(queries))
+    for query in queries:
+        data += struct.pack(f'<III{len(query)}I', 0, 0, len(query), *query)
+    return data
+
+
+def decode_binary_search(data):
+    (num_queries,) = struct.unpack_from('<I', data, 0)
+    pos = 4
+    responses = []
+    for _ in range(num_queries):
+        flags, num_results = struct.unpack_from('<II', data, pos)
+        pos += 8
+        values = struct.unpack_from(f'<{2 * num_results}I', data, pos)
+        pos += 8 * num_results
+        responses.append((flags, list(zip(values[0::2], values[1::2]))))
+    assert pos == len(data)
+    return responses
+
+
+def test_binary_search(client, index_name, create_index):
+    req = client.post(f'/{index_name}/_update', json={
+        'changes': [
+            {'insert': {'id': 1, 'hashes': [101, 201, 301]}},
+            {'insert': {'id': 2, 'hashes': [102, 202, 302]}},
+        ],
+    })
+    assert req.status_code == 200, req.content
+
+    req = client.post(f'/{index_name}/_bsearch', data=encode_binary_search([
+        [101, 201, 301],
+        [102, 202, 301],
+        [999],
+    ]), headers={'Content-Type': 'application/vnd.fpindex.search'})
+    assert req.status_code == 200, req.content
+    assert req.headers['Content-Type'] == 'application/vnd.fpindex.search'
+    assert decode_binary_search(req.content) == [
+        (0, [(1, 3)]),
+        (0, [(2, 2), (1, 1)]),
+        (0, []),
+    ]
+
+    # truncated request
+    req = client.post(f'/{index_name}/_bsearch', data=encode_binary_search([[101, 201]])[:-2])
+    assert req.status_code == 400, req.content
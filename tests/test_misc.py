@@ -8,6 +8,16 @@ def test_index_health(client, create_index, index_name):
     assert req.status_code == 200, req.content
 
 
+def test_merge_plan(client, create_index, index_name):
+    req = client.get(f'/{index_name}/_merge_plan')
+    assert req.status_code == 200, req.content
+    plans = req.json()['plans']
+    assert [(p['shard'], p['tier']) for p in plans] == [(0, 'memory'), (0, 'file')]
+    for plan in plans:
+        assert plan['start'] == plan['end']
+        assert plan['deferred'] is False
+
+
 def test_metrics(client):
     req = client.get('/_metrics')
     assert req.status_code == 200, req.content